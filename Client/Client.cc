@@ -136,6 +136,25 @@ operator<<(std::ostream& os, Status status)
     return os;
 }
 
+////////// enum ReadConsistency //////////
+
+std::ostream&
+operator<<(std::ostream& os, ReadConsistency consistency)
+{
+    switch (consistency) {
+        case ReadConsistency::LINEARIZABLE:
+            os << "ReadConsistency::LINEARIZABLE";
+            break;
+        case ReadConsistency::BOUNDED_STALENESS:
+            os << "ReadConsistency::BOUNDED_STALENESS";
+            break;
+        case ReadConsistency::ANY_REPLICA:
+            os << "ReadConsistency::ANY_REPLICA";
+            break;
+    }
+    return os;
+}
+
 ////////// struct Result //////////
 
 Result::Result()
@@ -200,6 +219,7 @@ class TreeDetails {
         , workingDirectory(workingDirectory)
         , condition()
         , timeoutNanos(0)
+        , consistency()
     {
     }
     /**
@@ -219,8 +239,291 @@ class TreeDetails {
      * If nonzero, a relative timeout in nanoseconds for all Tree operations.
      */
     uint64_t timeoutNanos;
+    /**
+     * Consistency requirements for read-only Tree operations.
+     */
+    Protocol::Client::ReadConsistency consistency;
+};
+
+////////// BatchDetails //////////
+
+/**
+ * Implementation-specific members of Client::Batch.
+ */
+class BatchDetails {
+  public:
+    explicit BatchDetails(std::shared_ptr<const TreeDetails> treeDetails)
+        : treeDetails(treeDetails)
+        , condition()
+        , operations()
+    {
+    }
+    /**
+     * Append a new operation to #operations, with the current condition.
+     */
+    Protocol::Client::ReadWriteTree::Request::Batch::Operation&
+    add()
+    {
+        Protocol::Client::ReadWriteTree::Request::Batch::Operation& op =
+            *operations.add_operation();
+        if (!condition.path.empty()) {
+            op.mutable_condition()->set_path(condition.path);
+            if (condition.hasVersion)
+                op.mutable_condition()->set_version(condition.version);
+            else
+                op.mutable_condition()->set_contents(condition.contents);
+        }
+        return op;
+    }
+    /**
+     * The Tree's settings when the batch was created.
+     */
+    std::shared_ptr<const TreeDetails> treeDetails;
+    /**
+     * If set, specifies a predicate for operations added from now on. The
+     * path is canonicalized when the batch is committed.
+     */
+    Condition condition;
+    /**
+     * The operations added so far. Their paths are canonicalized when the
+     * batch is committed.
+     */
+    Protocol::Client::ReadWriteTree::Request::Batch operations;
 };
 
+////////// ScanDetails //////////
+
+/**
+ * Implementation-specific members of Client::Scan.
+ */
+class ScanDetails {
+  public:
+    ScanDetails(std::shared_ptr<const TreeDetails> treeDetails,
+                const std::string& path,
+                bool recursive,
+                uint64_t maxBytesPerBatch)
+        : treeDetails(treeDetails)
+        , path(path)
+        , recursive(recursive)
+        , maxBytesPerBatch(maxBytesPerBatch)
+        , entries()
+        , nextEntry(0)
+        , continuation()
+        , started(false)
+    {
+    }
+    /**
+     * The Tree's settings when the scan was created.
+     */
+    std::shared_ptr<const TreeDetails> treeDetails;
+    /**
+     * See Tree::scan(). This is resolved against the working directory for
+     * each batch.
+     */
+    std::string path;
+    /**
+     * See Tree::scan().
+     */
+    bool recursive;
+    /**
+     * See Tree::scan().
+     */
+    uint64_t maxBytesPerBatch;
+    /**
+     * The (path, contents) pairs of the most recently fetched batch.
+     */
+    std::vector<std::pair<std::string, std::string>> entries;
+    /**
+     * The index into #entries of the file that next() returns next.
+     */
+    size_t nextEntry;
+    /**
+     * Where the next batch starts, or empty if the last batch fetched was
+     * the final one.
+     */
+    std::string continuation;
+    /**
+     * False until the first batch has been fetched.
+     */
+    bool started;
+};
+
+////////// Batch //////////
+
+Batch::Batch(std::shared_ptr<const TreeDetails> treeDetails)
+    : batchDetails(new BatchDetails(treeDetails))
+{
+}
+
+Batch::Batch(const Batch& other)
+    : batchDetails(new BatchDetails(*other.batchDetails))
+{
+}
+
+Batch::~Batch()
+{
+}
+
+Batch&
+Batch::operator=(const Batch& other)
+{
+    *batchDetails = *other.batchDetails;
+    return *this;
+}
+
+Batch&
+Batch::setCondition(const std::string& path, const std::string& value)
+{
+    if (path.empty())
+        batchDetails->condition = {"", ""};
+    else
+        batchDetails->condition = {path, value};
+    return *this;
+}
+
+Batch&
+Batch::setVersionCondition(const std::string& path, uint64_t version)
+{
+    if (path.empty())
+        batchDetails->condition = {"", ""};
+    else
+        batchDetails->condition = {path, version};
+    return *this;
+}
+
+Batch&
+Batch::makeDirectory(const std::string& path)
+{
+    batchDetails->add().mutable_make_directory()->set_path(path);
+    return *this;
+}
+
+Batch&
+Batch::removeDirectory(const std::string& path)
+{
+    batchDetails->add().mutable_remove_directory()->set_path(path);
+    return *this;
+}
+
+Batch&
+Batch::write(const std::string& path, const std::string& contents)
+{
+    Protocol::Client::ReadWriteTree::Request::Write& write =
+        *batchDetails->add().mutable_write();
+    write.set_path(path);
+    write.set_contents(contents);
+    return *this;
+}
+
+Batch&
+Batch::removeFile(const std::string& path)
+{
+    batchDetails->add().mutable_remove_file()->set_path(path);
+    return *this;
+}
+
+uint64_t
+Batch::size() const
+{
+    return uint64_t(batchDetails->operations.operation_size());
+}
+
+Result
+Batch::commit()
+{
+    const TreeDetails& treeDetails = *batchDetails->treeDetails;
+    return treeDetails.clientImpl->batch(
+        treeDetails.workingDirectory,
+        treeDetails.condition,
+        batchDetails->operations,
+        ClientImpl::absTimeout(treeDetails.timeoutNanos));
+}
+
+void
+Batch::commitEx()
+{
+    throwException(commit(), batchDetails->treeDetails->timeoutNanos);
+}
+
+////////// Scan //////////
+
+Scan::Scan(std::shared_ptr<const TreeDetails> treeDetails,
+           const std::string& path,
+           bool recursive,
+           uint64_t maxBytesPerBatch)
+    : scanDetails(new ScanDetails(treeDetails, path, recursive,
+                                  maxBytesPerBatch))
+{
+}
+
+Scan::Scan(const Scan& other)
+    : scanDetails(new ScanDetails(*other.scanDetails))
+{
+}
+
+Scan::~Scan()
+{
+}
+
+Scan&
+Scan::operator=(const Scan& other)
+{
+    *scanDetails = *other.scanDetails;
+    return *this;
+}
+
+Result
+Scan::next(std::string& path, std::string& contents, bool& done)
+{
+    ScanDetails& details = *scanDetails;
+    path.clear();
+    contents.clear();
+    done = false;
+    // Loop in case a batch comes back empty, though the server always
+    // returns at least one file unless the scan is over.
+    while (details.nextEntry == details.entries.size()) {
+        if (details.started && details.continuation.empty()) {
+            done = true;
+            return Result();
+        }
+        const TreeDetails& treeDetails = *details.treeDetails;
+        std::vector<std::pair<std::string, std::string>> entries;
+        std::string continuation;
+        Result result = treeDetails.clientImpl->scanTree(
+            details.path,
+            treeDetails.workingDirectory,
+            details.recursive,
+            details.continuation,
+            details.maxBytesPerBatch,
+            treeDetails.condition,
+            treeDetails.consistency,
+            ClientImpl::absTimeout(treeDetails.timeoutNanos),
+            entries,
+            continuation);
+        if (result.status != Status::OK)
+            return result;
+        details.entries.swap(entries);
+        details.nextEntry = 0;
+        details.continuation.swap(continuation);
+        details.started = true;
+    }
+    std::pair<std::string, std::string>& entry =
+        details.entries.at(details.nextEntry);
+    path.swap(entry.first);
+    contents.swap(entry.second);
+    ++details.nextEntry;
+    return Result();
+}
+
+bool
+Scan::nextEx(std::string& path, std::string& contents)
+{
+    bool done = false;
+    throwException(next(path, contents, done),
+                   scanDetails->treeDetails->timeoutNanos);
+    return !done;
+}
+
 
 ////////// Tree //////////
 
@@ -296,6 +599,41 @@ Tree::getWorkingDirectory() const
     return treeDetails->workingDirectory;
 }
 
+namespace {
+/**
+ * Helper for Tree::setCondition() and Tree::setVersionCondition(): set the
+ * path of the given condition to the absolute form of 'path', or clear the
+ * condition if 'path' is empty. If 'path' is malformed, this sets the
+ * condition's path to an invalid one, so that operations using it fail.
+ */
+Result
+setConditionPath(const TreeDetails& treeDetails,
+                 const char* method,
+                 const std::string& path,
+                 Condition& condition)
+{
+    if (path.empty()) {
+        condition = {"", ""};
+        return Result();
+    }
+    std::string realPath;
+    Result result = treeDetails.clientImpl->canonicalize(
+                                path,
+                                treeDetails.workingDirectory,
+                                realPath);
+    if (result.status != Status::OK) {
+        condition.path = Core::StringUtil::format(
+                "invalid from prior call to %s('%s') relative to '%s'",
+                method,
+                path.c_str(),
+                treeDetails.workingDirectory.c_str());
+        return result;
+    }
+    condition.path = realPath;
+    return result;
+}
+} // anonymous namespace
+
 Result
 Tree::setCondition(const std::string& path, const std::string& value)
 {
@@ -304,31 +642,12 @@ Tree::setCondition(const std::string& path, const std::string& value)
     // instead of operating on the prior condition.
 
     std::lock_guard<std::mutex> lockGuard(mutex);
-    std::string realPath;
     std::shared_ptr<TreeDetails> newTreeDetails(new TreeDetails(*treeDetails));
-    if (path.empty()) {
-        newTreeDetails->condition = {"", ""};
-    } else {
-        Result result = treeDetails->clientImpl->canonicalize(
-                                    path,
-                                    treeDetails->workingDirectory,
-                                    realPath);
-        if (result.status != Status::OK) {
-            newTreeDetails->condition = {
-                Core::StringUtil::format(
-                        "invalid from prior call to setCondition('%s') "
-                        "relative to '%s'",
-                        path.c_str(),
-                        treeDetails->workingDirectory.c_str()),
-                value,
-            };
-            treeDetails = newTreeDetails;
-            return result;
-        }
-        newTreeDetails->condition = {realPath, value};
-    }
+    newTreeDetails->condition = {"", value};
+    Result result = setConditionPath(*treeDetails, "setCondition", path,
+                                     newTreeDetails->condition);
     treeDetails = newTreeDetails;
-    return Result();
+    return result;
 }
 
 void
@@ -337,11 +656,31 @@ Tree::setConditionEx(const std::string& path, const std::string& value)
     throwException(setCondition(path, value), treeDetails->timeoutNanos);
 }
 
+Result
+Tree::setVersionCondition(const std::string& path, uint64_t version)
+{
+    // Like setCondition, this sets the condition even if it fails.
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    std::shared_ptr<TreeDetails> newTreeDetails(new TreeDetails(*treeDetails));
+    newTreeDetails->condition = {"", version};
+    Result result = setConditionPath(*treeDetails, "setVersionCondition",
+                                     path, newTreeDetails->condition);
+    treeDetails = newTreeDetails;
+    return result;
+}
+
+void
+Tree::setVersionConditionEx(const std::string& path, uint64_t version)
+{
+    throwException(setVersionCondition(path, version),
+                   treeDetails->timeoutNanos);
+}
+
 std::pair<std::string, std::string>
 Tree::getCondition() const
 {
     std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
-    return treeDetails->condition;
+    return {treeDetails->condition.path, treeDetails->condition.contents};
 }
 
 uint64_t
@@ -360,6 +699,28 @@ Tree::setTimeout(uint64_t nanoseconds)
     treeDetails = newTreeDetails;
 }
 
+ReadConsistency
+Tree::getReadConsistency() const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return ReadConsistency(treeDetails->consistency.mode());
+}
+
+void
+Tree::setReadConsistency(ReadConsistency consistency,
+                         uint64_t maxStalenessNanos,
+                         uint64_t maxLagEntries)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    std::shared_ptr<TreeDetails> newTreeDetails(new TreeDetails(*treeDetails));
+    newTreeDetails->consistency.Clear();
+    newTreeDetails->consistency.set_mode(
+        Protocol::Client::ReadConsistency::Mode(consistency));
+    newTreeDetails->consistency.set_max_staleness_nanos(maxStalenessNanos);
+    newTreeDetails->consistency.set_max_lag_entries(maxLagEntries);
+    treeDetails = newTreeDetails;
+}
+
 Result
 Tree::makeDirectory(const std::string& path)
 {
@@ -380,24 +741,72 @@ Tree::makeDirectoryEx(const std::string& path)
 Result
 Tree::listDirectory(const std::string& path,
                     std::vector<std::string>& children) const
+{
+    uint64_t version;
+    return listDirectory(path, children, version);
+}
+
+std::vector<std::string>
+Tree::listDirectoryEx(const std::string& path) const
+{
+    std::vector<std::string> children;
+    throwException(listDirectory(path, children), treeDetails->timeoutNanos);
+    return children;
+}
+
+Result
+Tree::listDirectory(const std::string& path,
+                    std::vector<std::string>& children,
+                    uint64_t& version) const
 {
     std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
     return treeDetails->clientImpl->listDirectory(
         path,
         treeDetails->workingDirectory,
         treeDetails->condition,
+        treeDetails->consistency,
         ClientImpl::absTimeout(treeDetails->timeoutNanos),
-        children);
+        children,
+        version);
 }
 
 std::vector<std::string>
-Tree::listDirectoryEx(const std::string& path) const
+Tree::listDirectoryEx(const std::string& path, uint64_t& version) const
 {
     std::vector<std::string> children;
-    throwException(listDirectory(path, children), treeDetails->timeoutNanos);
+    throwException(listDirectory(path, children, version),
+                   treeDetails->timeoutNanos);
     return children;
 }
 
+Scan
+Tree::scan(const std::string& path,
+           bool recursive,
+           uint64_t maxBytesPerBatch) const
+{
+    return Scan(getTreeDetails(), path, recursive, maxBytesPerBatch);
+}
+
+Result
+Tree::watch(const std::string& path, bool recursive, uint64_t& index) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->watch(
+        path,
+        treeDetails->workingDirectory,
+        recursive,
+        treeDetails->consistency,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        index);
+}
+
+uint64_t
+Tree::watchEx(const std::string& path, bool recursive, uint64_t index) const
+{
+    throwException(watch(path, recursive, index), treeDetails->timeoutNanos);
+    return index;
+}
+
 Result
 Tree::removeDirectory(const std::string& path)
 {
@@ -435,21 +844,40 @@ Tree::writeEx(const std::string& path, const std::string& contents)
 
 Result
 Tree::read(const std::string& path, std::string& contents) const
+{
+    uint64_t version;
+    return read(path, contents, version);
+}
+
+std::string
+Tree::readEx(const std::string& path) const
+{
+    std::string contents;
+    throwException(read(path, contents), treeDetails->timeoutNanos);
+    return contents;
+}
+
+Result
+Tree::read(const std::string& path,
+           std::string& contents,
+           uint64_t& version) const
 {
     std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
     return treeDetails->clientImpl->read(
         path,
         treeDetails->workingDirectory,
         treeDetails->condition,
+        treeDetails->consistency,
         ClientImpl::absTimeout(treeDetails->timeoutNanos),
-        contents);
+        contents,
+        version);
 }
 
 std::string
-Tree::readEx(const std::string& path) const
+Tree::readEx(const std::string& path, uint64_t& version) const
 {
     std::string contents;
-    throwException(read(path, contents), treeDetails->timeoutNanos);
+    throwException(read(path, contents, version), treeDetails->timeoutNanos);
     return contents;
 }
 
@@ -470,6 +898,12 @@ Tree::removeFileEx(const std::string& path)
     throwException(removeFile(path), treeDetails->timeoutNanos);
 }
 
+Batch
+Tree::batch() const
+{
+    return Batch(getTreeDetails());
+}
+
 std::shared_ptr<const TreeDetails>
 Tree::getTreeDetails() const
 {
@@ -82,12 +82,27 @@ template<typename Message>
 void
 setCondition(Message& request, const Condition& condition)
 {
-    if (!condition.first.empty()) {
-        request.mutable_condition()->set_path(condition.first);
-        request.mutable_condition()->set_contents(condition.second);
+    if (!condition.path.empty()) {
+        request.mutable_condition()->set_path(condition.path);
+        if (condition.hasVersion)
+            request.mutable_condition()->set_version(condition.version);
+        else
+            request.mutable_condition()->set_contents(condition.contents);
     }
 }
 
+/**
+ * If the client has relaxed the consistency for a read-only operation,
+ * serialize it into the request message.
+ */
+void
+setConsistency(Protocol::Client::ReadOnlyTree::Request& request,
+               const Protocol::Client::ReadConsistency& consistency)
+{
+    if (consistency.mode() != Protocol::Client::ReadConsistency::LINEARIZABLE)
+        *request.mutable_consistency() = consistency;
+}
+
 /**
  * Split a path into its components. Helper for ClientImpl::canonicalize.
  * \param[in] path
@@ -209,6 +224,32 @@ treeCall(LeaderRPCBase& leaderRPC,
 using Protocol::Client::OpCode;
 
 
+////////// struct Condition //////////
+
+Condition::Condition()
+    : path()
+    , contents()
+    , hasVersion(false)
+    , version(0)
+{
+}
+
+Condition::Condition(const std::string& path, const std::string& contents)
+    : path(path)
+    , contents(contents)
+    , hasVersion(false)
+    , version(0)
+{
+}
+
+Condition::Condition(const std::string& path, uint64_t version)
+    : path(path)
+    , contents()
+    , hasVersion(true)
+    , version(version)
+{
+}
+
 ////////// class ClientImpl::ExactlyOnceRPCHelper //////////
 
 ClientImpl::ExactlyOnceRPCHelper::ExactlyOnceRPCHelper(ClientImpl* client)
@@ -445,6 +486,7 @@ ClientImpl::ClientImpl(const std::map<std::string, std::string>& options)
                              100UL * 1000 * 1000) // 100 ms
     , hosts()
     , leaderRPC()             // set in init()
+    , readRPC()               // set in init()
     , exactlyOnceRPCHelper(this)
     , eventLoopThread()
 {
@@ -484,9 +526,29 @@ ClientImpl::initDerived()
             clusterUUID,
             sessionCreationBackoff,
             sessionManager));
+        std::string readHosts = config.read("readHosts", hosts);
+        if (readHosts != hosts) {
+            NOTICE("Using server list for relaxed reads: %s",
+                   readHosts.c_str());
+            readRPC.reset(new LeaderRPC(
+                RPC::Address(readHosts, Protocol::Common::DEFAULT_PORT),
+                clusterUUID,
+                sessionCreationBackoff,
+                sessionManager));
+        }
     }
 }
 
+LeaderRPCBase&
+ClientImpl::readRPCFor(const Protocol::Client::ReadConsistency& consistency)
+{
+    if (readRPC &&
+        consistency.mode() != Protocol::Client::ReadConsistency::LINEARIZABLE) {
+        return *readRPC;
+    }
+    return *leaderRPC;
+}
+
 GetConfigurationResult
 ClientImpl::getConfiguration(TimePoint timeout)
 {
@@ -711,28 +773,115 @@ Result
 ClientImpl::listDirectory(const std::string& path,
                           const std::string& workingDirectory,
                           const Condition& condition,
+                          const Protocol::Client::ReadConsistency& consistency,
                           TimePoint timeout,
-                          std::vector<std::string>& children)
+                          std::vector<std::string>& children,
+                          uint64_t& version)
 {
     children.clear();
+    version = 0;
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
         return result;
     Protocol::Client::ReadOnlyTree::Request request;
     setCondition(request, condition);
+    setConsistency(request, consistency);
     request.mutable_list_directory()->set_path(realPath);
     Protocol::Client::ReadOnlyTree::Response response;
-    treeCall(*leaderRPC,
+    treeCall(readRPCFor(consistency),
              request, response, timeout);
     if (response.status() != Protocol::Client::Status::OK)
         return treeError(response);
     children = std::vector<std::string>(
                     response.list_directory().child().begin(),
                     response.list_directory().child().end());
+    version = response.list_directory().version();
     return Result();
 }
 
+Result
+ClientImpl::scanTree(const std::string& path,
+                     const std::string& workingDirectory,
+                     bool recursive,
+                     const std::string& after,
+                     uint64_t maxBytes,
+                     const Condition& condition,
+                     const Protocol::Client::ReadConsistency& consistency,
+                     TimePoint timeout,
+                     std::vector<std::pair<std::string, std::string>>& entries,
+                     std::string& continuation)
+{
+    entries.clear();
+    continuation.clear();
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    Protocol::Client::ReadOnlyTree::Request request;
+    setCondition(request, condition);
+    setConsistency(request, consistency);
+    request.mutable_scan_tree()->set_path(realPath);
+    request.mutable_scan_tree()->set_recursive(recursive);
+    if (!after.empty())
+        request.mutable_scan_tree()->set_after(after);
+    request.mutable_scan_tree()->set_max_bytes(maxBytes);
+    Protocol::Client::ReadOnlyTree::Response response;
+    treeCall(readRPCFor(consistency),
+             request, response, timeout);
+    if (response.status() != Protocol::Client::Status::OK)
+        return treeError(response);
+    const Protocol::Client::ReadOnlyTree::Response::ScanTree& scan =
+        response.scan_tree();
+    entries.reserve(size_t(scan.entry_size()));
+    for (auto it = scan.entry().begin(); it != scan.entry().end(); ++it)
+        entries.emplace_back(it->path(), it->contents());
+    continuation = scan.continuation();
+    return Result();
+}
+
+Result
+ClientImpl::watch(const std::string& path,
+                  const std::string& workingDirectory,
+                  bool recursive,
+                  const Protocol::Client::ReadConsistency& consistency,
+                  TimePoint timeout,
+                  uint64_t& index)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    Protocol::Client::ReadOnlyTree::Request request;
+    setConsistency(request, consistency);
+    request.mutable_watch()->set_path(realPath);
+    request.mutable_watch()->set_recursive(recursive);
+    while (true) {
+        request.mutable_watch()->set_after_index(index);
+        if (timeout != TimePoint::max()) {
+            TimePoint now = Clock::now();
+            if (now >= timeout) {
+                result.status = Status::TIMEOUT;
+                result.error = "Client-specified timeout elapsed";
+                return result;
+            }
+            request.mutable_watch()->set_timeout_nanos(uint64_t(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    timeout - now).count()));
+        }
+        Protocol::Client::ReadOnlyTree::Response response;
+        treeCall(readRPCFor(consistency),
+                 request, response, timeout);
+        if (response.status() != Protocol::Client::Status::OK)
+            return treeError(response);
+        // If nothing changed, the server gave up waiting. Nothing changed up
+        // to the index it returned either, so wait again from there.
+        index = response.watch().index();
+        if (response.watch().changed())
+            return Result();
+    }
+}
+
 Result
 ClientImpl::removeDirectory(const std::string& path,
                             const std::string& workingDirectory,
@@ -787,23 +936,28 @@ Result
 ClientImpl::read(const std::string& path,
                  const std::string& workingDirectory,
                  const Condition& condition,
+                 const Protocol::Client::ReadConsistency& consistency,
                  TimePoint timeout,
-                 std::string& contents)
+                 std::string& contents,
+                 uint64_t& version)
 {
     contents = "";
+    version = 0;
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
         return result;
     Protocol::Client::ReadOnlyTree::Request request;
     setCondition(request, condition);
+    setConsistency(request, consistency);
     request.mutable_read()->set_path(realPath);
     Protocol::Client::ReadOnlyTree::Response response;
-    treeCall(*leaderRPC,
+    treeCall(readRPCFor(consistency),
              request, response, timeout);
     if (response.status() != Protocol::Client::Status::OK)
         return treeError(response);
     contents = response.read().contents();
+    version = response.read().version();
     return Result();
 }
 
@@ -831,6 +985,62 @@ ClientImpl::removeFile(const std::string& path,
     return Result();
 }
 
+Result
+ClientImpl::batch(
+        const std::string& workingDirectory,
+        const Condition& condition,
+        const Protocol::Client::ReadWriteTree::Request::Batch& operations,
+        TimePoint timeout)
+{
+    Protocol::Client::ReadWriteTree::Request request;
+    *request.mutable_batch() = operations;
+    for (int i = 0; i < operations.operation_size(); ++i) {
+        Protocol::Client::ReadWriteTree::Request::Batch::Operation& op =
+            *request.mutable_batch()->mutable_operation(i);
+        std::string* path = NULL;
+        if (op.has_make_directory())
+            path = op.mutable_make_directory()->mutable_path();
+        else if (op.has_remove_directory())
+            path = op.mutable_remove_directory()->mutable_path();
+        else if (op.has_write())
+            path = op.mutable_write()->mutable_path();
+        else if (op.has_remove_file())
+            path = op.mutable_remove_file()->mutable_path();
+        assert(path != NULL);
+        std::string realPath;
+        Result result = canonicalize(*path, workingDirectory, realPath);
+        *path = realPath;
+        if (result.status == Status::OK && op.has_condition()) {
+            result = canonicalize(op.condition().path(), workingDirectory,
+                                  realPath);
+            op.mutable_condition()->set_path(realPath);
+        }
+        if (result.status != Status::OK) {
+            result.error = Core::StringUtil::format(
+                "Batch operation %d: %s", i, result.error.c_str());
+            return result;
+        }
+    }
+    *request.mutable_exactly_once() =
+        exactlyOnceRPCHelper.getRPCInfo(timeout);
+    setCondition(request, condition);
+    Protocol::Client::ReadWriteTree::Response response;
+    treeCall(*leaderRPC,
+             request, response, timeout);
+    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
+    if (response.status() != Protocol::Client::Status::OK) {
+        Result result = treeError(response);
+        if (response.has_failed_operation()) {
+            result.error = Core::StringUtil::format(
+                "Batch operation %u: %s",
+                response.failed_operation(),
+                result.error.c_str());
+        }
+        return result;
+    }
+    return Result();
+}
+
 Result
 ClientImpl::serverControl(const std::string& host,
                           TimePoint timeout,
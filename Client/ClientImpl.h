@@ -37,13 +37,34 @@ namespace LogCabin {
 namespace Client {
 
 /**
- * A predicate on tree operations.
- * First component: the absolute path corresponding to the 'path'
- * argument of setCondition(), or empty if no condition is set.
- * Second component: the file contents given as the 'value' argument of
- * setCondition().
+ * A predicate on tree operations, as set by Tree::setCondition() or
+ * Tree::setVersionCondition().
  */
-typedef std::pair<std::string, std::string> Condition;
+struct Condition {
+    /// Constructor for no condition.
+    Condition();
+    /// Constructor for a condition on contents.
+    Condition(const std::string& path, const std::string& contents);
+    /// Constructor for a condition on a version.
+    Condition(const std::string& path, uint64_t version);
+    /**
+     * The absolute path corresponding to the 'path' argument of
+     * setCondition(), or empty if no condition is set.
+     */
+    std::string path;
+    /**
+     * The file contents given as the 'value' argument of setCondition().
+     */
+    std::string contents;
+    /**
+     * True if the condition is on #version rather than #contents.
+     */
+    bool hasVersion;
+    /**
+     * The version given to setVersionCondition().
+     */
+    uint64_t version;
+};
 
 /**
  * The implementation of the client library.
@@ -121,8 +142,53 @@ class ClientImpl {
     Result listDirectory(const std::string& path,
                          const std::string& workingDirectory,
                          const Condition& condition,
+                         const Protocol::Client::ReadConsistency& consistency,
                          TimePoint timeout,
-                         std::vector<std::string>& children);
+                         std::vector<std::string>& children,
+                         uint64_t& version);
+
+    /**
+     * Fetch one batch of a scan; see Scan::next.
+     * \param path
+     *      The directory to scan, relative to workingDirectory.
+     * \param workingDirectory
+     *      See Tree.
+     * \param recursive
+     *      See Tree::scan.
+     * \param after
+     *      Empty for the first batch, or the continuation returned with the
+     *      previous batch (an absolute path).
+     * \param maxBytes
+     *      See Tree::scan.
+     * \param condition
+     *      See Tree.
+     * \param consistency
+     *      See Tree.
+     * \param timeout
+     *      See Tree.
+     * \param[out] entries
+     *      The (path, contents) pairs of the files in this batch.
+     * \param[out] continuation
+     *      Where the next batch starts, or empty if the scan is done.
+     */
+    Result scanTree(const std::string& path,
+                    const std::string& workingDirectory,
+                    bool recursive,
+                    const std::string& after,
+                    uint64_t maxBytes,
+                    const Condition& condition,
+                    const Protocol::Client::ReadConsistency& consistency,
+                    TimePoint timeout,
+                    std::vector<std::pair<std::string, std::string>>& entries,
+                    std::string& continuation);
+
+    /// See Tree::watch.
+    Result watch(const std::string& path,
+                 const std::string& workingDirectory,
+                 bool recursive,
+                 const Protocol::Client::ReadConsistency& consistency,
+                 TimePoint timeout,
+                 uint64_t& index);
 
     /// See Tree::removeDirectory.
     Result removeDirectory(const std::string& path,
@@ -141,8 +207,10 @@ class ClientImpl {
     Result read(const std::string& path,
                 const std::string& workingDirectory,
                 const Condition& condition,
+                const Protocol::Client::ReadConsistency& consistency,
                 TimePoint timeout,
-                std::string& contents);
+                std::string& contents,
+                uint64_t& version);
 
     /// See Tree::removeFile.
     Result removeFile(const std::string& path,
@@ -150,6 +218,13 @@ class ClientImpl {
                       const Condition& condition,
                       TimePoint timeout);
 
+    /// See Batch::commit.
+    Result batch(
+        const std::string& workingDirectory,
+        const Condition& condition,
+        const Protocol::Client::ReadWriteTree::Request::Batch& operations,
+        TimePoint timeout);
+
     /**
      * Low-level interface to ServerControl service used by
      * Client/ServerControl.cc.
@@ -162,6 +237,14 @@ class ClientImpl {
 
   protected:
 
+    /**
+     * Return the RPC mechanism to use for a read-only Tree operation with the
+     * given consistency requirements: #readRPC if they allow it, #leaderRPC
+     * otherwise.
+     */
+    LeaderRPCBase&
+    readRPCFor(const Protocol::Client::ReadConsistency& consistency);
+
     /**
      * Options/settings.
      */
@@ -201,6 +284,14 @@ class ClientImpl {
      */
     std::unique_ptr<LeaderRPCBase> leaderRPC;
 
+    /**
+     * Used to send read-only Tree RPCs that need not be linearizable, to the
+     * hosts given by the "readHosts" option. These are redirected to the
+     * leader if the server can't serve them. If null, #leaderRPC is used
+     * instead.
+     */
+    std::unique_ptr<LeaderRPCBase> readRPC;
+
     /**
      * This class helps with providing exactly-once semantics for read-write
      * RPCs. For example, it assigns sequence numbers to RPCs, which servers
@@ -334,15 +334,39 @@ TEST_F(ClientClientImplTest, makeDirectory_timeout) {
 
 TEST_F(ClientClientImplTest, listDirectory_timeout) {
     std::vector<std::string> children { "hi" };
+    uint64_t version = 8;
     Client::Result result =
         client.listDirectory("/",
                              "/",
                              Client::Condition {"", ""},
+                             Protocol::Client::ReadConsistency(),
                              TimePoint::min(),
-                             children);
+                             children,
+                             version);
     EXPECT_EQ(Client::Status::TIMEOUT, result.status);
     EXPECT_EQ("Client-specified timeout elapsed", result.error);
     EXPECT_EQ(std::vector<std::string> { }, children);
+    EXPECT_EQ(0U, version);
+}
+
+TEST_F(ClientClientImplTest, readRPCFor) {
+    typedef Protocol::Client::ReadConsistency ReadConsistency;
+    ReadConsistency consistency;
+    EXPECT_EQ(NULL, client.readRPC.get());
+    EXPECT_EQ(client.leaderRPC.get(), &client.readRPCFor(consistency));
+    consistency.set_mode(ReadConsistency::ANY_REPLICA);
+    EXPECT_EQ(client.leaderRPC.get(), &client.readRPCFor(consistency));
+
+    Client::ClientImpl client2(
+        std::map<std::string, std::string> {{"readHosts", "127.0.0.2"}});
+    client2.sessionManager.skipVerify = true;
+    client2.init("127.0.0.1");
+    ASSERT_NE(static_cast<Client::LeaderRPCBase*>(NULL), client2.readRPC.get());
+    EXPECT_EQ(client2.readRPC.get(), &client2.readRPCFor(consistency));
+    consistency.set_mode(ReadConsistency::BOUNDED_STALENESS);
+    EXPECT_EQ(client2.readRPC.get(), &client2.readRPCFor(consistency));
+    consistency.set_mode(ReadConsistency::LINEARIZABLE);
+    EXPECT_EQ(client2.leaderRPC.get(), &client2.readRPCFor(consistency));
 }
 
 TEST_F(ClientClientImplServiceMockTest, serverControl) {
@@ -122,16 +122,16 @@ TEST_F(ClientTreeTest, setWorkingDirectory)
 
 TEST_F(ClientTreeTest, getCondition)
 {
-    EXPECT_EQ((Client::Condition {"", ""}),
+    EXPECT_EQ((std::pair<std::string, std::string> {"", ""}),
               tree.getCondition());
     tree.setCondition("a", "b");
-    EXPECT_EQ((Client::Condition {"/a", "b"}),
+    EXPECT_EQ((std::pair<std::string, std::string> {"/a", "b"}),
               tree.getCondition());
     tree.setCondition("", "asdf");
-    EXPECT_EQ((Client::Condition {"", ""}),
+    EXPECT_EQ((std::pair<std::string, std::string> {"", ""}),
               tree.getCondition());
     tree.setCondition("", "");
-    EXPECT_EQ((Client::Condition {"", ""}),
+    EXPECT_EQ((std::pair<std::string, std::string> {"", ""}),
               tree.getCondition());
 }
 
@@ -145,7 +145,7 @@ TEST_F(ClientTreeTest, setCondition)
     EXPECT_EQ("Path '/..' from working directory '/' attempts to look up "
               "directory above root ('/')",
               result.error);
-    EXPECT_EQ((Client::Condition {
+    EXPECT_EQ((std::pair<std::string, std::string> {
                    "invalid from prior call to setCondition('/..') "
                    "relative to '/'",
                    "x"
@@ -168,6 +168,54 @@ TEST_F(ClientTreeTest, setTimeout)
     EXPECT_EQ(0UL, tree.getTimeout());
 }
 
+class QueryRecorder : public Client::TestingCallbacks {
+  public:
+    QueryRecorder()
+        : lastQuery()
+    {
+    }
+    bool stateMachineQuery(
+        Protocol::Client::StateMachineQuery_Request& request,
+        Protocol::Client::StateMachineQuery_Response& response) {
+        lastQuery = request;
+        return false;
+    }
+    Protocol::Client::StateMachineQuery_Request lastQuery;
+};
+
+TEST_F(ClientTreeTest, setReadConsistency)
+{
+    std::shared_ptr<QueryRecorder> recorder =
+        std::make_shared<QueryRecorder>();
+    Client::Cluster cluster2(recorder);
+    Client::Tree tree2 = cluster2.getTree();
+    EXPECT_EQ(Client::ReadConsistency::LINEARIZABLE,
+              tree2.getReadConsistency());
+    EXPECT_OK(tree2.write("/foo", "bar"));
+    EXPECT_EQ("bar", tree2.readEx("/foo"));
+    EXPECT_FALSE(recorder->lastQuery.tree().has_consistency());
+
+    tree2.setReadConsistency(Client::ReadConsistency::BOUNDED_STALENESS,
+                             1000UL, 5UL);
+    EXPECT_EQ(Client::ReadConsistency::BOUNDED_STALENESS,
+              tree2.getReadConsistency());
+    EXPECT_EQ("bar", tree2.readEx("/foo"));
+    EXPECT_EQ("mode: BOUNDED_STALENESS "
+              "max_staleness_nanos: 1000 "
+              "max_lag_entries: 5",
+              recorder->lastQuery.tree().consistency());
+
+    tree2.setReadConsistency(Client::ReadConsistency::ANY_REPLICA);
+    EXPECT_EQ(Client::ReadConsistency::ANY_REPLICA,
+              tree2.getReadConsistency());
+    EXPECT_EQ((std::vector<std::string> {"foo"}),
+              tree2.listDirectoryEx("/"));
+    EXPECT_EQ("mode: ANY_REPLICA "
+              "max_staleness_nanos: 0 "
+              "max_lag_entries: 0",
+              recorder->lastQuery.tree().consistency());
+}
+
 TEST_F(ClientTreeTest, makeDirectory)
 {
     EXPECT_OK(tree.makeDirectory("/foo"));
@@ -195,6 +243,77 @@ TEST_F(ClientTreeTest, listDirectory)
               children);
 }
 
+TEST_F(ClientTreeTest, scan)
+{
+    std::string path;
+    std::string contents;
+    bool done = false;
+    Client::Scan scan = tree.scan("/..");
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              scan.next(path, contents, done).status);
+    scan = tree.scan("/foo");
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              scan.next(path, contents, done).status);
+
+    EXPECT_OK(tree.makeDirectory("/foo/b"));
+    EXPECT_OK(tree.write("/foo/a", "1"));
+    EXPECT_OK(tree.write("/foo/b/c", "2"));
+    EXPECT_OK(tree.write("/foo/d", "3"));
+    std::vector<std::string> scanned;
+    // The 1-byte batches hold one file each.
+    scan = tree.scan("foo", true, 1);
+    while (scan.nextEx(path, contents))
+        scanned.push_back(path + "=" + contents);
+    EXPECT_EQ((std::vector<std::string>{
+                    "/foo/a=1", "/foo/b/c=2", "/foo/d=3",
+               }), scanned);
+    EXPECT_OK(scan.next(path, contents, done));
+    EXPECT_TRUE(done);
+    EXPECT_EQ("", path);
+
+    scanned.clear();
+    EXPECT_OK(tree.setWorkingDirectory("/foo"));
+    scan = tree.scan(".", false);
+    while (scan.nextEx(path, contents))
+        scanned.push_back(path + "=" + contents);
+    EXPECT_EQ((std::vector<std::string>{
+                    "/foo/a=1", "/foo/d=3",
+               }), scanned);
+
+    // A failed batch is retried by the next call.
+    scan = tree.scan("/foo", true, 1);
+    EXPECT_TRUE(scan.nextEx(path, contents));
+    EXPECT_EQ("/foo/a", path);
+    EXPECT_OK(tree.removeDirectory("/foo"));
+    EXPECT_THROW(scan.nextEx(path, contents),
+                 Client::LookupException);
+    EXPECT_OK(tree.makeDirectory("/foo"));
+    EXPECT_OK(tree.write("/foo/d", "4"));
+    EXPECT_TRUE(scan.nextEx(path, contents));
+    EXPECT_EQ("/foo/d=4", path + "=" + contents);
+    EXPECT_FALSE(scan.nextEx(path, contents));
+}
+
+TEST_F(ClientTreeTest, watch)
+{
+    uint64_t index = 0;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.watch("/..", false, index).status);
+    EXPECT_OK(tree.watch("/foo", false, index));
+    EXPECT_EQ(0U, index);
+    EXPECT_OK(tree.makeDirectory("/foo"));
+    EXPECT_OK(tree.write("/foo/a", "1"));
+    index = tree.watchEx("/foo", false, 1);
+    EXPECT_EQ(2U, index);
+
+    tree.setTimeout(1000000UL);
+    EXPECT_EQ(Status::TIMEOUT,
+              tree.watch("/foo", true, index).status);
+    EXPECT_EQ(2U, index);
+    EXPECT_THROW(tree.watchEx("/foo", true, index),
+                 Client::TimeoutException);
+}
+
 TEST_F(ClientTreeTest, removeDirectory)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT,
@@ -239,6 +358,82 @@ TEST_F(ClientTreeTest, removeFile)
               children);
 }
 
+TEST_F(ClientTreeTest, batch)
+{
+    std::string contents;
+    tree.setWorkingDirectory("/foo");
+    Client::Batch batch = tree.batch();
+    EXPECT_EQ(0U, batch.size());
+    EXPECT_OK(batch.commit());
+    batch.makeDirectory("bar")
+         .write("bar/a", "1")
+         .write("/b", "2")
+         .removeFile("/b");
+    EXPECT_EQ(4U, batch.size());
+    EXPECT_OK(batch.commit());
+    EXPECT_EQ("1", tree.readEx("/foo/bar/a"));
+    std::vector<std::string> children;
+    EXPECT_OK(tree.listDirectory("/", children));
+    EXPECT_EQ((std::vector<std::string>{"foo/"}),
+              children);
+
+    // failures roll back the entire batch
+    batch = tree.batch();
+    batch.write("/foo/bar/a", "changed")
+         .removeDirectory("/foo/bar")
+         .write("/foo/bar/c", "3");
+    Result result = batch.commit();
+    EXPECT_EQ(Status::LOOKUP_ERROR, result.status);
+    EXPECT_EQ("Batch operation 2: Parent /foo/bar of /foo/bar/c does not "
+              "exist", result.error);
+    EXPECT_EQ("1", tree.readEx("/foo/bar/a"));
+
+    // malformed paths are caught before sending
+    batch = tree.batch();
+    batch.write("/x", "1").write("../..", "2");
+    result = batch.commit();
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ(0U, result.error.find("Batch operation 1: "))
+        << result.error;
+    EXPECT_THROW(batch.commitEx(), Client::InvalidArgumentException);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.read("/x", contents).status);
+}
+
+TEST_F(ClientTreeTest, batch_conditions)
+{
+    std::string contents;
+    // per-operation conditions see earlier operations in the batch
+    Client::Batch batch = tree.batch();
+    batch.write("/a", "1")
+         .setCondition("/a", "1")
+         .write("/b", "2")
+         .setCondition("", "")
+         .write("/a", "3");
+    EXPECT_OK(batch.commit());
+    EXPECT_EQ("2", tree.readEx("/b"));
+    EXPECT_EQ("3", tree.readEx("/a"));
+
+    batch = tree.batch();
+    batch.write("/c", "4")
+         .setCondition("/a", "1")
+         .removeFile("/b");
+    Result result = batch.commit();
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ(0U, result.error.find("Batch operation 1: ")) << result.error;
+    EXPECT_EQ("2", tree.readEx("/b"));
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.read("/c", contents).status);
+
+    // the tree's condition applies to the whole batch
+    tree.setCondition("/a", "1");
+    batch = tree.batch();
+    batch.write("/c", "4");
+    result = batch.commit();
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ(std::string::npos, result.error.find("Batch operation"));
+    tree.setCondition("", "");
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.read("/c", contents).status);
+}
+
 TEST_F(ClientTreeTest, conditions)
 {
     tree.setCondition("/a", "c");
@@ -276,6 +471,50 @@ TEST_F(ClientTreeTest, conditions)
               tree.removeFile("/b").status);
 }
 
+TEST_F(ClientTreeTest, versionConditions)
+{
+    std::string contents;
+    std::vector<std::string> children;
+    uint64_t fileVersion = 0;
+    uint64_t dirVersion = 0;
+    EXPECT_OK(tree.makeDirectory("/d"));
+    EXPECT_OK(tree.write("/d/a", "1"));
+    EXPECT_EQ("1", tree.readEx("/d/a", fileVersion));
+    EXPECT_LT(0U, fileVersion);
+    EXPECT_OK(tree.listDirectory("/d", children, dirVersion));
+    EXPECT_EQ(fileVersion, dirVersion);
+
+    EXPECT_OK(tree.setVersionCondition("d/a", fileVersion));
+    EXPECT_EQ((std::pair<std::string, std::string> {"/d/a", ""}),
+              tree.getCondition());
+    EXPECT_OK(tree.write("/d/a", "2"));
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.write("/d/a", "3").status);
+    tree.setVersionConditionEx("", 0);
+    EXPECT_EQ("2", tree.readEx("/d/a"));
+
+    // the file changed, but the listing didn't
+    Client::Batch batch = tree.batch();
+    batch.setVersionCondition("/d", dirVersion)
+         .write("/d/b", "4")
+         .setVersionCondition("/d", dirVersion)
+         .write("/d/c", "5");
+    EXPECT_EQ(Status::CONDITION_NOT_MET, batch.commit().status);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.read("/d/b", contents).status);
+    EXPECT_EQ((std::vector<std::string> {"a"}),
+              tree.listDirectoryEx("/d", dirVersion));
+    EXPECT_LT(fileVersion, dirVersion);
+
+    Result result = tree.setVersionCondition("/..", 1);
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ((std::pair<std::string, std::string> {
+                   "invalid from prior call to setVersionCondition('/..') "
+                   "relative to '/'",
+                   ""
+               }),
+               tree.getCondition());
+}
+
 TEST_F(ClientTreeTest, conditions_withWorkingDirectory)
 {
     tree.setWorkingDirectory("/baz");
@@ -55,6 +55,7 @@ class TreeLeaderRPC : public LeaderRPCBase {
         : mutex()
         , callbacks(callbacks)
         , tree()
+        , lastIndex(0)
     {
     }
     Status call(OpCode opCode,
@@ -75,6 +76,16 @@ class TreeLeaderRPC : public LeaderRPCBase {
             qresponse.Clear();
             if (timeout < Clock::now())
                 return Status::TIMEOUT;
+            if (qrequest.has_tree() && qrequest.tree().has_watch()) {
+                // Watches can't wait here, so they just report whether any
+                // command was applied since after_index.
+                uint64_t afterIndex = qrequest.tree().watch().after_index();
+                qresponse.mutable_tree()->set_status(PC::Status::OK);
+                auto& watch = *qresponse.mutable_tree()->mutable_watch();
+                watch.set_index(lastIndex);
+                watch.set_changed(afterIndex == 0 || afterIndex < lastIndex);
+                return Status::OK;
+            }
             if (qrequest.has_tree()) {
                 LogCabin::Tree::ProtoBuf::readOnlyTreeRPC(
                     tree, qrequest.tree(), *qresponse.mutable_tree());
@@ -96,6 +107,7 @@ class TreeLeaderRPC : public LeaderRPCBase {
             if (crequest.has_tree()) {
                 LogCabin::Tree::ProtoBuf::readWriteTreeRPC(
                     tree, crequest.tree(), *cresponse.mutable_tree());
+                ++lastIndex;
                 return Status::OK;
             } else if (crequest.has_open_session()) {
                 cresponse.mutable_open_session()->
@@ -154,6 +166,11 @@ class TreeLeaderRPC : public LeaderRPCBase {
     std::recursive_mutex mutex;
     std::shared_ptr<TestingCallbacks> callbacks;
     LogCabin::Tree::Tree tree;
+    /**
+     * The number of read-write tree commands applied, which stands in for
+     * the log index in watch replies.
+     */
+    uint64_t lastIndex;
 };
 } // anonymous namespace
 
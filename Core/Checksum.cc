@@ -18,6 +18,9 @@
 #include <memory>
 #include <mutex>
 #include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
 #include <cryptopp/cryptlib.h>
@@ -183,6 +186,97 @@ class Algorithms {
     std::map<std::string, Algorithm> byName;
 } algorithms;
 
+/**
+ * Lookup table for crc32cSoftware(), indexed by the low byte of the CRC
+ * xor'ed with the next byte of data.
+ */
+class CRC32CTable {
+  public:
+    CRC32CTable()
+        : table()
+    {
+        // 0x82f63b78 is the Castagnoli polynomial, bit-reversed.
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (uint32_t j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+            table[i] = crc;
+        }
+    }
+    uint32_t table[256];
+} crc32cTable;
+
+/**
+ * Update a CRC32C checksum with some data, one byte at a time.
+ */
+uint32_t
+crc32cSoftware(uint32_t crc, const uint8_t* data, uint64_t length)
+{
+    for (uint64_t i = 0; i < length; ++i)
+        crc = (crc >> 8) ^ crc32cTable.table[(crc ^ data[i]) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * Update a CRC32C checksum with some data using the SSE4.2 crc32
+ * instruction, 8 bytes at a time. The caller must make sure the processor
+ * supports SSE4.2.
+ */
+__attribute__((target("sse4.2")))
+uint32_t
+crc32cHardware(uint32_t crc, const uint8_t* data, uint64_t length)
+{
+    while (length > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data);
+        ++data;
+        --length;
+    }
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = uint32_t(crc64);
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *data);
+        ++data;
+        --length;
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Type for crc32cSoftware() and crc32cHardware().
+ */
+typedef uint32_t (*CRC32CFn)(uint32_t crc,
+                             const uint8_t* data, uint64_t length);
+
+/**
+ * Return the fastest CRC32C implementation this processor supports.
+ */
+CRC32CFn
+selectCRC32C()
+{
+#if defined(__x86_64__)
+    // This runs during static initialization, possibly before libgcc has
+    // initialized its CPU feature data.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32cHardware;
+#endif
+    return crc32cSoftware;
+}
+
+/**
+ * Used by crc32c().
+ */
+const CRC32CFn crc32cFn = selectCRC32C();
+
 } // namespace LogCabin::Core::Checksum::<anonymous>
 
 std::vector<std::string>
@@ -271,6 +365,24 @@ verify(const char* checksum,
     return std::string();
 }
 
+uint32_t
+crc32c(const void* data, uint64_t dataLength)
+{
+    return crc32c({{data, dataLength}});
+}
+
+uint32_t
+crc32c(std::initializer_list<std::pair<const void*, uint64_t>> data)
+{
+    uint32_t crc = ~0U;
+    for (auto it = data.begin(); it != data.end(); ++it) {
+        crc = (*crc32cFn)(crc,
+                          static_cast<const uint8_t*>(it->first),
+                          it->second);
+    }
+    return ~crc;
+}
+
 } // namespace LogCabin::Core::Checksum
 } // namespace LogCabin::Core
 } // namespace LogCabin
@@ -136,6 +136,32 @@ std::string
 verify(const char* checksum,
        std::initializer_list<std::pair<const void*, uint64_t>> data);
 
+/**
+ * Calculate the CRC32C (Castagnoli) checksum of a chunk of data. Unlike
+ * calculate(), this produces a raw 32-bit value, for binary formats that
+ * don't need to name their checksum algorithm. This uses the SSE4.2 crc32
+ * instruction when the processor supports it and a table-driven software
+ * implementation otherwise.
+ * \param data
+ *      The first byte of the data.
+ * \param dataLength
+ *      The number of bytes in the data.
+ * \return
+ *      The checksum.
+ */
+uint32_t
+crc32c(const void* data, uint64_t dataLength);
+
+/**
+ * Calculate the CRC32C (Castagnoli) checksum of a chunk of data.
+ * \param data
+ *      An list of (pointer, length) pairs describing what to checksum.
+ * \return
+ *      The checksum.
+ */
+uint32_t
+crc32c(std::initializer_list<std::pair<const void*, uint64_t>> data);
+
 } // namespace LogCabin::Core::Checksum
 } // namespace LogCabin::Core
 } // namespace LogCabin
@@ -118,6 +118,34 @@ TEST_F(CoreChecksumTest, verify) {
               verify("nonsense:358", "test", 5));
 }
 
+TEST_F(CoreChecksumTest, crc32c) {
+    EXPECT_EQ(0U, crc32c("", 0));
+    EXPECT_EQ(0xe3069283U, crc32c("123456789", 9));
+    EXPECT_EQ(0xe3069283U, crc32c({{"1234", 4},
+                                   {"", 0},
+                                   {"56789", 5}}));
+
+    // Compare against a bitwise implementation for all alignments and
+    // for lengths around the 8-byte words the hardware version uses.
+    uint8_t data[64];
+    for (uint32_t i = 0; i < sizeof(data); ++i)
+        data[i] = uint8_t(i * 37 + 11);
+    for (uint32_t start = 0; start < 8; ++start) {
+        for (uint32_t length = 0; start + length <= sizeof(data); ++length) {
+            uint32_t expected = ~0U;
+            for (uint32_t i = start; i < start + length; ++i) {
+                expected ^= data[i];
+                for (uint32_t j = 0; j < 8; ++j) {
+                    expected = ((expected >> 1) ^
+                                ((expected & 1) ? 0x82f63b78 : 0));
+                }
+            }
+            EXPECT_EQ(~expected, crc32c(data + start, length))
+                << "start " << start << ", length " << length;
+        }
+    }
+}
+
 } // namespace LogCabin::Core::Checksum::<anonymous>
 } // namespace LogCabin::Core::Checksum
 } // namespace LogCabin::Core
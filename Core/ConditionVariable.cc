@@ -91,8 +91,7 @@ void
 ConditionVariable::wait(std::unique_lock<Core::Mutex>& lockGuard)
 {
     Core::Mutex& mutex(*lockGuard.mutex());
-    if (mutex.callback)
-        mutex.callback();
+    mutex.unlocking();
     assert(lockGuard);
     std::unique_lock<std::mutex> stdLockGuard(mutex.m,
                                               std::adopt_lock_t());
@@ -101,8 +100,7 @@ ConditionVariable::wait(std::unique_lock<Core::Mutex>& lockGuard)
     assert(stdLockGuard);
     lockGuard = std::unique_lock<Core::Mutex>(mutex, std::adopt_lock_t());
     stdLockGuard.release();
-    if (mutex.callback)
-        mutex.callback();
+    mutex.locked();
 }
 
 void
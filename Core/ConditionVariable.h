@@ -96,8 +96,7 @@ class ConditionVariable {
     wait_until(std::unique_lock<Core::Mutex>& lockGuard,
                const std::chrono::time_point<Clock, Duration>& abs_time) {
         Core::Mutex& mutex(*lockGuard.mutex());
-        if (mutex.callback)
-            mutex.callback();
+        mutex.unlocking();
         assert(lockGuard);
         std::unique_lock<std::mutex> stdLockGuard(mutex.m,
                                                   std::adopt_lock_t());
@@ -106,8 +105,7 @@ class ConditionVariable {
         assert(stdLockGuard);
         lockGuard = std::unique_lock<Core::Mutex>(mutex, std::adopt_lock_t());
         stdLockGuard.release();
-        if (mutex.callback)
-            mutex.callback();
+        mutex.locked();
     }
 
   private:
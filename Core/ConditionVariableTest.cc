@@ -221,6 +221,23 @@ TEST_F(CoreConditionVariableTest, wait_CoreMutex_callback) {
     EXPECT_EQ(4U, mutexCounter); // 2 from lock guard, 2 from wait
 }
 
+TEST_F(CoreConditionVariableTest, wait_CoreMutex_holdNanos) {
+    Time::SteadyClock::Mocker mocker;
+    RollingStat holdNanos;
+    mutex.holdNanos = &holdNanos;
+    cv.callback = [] () { Time::SteadyClock::mockValue += ms(5); };
+    {
+        std::unique_lock<Mutex> lockGuard(mutex);
+        Time::SteadyClock::mockValue += ms(1);
+        cv.wait(lockGuard);
+        Time::SteadyClock::mockValue += ms(2);
+    }
+    // held for 1ms before the wait and 2ms after it, but not while waiting
+    EXPECT_EQ(2U, holdNanos.getCount());
+    EXPECT_EQ(1000000U, holdNanos.getMin());
+    EXPECT_EQ(2000000U, holdNanos.getMax());
+}
+
 TEST_F(CoreConditionVariableTest, wait_CoreMutex_real_TimingSensitive) {
     thread1 = std::thread(&CoreConditionVariableTest::wait, this);
     spinForReady(1);
@@ -18,6 +18,8 @@
 #include <mutex>
 
 #include "Core/Debug.h"
+#include "Core/RollingStat.h"
+#include "Core/Time.h"
 
 #ifndef LOGCABIN_CORE_MUTEX_H
 #define LOGCABIN_CORE_MUTEX_H
@@ -29,6 +31,8 @@ namespace Core {
  * A wrapper around std::mutex that is useful for testing purposes. You can set
  * a callback to be called when the mutex is locked and before it is unlocked.
  * This callback can, for example, check the invariants on the protected state.
+ * You can also have it measure how long the mutex is held each time it is
+ * locked; see #holdNanos.
  *
  * The interface to this class is the same as std::mutex.
  */
@@ -38,24 +42,26 @@ class Mutex {
 
     Mutex()
         : m()
+        , lockedAt()
         , callback()
+        , holdNanos(NULL)
     {
     }
 
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+
     void
     lock() {
         m.lock();
-        if (callback)
-            callback();
+        locked();
     }
 
     bool
     try_lock() {
         bool l = m.try_lock();
-        if (l) {
-            if (callback)
-                callback();
-        }
+        if (l)
+            locked();
         return l;
     }
 
@@ -63,8 +69,7 @@ class Mutex {
     unlock() {
         // TODO(ongardie): apparently try_lock->false...unlock is allowed, but
         // this will then call the callback without the lock, which is unsafe.
-        if (callback)
-            callback();
+        unlocking();
         m.unlock();
     }
 
@@ -74,8 +79,37 @@ class Mutex {
     }
 
   private:
+    /**
+     * Called with the lock held just after it is acquired.
+     */
+    void
+    locked() {
+        if (holdNanos != NULL)
+            lockedAt = Time::SteadyClock::now();
+        if (callback)
+            callback();
+    }
+
+    /**
+     * Called with the lock held just before it is released.
+     */
+    void
+    unlocking() {
+        if (callback)
+            callback();
+        if (holdNanos != NULL) {
+            std::chrono::nanoseconds elapsed =
+                Time::SteadyClock::now() - lockedAt;
+            holdNanos->push(uint64_t(elapsed.count()));
+        }
+    }
+
     /// Underlying mutex.
     std::mutex m;
+
+    /// When the mutex was last acquired. Only set if #holdNanos is set.
+    Time::SteadyClock::time_point lockedAt;
+
   public:
     /**
      * This function will be called with the lock held after the lock is
@@ -83,6 +117,14 @@ class Mutex {
      */
     std::function<void()> callback;
 
+    /**
+     * If not NULL, the length of time the mutex was held is pushed onto this
+     * every time it is released (including while waiting on a
+     * ConditionVariable). This happens with the lock held, so the RollingStat
+     * is protected by this mutex.
+     */
+    RollingStat* holdNanos;
+
     friend class ConditionVariable;
 };
 
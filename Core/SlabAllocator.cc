@@ -0,0 +1,104 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cassert>
+
+#include "Core/SlabAllocator.h"
+
+namespace LogCabin {
+namespace Core {
+
+namespace {
+
+/**
+ * Round the block size up so that every block is pointer-aligned and can
+ * hold a free list link.
+ */
+size_t
+roundBlockSize(size_t blockSize)
+{
+    const size_t align = alignof(void*);
+    if (blockSize < sizeof(void*))
+        blockSize = sizeof(void*);
+    return (blockSize + align - 1) / align * align;
+}
+
+} // anonymous namespace
+
+SlabStats::SlabStats()
+    : slabBytes(0)
+    , blocksInUse(0)
+    , bytesInUse(0)
+{
+}
+
+const size_t SlabPool::SLAB_BYTES;
+
+SlabPool::SlabPool(size_t blockSize, SlabStats& stats)
+    : mutex()
+    , blockSize(roundBlockSize(blockSize))
+    , stats(stats)
+    , freeList(NULL)
+    , unused(NULL)
+    , unusedEnd(NULL)
+    , slabs()
+{
+    assert(this->blockSize <= SLAB_BYTES);
+}
+
+SlabPool::~SlabPool()
+{
+    for (auto it = slabs.begin(); it != slabs.end(); ++it)
+        ::operator delete(*it);
+    stats.slabBytes -= slabs.size() * SLAB_BYTES;
+}
+
+void*
+SlabPool::allocate()
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    void* block;
+    if (freeList != NULL) {
+        block = freeList;
+        freeList = freeList->next;
+    } else {
+        if (size_t(unusedEnd - unused) < blockSize) {
+            char* slab = static_cast<char*>(::operator new(SLAB_BYTES));
+            slabs.push_back(slab);
+            unused = slab;
+            unusedEnd = slab + SLAB_BYTES;
+            stats.slabBytes += SLAB_BYTES;
+        }
+        block = unused;
+        unused += blockSize;
+    }
+    ++stats.blocksInUse;
+    stats.bytesInUse += blockSize;
+    return block;
+}
+
+void
+SlabPool::deallocate(void* block)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+    freeBlock->next = freeList;
+    freeList = freeBlock;
+    --stats.blocksInUse;
+    stats.bytesInUse -= blockSize;
+}
+
+} // namespace LogCabin::Core
+} // namespace LogCabin
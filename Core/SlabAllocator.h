@@ -0,0 +1,203 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifndef LOGCABIN_CORE_SLABALLOCATOR_H
+#define LOGCABIN_CORE_SLABALLOCATOR_H
+
+namespace LogCabin {
+namespace Core {
+
+/**
+ * Counters describing the memory held by a SlabPool. These are atomic so
+ * that they can be read without locking the pool.
+ */
+struct SlabStats {
+    SlabStats();
+    /**
+     * Total size of the slabs the pool has allocated, in bytes. Slabs are
+     * never freed, so this only grows.
+     */
+    std::atomic<uint64_t> slabBytes;
+    /**
+     * Number of blocks currently handed out.
+     */
+    std::atomic<uint64_t> blocksInUse;
+    /**
+     * Bytes in the blocks currently handed out.
+     */
+    std::atomic<uint64_t> bytesInUse;
+};
+
+/**
+ * Hands out fixed-size blocks of memory carved from large slabs, reusing
+ * freed blocks before carving new ones. Compared to allocating each small
+ * object with malloc, this avoids per-object headers and padding and keeps
+ * objects of the same kind together instead of scattered across the heap.
+ * Freed blocks are only ever reused by the same pool; slabs are never
+ * returned to the system.
+ *
+ * This class is thread-safe.
+ */
+class SlabPool {
+  public:
+    /**
+     * Constructor.
+     * \param blockSize
+     *      Size of each block in bytes. This is rounded up to a multiple of
+     *      the pointer size, which is also the blocks' alignment.
+     * \param stats
+     *      Counters to keep up to date. These must outlive the pool.
+     */
+    SlabPool(size_t blockSize, SlabStats& stats);
+    /**
+     * Destructor. Frees the slabs, so every block must have been returned.
+     */
+    ~SlabPool();
+
+    /**
+     * Return an uninitialized block.
+     */
+    void* allocate();
+    /**
+     * Return a block obtained from allocate() to the pool.
+     */
+    void deallocate(void* block);
+    /**
+     * Return the size of each block, after rounding.
+     */
+    size_t getBlockSize() const { return blockSize; }
+
+    /**
+     * Number of bytes in each slab.
+     */
+    static const size_t SLAB_BYTES = 64 * 1024;
+
+  private:
+    /**
+     * Free blocks are linked through their first word.
+     */
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    /**
+     * Protects all of the members below except #blockSize.
+     */
+    std::mutex mutex;
+    /**
+     * See getBlockSize().
+     */
+    const size_t blockSize;
+    /**
+     * See constructor.
+     */
+    SlabStats& stats;
+    /**
+     * Blocks that have been freed and may be handed out again.
+     */
+    FreeBlock* freeList;
+    /**
+     * The part of the newest slab that hasn't been handed out yet, from
+     * #unused up to #unusedEnd.
+     */
+    char* unused;
+    char* unusedEnd;
+    /**
+     * All the slabs, so that the destructor can free them.
+     */
+    std::vector<char*> slabs;
+
+    // SlabPool is non-copyable.
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+};
+
+/**
+ * A stateless C++11 allocator that takes single objects from a SlabPool. It's
+ * meant for std::allocate_shared(), which places the object and its
+ * reference counts in one block. Requests for arrays fall back to operator
+ * new.
+ *
+ * \tparam T
+ *      The type of object to allocate.
+ * \tparam Tag
+ *      Selects the pool: all SlabAllocators with the same Tag and T share
+ *      one, and it reports into Tag::slabStats(), which must return a
+ *      SlabStats reference.
+ */
+template<typename T, typename Tag>
+class SlabAllocator {
+  public:
+    typedef T value_type;
+    template<typename U>
+    struct rebind {
+        typedef SlabAllocator<U, Tag> other;
+    };
+
+    SlabAllocator() {}
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U, Tag>&) {} // NOLINT
+
+    T* allocate(size_t n) {
+        if (n != 1)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(pool().allocate());
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1)
+            ::operator delete(p);
+        else
+            pool().deallocate(p);
+    }
+
+    /**
+     * Return the pool for this T and Tag.
+     */
+    static SlabPool& pool() {
+        static_assert(alignof(T) <= alignof(void*),
+                      "SlabPool blocks are only pointer-aligned");
+        // This is never destroyed, since objects may be freed during static
+        // destruction.
+        static SlabPool* pool = new SlabPool(sizeof(T), Tag::slabStats());
+        return *pool;
+    }
+};
+
+template<typename T, typename U, typename Tag>
+bool
+operator==(const SlabAllocator<T, Tag>&, const SlabAllocator<U, Tag>&)
+{
+    return true;
+}
+
+template<typename T, typename U, typename Tag>
+bool
+operator!=(const SlabAllocator<T, Tag>&, const SlabAllocator<U, Tag>&)
+{
+    return false;
+}
+
+} // namespace LogCabin::Core
+} // namespace LogCabin
+
+#endif /* LOGCABIN_CORE_SLABALLOCATOR_H */
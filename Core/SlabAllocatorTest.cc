@@ -0,0 +1,100 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "Core/SlabAllocator.h"
+
+namespace LogCabin {
+namespace {
+
+using Core::SlabAllocator;
+using Core::SlabPool;
+using Core::SlabStats;
+
+TEST(CoreSlabPoolTest, basics) {
+    SlabStats stats;
+    {
+        SlabPool pool(3, stats);
+        EXPECT_EQ(sizeof(void*), pool.getBlockSize());
+        void* a = pool.allocate();
+        void* b = pool.allocate();
+        EXPECT_EQ(sizeof(void*), size_t(static_cast<char*>(b) -
+                                        static_cast<char*>(a)));
+        EXPECT_EQ(SlabPool::SLAB_BYTES, stats.slabBytes);
+        EXPECT_EQ(2U, stats.blocksInUse);
+        EXPECT_EQ(2 * sizeof(void*), stats.bytesInUse);
+        pool.deallocate(a);
+        EXPECT_EQ(1U, stats.blocksInUse);
+        EXPECT_EQ(a, pool.allocate()); // reused
+        pool.deallocate(a);
+        pool.deallocate(b);
+        EXPECT_EQ(0U, stats.blocksInUse);
+        EXPECT_EQ(0U, stats.bytesInUse);
+    }
+    EXPECT_EQ(0U, stats.slabBytes);
+}
+
+TEST(CoreSlabPoolTest, manySlabs) {
+    SlabStats stats;
+    SlabPool pool(1000, stats);
+    EXPECT_EQ(1000U, pool.getBlockSize());
+    std::set<void*> blocks;
+    for (size_t i = 0; i < 3 * SlabPool::SLAB_BYTES / 1000; ++i)
+        blocks.insert(pool.allocate());
+    EXPECT_EQ(3 * SlabPool::SLAB_BYTES / 1000, blocks.size());
+    EXPECT_EQ(4 * SlabPool::SLAB_BYTES, stats.slabBytes);
+    for (auto it = blocks.begin(); it != blocks.end(); ++it)
+        pool.deallocate(*it);
+    EXPECT_EQ(0U, stats.blocksInUse);
+}
+
+struct TestTag {
+    static SlabStats& slabStats() {
+        static SlabStats stats;
+        return stats;
+    }
+};
+
+TEST(CoreSlabAllocatorTest, allocateShared) {
+    SlabStats& stats = TestTag::slabStats();
+    uint64_t before = stats.blocksInUse;
+    {
+        std::shared_ptr<std::string> s1 = std::allocate_shared<std::string>(
+            SlabAllocator<std::string, TestTag>(), "hello");
+        std::shared_ptr<std::string> s2 = s1;
+        std::shared_ptr<std::string> s3 = std::allocate_shared<std::string>(
+            SlabAllocator<std::string, TestTag>(), "world");
+        EXPECT_EQ("hello", *s2);
+        EXPECT_EQ("world", *s3);
+        EXPECT_EQ(before + 2, stats.blocksInUse);
+    }
+    EXPECT_EQ(before, stats.blocksInUse);
+}
+
+TEST(CoreSlabAllocatorTest, arrays) {
+    SlabAllocator<uint64_t, TestTag> alloc;
+    uint64_t before = TestTag::slabStats().blocksInUse;
+    uint64_t* array = alloc.allocate(10);
+    array[9] = 1;
+    EXPECT_EQ(before, TestTag::slabStats().blocksInUse);
+    alloc.deallocate(array, 10);
+}
+
+} // namespace LogCabin::<anonymous>
+} // namespace LogCabin
@@ -13,7 +13,10 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <cstdio>
+#include <cstring>
 #include <mutex>
+#include <pthread.h>
 #include <unordered_map>
 
 #include "Core/ThreadId.h"
@@ -47,6 +50,42 @@ uint64_t nextId = 1;
  */
 std::unordered_map<uint64_t, std::string> threadNames;
 
+/**
+ * Called before fork() to grab #mutex, so that the child process doesn't
+ * inherit it locked by a thread that doesn't exist there. Otherwise, a child
+ * could hang on its first log message.
+ */
+void
+acquireMutex()
+{
+    mutex.lock();
+}
+
+/**
+ * Called in both the parent and the child after fork().
+ */
+void
+releaseMutex()
+{
+    mutex.unlock();
+}
+
+/**
+ * Registers the pthread_atfork() handlers during static initialization.
+ */
+struct ForkHandlers {
+    ForkHandlers() {
+        int err = pthread_atfork(acquireMutex, releaseMutex, releaseMutex);
+        if (err != 0) {
+            // too early to call ERROR in here
+            fprintf(stderr, "Failed to set up pthread_atfork() handler for "
+                    "thread names. Child processes may hang if they log "
+                    "while another thread is naming itself. Error: %s\n",
+                    strerror(err));
+        }
+    }
+} forkHandlers;
+
 /**
  * Pick a unique value to use as the thread identifier for the current
  * thread. This value is saved in the thread-specific variable #id.
@@ -38,6 +38,7 @@
 
 namespace {
 
+using LogCabin::Client::Batch;
 using LogCabin::Client::Cluster;
 using LogCabin::Client::Result;
 using LogCabin::Client::Status;
@@ -52,6 +53,7 @@ class OptionParser {
     OptionParser(int& argc, char**& argv)
         : argc(argc)
         , argv(argv)
+        , batchSize(1)
         , cluster("logcabin:5254")
         , logPolicy("")
         , size(1024)
@@ -61,6 +63,7 @@ class OptionParser {
     {
         while (true) {
             static struct option longOptions[] = {
+               {"batch",  required_argument, NULL, 'b'},
                {"cluster",  required_argument, NULL, 'c'},
                {"help",  no_argument, NULL, 'h'},
                {"size",  required_argument, NULL, 's'},
@@ -71,13 +74,18 @@ class OptionParser {
                {"verbosity",  required_argument, NULL, 256},
                {0, 0, 0, 0}
             };
-            int c = getopt_long(argc, argv, "c:hs:t:w:v", longOptions, NULL);
+            int c = getopt_long(argc, argv, "b:c:hs:t:w:v", longOptions, NULL);
 
             // Detect the end of the options.
             if (c == -1)
                 break;
 
             switch (c) {
+                case 'b':
+                    batchSize = uint64_t(atol(optarg));
+                    if (batchSize == 0)
+                        batchSize = 1;
+                    break;
                 case 'c':
                     cluster = optarg;
                     break;
@@ -131,6 +139,13 @@ class OptionParser {
             << "Options:"
             << std::endl
 
+            << "  -b <num>, --batch=<num>                "
+            << "Number of writes to commit together"
+            << std::endl
+            << "                                         "
+            << "atomically [default: 1]"
+            << std::endl
+
             << "  -c <addresses>, --cluster=<addresses>  "
             << "Network addresses of the LogCabin"
             << std::endl
@@ -184,6 +199,7 @@ class OptionParser {
 
     int& argc;
     char**& argv;
+    uint64_t batchSize;
     std::string cluster;
     std::string logPolicy;
     uint64_t size;
@@ -225,7 +241,17 @@ writeThreadMain(uint64_t id,
     for (uint64_t i = 0; i < numWrites; ++i) {
         if (exit)
             break;
-        tree.writeEx(key, value);
+        if (options.batchSize > 1) {
+            Batch batch = tree.batch();
+            while (batch.size() < options.batchSize && i < numWrites) {
+                batch.write(key, value);
+                ++i;
+            }
+            --i;
+            batch.commitEx();
+        } else {
+            tree.writeEx(key, value);
+        }
         writesDone = i + 1;
     }
 }
@@ -307,6 +333,11 @@ main(int argc, char** argv)
                   << totalWritesDone
                   << " objects"
                   << std::endl;
+        std::cout << "Throughput: "
+                  << (static_cast<double>(totalWritesDone) * 1e9 /
+                      static_cast<double>(endNanos - startNanos))
+                  << " writes/s"
+                  << std::endl;
         return 0;
 
     } catch (const LogCabin::Client::Exception& e) {
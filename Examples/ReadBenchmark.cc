@@ -0,0 +1,342 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file
+ * This benchmark measures how LogCabin's read throughput scales with the
+ * number of concurrent readers. It runs with 1, 2, 4, ... readers up to the
+ * given number, optionally while another thread writes continuously.
+ */
+
+#include <atomic>
+#include <cassert>
+#include <ctime>
+#include <getopt.h>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+#include <LogCabin/Client.h>
+#include <LogCabin/Debug.h>
+#include <LogCabin/Util.h>
+
+namespace {
+
+using LogCabin::Client::Cluster;
+using LogCabin::Client::Tree;
+using LogCabin::Client::Util::parseNonNegativeDuration;
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , cluster("logcabin:5254")
+        , logPolicy("")
+        , size(1024)
+        , readers(16)
+        , duration(parseNonNegativeDuration("5s"))
+        , writer(false)
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"cluster",  required_argument, NULL, 'c'},
+               {"duration",  required_argument, NULL, 'd'},
+               {"help",  no_argument, NULL, 'h'},
+               {"size",  required_argument, NULL, 's'},
+               {"threads",  required_argument, NULL, 't'},
+               {"writer",  no_argument, NULL, 'w'},
+               {"verbose",  no_argument, NULL, 'v'},
+               {"verbosity",  required_argument, NULL, 256},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "c:d:hs:t:wv", longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'c':
+                    cluster = optarg;
+                    break;
+                case 'd':
+                    duration = parseNonNegativeDuration(optarg);
+                    break;
+                case 'h':
+                    usage();
+                    exit(0);
+                case 's':
+                    size = uint64_t(atol(optarg));
+                    break;
+                case 't':
+                    readers = uint64_t(atol(optarg));
+                    if (readers == 0)
+                        readers = 1;
+                    break;
+                case 'w':
+                    writer = true;
+                    break;
+                case 'v':
+                    logPolicy = "VERBOSE";
+                    break;
+                case 256:
+                    logPolicy = optarg;
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+    }
+
+    void usage() {
+        std::cout
+            << "Reads repeatedly from LogCabin with 1, 2, 4, ... concurrent "
+            << "readers, up to"
+            << std::endl
+            << "the given number, and reports the read throughput for each."
+            << std::endl
+            << std::endl
+            << "This program is subject to change (it is not part of "
+            << "LogCabin's stable API)."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  -c <addresses>, --cluster=<addresses>  "
+            << "Network addresses of the LogCabin"
+            << std::endl
+            << "                                         "
+            << "servers, comma-separated"
+            << std::endl
+            << "                                         "
+            << "[default: logcabin:5254]"
+            << std::endl
+
+            << "  --duration <time>       "
+            << "Time to read for at each number of"
+            << std::endl
+            << "                          "
+            << "readers [default: 5s]"
+            << std::endl
+
+            << "  -h, --help              "
+            << "Print this usage information"
+            << std::endl
+
+            << "  --size <bytes>          "
+            << "Size of value read [default: 1024]"
+            << std::endl
+
+            << "  --threads <num>         "
+            << "Maximum number of concurrent readers"
+            << std::endl
+            << "                          "
+            << "[default: 16]"
+            << std::endl
+
+            << "  --writer                "
+            << "Also write continuously while reading"
+            << std::endl
+
+            << "  -v, --verbose           "
+            << "Same as --verbosity=VERBOSE"
+            << std::endl
+
+            << "  --verbosity=<policy>    "
+            << "Set which log messages are shown."
+            << std::endl
+            << "                          "
+            << "Comma-separated LEVEL or PATTERN@LEVEL rules."
+            << std::endl
+            << "                          "
+            << "Levels: SILENT, ERROR, WARNING, NOTICE, VERBOSE."
+            << std::endl
+            << "                          "
+            << "Patterns match filename prefixes or suffixes."
+            << std::endl
+            << "                          "
+            << "Example: Client@NOTICE,Test.cc@SILENT,VERBOSE."
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    std::string cluster;
+    std::string logPolicy;
+    uint64_t size;
+    uint64_t readers;
+    uint64_t duration;
+    bool writer;
+};
+
+/**
+ * The main function for a single reader thread.
+ * \param tree
+ *      Interface to LogCabin.
+ * \param key
+ *      Key to read repeatedly.
+ * \param exit
+ *      When this becomes true, this thread should exit.
+ * \param[out] readsDone
+ *      The number of reads this thread has completed.
+ */
+void
+readThreadMain(Tree tree,
+               const std::string& key,
+               std::atomic<bool>& exit,
+               uint64_t& readsDone)
+{
+    while (!exit) {
+        tree.readEx(key);
+        ++readsDone;
+    }
+}
+
+/**
+ * The main function for the writer thread, if any.
+ * \param tree
+ *      Interface to LogCabin.
+ * \param key
+ *      Key to write repeatedly.
+ * \param value
+ *      Value to write at key repeatedly.
+ * \param exit
+ *      When this becomes true, this thread should exit.
+ */
+void
+writeThreadMain(Tree tree,
+                const std::string& key,
+                const std::string& value,
+                std::atomic<bool>& exit)
+{
+    while (!exit)
+        tree.writeEx(key, value);
+}
+
+/**
+ * Return the time since the Unix epoch in nanoseconds.
+ */
+uint64_t timeNanos()
+{
+    struct timespec now;
+    int r = clock_gettime(CLOCK_REALTIME, &now);
+    assert(r == 0);
+    return uint64_t(now.tv_sec) * 1000 * 1000 * 1000 + uint64_t(now.tv_nsec);
+}
+
+/**
+ * Run the given number of readers for the given time.
+ * \return
+ *      The number of reads per second they completed in total.
+ */
+double
+runReaders(Tree tree,
+           const std::string& key,
+           uint64_t numReaders,
+           uint64_t duration)
+{
+    std::atomic<bool> exit(false);
+    std::vector<uint64_t> readsDonePerThread(numReaders);
+    std::vector<std::thread> threads;
+    uint64_t startNanos = timeNanos();
+    for (uint64_t i = 0; i < numReaders; ++i) {
+        threads.emplace_back(readThreadMain, tree, std::ref(key),
+                             std::ref(exit),
+                             std::ref(readsDonePerThread.at(i)));
+    }
+    while (timeNanos() - startNanos < duration)
+        usleep(50 * 1000);
+    exit = true;
+    uint64_t totalReadsDone = 0;
+    for (uint64_t i = 0; i < numReaders; ++i) {
+        threads.at(i).join();
+        totalReadsDone += readsDonePerThread.at(i);
+    }
+    uint64_t endNanos = timeNanos();
+    return (static_cast<double>(totalReadsDone) * 1e9 /
+            static_cast<double>(endNanos - startNanos));
+}
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    try {
+
+        OptionParser options(argc, argv);
+        LogCabin::Client::Debug::setLogPolicy(
+            LogCabin::Client::Debug::logPolicyFromString(
+                options.logPolicy));
+        Cluster cluster = Cluster(options.cluster);
+        Tree tree = cluster.getTree();
+
+        std::string key("/readbench");
+        std::string writeKey("/readbench-writes");
+        std::string value(options.size, 'v');
+        tree.writeEx(key, value);
+
+        std::atomic<bool> exit(false);
+        std::thread writer;
+        if (options.writer) {
+            writer = std::thread(writeThreadMain, tree, std::ref(writeKey),
+                                 std::ref(value), std::ref(exit));
+        }
+
+        double baseline = 0;
+        for (uint64_t numReaders = 1;
+             numReaders <= options.readers;
+             numReaders *= 2) {
+            double throughput = runReaders(tree, key, numReaders,
+                                           options.duration);
+            if (numReaders == 1)
+                baseline = throughput;
+            std::cout << numReaders << " readers: "
+                      << throughput << " reads/s ("
+                      << throughput / baseline << "x)"
+                      << std::endl;
+            if (numReaders < options.readers &&
+                numReaders * 2 > options.readers) {
+                numReaders = options.readers / 2;
+            }
+        }
+
+        exit = true;
+        if (writer.joinable())
+            writer.join();
+        tree.removeFile(key);
+        tree.removeFile(writeKey);
+        return 0;
+
+    } catch (const LogCabin::Client::Exception& e) {
+        std::cerr << "Exiting due to LogCabin::Client::Exception: "
+                  << e.what()
+                  << std::endl;
+        exit(1);
+    }
+}
@@ -29,19 +29,45 @@ using RPC::Protocol::ResponseHeaderPrefix;
 using RPC::Protocol::ResponseHeaderVersion1;
 typedef RPC::Protocol::Status ProtocolStatus;
 
+namespace {
+
+/**
+ * Serialize a request, leaving space for the RPC header at the start.
+ */
+Core::Buffer
+serializeRequest(const google::protobuf::Message& request)
+{
+    Core::Buffer requestBuffer;
+    Core::ProtoBuf::serialize(request, requestBuffer,
+                              sizeof(RequestHeaderVersion1));
+    return requestBuffer;
+}
+
+} // anonymous namespace
+
+const uint32_t ClientRPC::REQUEST_HEADER_LENGTH =
+    sizeof(RequestHeaderVersion1);
+
 ClientRPC::ClientRPC(std::shared_ptr<RPC::ClientSession> session,
                      uint16_t service,
                      uint8_t serviceSpecificErrorVersion,
                      uint16_t opCode,
                      const google::protobuf::Message& request)
+    : ClientRPC(session, service, serviceSpecificErrorVersion, opCode,
+                serializeRequest(request))
+{
+}
+
+ClientRPC::ClientRPC(std::shared_ptr<RPC::ClientSession> session,
+                     uint16_t service,
+                     uint8_t serviceSpecificErrorVersion,
+                     uint16_t opCode,
+                     Core::Buffer requestBuffer)
     : service(service)
     , opCode(opCode)
     , opaqueRPC() // placeholder, set again below
 {
-    // Serialize the request into a Buffer
-    Core::Buffer requestBuffer;
-    Core::ProtoBuf::serialize(request, requestBuffer,
-                              sizeof(RequestHeaderVersion1));
+    assert(requestBuffer.getLength() >= REQUEST_HEADER_LENGTH);
     auto& requestHeader =
         *static_cast<RequestHeaderVersion1*>(requestBuffer.getData());
     requestHeader.prefix.version = 1;
@@ -20,6 +20,7 @@
 #include <memory>
 #include <string>
 
+#include "Core/Buffer.h"
 #include "RPC/OpaqueClientRPC.h"
 
 #ifndef LOGCABIN_RPC_CLIENTRPC_H
@@ -45,6 +46,12 @@ class ClientRPC {
     /// Type for absolute time values used for timeouts.
     typedef OpaqueClientRPC::TimePoint TimePoint;
 
+    /**
+     * The number of bytes at the start of a pre-serialized request that are
+     * reserved for the RPC header. See the constructor below.
+     */
+    static const uint32_t REQUEST_HEADER_LENGTH;
+
     /**
      * Issue an RPC to a remote service.
      * \param session
@@ -68,6 +75,30 @@ class ClientRPC {
               uint16_t opCode,
               const google::protobuf::Message& request);
 
+    /**
+     * Issue an RPC to a remote service with a request that the caller has
+     * already serialized. This allows large requests to be built without an
+     * intermediate ProtoBuf message.
+     * \param session
+     *      A connection to the remote server.
+     * \param service
+     *      Identifies the service running on the server.
+     *      See Protocol::Common::ServiceId.
+     * \param serviceSpecificErrorVersion
+     *      See the constructor above.
+     * \param opCode
+     *      Identifies the remote procedure within the Service to execute.
+     * \param request
+     *      The serialized arguments to the remote procedure, preceded by
+     *      REQUEST_HEADER_LENGTH bytes of space in which the RPC header will
+     *      be placed.
+     */
+    ClientRPC(std::shared_ptr<RPC::ClientSession> session,
+              uint16_t service,
+              uint8_t serviceSpecificErrorVersion,
+              uint16_t opCode,
+              Core::Buffer request);
+
     /**
      * Default constructor. This doesn't create a valid RPC, but it is useful
      * as a placeholder.
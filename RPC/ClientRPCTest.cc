@@ -140,6 +140,38 @@ TEST_F(RPCClientRPCTest, constructor) {
     EXPECT_EQ(payload, actual);
 }
 
+TEST_F(RPCClientRPCTest, constructor_serialized) {
+    std::string serialized = payload.SerializeAsString();
+    uint64_t length = ClientRPC::REQUEST_HEADER_LENGTH + serialized.length();
+    char* data = new char[length];
+    memcpy(data + ClientRPC::REQUEST_HEADER_LENGTH,
+           serialized.data(), serialized.length());
+    ClientRPC rpc(session, 2, 3, 4,
+                  Core::Buffer(data, length,
+                               Core::Buffer::deleteArrayFn<char>));
+    while (!rpc.isReady()) {
+        /* spin -- can't call waitForReply because it will PANIC */;
+        usleep(100);
+    }
+    EXPECT_EQ(sizeof(Protocol::RequestHeaderVersion1),
+              ClientRPC::REQUEST_HEADER_LENGTH);
+    EXPECT_EQ(length, rpcHandler.lastRequest.getLength());
+    Protocol::RequestHeaderVersion1 header =
+        *static_cast<Protocol::RequestHeaderVersion1*>(
+            rpcHandler.lastRequest.getData());
+    header.prefix.fromBigEndian();
+    EXPECT_EQ(1U, header.prefix.version);
+    header.fromBigEndian();
+    EXPECT_EQ(2U, header.service);
+    EXPECT_EQ(3U, header.serviceSpecificErrorVersion);
+    EXPECT_EQ(4U, header.opCode);
+    LogCabin::ProtoBuf::TestMessage actual;
+    EXPECT_TRUE(Core::ProtoBuf::parse(
+        rpcHandler.lastRequest, actual,
+        sizeof(Protocol::RequestHeaderVersion1)));
+    EXPECT_EQ(payload, actual);
+}
+
 // default constructor: nothing to test
 // move constructor: nothing to test
 // destructor: nothing to test
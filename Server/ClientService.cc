@@ -177,7 +177,35 @@ void
 ClientService::stateMachineQuery(RPC::ServerRPC rpc)
 {
     PRELUDE(StateMachineQuery);
-    std::pair<Result, uint64_t> result = globals.raft->getLastCommitIndex();
+    typedef Protocol::Client::ReadConsistency ReadConsistency;
+    const ReadConsistency& consistency = request.tree().consistency();
+    std::pair<Result, uint64_t> result;
+    switch (consistency.mode()) {
+        case ReadConsistency::LINEARIZABLE:
+            result = globals.raft->getLastCommitIndex();
+            break;
+        case ReadConsistency::BOUNDED_STALENESS:
+            result = globals.raft->getRecentCommitIndex(
+                                        consistency.max_staleness_nanos(),
+                                        consistency.max_lag_entries());
+            break;
+        case ReadConsistency::ANY_REPLICA:
+            result = {Result::SUCCESS, 0};
+            break;
+        default:
+            rpc.rejectInvalidRequest();
+            return;
+    }
+    if (result.first == Result::SUCCESS &&
+        consistency.mode() == ReadConsistency::BOUNDED_STALENESS &&
+        consistency.max_staleness_nanos() > 0) {
+        // Don't wait longer to catch up than the staleness bound allows.
+        Core::Time::SteadyClock::time_point deadline =
+            Core::Time::SteadyClock::now() +
+            std::chrono::nanoseconds(consistency.max_staleness_nanos());
+        if (!globals.stateMachine->waitUntil(result.second, deadline))
+            result.first = Result::NOT_LEADER;
+    }
     if (result.first == Result::RETRY || result.first == Result::NOT_LEADER) {
         Protocol::Client::Error error;
         error.set_error_code(Protocol::Client::Error::NOT_LEADER);
@@ -190,6 +218,10 @@ ClientService::stateMachineQuery(RPC::ServerRPC rpc)
     assert(result.first == Result::SUCCESS);
     uint64_t logIndex = result.second;
     globals.stateMachine->wait(logIndex);
+    if (request.tree().has_watch()) {
+        globals.stateMachine->watch(request, std::move(rpc));
+        return;
+    }
     if (!globals.stateMachine->query(request, response))
         rpc.rejectInvalidRequest();
     rpc.reply(response);
@@ -17,7 +17,10 @@
 
 #include <algorithm>
 #include <fcntl.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 #include <limits>
+#include <set>
 #include <string.h>
 #include <sys/file.h>
 #include <sys/stat.h>
@@ -27,6 +30,7 @@
 #include "build/Protocol/Raft.pb.h"
 #include "build/Server/SnapshotMetadata.pb.h"
 #include "Core/Buffer.h"
+#include "Core/Checksum.h"
 #include "Core/Debug.h"
 #include "Core/ProtoBuf.h"
 #include "Core/Random.h"
@@ -103,6 +107,12 @@ namespace LogCabin
                 return consensus.currentEpoch;
             }
 
+            TimePoint
+            LocalServer::getLastAckTime() const
+            {
+                return TimePoint::max();
+            }
+
             uint64_t
             LocalServer::getMatchIndex() const
             {
@@ -126,6 +136,11 @@ namespace LogCabin
                 return true;
             }
 
+            void
+            LocalServer::notifyNewEntries()
+            {
+            }
+
             void
             LocalServer::scheduleHeartbeat()
             {
@@ -157,14 +172,14 @@ namespace LogCabin
             ////////// Peer //////////
 
             Peer::Peer(uint64_t serverId, RaftConsensus &consensus)
-                : Server(serverId), consensus(consensus), eventLoop(consensus.globals.eventLoop), exiting(false), requestVoteDone(false), haveVote_(false), suppressBulkData(true)
+                : Server(serverId), consensus(consensus), eventLoop(consensus.globals.eventLoop), exiting(false), workAvailable(), requestVoteDone(false), haveVote_(false), suppressBulkData(true)
                   // It's somewhat important to set nextIndex correctly here, since peers
                   // that are added to the configuration won't go through beginLeadership()
                   // on the current leader. I say somewhat important because, if nextIndex
                   // is set incorrectly, it's self-correcting, so it's just a potential
                   // performance issue.
                   ,
-                  nextIndex(consensus.log->getLastLogIndex() + 1), matchIndex(0), lastAckEpoch(0), nextHeartbeatTime(TimePoint::min()), backoffUntil(TimePoint::min()), rpcFailuresSinceLastWarning(0), lastCatchUpIterationMs(~0UL), thisCatchUpIterationStart(Clock::now()), thisCatchUpIterationGoalId(~0UL), isCaughtUp_(false), snapshotFile(), snapshotFileOffset(0), lastSnapshotIndex(0), session(), rpc()
+                  nextIndex(consensus.log->getLastLogIndex() + 1), matchIndex(0), lastAckEpoch(0), lastAckTime(TimePoint::min()), nextHeartbeatTime(TimePoint::min()), backoffUntil(TimePoint::min()), rpcFailuresSinceLastWarning(0), lastCatchUpIterationMs(~0UL), thisCatchUpIterationStart(Clock::now()), thisCatchUpIterationGoalId(~0UL), isCaughtUp_(false), snapshotFile(), snapshotFileOffset(0), lastSnapshotIndex(0), snapshotFileCrc32c(0), installSnapshotVersion(0), snapshotBytesAcked(0), appendEntriesInFlight(), installSnapshotInFlight(), session(), rpc()
             {
             }
 
@@ -184,10 +199,14 @@ namespace LogCabin
             {
                 nextIndex = consensus.log->getLastLogIndex() + 1;
                 matchIndex = 0;
+                lastAckTime = TimePoint::min();
                 suppressBulkData = true;
                 snapshotFile.reset();
                 snapshotFileOffset = 0;
                 lastSnapshotIndex = 0;
+                snapshotFileCrc32c = 0;
+                installSnapshotVersion = 0;
+                snapshotBytesAcked = 0;
             }
 
             void
@@ -210,6 +229,12 @@ namespace LogCabin
                 return lastAckEpoch;
             }
 
+            TimePoint
+            Peer::getLastAckTime() const
+            {
+                return lastAckTime;
+            }
+
             uint64_t
             Peer::getMatchIndex() const
             {
@@ -226,6 +251,19 @@ namespace LogCabin
             Peer::interrupt()
             {
                 rpc.cancel();
+                for (auto it = appendEntriesInFlight.begin();
+                     it != appendEntriesInFlight.end();
+                     ++it)
+                {
+                    it->rpc.cancel();
+                }
+                for (auto it = installSnapshotInFlight.begin();
+                     it != installSnapshotInFlight.end();
+                     ++it)
+                {
+                    it->rpc.cancel();
+                }
+                workAvailable.notify_all();
             }
 
             bool
@@ -234,10 +272,29 @@ namespace LogCabin
                 return isCaughtUp_;
             }
 
+            void
+            Peer::notifyNewEntries()
+            {
+                workAvailable.notify_all();
+            }
+
+            void
+            Peer::cancelInstallSnapshotInFlight()
+            {
+                for (auto it = installSnapshotInFlight.begin();
+                     it != installSnapshotInFlight.end();
+                     ++it)
+                {
+                    it->rpc.cancel();
+                }
+                installSnapshotInFlight.clear();
+            }
+
             void
             Peer::scheduleHeartbeat()
             {
                 nextHeartbeatTime = Clock::now();
+                workAvailable.notify_all();
             }
 
             Peer::CallStatus
@@ -245,13 +302,51 @@ namespace LogCabin
                           const google::protobuf::Message &request,
                           google::protobuf::Message &response,
                           std::unique_lock<Mutex> &lockGuard)
+            {
+                rpc = startRPC(opCode, request, lockGuard);
+                return waitForRPC(rpc, response, lockGuard);
+            }
+
+            Peer::CallStatus
+            Peer::callRPC(Protocol::Raft::OpCode opCode,
+                          Core::Buffer request,
+                          google::protobuf::Message &response,
+                          std::unique_lock<Mutex> &lockGuard)
+            {
+                rpc = startRPC(opCode, std::move(request), lockGuard);
+                return waitForRPC(rpc, response, lockGuard);
+            }
+
+            RPC::ClientRPC
+            Peer::startRPC(Protocol::Raft::OpCode opCode,
+                           const google::protobuf::Message &request,
+                           std::unique_lock<Mutex> &lockGuard)
+            {
+                return RPC::ClientRPC(getSession(lockGuard),
+                                      Protocol::Common::ServiceId::RAFT_SERVICE,
+                                      /* serviceSpecificErrorVersion = */ 0,
+                                      opCode,
+                                      request);
+            }
+
+            RPC::ClientRPC
+            Peer::startRPC(Protocol::Raft::OpCode opCode,
+                           Core::Buffer request,
+                           std::unique_lock<Mutex> &lockGuard)
+            {
+                return RPC::ClientRPC(getSession(lockGuard),
+                                      Protocol::Common::ServiceId::RAFT_SERVICE,
+                                      /* serviceSpecificErrorVersion = */ 0,
+                                      opCode,
+                                      std::move(request));
+            }
+
+            Peer::CallStatus
+            Peer::waitForRPC(RPC::ClientRPC &rpc,
+                             google::protobuf::Message &response,
+                             std::unique_lock<Mutex> &lockGuard)
             {
                 typedef RPC::ClientRPC::Status RPCStatus;
-                rpc = RPC::ClientRPC(getSession(lockGuard),
-                                     Protocol::Common::ServiceId::RAFT_SERVICE,
-                                     /* serviceSpecificErrorVersion = */ 0,
-                                     opCode,
-                                     request);
                 // release lock for concurrency
                 Core::MutexUnlock<Mutex> unlockGuard(lockGuard);
                 switch (rpc.waitForReply(&response, NULL, TimePoint::max()))
@@ -354,6 +449,10 @@ namespace LogCabin
                     os << "suppressBulkData: " << suppressBulkData << std::endl;
                     os << "nextIndex: " << nextIndex << std::endl;
                     os << "matchIndex: " << matchIndex << std::endl;
+                    os << "appendEntriesInFlight: "
+                       << appendEntriesInFlight.size() << std::endl;
+                    os << "installSnapshotInFlight: "
+                       << installSnapshotInFlight.size() << std::endl;
                     break;
                 }
                 return os;
@@ -374,6 +473,8 @@ namespace LogCabin
                     peerStats.set_next_index(nextIndex);
                     peerStats.set_last_agree_index(matchIndex);
                     peerStats.set_is_caught_up(isCaughtUp_);
+                    peerStats.set_append_entries_in_flight(
+                        appendEntriesInFlight.size());
                     peerStats.set_next_heartbeat_at(time.unixNanos(nextHeartbeatTime));
                     break;
                 }
@@ -391,6 +492,50 @@ namespace LogCabin
                 }
             }
 
+            ////////// Peer::InFlightAppendEntries //////////
+
+            Peer::InFlightAppendEntries::InFlightAppendEntries(
+                RPC::ClientRPC rpc,
+                uint64_t term,
+                uint64_t prevLogIndex,
+                uint64_t numEntries,
+                TimePoint start,
+                uint64_t epoch)
+                : rpc(std::move(rpc)), term(term), prevLogIndex(prevLogIndex), numEntries(numEntries), start(start), epoch(epoch)
+            {
+            }
+
+            Peer::InFlightAppendEntries::InFlightAppendEntries(
+                InFlightAppendEntries &&other)
+                : rpc(std::move(other.rpc)), term(other.term), prevLogIndex(other.prevLogIndex), numEntries(other.numEntries), start(other.start), epoch(other.epoch)
+            {
+            }
+
+            Peer::InFlightAppendEntries::~InFlightAppendEntries()
+            {
+            }
+
+            Peer::InFlightInstallSnapshot::InFlightInstallSnapshot(
+                RPC::ClientRPC rpc,
+                uint64_t term,
+                uint64_t byteOffset,
+                uint64_t numDataBytes,
+                TimePoint start,
+                uint64_t epoch)
+                : rpc(std::move(rpc)), term(term), byteOffset(byteOffset), numDataBytes(numDataBytes), start(start), epoch(epoch)
+            {
+            }
+
+            Peer::InFlightInstallSnapshot::InFlightInstallSnapshot(
+                InFlightInstallSnapshot &&other)
+                : rpc(std::move(other.rpc)), term(other.term), byteOffset(other.byteOffset), numDataBytes(other.numDataBytes), start(other.start), epoch(other.epoch)
+            {
+            }
+
+            Peer::InFlightInstallSnapshot::~InFlightInstallSnapshot()
+            {
+            }
+
             ////////// Configuration::SimpleConfiguration //////////
 
             Configuration::SimpleConfiguration::SimpleConfiguration()
@@ -920,6 +1065,65 @@ namespace LogCabin
 
         } // namespace RaftConsensusInternal
 
+        namespace
+        {
+
+            /**
+             * The name under which a snapshot covering log entries
+             * [1, lastIncludedIndex] is kept while delta snapshots depend on it.
+             */
+            std::string
+            deltaBaseFilename(uint64_t lastIncludedIndex)
+            {
+                return Core::StringUtil::format("snapshot.%lu", lastIncludedIndex);
+            }
+
+            /**
+             * Open the kept snapshot covering log entries [1, lastIncludedIndex]
+             * and read its header. PANICs if it's missing or malformed, since the
+             * delta snapshots that depend on it are useless without it.
+             */
+            std::unique_ptr<Storage::SnapshotFile::Reader>
+            openDeltaBase(const Storage::Layout &storageLayout,
+                          uint64_t lastIncludedIndex,
+                          SnapshotMetadata::Header &header)
+            {
+                std::unique_ptr<Storage::SnapshotFile::Reader> reader;
+                try
+                {
+                    reader.reset(new Storage::SnapshotFile::Reader(
+                        storageLayout, deltaBaseFilename(lastIncludedIndex)));
+                }
+                catch (const std::runtime_error &e)
+                {
+                    PANIC("Couldn't open the snapshot through %lu that a delta "
+                          "snapshot depends on: %s",
+                          lastIncludedIndex, e.what());
+                }
+                uint8_t version = 0;
+                reader->readRaw(&version, sizeof(version));
+                if (version != 1)
+                {
+                    PANIC("Snapshot format version read was %u, but this code can "
+                          "only read version 1",
+                          version);
+                }
+                std::string error = reader->readMessage(header);
+                if (!error.empty())
+                {
+                    PANIC("Couldn't read snapshot header: %s", error.c_str());
+                }
+                if (header.last_included_index() != lastIncludedIndex)
+                {
+                    PANIC("Snapshot %s covers log entries through %lu instead",
+                          deltaBaseFilename(lastIncludedIndex).c_str(),
+                          header.last_included_index());
+                }
+                return reader;
+            }
+
+        } // anonymous namespace
+
         ////////// RaftConsensus::Entry //////////
 
         RaftConsensus::Entry::Entry()
@@ -936,6 +1140,14 @@ namespace LogCabin
         {
         }
 
+        ////////// RaftConsensus::GroupCommitRequest //////////
+
+        RaftConsensus::GroupCommitRequest::GroupCommitRequest(
+            Log::Entry &entry, uint64_t term)
+            : entry(entry), term(term), queuedAt(Clock::now()), flushed(false), index(0)
+        {
+        }
+
         ////////// RaftConsensus //////////
 
         RaftConsensus::RaftConsensus(Globals &globals)
@@ -951,10 +1163,43 @@ namespace LogCabin
                                 globals.config.read<uint64_t>(
                                     "heartbeatPeriodMilliseconds")))
                       : ELECTION_TIMEOUT / 2),
+              LEADER_LEASE(
+                  std::min(ELECTION_TIMEOUT,
+                           std::chrono::nanoseconds(
+                               std::chrono::milliseconds(
+                                   globals.config.read<uint64_t>(
+                                       "leaderLeaseMilliseconds",
+                                       0))))),
               MAX_LOG_ENTRIES_PER_REQUEST(
                   globals.config.read<uint64_t>(
                       "maxLogEntriesPerRequest",
                       5000)),
+              MAX_APPEND_ENTRIES_IN_FLIGHT(
+                  std::max(uint64_t(1),
+                           globals.config.read<uint64_t>(
+                               "maxAppendEntriesInFlight",
+                               1))),
+              MAX_INSTALL_SNAPSHOT_IN_FLIGHT(
+                  std::max(uint64_t(1),
+                           globals.config.read<uint64_t>(
+                               "maxInstallSnapshotInFlight",
+                               4))),
+              GROUP_COMMIT_DELAY(
+                  std::chrono::microseconds(
+                      globals.config.read<uint64_t>(
+                          "groupCommitDelayMicroseconds",
+                          0))),
+              GROUP_COMMIT_MAX_ENTRIES(
+                  std::max(uint64_t(1),
+                           globals.config.read<uint64_t>(
+                               "groupCommitMaxEntries",
+                               1000))),
+              GROUP_COMMIT_MAX_BYTES(
+                  globals.config.read<uint64_t>(
+                      "groupCommitMaxBytes",
+                      1024 * 1024)),
+              ASYNC_FOLLOWER_SYNC(
+                  globals.config.read<bool>("asyncFollowerSync", false)),
               RPC_FAILURE_BACKOFF(
                   globals.config.keyExists("rpcFailureBackoffMilliseconds")
                       ? std::chrono::nanoseconds(
@@ -967,10 +1212,13 @@ namespace LogCabin
                       globals.config.read<uint64_t>(
                           "stateMachineUpdaterBackoffMilliseconds",
                           10000))),
+              SNAPSHOT_COMPRESSION_LEVEL(
+                  globals.config.read<int>("snapshotCompressionLevel", 0)),
               SOFT_RPC_SIZE_LIMIT(Protocol::Common::MAX_MESSAGE_LENGTH - 1024), serverId(0), serverAddresses(), globals(globals), storageLayout(), sessionManager(globals.eventLoop,
                                                                                                                                                                   globals.config),
-              mutex(), stateChanged(), exiting(false), numPeerThreads(0), log(), logSyncQueued(false), leaderDiskThreadWorking(false), configuration(), configurationManager(), currentTerm(0), state(State::FOLLOWER), lastSnapshotIndex(0), lastSnapshotTerm(0), lastSnapshotClusterTime(0), lastSnapshotBytes(0), snapshotReader(), snapshotWriter(), commitIndex(0), leaderId(0), votedFor(0), currentEpoch(0), clusterClock(), startElectionAt(TimePoint::max()), withholdVotesUntil(TimePoint::min()), numEntriesTruncated(0), leaderDiskThread(), timerThread(), stateMachineUpdaterThread(), stepDownThread(), invariants(*this)
+              lockHoldNanos(), mutex(), stateChanged(), exiting(false), numPeerThreads(0), log(), logSyncQueued(false), leaderDiskThreadWorking(false), followerDiskThreadWorking(false), followerSyncedIndex(0), followerSyncGeneration(0), configuration(), configurationManager(), currentTerm(0), state(State::FOLLOWER), lastSnapshotIndex(0), lastSnapshotTerm(0), lastSnapshotClusterTime(0), lastSnapshotBytes(0), lastSnapshotDeltaBaseIndex(0), fullSnapshotNeeded(false), snapshotReader(), snapshotWriter(), snapshotTransferIndex(0), snapshotTransferBytes(0), snapshotTransferCrc32c(0), commitIndex(0), leaderId(0), leaderCommitIndex(0), leaderCommitIndexTime(TimePoint::min()), votedFor(0), currentEpoch(0), lastSentEpoch(0), readRoundEpoch(0), numReadIndexRequests(0), numReadIndexRounds(0), groupCommitQueue(), groupCommitQueueBytes(0), groupCommitFlushAt(TimePoint::max()), groupCommitEntries(), groupCommitDelayNanos(), clusterClock(), startElectionAt(TimePoint::max()), withholdVotesUntil(TimePoint::min()), numEntriesTruncated(0), leaderDiskThread(), followerDiskThread(), timerThread(), stateMachineUpdaterThread(), stepDownThread(), invariants(*this)
         {
+            mutex.holdNanos = &lockHoldNanos;
         }
 
         RaftConsensus::~RaftConsensus()
@@ -979,6 +1227,8 @@ namespace LogCabin
                 exit();
             if (leaderDiskThread.joinable())
                 leaderDiskThread.join();
+            if (followerDiskThread.joinable())
+                followerDiskThread.join();
             if (timerThread.joinable())
                 timerThread.join();
             if (stateMachineUpdaterThread.joinable())
@@ -1033,20 +1283,23 @@ namespace LogCabin
             { // some unit tests pre-set the log; don't overwrite it
                 log = Storage::LogFactory::makeLog(globals.config, storageLayout);
             }
+            // Only look at the entries themselves where needed: the log may
+            // have to read them back from disk.
             for (uint64_t index = log->getLogStartIndex();
                  index <= log->getLastLogIndex();
                  ++index)
             {
-                const Log::Entry &entry = log->getEntry(index);
-                if (entry.type() == Protocol::Raft::EntryType::UNKNOWN)
+                Protocol::Raft::EntryType type = log->getEntryType(index);
+                if (type == Protocol::Raft::EntryType::UNKNOWN)
                 {
                     PANIC("Don't understand the entry type for index %lu (term %lu) "
                           "found on disk",
-                          index, entry.term());
+                          index, log->getEntry(index).term());
                 }
-                if (entry.type() == Protocol::Raft::EntryType::CONFIGURATION)
+                if (type == Protocol::Raft::EntryType::CONFIGURATION)
                 {
-                    configurationManager->add(index, entry.configuration());
+                    configurationManager->add(
+                        index, log->getEntry(index).configuration());
                 }
             }
 
@@ -1069,20 +1322,32 @@ namespace LogCabin
             // Read snapshot after reading log, since readSnapshot() will get rid of
             // conflicting log entries
             readSnapshot();
+            followerSyncedIndex = log->getLastLogIndex();
 
             // Clean up incomplete snapshots left by prior runs. This could be done
             // earlier, but maybe it's nicer to make sure we can get to this point
             // without PANICing before deleting these files.
             Storage::SnapshotFile::discardPartialSnapshots(storageLayout);
+            discardUnneededDeltaBases();
 
             if (configuration->id == 0)
                 NOTICE("No configuration, waiting to receive one.");
 
             stepDown(currentTerm);
+            // Some leader may be counting on this server's promise not to vote
+            // for anyone else for an election timeout after acknowledging its
+            // heartbeat. Keep that promise across restarts.
+            if (LEADER_LEASE > std::chrono::nanoseconds::zero())
+                withholdVotesUntil = Clock::now() + ELECTION_TIMEOUT;
             if (RaftConsensusInternal::startThreads)
             {
                 leaderDiskThread = std::thread(
                     &RaftConsensus::leaderDiskThreadMain, this);
+                if (ASYNC_FOLLOWER_SYNC)
+                {
+                    followerDiskThread = std::thread(
+                        &RaftConsensus::followerDiskThreadMain, this);
+                }
                 timerThread = std::thread(
                     &RaftConsensus::timerThreadMain, this);
                 if (globals.config.read<bool>("disableStateMachineUpdates", false))
@@ -1171,6 +1436,52 @@ namespace LogCabin
                 return {ClientResult::SUCCESS, commitIndex};
         }
 
+        std::pair<RaftConsensus::ClientResult, uint64_t>
+        RaftConsensus::getRecentCommitIndex(uint64_t maxStalenessNanos,
+                                            uint64_t maxLagEntries) const
+        {
+            std::unique_lock<Mutex> lockGuard(mutex);
+            std::chrono::nanoseconds maxStaleness(maxStalenessNanos);
+            TimePoint oldest = TimePoint::min();
+            if (maxStaleness != std::chrono::nanoseconds::zero())
+                oldest = Clock::now() - maxStaleness;
+            uint64_t base;
+            if (state == State::LEADER)
+            {
+                // A quorum heard from this server recently enough, so no other
+                // leader could have committed anything before then (modulo
+                // clock drift and network delays).
+                if (configuration->quorumAll([oldest](Server &server)
+                                             { return server.getLastAckTime() > oldest; }) &&
+                    commitIndexInCurrentTerm())
+                {
+                    base = commitIndex;
+                }
+                else if (upToDateLeader(lockGuard))
+                {
+                    base = commitIndex;
+                }
+                else
+                {
+                    return {ClientResult::NOT_LEADER, 0};
+                }
+            }
+            else if (state == State::FOLLOWER && leaderId != 0)
+            {
+                if (oldest == TimePoint::min())
+                    base = commitIndex;
+                else if (leaderCommitIndexTime > oldest)
+                    base = leaderCommitIndex;
+                else
+                    return {ClientResult::NOT_LEADER, 0};
+            }
+            else
+            {
+                return {ClientResult::NOT_LEADER, 0};
+            }
+            return {ClientResult::SUCCESS, base - std::min(base, maxLagEntries)};
+        }
+
         std::string
         RaftConsensus::getLeaderHint() const
         {
@@ -1254,6 +1565,8 @@ namespace LogCabin
             s.set_last_log_index(log->getLastLogIndex());
             s.set_log_bytes(log->getSizeBytes());
             s.set_is_leader(state == State::LEADER);
+            if (fullSnapshotNeeded)
+                s.set_full_snapshot_needed(true);
             return s;
         }
 
@@ -1262,7 +1575,7 @@ namespace LogCabin
             const Protocol::Raft::AppendEntries::Request &request,
             Protocol::Raft::AppendEntries::Response &response)
         {
-            std::lock_guard<Mutex> lockGuard(mutex);
+            std::unique_lock<Mutex> lockGuard(mutex);
             assert(!exiting);
 
             // Set response to a rejection. We'll overwrite these later if we end up
@@ -1390,8 +1703,11 @@ namespace LogCabin
                            numTruncating,
                            lastIndexKept);
                     numEntriesTruncated += numTruncating;
+                    syncFollowerLog();
                     log->truncateSuffix(lastIndexKept);
                     configurationManager->truncateSuffix(lastIndexKept);
+                    followerSyncedIndex = std::min(followerSyncedIndex,
+                                                   lastIndexKept);
                 }
 
                 // Append this and all following entries.
@@ -1432,6 +1748,37 @@ namespace LogCabin
                 stateChanged.notify_all();
                 VERBOSE("New commitIndex: %lu", commitIndex);
             }
+            // Remember how far along the leader is, for reads with bounded
+            // staleness. The state machine can serve those once this server
+            // catches up to it.
+            if (request.has_leader_commit_index())
+            {
+                leaderCommitIndex = request.leader_commit_index();
+                leaderCommitIndexTime = Clock::now();
+            }
+
+            // The leader will take a successful reply to mean that the entries
+            // through this index are on our disk. If followerDiskThread hasn't
+            // flushed them yet, wait for it. Entries are only ever truncated by
+            // a leader of a newer term, so if the term hasn't changed, the
+            // entries that get flushed are the ones we're acknowledging.
+            if (ASYNC_FOLLOWER_SYNC)
+            {
+                uint64_t term = currentTerm;
+                uint64_t ackIndex = (request.prev_log_index() +
+                                     uint64_t(request.entries_size()));
+                while (!exiting && currentTerm == term &&
+                       followerSyncedIndex < ackIndex)
+                {
+                    stateChanged.wait(lockGuard);
+                }
+                if (exiting || currentTerm != term)
+                {
+                    response.set_term(currentTerm);
+                    response.set_success(false);
+                    return;
+                }
+            }
 
             // reset election timer to avoid punishing the leader for our own
             // long disk writes
@@ -1483,13 +1830,30 @@ namespace LogCabin
                 assert(leaderId == request.server_id());
             }
 
+            if (request.has_snapshot_bytes())
+            {
+                handleSnapshotChunk(request, response);
+                return;
+            }
+
+            // The rest of this function handles requests from leaders that
+            // predate InstallSnapshot version 3. Such a leader sends the chunks
+            // in order, and a partial snapshot kept from another leader can't
+            // be matched up with what it's sending.
+            if (snapshotWriter && snapshotTransferBytes != 0)
+            {
+                snapshotWriter->discard();
+                snapshotWriter.reset();
+                snapshotTransferIndex = 0;
+                snapshotTransferBytes = 0;
+                snapshotTransferCrc32c = 0;
+            }
             if (!snapshotWriter)
             {
                 snapshotWriter.reset(
                     new Storage::SnapshotFile::Writer(storageLayout));
             }
             response.set_bytes_stored(snapshotWriter->getBytesWritten());
-
             if (request.byte_offset() < snapshotWriter->getBytesWritten())
             {
                 WARNING("Ignoring stale snapshot chunk for byte offset %lu when the "
@@ -1546,6 +1910,100 @@ namespace LogCabin
             }
         }
 
+        void
+        RaftConsensus::handleSnapshotChunk(
+            const Protocol::Raft::InstallSnapshot::Request &request,
+            Protocol::Raft::InstallSnapshot::Response &response)
+        {
+            response.set_version(3);
+            uint64_t byteOffset = request.byte_offset();
+            uint64_t numDataBytes = request.data().length();
+
+            // The leader is still preparing a snapshot to send. Any partial
+            // snapshot may well be the same file it will send, so keep it.
+            if (request.snapshot_bytes() == 0)
+            {
+                response.set_bytes_stored(0);
+                return;
+            }
+
+            // Keep a partial snapshot only if this is the same file, possibly
+            // from a new leader.
+            if (snapshotWriter &&
+                (snapshotTransferIndex != request.last_snapshot_index() ||
+                 snapshotTransferBytes != request.snapshot_bytes() ||
+                 snapshotTransferCrc32c != request.snapshot_crc32c()))
+            {
+                NOTICE("Discarding %lu bytes of partial snapshot through index "
+                       "%lu, since the leader is now sending a different "
+                       "%lu-byte snapshot through index %lu",
+                       snapshotWriter->getBytesWritten(),
+                       snapshotTransferIndex,
+                       request.snapshot_bytes(),
+                       request.last_snapshot_index());
+                snapshotWriter->discard();
+                snapshotWriter.reset();
+            }
+            if (!snapshotWriter)
+            {
+                snapshotWriter.reset(
+                    new Storage::SnapshotFile::Writer(storageLayout));
+                snapshotTransferIndex = request.last_snapshot_index();
+                snapshotTransferBytes = request.snapshot_bytes();
+                snapshotTransferCrc32c = request.snapshot_crc32c();
+            }
+            response.set_bytes_stored(snapshotWriter->getBytesWritten());
+
+            if (byteOffset + numDataBytes > request.snapshot_bytes())
+            {
+                WARNING("Leader sent snapshot chunk for bytes %lu through %lu "
+                        "of a %lu-byte snapshot. Discarding the chunk.",
+                        byteOffset, byteOffset + numDataBytes,
+                        request.snapshot_bytes());
+                return;
+            }
+            if (request.has_data_crc32c() &&
+                Core::Checksum::crc32c(request.data().data(), numDataBytes) !=
+                    request.data_crc32c())
+            {
+                WARNING("Snapshot chunk at byte offset %lu (%lu bytes) failed "
+                        "its checksum. Discarding the chunk.",
+                        byteOffset, numDataBytes);
+                return;
+            }
+            if (byteOffset + numDataBytes > snapshotWriter->getBytesWritten())
+            {
+                snapshotWriter->writeRawAt(byteOffset,
+                                           request.data().data(),
+                                           numDataBytes);
+                response.set_bytes_stored(snapshotWriter->getBytesWritten());
+            }
+
+            if (snapshotWriter->getBytesWritten() == request.snapshot_bytes())
+            {
+                snapshotTransferIndex = 0;
+                snapshotTransferBytes = 0;
+                snapshotTransferCrc32c = 0;
+                if (request.last_snapshot_index() < lastSnapshotIndex)
+                {
+                    WARNING("The leader sent us a snapshot, but it's stale: it only "
+                            "covers up through index %lu and we already have one "
+                            "through %lu. A well-behaved leader shouldn't do that. "
+                            "Discarding the snapshot.",
+                            request.last_snapshot_index(),
+                            lastSnapshotIndex);
+                    snapshotWriter->discard();
+                    snapshotWriter.reset();
+                    return;
+                }
+                NOTICE("Loading in new snapshot from leader");
+                snapshotWriter->save();
+                snapshotWriter.reset();
+                readSnapshot();
+                stateChanged.notify_all();
+            }
+        }
+
         void
         RaftConsensus::handleRequestVote(
             const Protocol::Raft::RequestVote::Request &request,
@@ -1616,6 +2074,8 @@ namespace LogCabin
             Log::Entry entry;
             entry.set_type(Protocol::Raft::EntryType::DATA);
             entry.set_data(operation.getData(), operation.getLength());
+            if (GROUP_COMMIT_DELAY > std::chrono::nanoseconds::zero())
+                return replicateEntryInGroup(entry, lockGuard);
             return replicateEntry(entry, lockGuard);
         }
 
@@ -1790,14 +2250,16 @@ namespace LogCabin
         }
 
         std::unique_ptr<Storage::SnapshotFile::Writer>
-        RaftConsensus::beginSnapshot(uint64_t lastIncludedIndex)
+        RaftConsensus::beginSnapshot(uint64_t lastIncludedIndex,
+                                     uint64_t *deltaBaseIndex)
         {
             std::lock_guard<Mutex> lockGuard(mutex);
 
             NOTICE("Creating new snapshot through log index %lu (inclusive)",
                    lastIncludedIndex);
             std::unique_ptr<Storage::SnapshotFile::Writer> writer(
-                new Storage::SnapshotFile::Writer(storageLayout));
+                new Storage::SnapshotFile::Writer(storageLayout,
+                                                  SNAPSHOT_COMPRESSION_LEVEL));
 
             // Only committed entries may be snapshotted.
             // (This check relies on commitIndex monotonically increasing.)
@@ -1865,6 +2327,26 @@ namespace LogCabin
                 *header.mutable_configuration() = c.second;
             }
 
+            // A delta is only useful against the latest snapshot, and only if it
+            // covers something new. Deltas can't be sent to followers, so don't
+            // write another one if a follower is waiting for a full snapshot.
+            if (deltaBaseIndex != NULL && *deltaBaseIndex != 0)
+            {
+                if (*deltaBaseIndex != lastSnapshotIndex ||
+                    lastIncludedIndex <= lastSnapshotIndex ||
+                    fullSnapshotNeeded)
+                {
+                    NOTICE("Taking a full snapshot instead of a delta against the "
+                           "snapshot through %lu",
+                           *deltaBaseIndex);
+                    *deltaBaseIndex = 0;
+                }
+                else
+                {
+                    header.set_delta_base_index(*deltaBaseIndex);
+                }
+            }
+
             // write header to file
             writer->writeMessage(header);
             return writer;
@@ -1873,10 +2355,16 @@ namespace LogCabin
         void
         RaftConsensus::snapshotDone(
             uint64_t lastIncludedIndex,
-            std::unique_ptr<Storage::SnapshotFile::Writer> writer)
+            std::unique_ptr<Storage::SnapshotFile::Writer> writer,
+            uint64_t deltaBaseIndex)
         {
             std::lock_guard<Mutex> lockGuard(mutex);
-            if (lastIncludedIndex <= lastSnapshotIndex)
+            // A full snapshot may replace a delta through the same index (that's
+            // how the state machine answers fullSnapshotNeeded when it has
+            // nothing new to apply).
+            if (lastIncludedIndex < lastSnapshotIndex ||
+                (lastIncludedIndex == lastSnapshotIndex &&
+                 (lastSnapshotDeltaBaseIndex == 0 || deltaBaseIndex != 0)))
             {
                 NOTICE("Discarding snapshot through %lu since we already have one "
                        "(presumably from another server) through %lu",
@@ -1884,6 +2372,35 @@ namespace LogCabin
                 writer->discard();
                 return;
             }
+            if (deltaBaseIndex != 0 && deltaBaseIndex != lastSnapshotIndex)
+            {
+                NOTICE("Discarding delta snapshot through %lu since the snapshot "
+                       "through %lu that it depends on has since been replaced by "
+                       "one through %lu",
+                       lastIncludedIndex, deltaBaseIndex, lastSnapshotIndex);
+                writer->discard();
+                return;
+            }
+
+            // Keep the snapshot that this one depends on around under another
+            // name, then replace it.
+            if (deltaBaseIndex != 0)
+            {
+                Storage::FilesystemUtil::link(storageLayout.snapshotDir, "snapshot",
+                                              storageLayout.snapshotDir,
+                                              deltaBaseFilename(deltaBaseIndex));
+            }
+            if (lastIncludedIndex == lastSnapshotIndex)
+            {
+                lastSnapshotBytes = writer->save();
+                lastSnapshotDeltaBaseIndex = 0;
+                fullSnapshotNeeded = false;
+                discardUnneededDeltaBases();
+                NOTICE("Replaced delta snapshot through log index %lu with a full "
+                       "snapshot",
+                       lastSnapshotIndex);
+                return;
+            }
 
             // log->getEntry(lastIncludedIndex) is safe:
             // If the log prefix for this snapshot was truncated, that means we have a
@@ -1896,6 +2413,10 @@ namespace LogCabin
 
             lastSnapshotBytes = writer->save();
             lastSnapshotIndex = lastIncludedIndex;
+            lastSnapshotDeltaBaseIndex = deltaBaseIndex;
+            if (deltaBaseIndex == 0)
+                fullSnapshotNeeded = false;
+            discardUnneededDeltaBases();
             const Log::Entry &lastEntry = log->getEntry(lastIncludedIndex);
             lastSnapshotTerm = lastEntry.term();
             lastSnapshotClusterTime = lastEntry.cluster_time();
@@ -1916,8 +2437,17 @@ namespace LogCabin
                 configurationManager->setSnapshot(c.first, c.second);
             }
 
-            NOTICE("Completed snapshot through log index %lu (inclusive)",
-                   lastSnapshotIndex);
+            if (deltaBaseIndex == 0)
+            {
+                NOTICE("Completed snapshot through log index %lu (inclusive)",
+                       lastSnapshotIndex);
+            }
+            else
+            {
+                NOTICE("Completed snapshot through log index %lu (inclusive) as a "
+                       "delta against the one through %lu",
+                       lastSnapshotIndex, deltaBaseIndex);
+            }
 
             // It may be beneficial to defer discarding entries if some followers are
             // a little bit slow, to avoid having to send them a snapshot when a few
@@ -1925,6 +2455,13 @@ namespace LogCabin
             discardUnneededEntries();
         }
 
+        std::unique_ptr<Storage::SnapshotFile::Reader>
+        RaftConsensus::readSnapshotDeltaBase(uint64_t lastIncludedIndex) const
+        {
+            SnapshotMetadata::Header header;
+            return openDeltaBase(storageLayout, lastIncludedIndex, header);
+        }
+
         void
         RaftConsensus::updateServerStats(Protocol::ServerStats &serverStats) const
         {
@@ -1960,6 +2497,13 @@ namespace LogCabin
             raftStats.set_last_snapshot_cluster_time(lastSnapshotClusterTime);
             raftStats.set_last_snapshot_bytes(lastSnapshotBytes);
             raftStats.set_num_entries_truncated(numEntriesTruncated);
+            raftStats.set_num_read_index_requests(numReadIndexRequests);
+            raftStats.set_num_read_index_rounds(numReadIndexRounds);
+            groupCommitEntries.updateProtoBuf(
+                *raftStats.mutable_group_commit_entries());
+            groupCommitDelayNanos.updateProtoBuf(
+                *raftStats.mutable_group_commit_delay_nanos());
+            lockHoldNanos.updateProtoBuf(*raftStats.mutable_lock_hold_nanos());
             raftStats.set_log_start_index(log->getLogStartIndex());
             raftStats.set_log_bytes(log->getSizeBytes());
             configuration->updateServerStats(serverStats, time);
@@ -2134,6 +2678,53 @@ namespace LogCabin
             }
         }
 
+        void
+        RaftConsensus::followerDiskThreadMain()
+        {
+            std::unique_lock<Mutex> lockGuard(mutex);
+            Core::ThreadId::setName("FollowerDisk");
+            // Each iteration of this loop syncs the log to disk once or sleeps until
+            // that is necessary. Entries appended while a sync is in progress are
+            // picked up together by the next one.
+            while (!exiting)
+            {
+                if (state != State::LEADER && logSyncQueued)
+                {
+                    std::unique_ptr<Log::Sync> sync = log->takeSync();
+                    uint64_t generation = followerSyncGeneration;
+                    logSyncQueued = false;
+                    followerDiskThreadWorking = true;
+                    {
+                        Core::MutexUnlock<Mutex> unlockGuard(lockGuard);
+                        sync->wait();
+                        // Mark this false before re-acquiring RaftConsensus lock,
+                        // since syncFollowerLog() polls on this to go false while
+                        // holding the lock.
+                        followerDiskThreadWorking = false;
+                    }
+                    if (followerSyncGeneration == generation)
+                    {
+                        followerSyncedIndex = sync->lastIndex;
+                    }
+                    else
+                    {
+                        // syncFollowerLog() got in between clearing the flag and
+                        // re-acquiring the lock, and the log may have been
+                        // truncated since. Entries at indexes up to lastIndex may
+                        // not be the ones this flushed, so don't count them as
+                        // durable, and don't let the log release segments whose
+                        // close operations haven't run yet.
+                        sync->lastIndex = std::min(sync->lastIndex,
+                                                   followerSyncedIndex);
+                    }
+                    log->syncComplete(std::move(sync));
+                    stateChanged.notify_all();
+                    continue;
+                }
+                stateChanged.wait(lockGuard);
+            }
+        }
+
         void
         RaftConsensus::timerThreadMain()
         {
@@ -2162,11 +2753,34 @@ namespace LogCabin
                 TimePoint now = Clock::now();
                 TimePoint waitUntil = TimePoint::min();
 
-                if (peer->backoffUntil > now)
+                // Pipelined AppendEntries requests from a previous term are no
+                // longer of interest. (Terms only increase, so if the oldest is
+                // current, they all are.)
+                if (!peer->appendEntriesInFlight.empty() &&
+                    (state != State::LEADER ||
+                     peer->appendEntriesInFlight.front().term != currentTerm))
                 {
-                    waitUntil = peer->backoffUntil;
+                    for (auto it = peer->appendEntriesInFlight.begin();
+                         it != peer->appendEntriesInFlight.end();
+                         ++it)
+                    {
+                        it->rpc.cancel();
+                    }
+                    peer->appendEntriesInFlight.clear();
                 }
-                else
+                // Likewise for snapshot chunks.
+                if (!peer->installSnapshotInFlight.empty() &&
+                    (state != State::LEADER ||
+                     peer->installSnapshotInFlight.front().term != currentTerm))
+                {
+                    peer->cancelInstallSnapshotInFlight();
+                }
+
+                if (peer->backoffUntil > now)
+                {
+                    waitUntil = peer->backoffUntil;
+                }
+                else
                 {
                     switch (state)
                     {
@@ -2185,8 +2799,25 @@ namespace LogCabin
 
                     // Leaders replicate entries and periodically send heartbeats.
                     case State::LEADER:
-                        if (peer->getMatchIndex() < log->getLastLogIndex() ||
-                            peer->nextHeartbeatTime < now)
+                        if (canPipelineAppendEntries(*peer))
+                        {
+                            pipelineAppendEntries(lockGuard, *peer);
+                        }
+                        else if (!peer->appendEntriesInFlight.empty())
+                        {
+                            // The replies to these double as heartbeats.
+                            receiveAppendEntries(lockGuard, *peer);
+                        }
+                        else if (canPipelineInstallSnapshot(*peer))
+                        {
+                            pipelineInstallSnapshot(lockGuard, *peer);
+                        }
+                        else if (!peer->installSnapshotInFlight.empty())
+                        {
+                            receiveInstallSnapshot(lockGuard, *peer);
+                        }
+                        else if (peer->getMatchIndex() < log->getLastLogIndex() ||
+                                 peer->nextHeartbeatTime < now)
                         {
                             // appendEntries delegates to installSnapshot if we
                             // need to send a snapshot instead
@@ -2200,7 +2831,7 @@ namespace LogCabin
                     }
                 }
 
-                stateChanged.wait_until(lockGuard, waitUntil);
+                peer->workAvailable.wait_until(lockGuard, waitUntil);
             }
 
             // must return immediately after this
@@ -2328,8 +2959,8 @@ namespace LogCabin
             for (auto it = entries.begin(); it != entries.end(); ++it)
                 assert((*it)->term() != 0);
             std::pair<uint64_t, uint64_t> range = log->append(entries);
-            if (state == State::LEADER)
-            { // defer log sync
+            if (state == State::LEADER || ASYNC_FOLLOWER_SYNC)
+            { // defer log sync to leaderDiskThread or followerDiskThread
                 logSyncQueued = true;
             }
             else
@@ -2346,6 +2977,11 @@ namespace LogCabin
                     configurationManager->add(index, entry.configuration());
                 ++index;
             }
+            // Only the peers have something new to send; the other threads
+            // waiting on stateChanged are the leader disk thread and
+            // replicate() callers.
+            if (state == State::LEADER)
+                configuration->forEach(&Server::notifyNewEntries);
             stateChanged.notify_all();
         }
 
@@ -2391,18 +3027,22 @@ namespace LogCabin
             request.set_term(currentTerm);
             request.set_prev_log_term(prevLogTerm);
             request.set_prev_log_index(prevLogIndex);
+            std::vector<Core::Buffer> entries;
             uint64_t numEntries = 0;
             if (!peer.suppressBulkData)
-                numEntries = packEntries(peer.nextIndex, request);
+                numEntries = packEntries(peer.nextIndex, request, entries);
             request.set_commit_index(std::min(commitIndex, prevLogIndex + numEntries));
+            if (commitIndexInCurrentTerm())
+                request.set_leader_commit_index(commitIndex);
 
             // Execute RPC
             Protocol::Raft::AppendEntries::Response response;
             TimePoint start = Clock::now();
             uint64_t epoch = currentEpoch;
+            lastSentEpoch = epoch;
             Peer::CallStatus status = peer.callRPC(
                 Protocol::Raft::OpCode::APPEND_ENTRIES,
-                request, response,
+                serializeAppendEntries(request, entries), response,
                 lockGuard);
             switch (status)
             {
@@ -2424,6 +3064,147 @@ namespace LogCabin
                 // we don't care about result of RPC
                 return;
             }
+            handleAppendEntriesResponse(peer, prevLogIndex, numEntries,
+                                        start, epoch, response);
+        }
+
+        bool
+        RaftConsensus::canPipelineAppendEntries(const Peer &peer) const
+        {
+            if (MAX_APPEND_ENTRIES_IN_FLIGHT <= 1 ||
+                peer.suppressBulkData ||
+                peer.appendEntriesInFlight.size() >= MAX_APPEND_ENTRIES_IN_FLIGHT)
+            {
+                return false;
+            }
+            // Nothing new to send. Heartbeats are never pipelined.
+            if (peer.nextIndex > log->getLastLogIndex())
+                return false;
+            // Need the previous entry in the log to fill in prevLogTerm. The
+            // remaining cases are left to appendEntries().
+            if (peer.nextIndex <= log->getLogStartIndex())
+                return false;
+            // Only send ahead once the follower has acknowledged that its log
+            // matches ours through nextIndex - 1. Otherwise the follower would
+            // likely just reject the whole window.
+            return (!peer.appendEntriesInFlight.empty() ||
+                    peer.matchIndex + 1 == peer.nextIndex);
+        }
+
+        void
+        RaftConsensus::pipelineAppendEntries(std::unique_lock<Mutex> &lockGuard,
+                                             Peer &peer)
+        {
+            assert(canPipelineAppendEntries(peer));
+            uint64_t prevLogIndex = peer.nextIndex - 1;
+
+            // Build up request
+            Protocol::Raft::AppendEntries::Request request;
+            request.set_server_id(serverId);
+            request.set_term(currentTerm);
+            request.set_prev_log_term(log->getEntry(prevLogIndex).term());
+            request.set_prev_log_index(prevLogIndex);
+            std::vector<Core::Buffer> entries;
+            uint64_t numEntries = packEntries(peer.nextIndex, request, entries);
+            request.set_commit_index(std::min(commitIndex, prevLogIndex + numEntries));
+            if (commitIndexInCurrentTerm())
+                request.set_leader_commit_index(commitIndex);
+
+            // Send RPC. Advance nextIndex before releasing the lock, so that
+            // the next request picks up where this one left off.
+            TimePoint start = Clock::now();
+            uint64_t epoch = currentEpoch;
+            lastSentEpoch = epoch;
+            uint64_t term = currentTerm;
+            peer.nextIndex = prevLogIndex + numEntries + 1;
+            RPC::ClientRPC rpc = peer.startRPC(
+                Protocol::Raft::OpCode::APPEND_ENTRIES,
+                serializeAppendEntries(request, entries),
+                lockGuard);
+            if (currentTerm != term || peer.exiting)
+            {
+                // Lost leadership while creating the session. beginLeadership()
+                // will have reset nextIndex if needed.
+                rpc.cancel();
+                return;
+            }
+            peer.appendEntriesInFlight.emplace_back(std::move(rpc), term,
+                                                    prevLogIndex, numEntries,
+                                                    start, epoch);
+        }
+
+        void
+        RaftConsensus::receiveAppendEntries(std::unique_lock<Mutex> &lockGuard,
+                                            Peer &peer)
+        {
+            assert(!peer.appendEntriesInFlight.empty());
+            Protocol::Raft::AppendEntries::Response response;
+            // Only this thread removes elements from appendEntriesInFlight, so
+            // the front element remains valid while the lock is released.
+            Peer::CallStatus status = peer.waitForRPC(
+                peer.appendEntriesInFlight.front().rpc,
+                response,
+                lockGuard);
+            uint64_t term = peer.appendEntriesInFlight.front().term;
+            uint64_t prevLogIndex = peer.appendEntriesInFlight.front().prevLogIndex;
+            uint64_t numEntries = peer.appendEntriesInFlight.front().numEntries;
+            TimePoint start = peer.appendEntriesInFlight.front().start;
+            uint64_t epoch = peer.appendEntriesInFlight.front().epoch;
+            peer.appendEntriesInFlight.pop_front();
+
+            // Give up on the rest of the window if this request didn't make it.
+            // Replies are processed in the order the requests were sent, so
+            // nextIndex goes back to where this request started.
+            bool abortPipeline;
+            switch (status)
+            {
+            case Peer::CallStatus::OK:
+                abortPipeline = (!response.success() ||
+                                 response.term() != term);
+                break;
+            case Peer::CallStatus::FAILED:
+                abortPipeline = true;
+                break;
+            case Peer::CallStatus::INVALID_REQUEST:
+                PANIC("The server's RaftService doesn't support the AppendEntries "
+                      "RPC or claims the request is malformed");
+            }
+            if (currentTerm != term || peer.exiting)
+            {
+                // we don't care about result of RPC; peerThreadMain will discard
+                // the rest of the window
+                return;
+            }
+            if (abortPipeline)
+            {
+                for (auto it = peer.appendEntriesInFlight.begin();
+                     it != peer.appendEntriesInFlight.end();
+                     ++it)
+                {
+                    it->rpc.cancel();
+                }
+                peer.appendEntriesInFlight.clear();
+                peer.nextIndex = prevLogIndex + 1;
+            }
+            if (status == Peer::CallStatus::FAILED)
+            {
+                peer.suppressBulkData = true;
+                peer.backoffUntil = start + RPC_FAILURE_BACKOFF;
+                return;
+            }
+            handleAppendEntriesResponse(peer, prevLogIndex, numEntries,
+                                        start, epoch, response);
+        }
+
+        void
+        RaftConsensus::handleAppendEntriesResponse(
+            Peer &peer,
+            uint64_t prevLogIndex,
+            uint64_t numEntries,
+            TimePoint start,
+            uint64_t epoch,
+            const Protocol::Raft::AppendEntries::Response &response)
+        {
             // Since we were leader in this term before, we must still be leader in
             // this term.
             assert(state == State::LEADER);
@@ -2438,14 +3219,18 @@ namespace LogCabin
             {
                 assert(response.term() == currentTerm);
                 peer.lastAckEpoch = epoch;
+                peer.lastAckTime = start;
                 stateChanged.notify_all();
-                peer.nextHeartbeatTime = start + HEARTBEAT_PERIOD;
+                // Don't postpone a heartbeat that upToDateLeader() scheduled
+                // while this request was outstanding.
+                if (epoch >= readRoundEpoch)
+                    peer.nextHeartbeatTime = start + HEARTBEAT_PERIOD;
                 if (response.success())
                 {
                     if (peer.matchIndex > prevLogIndex + numEntries)
                     {
-                        // Revisit this warning if we pipeline AppendEntries RPCs for
-                        // performance.
+                        // Pipelined replies are processed in the order their
+                        // requests were sent, so this still shouldn't happen.
                         WARNING("matchIndex should monotonically increase within a "
                                 "term, since servers don't forget entries. But it "
                                 "didn't.");
@@ -2455,7 +3240,9 @@ namespace LogCabin
                         peer.matchIndex = prevLogIndex + numEntries;
                         advanceCommitIndex();
                     }
-                    peer.nextIndex = peer.matchIndex + 1;
+                    // With pipelining, nextIndex may already be past entries that
+                    // are still in flight.
+                    peer.nextIndex = std::max(peer.nextIndex, peer.matchIndex + 1);
                     peer.suppressBulkData = false;
 
                     if (!peer.isCaughtUp_ &&
@@ -2523,44 +3310,75 @@ namespace LogCabin
             Protocol::Raft::InstallSnapshot::Request request;
             request.set_server_id(serverId);
             request.set_term(currentTerm);
-            request.set_version(2);
+            request.set_version(3);
+
+            // A delta snapshot is useless to the follower without the snapshots
+            // it depends on. Ask the state machine for a full snapshot, and in
+            // the meantime, send an empty chunk so that the follower doesn't time
+            // out waiting for it.
+            bool waitForFullSnapshot = (!peer.snapshotFile &&
+                                        lastSnapshotDeltaBaseIndex != 0);
+            if (waitForFullSnapshot && !fullSnapshotNeeded)
+            {
+                NOTICE("Need a full snapshot to send to server %lu, but the latest "
+                       "snapshot (through index %lu) is a delta. Asking the state "
+                       "machine for one.",
+                       peer.serverId, lastSnapshotIndex);
+                fullSnapshotNeeded = true;
+                stateChanged.notify_all();
+            }
 
             // Open the latest snapshot if we haven't already. Stash a copy of the
             // lastSnapshotIndex that goes along with the file, since it's possible
             // that this will change while we're transferring chunks).
-            if (!peer.snapshotFile)
+            if (!peer.snapshotFile && !waitForFullSnapshot)
             {
                 namespace FS = Storage::FilesystemUtil;
-                peer.snapshotFile.reset(new FS::FileContents(
+                std::unique_ptr<FS::FileContents> file(new FS::FileContents(
                     FS::openFile(storageLayout.snapshotDir, "snapshot", O_RDONLY)));
+                uint64_t snapshotIndex = lastSnapshotIndex;
+                uint64_t length = file->getFileLength();
+                uint32_t crc = 0;
+                {
+                    // This reads the entire file, which can take a while. The
+                    // mapping stays the same even if a new snapshot replaces
+                    // the file in the meantime.
+                    Core::MutexUnlock<Mutex> unlockGuard(lockGuard);
+                    crc = Core::Checksum::crc32c(file->get(0, length), length);
+                }
+                if (currentTerm != request.term() || peer.exiting)
+                    return;
+                peer.snapshotFile = std::move(file);
                 peer.snapshotFileOffset = 0;
-                peer.lastSnapshotIndex = lastSnapshotIndex;
+                peer.lastSnapshotIndex = snapshotIndex;
+                peer.snapshotFileCrc32c = crc;
                 NOTICE("Beginning to send snapshot of %lu bytes up through index %lu "
                        "to follower",
-                       peer.snapshotFile->getFileLength(),
-                       lastSnapshotIndex);
+                       length,
+                       snapshotIndex);
             }
-            request.set_last_snapshot_index(peer.lastSnapshotIndex);
-            request.set_byte_offset(peer.snapshotFileOffset);
             uint64_t numDataBytes = 0;
-            if (!peer.suppressBulkData)
+            if (waitForFullSnapshot)
             {
-                // The amount of data we can send is bounded by the remaining bytes in
-                // the file and the maximum length for RPCs.
-                numDataBytes = std::min(
-                    peer.snapshotFile->getFileLength() - peer.snapshotFileOffset,
-                    SOFT_RPC_SIZE_LIMIT);
+                request.set_last_snapshot_index(lastSnapshotIndex);
+                request.set_byte_offset(0);
+                request.set_data("");
+                request.set_done(false);
+                // Without this, the follower would take this for a request
+                // from a leader that predates version 3 and throw out any
+                // partial snapshot it has.
+                request.set_snapshot_bytes(0);
+            }
+            else
+            {
+                numDataBytes = packSnapshotChunk(peer, request);
             }
-            request.set_data(peer.snapshotFile->get<char>(peer.snapshotFileOffset,
-                                                          numDataBytes),
-                             numDataBytes);
-            request.set_done(peer.snapshotFileOffset + numDataBytes ==
-                             peer.snapshotFile->getFileLength());
 
             // Execute RPC
             Protocol::Raft::InstallSnapshot::Response response;
             TimePoint start = Clock::now();
             uint64_t epoch = currentEpoch;
+            lastSentEpoch = epoch;
             Peer::CallStatus status = peer.callRPC(
                 Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                 request, response,
@@ -2599,9 +3417,17 @@ namespace LogCabin
             {
                 assert(response.term() == currentTerm);
                 peer.lastAckEpoch = epoch;
+                peer.lastAckTime = start;
                 stateChanged.notify_all();
                 peer.nextHeartbeatTime = start + HEARTBEAT_PERIOD;
                 peer.suppressBulkData = false;
+                if (waitForFullSnapshot)
+                {
+                    // Check back about once per heartbeat rather than spinning.
+                    peer.backoffUntil = start + HEARTBEAT_PERIOD;
+                    return;
+                }
+                peer.installSnapshotVersion = response.version();
                 if (response.has_bytes_stored())
                 {
                     // Normal path (since InstallSnapshot version 2).
@@ -2615,23 +3441,190 @@ namespace LogCabin
                     peer.snapshotFileOffset += numDataBytes;
                 }
                 if (peer.snapshotFileOffset == peer.snapshotFile->getFileLength())
+                    finishInstallSnapshot(peer);
+            }
+        }
+
+        uint64_t
+        RaftConsensus::packSnapshotChunk(
+            const Peer &peer,
+            Protocol::Raft::InstallSnapshot::Request &request) const
+        {
+            uint64_t numDataBytes = 0;
+            if (!peer.suppressBulkData)
+            {
+                // The amount of data we can send is bounded by the remaining
+                // bytes in the file and the maximum length for RPCs.
+                numDataBytes = std::min(
+                    peer.snapshotFile->getFileLength() - peer.snapshotFileOffset,
+                    SOFT_RPC_SIZE_LIMIT);
+            }
+            const char *data = peer.snapshotFile->get<char>(
+                peer.snapshotFileOffset, numDataBytes);
+            request.set_last_snapshot_index(peer.lastSnapshotIndex);
+            request.set_byte_offset(peer.snapshotFileOffset);
+            request.set_data(data, numDataBytes);
+            request.set_done(peer.snapshotFileOffset + numDataBytes ==
+                             peer.snapshotFile->getFileLength());
+            request.set_snapshot_bytes(peer.snapshotFile->getFileLength());
+            request.set_snapshot_crc32c(peer.snapshotFileCrc32c);
+            request.set_data_crc32c(Core::Checksum::crc32c(data, numDataBytes));
+            return numDataBytes;
+        }
+
+        bool
+        RaftConsensus::canPipelineInstallSnapshot(const Peer &peer) const
+        {
+            // Only send ahead once the follower has said it can store chunks
+            // out of order.
+            if (MAX_INSTALL_SNAPSHOT_IN_FLIGHT <= 1 ||
+                peer.suppressBulkData ||
+                !peer.snapshotFile ||
+                peer.installSnapshotVersion < 3 ||
+                peer.installSnapshotInFlight.size() >= MAX_INSTALL_SNAPSHOT_IN_FLIGHT)
+            {
+                return false;
+            }
+            return peer.snapshotFileOffset < peer.snapshotFile->getFileLength();
+        }
+
+        void
+        RaftConsensus::pipelineInstallSnapshot(std::unique_lock<Mutex> &lockGuard,
+                                               Peer &peer)
+        {
+            assert(canPipelineInstallSnapshot(peer));
+
+            // Build up request
+            Protocol::Raft::InstallSnapshot::Request request;
+            request.set_server_id(serverId);
+            request.set_term(currentTerm);
+            request.set_version(3);
+            uint64_t byteOffset = peer.snapshotFileOffset;
+            uint64_t numDataBytes = packSnapshotChunk(peer, request);
+
+            // Send RPC. Advance snapshotFileOffset before releasing the lock, so
+            // that the next request picks up where this one left off.
+            TimePoint start = Clock::now();
+            uint64_t epoch = currentEpoch;
+            lastSentEpoch = epoch;
+            uint64_t term = currentTerm;
+            peer.snapshotFileOffset += numDataBytes;
+            RPC::ClientRPC rpc = peer.startRPC(
+                Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                request,
+                lockGuard);
+            if (currentTerm != term || peer.exiting)
+            {
+                // Lost leadership while creating the session. beginLeadership()
+                // will have reset the transfer.
+                rpc.cancel();
+                return;
+            }
+            peer.installSnapshotInFlight.emplace_back(std::move(rpc), term,
+                                                      byteOffset, numDataBytes,
+                                                      start, epoch);
+        }
+
+        void
+        RaftConsensus::receiveInstallSnapshot(std::unique_lock<Mutex> &lockGuard,
+                                              Peer &peer)
+        {
+            assert(!peer.installSnapshotInFlight.empty());
+            Protocol::Raft::InstallSnapshot::Response response;
+            // Only this thread removes elements from installSnapshotInFlight,
+            // so the front element remains valid while the lock is released.
+            Peer::CallStatus status = peer.waitForRPC(
+                peer.installSnapshotInFlight.front().rpc,
+                response,
+                lockGuard);
+            uint64_t term = peer.installSnapshotInFlight.front().term;
+            uint64_t byteOffset = peer.installSnapshotInFlight.front().byteOffset;
+            TimePoint start = peer.installSnapshotInFlight.front().start;
+            uint64_t epoch = peer.installSnapshotInFlight.front().epoch;
+            peer.installSnapshotInFlight.pop_front();
+
+            switch (status)
+            {
+            case Peer::CallStatus::OK:
+                break;
+            case Peer::CallStatus::FAILED:
+                if (currentTerm == term && !peer.exiting)
                 {
-                    NOTICE("Done sending snapshot through index %lu to follower",
-                           peer.lastSnapshotIndex);
-                    peer.matchIndex = peer.lastSnapshotIndex;
-                    peer.nextIndex = peer.lastSnapshotIndex + 1;
-                    // These entries are already committed if they're in a snapshot, so
-                    // the commitIndex shouldn't advance, but let's just follow the
-                    // simple rule that bumping matchIndex should always be
-                    // followed by a call to advanceCommitIndex():
-                    advanceCommitIndex();
-                    peer.snapshotFile.reset();
-                    peer.snapshotFileOffset = 0;
-                    peer.lastSnapshotIndex = 0;
+                    // Give up on the rest of the window and resend starting
+                    // with this chunk. The chunks before it were acknowledged.
+                    peer.cancelInstallSnapshotInFlight();
+                    peer.snapshotFileOffset = byteOffset;
+                    peer.snapshotBytesAcked = 0;
+                    peer.suppressBulkData = true;
+                    peer.backoffUntil = start + RPC_FAILURE_BACKOFF;
                 }
+                return;
+            case Peer::CallStatus::INVALID_REQUEST:
+                PANIC("The server's RaftService doesn't support the "
+                      "InstallSnapshot RPC or claims the request is malformed");
+            }
+
+            // Process response
+
+            if (currentTerm != term || peer.exiting)
+            {
+                // we don't care about result of RPC; peerThreadMain will discard
+                // the rest of the window
+                return;
+            }
+            if (response.term() > currentTerm)
+            {
+                NOTICE("Received InstallSnapshot response from server %lu in "
+                       "term %lu (this server's term was %lu)",
+                       peer.serverId, response.term(), currentTerm);
+                stepDown(response.term());
+                return;
+            }
+            assert(response.term() == currentTerm);
+            peer.lastAckEpoch = epoch;
+            peer.lastAckTime = start;
+            stateChanged.notify_all();
+            peer.nextHeartbeatTime = start + HEARTBEAT_PERIOD;
+            peer.installSnapshotVersion = response.version();
+
+            // Since the follower may handle the chunks in any order, a reply's
+            // bytes_stored can trail the chunks it has received. Once every
+            // chunk has been handled, though, the largest bytes_stored is how
+            // much of the file the follower has.
+            peer.snapshotBytesAcked = std::max(peer.snapshotBytesAcked,
+                                               response.bytes_stored());
+            if (peer.snapshotBytesAcked == peer.snapshotFile->getFileLength())
+            {
+                finishInstallSnapshot(peer);
+            }
+            else if (peer.installSnapshotInFlight.empty())
+            {
+                // Resend whatever the follower is missing (for example, a chunk
+                // that failed its checksum, or everything if it restarted).
+                peer.snapshotFileOffset = peer.snapshotBytesAcked;
+                peer.snapshotBytesAcked = 0;
             }
         }
 
+        void
+        RaftConsensus::finishInstallSnapshot(Peer &peer)
+        {
+            NOTICE("Done sending snapshot through index %lu to follower",
+                   peer.lastSnapshotIndex);
+            peer.matchIndex = peer.lastSnapshotIndex;
+            peer.nextIndex = peer.lastSnapshotIndex + 1;
+            // These entries are already committed if they're in a snapshot, so
+            // the commitIndex shouldn't advance, but let's just follow the
+            // simple rule that bumping matchIndex should always be
+            // followed by a call to advanceCommitIndex():
+            advanceCommitIndex();
+            peer.cancelInstallSnapshotInFlight();
+            peer.snapshotFile.reset();
+            peer.snapshotFileOffset = 0;
+            peer.snapshotBytesAcked = 0;
+            peer.lastSnapshotIndex = 0;
+        }
+
         void
         RaftConsensus::becomeLeader()
         {
@@ -2651,10 +3644,17 @@ namespace LogCabin
             // for most of it).
             clusterClock.newEpoch(clusterClock.clusterTimeAtEpoch);
 
+            // The localServer's lastSyncedIndex is about to be set to the end of
+            // the log, so anything followerDiskThread hasn't written yet needs to
+            // be flushed first.
+            syncFollowerLog();
+
             // The ordering is pretty important here: First set nextIndex and
             // matchIndex for ourselves and each follower, then append the no op.
             // Otherwise we'll set our localServer's last agree index too high.
             configuration->forEach(&Server::beginLeadership);
+            // Heartbeats scheduled by readers in an earlier term don't count.
+            readRoundEpoch = 0;
 
             // Append a new entry so that commitment is not delayed indefinitely.
             // Otherwise, if the leader never gets anything to append, it will never
@@ -2681,8 +3681,8 @@ namespace LogCabin
                 log->truncatePrefix(lastSnapshotIndex + 1);
                 configurationManager->truncatePrefix(lastSnapshotIndex + 1);
                 stateChanged.notify_all();
-                if (state == State::LEADER)
-                { // defer log sync
+                if (state == State::LEADER || ASYNC_FOLLOWER_SYNC)
+                { // defer log sync to leaderDiskThread or followerDiskThread
                     logSyncQueued = true;
                 }
                 else
@@ -2694,6 +3694,37 @@ namespace LogCabin
             }
         }
 
+        void
+        RaftConsensus::discardUnneededDeltaBases()
+        {
+            if (storageLayout.serverDir.fd == -1)
+                return;
+            // Follow the chain of deltas back to the full snapshot at its root.
+            std::set<std::string> needed;
+            uint64_t baseIndex = lastSnapshotDeltaBaseIndex;
+            while (baseIndex != 0)
+            {
+                needed.insert(deltaBaseFilename(baseIndex));
+                SnapshotMetadata::Header header;
+                openDeltaBase(storageLayout, baseIndex, header);
+                baseIndex = header.delta_base_index();
+            }
+            std::vector<std::string> files =
+                Storage::FilesystemUtil::ls(storageLayout.snapshotDir);
+            for (auto it = files.begin(); it != files.end(); ++it)
+            {
+                if (Core::StringUtil::startsWith(*it, "snapshot.") &&
+                    needed.find(*it) == needed.end())
+                {
+                    NOTICE("Removing %s since the latest snapshot no longer "
+                           "depends on it",
+                           it->c_str());
+                    Storage::FilesystemUtil::removeFile(storageLayout.snapshotDir,
+                                                        *it);
+                }
+            }
+        }
+
         uint64_t
         RaftConsensus::getLastLogTerm() const
         {
@@ -2721,70 +3752,89 @@ namespace LogCabin
         uint64_t
         RaftConsensus::packEntries(
             uint64_t nextIndex,
-            Protocol::Raft::AppendEntries::Request &request) const
-        {
-            // Add as many as entries as will fit comfortably in the request. It's
-            // easiest to add one entry at a time until the RPC gets too big, then back
-            // the last one out.
-
-            // Calculating the size of the request ProtoBuf is a bit expensive, so this
-            // estimates high, then if it reaches the size limit, corrects the estimate
-            // and keeps going. This is a dumb algorithm but does well enough. It gets
-            // the number of calls to request.ByteSize() down to about 15 even with
-            // extremely small entries (10 bytes of payload data in each of 50,000
-            // entries filling to a 1MB max).
-
-            // Processing 19000 entries here with 10 bytes of data each (total request
-            // size of 1MB) still takes about 42 milliseconds on an overloaded laptop
-            // when compiling in DEBUG mode. That's a bit slow, in case someone has
-            // aggressive election timeouts. As a result, the total number of entries
-            // in a request is now limited to MAX_LOG_ENTRIES_PER_REQUEST=5000, which
-            // amortizes RPC overhead well enough anyhow. This limit will only kick in
-            // when the entry size drops below 200 bytes, since 1M/5K=200.
+            const Protocol::Raft::AppendEntries::Request &request,
+            std::vector<Core::Buffer> &entries) const
+        {
+            // Add as many as entries as will fit comfortably in the request.
+            // Entries are taken from the log already serialized, so the size of
+            // the request is known exactly as each one is added, and nothing
+            // needs to be copied or re-serialized here.
+
+            // The total number of entries in a request is limited to
+            // MAX_LOG_ENTRIES_PER_REQUEST=5000, which amortizes RPC overhead
+            // well enough while bounding the follower's processing time. This
+            // limit will only kick in when the entry size drops below 200
+            // bytes, since 1M/5K=200.
 
             using Core::Util::downCast;
+            using google::protobuf::io::CodedOutputStream;
             uint64_t lastIndex = std::min(log->getLastLogIndex(),
                                           nextIndex + MAX_LOG_ENTRIES_PER_REQUEST - 1);
-            google::protobuf::RepeatedPtrField<Protocol::Raft::Entry> &requestEntries =
-                *request.mutable_entries();
 
             uint64_t numEntries = 0;
             uint64_t currentSize = downCast<uint64_t>(request.ByteSizeLong());
 
             for (uint64_t index = nextIndex; index <= lastIndex; ++index)
             {
-                const Log::Entry &entry = log->getEntry(index);
-                *requestEntries.Add() = entry;
-
-                // Each member of a repeated message field is encoded with a tag
-                // and a length. We conservatively assume the tag and length will
-                // be up to 10 bytes each (2^64), though in practice the tag is
-                // probably one byte and the length is probably two.
-                currentSize += uint64_t(entry.ByteSizeLong()) + 20;
-
-                if (currentSize >= SOFT_RPC_SIZE_LIMIT)
+                Core::Buffer entry = log->getEntryBytes(index);
+                // Each member of a repeated message field is encoded with a
+                // one-byte tag and its length as a varint.
+                currentSize += 1 +
+                               CodedOutputStream::VarintSize64(entry.getLength()) +
+                               entry.getLength();
+                if (currentSize >= SOFT_RPC_SIZE_LIMIT && numEntries > 0)
                 {
-                    // The message might be too big: calculate more exact but more
-                    // expensive size.
-                    uint64_t actualSize = downCast<uint64_t>(request.ByteSizeLong());
-                    assert(currentSize >= actualSize);
-                    currentSize = actualSize;
-                    if (currentSize >= SOFT_RPC_SIZE_LIMIT && numEntries > 0)
-                    {
-                        // This entry doesn't fit and we've already got some
-                        // entries to send: discard this one and stop adding more.
-                        requestEntries.RemoveLast();
-                        break;
-                    }
+                    // This entry doesn't fit and we've already got some
+                    // entries to send: stop adding more.
+                    break;
                 }
                 // This entry fit, so we'll send it.
+                entries.push_back(std::move(entry));
                 ++numEntries;
             }
 
-            assert(numEntries == uint64_t(requestEntries.size()));
             return numEntries;
         }
 
+        Core::Buffer
+        RaftConsensus::serializeAppendEntries(
+            const Protocol::Raft::AppendEntries::Request &request,
+            const std::vector<Core::Buffer> &entries)
+        {
+            using Core::Util::downCast;
+            using google::protobuf::io::CodedOutputStream;
+            using google::protobuf::internal::WireFormatLite;
+            assert(request.entries_size() == 0);
+            const uint32_t tag = WireFormatLite::MakeTag(
+                Protocol::Raft::AppendEntries::Request::kEntriesFieldNumber,
+                WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+
+            // ProtoBuf parsers accept fields in any order, so the entries are
+            // simply placed after the rest of the request.
+            uint64_t requestSize = downCast<uint64_t>(request.ByteSizeLong());
+            uint64_t length = RPC::ClientRPC::REQUEST_HEADER_LENGTH + requestSize;
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                length += CodedOutputStream::VarintSize32(tag) +
+                          CodedOutputStream::VarintSize64(it->getLength()) +
+                          it->getLength();
+            }
+
+            uint8_t *data = new uint8_t[length];
+            uint8_t *p = data + RPC::ClientRPC::REQUEST_HEADER_LENGTH;
+            p = request.SerializeWithCachedSizesToArray(p);
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                p = CodedOutputStream::WriteVarint32ToArray(tag, p);
+                p = CodedOutputStream::WriteVarint64ToArray(it->getLength(), p);
+                memcpy(p, it->getData(), it->getLength());
+                p += it->getLength();
+            }
+            assert(p == data + length);
+            return Core::Buffer(data, length,
+                                Core::Buffer::deleteArrayFn<uint8_t>);
+        }
+
         void
         RaftConsensus::readSnapshot()
         {
@@ -2839,7 +3889,8 @@ namespace LogCabin
                 lastSnapshotIndex = header.last_included_index();
                 lastSnapshotTerm = header.last_included_term();
                 lastSnapshotClusterTime = header.last_cluster_time();
-                lastSnapshotBytes = reader->getSizeBytes();
+                lastSnapshotBytes = reader->getFileSizeBytes();
+                lastSnapshotDeltaBaseIndex = header.delta_base_index();
                 commitIndex = std::max(lastSnapshotIndex, commitIndex);
 
                 NOTICE("Reading snapshot which covers log entries 1 through %lu "
@@ -2864,13 +3915,16 @@ namespace LogCabin
                     }
                     // Discard the entire log, setting the log start to point to the
                     // right place.
+                    syncFollowerLog();
                     log->truncatePrefix(lastSnapshotIndex + 1);
                     log->truncateSuffix(lastSnapshotIndex);
                     configurationManager->truncatePrefix(lastSnapshotIndex + 1);
                     configurationManager->truncateSuffix(lastSnapshotIndex);
+                    // The snapshot is durable and covers the rest.
+                    followerSyncedIndex = lastSnapshotIndex;
                     // Clean up resources.
-                    if (state == State::LEADER)
-                    { // defer log sync
+                    if (state == State::LEADER || ASYNC_FOLLOWER_SYNC)
+                    { // defer log sync to leaderDiskThread or followerDiskThread
                         logSyncQueued = true;
                     }
                     else
@@ -2935,6 +3989,111 @@ namespace LogCabin
             return {ClientResult::NOT_LEADER, 0};
         }
 
+        std::pair<RaftConsensus::ClientResult, uint64_t>
+        RaftConsensus::replicateEntryInGroup(Log::Entry &entry,
+                                             std::unique_lock<Mutex> &lockGuard)
+        {
+            if (exiting || state != State::LEADER)
+                return {ClientResult::NOT_LEADER, 0};
+
+            GroupCommitRequest request(entry, currentTerm);
+            if (groupCommitQueue.empty())
+                groupCommitFlushAt = request.queuedAt + GROUP_COMMIT_DELAY;
+            groupCommitQueue.push_back(&request);
+            groupCommitQueueBytes += entry.ByteSizeLong();
+            if (groupCommitQueue.size() >= GROUP_COMMIT_MAX_ENTRIES ||
+                groupCommitQueueBytes >= GROUP_COMMIT_MAX_BYTES)
+            {
+                flushGroupCommit();
+            }
+
+            // Wait for this entry to be appended, or append the whole group
+            // if its delay has expired.
+            while (!request.flushed)
+            {
+                if (exiting ||
+                    state != State::LEADER ||
+                    currentTerm != request.term)
+                {
+                    // Leave the queue, since request is about to go away.
+                    auto it = std::find(groupCommitQueue.begin(),
+                                        groupCommitQueue.end(),
+                                        &request);
+                    assert(it != groupCommitQueue.end());
+                    groupCommitQueue.erase(it);
+                    groupCommitQueueBytes -= entry.ByteSizeLong();
+                    return {ClientResult::NOT_LEADER, 0};
+                }
+                if (Clock::now() >= groupCommitFlushAt)
+                    flushGroupCommit();
+                else
+                    stateChanged.wait_until(lockGuard, groupCommitFlushAt);
+            }
+            if (request.index == 0)
+                return {ClientResult::NOT_LEADER, 0};
+
+            while (!exiting && currentTerm == request.term)
+            {
+                if (commitIndex >= request.index)
+                {
+                    VERBOSE("replicate succeeded");
+                    return {ClientResult::SUCCESS, request.index};
+                }
+                stateChanged.wait(lockGuard);
+            }
+            return {ClientResult::NOT_LEADER, 0};
+        }
+
+        void
+        RaftConsensus::flushGroupCommit()
+        {
+            std::vector<const Log::Entry *> entries;
+            entries.reserve(groupCommitQueue.size());
+            TimePoint now = Clock::now();
+            uint64_t clusterTime = 0;
+            if (state == State::LEADER)
+                clusterTime = clusterClock.leaderStamp();
+            for (auto it = groupCommitQueue.begin();
+                 it != groupCommitQueue.end();
+                 ++it)
+            {
+                GroupCommitRequest &request = **it;
+                if (state != State::LEADER || request.term != currentTerm)
+                    continue; // request.index stays 0
+                request.entry.set_term(currentTerm);
+                request.entry.set_cluster_time(clusterTime);
+                entries.push_back(&request.entry);
+                groupCommitDelayNanos.push(uint64_t(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        now - request.queuedAt)
+                        .count()));
+            }
+            if (!entries.empty())
+            {
+                append(entries);
+                uint64_t index = log->getLastLogIndex() - entries.size() + 1;
+                for (auto it = groupCommitQueue.begin();
+                     it != groupCommitQueue.end();
+                     ++it)
+                {
+                    GroupCommitRequest &request = **it;
+                    if (state == State::LEADER && request.term == currentTerm)
+                        request.index = index++;
+                }
+                groupCommitEntries.push(entries.size());
+            }
+            for (auto it = groupCommitQueue.begin();
+                 it != groupCommitQueue.end();
+                 ++it)
+            {
+                (*it)->flushed = true;
+            }
+            groupCommitQueue.clear();
+            groupCommitQueueBytes = 0;
+            groupCommitFlushAt = TimePoint::max();
+            stateChanged.notify_all();
+        }
+
         void
         RaftConsensus::requestVote(std::unique_lock<Mutex> &lockGuard, Peer &peer)
         {
@@ -2948,6 +4107,7 @@ namespace LogCabin
             VERBOSE("requestVote start");
             TimePoint start = Clock::now();
             uint64_t epoch = currentEpoch;
+            lastSentEpoch = epoch;
             Peer::CallStatus status = peer.callRPC(
                 Protocol::Raft::OpCode::REQUEST_VOTE,
                 request, response,
@@ -3080,11 +4240,14 @@ namespace LogCabin
             ++currentTerm;
             state = State::CANDIDATE;
             leaderId = 0;
+            leaderCommitIndexTime = TimePoint::min();
             votedFor = serverId;
             printElectionState();
             setElectionTimer();
             configuration->forEach(&Server::beginRequestVote);
-            if (snapshotWriter)
+            // A partial snapshot from a leader speaking InstallSnapshot version
+            // 3 is kept, in case the next leader sends the same file.
+            if (snapshotWriter && snapshotTransferBytes == 0)
             {
                 snapshotWriter->discard();
                 snapshotWriter.reset();
@@ -3101,15 +4264,19 @@ namespace LogCabin
         RaftConsensus::stepDown(uint64_t newTerm)
         {
             assert(currentTerm <= newTerm);
+            bool wasLeader = (state == State::LEADER);
             if (currentTerm < newTerm)
             {
                 VERBOSE("stepDown(%lu)", newTerm);
                 currentTerm = newTerm;
                 leaderId = 0;
+                leaderCommitIndexTime = TimePoint::min();
                 votedFor = 0;
                 updateLogMetadata();
                 configuration->resetStagingServers();
-                if (snapshotWriter)
+                // See startNewElection() for why some partial snapshots are
+                // kept.
+                if (snapshotWriter && snapshotTransferBytes == 0)
                 {
                     snapshotWriter->discard();
                     snapshotWriter.reset();
@@ -3131,6 +4298,11 @@ namespace LogCabin
                 withholdVotesUntil = TimePoint::min();
             interruptAll();
 
+            // The rest only concerns leaders: a follower's or candidate's queued
+            // appends belong to followerDiskThread.
+            if (!wasLeader)
+                return;
+
             // If the leader disk thread is currently writing to disk, wait for it to
             // finish. We poll here because we don't want to release the lock (this
             // server would then believe its writes have been flushed when they
@@ -3149,6 +4321,27 @@ namespace LogCabin
                 log->syncComplete(std::move(sync));
                 logSyncQueued = false;
             }
+            followerSyncedIndex = log->getLastLogIndex();
+        }
+
+        void
+        RaftConsensus::syncFollowerLog()
+        {
+            if (!ASYNC_FOLLOWER_SYNC)
+                return;
+            // Poll rather than release the lock, as in stepDown().
+            while (followerDiskThreadWorking)
+                usleep(500);
+            ++followerSyncGeneration;
+            if (logSyncQueued)
+            {
+                std::unique_ptr<Log::Sync> sync = log->takeSync();
+                sync->wait();
+                followerSyncedIndex = sync->lastIndex;
+                log->syncComplete(std::move(sync));
+                logSyncQueued = false;
+                stateChanged.notify_all();
+            }
         }
 
         void
@@ -3164,11 +4357,24 @@ namespace LogCabin
         bool
         RaftConsensus::upToDateLeader(std::unique_lock<Mutex> &lockGuard) const
         {
-            ++currentEpoch;
+            if (haveLeaderLease())
+                return true;
+            ++numReadIndexRequests;
+            // An acknowledgment of an epoch only confirms leadership as of when
+            // its RPCs were sent. If none have been sent yet, this caller can
+            // share the current epoch with earlier callers that are still
+            // waiting. Otherwise it needs a new one.
+            if (lastSentEpoch >= currentEpoch)
+                ++currentEpoch;
             uint64_t epoch = currentEpoch;
-            // schedule a heartbeat now so that this returns quickly
-            configuration->forEach(&Server::scheduleHeartbeat);
-            stateChanged.notify_all();
+            if (readRoundEpoch != epoch)
+            {
+                readRoundEpoch = epoch;
+                ++numReadIndexRounds;
+                // schedule a heartbeat now so that this returns quickly
+                configuration->forEach(&Server::scheduleHeartbeat);
+                stateChanged.notify_all();
+            }
             while (true)
             {
                 if (exiting || state != State::LEADER)
@@ -3176,29 +4382,56 @@ namespace LogCabin
                 if (configuration->quorumMin(&Server::getLastAckEpoch) >= epoch)
                 {
                     // So we know we're the current leader, but do we have an
-                    // up-to-date commitIndex yet? What we'd like to check is whether
-                    // the entry's term at commitIndex matches our currentTerm, but
-                    // snapshots mean that we may not have the entry in our log. Since
-                    // commitIndex >= lastSnapshotIndex, we split into two cases:
-                    uint64_t commitTerm;
-                    if (commitIndex == lastSnapshotIndex)
-                    {
-                        commitTerm = lastSnapshotTerm;
-                    }
-                    else
-                    {
-                        assert(commitIndex > lastSnapshotIndex);
-                        assert(commitIndex >= log->getLogStartIndex());
-                        assert(commitIndex <= log->getLastLogIndex());
-                        commitTerm = log->getEntry(commitIndex).term();
-                    }
-                    if (commitTerm == currentTerm)
+                    // up-to-date commitIndex yet?
+                    if (commitIndexInCurrentTerm())
                         return true;
                 }
                 stateChanged.wait(lockGuard);
             }
         }
 
+        bool
+        RaftConsensus::haveLeaderLease() const
+        {
+            if (LEADER_LEASE == std::chrono::nanoseconds::zero() ||
+                state != State::LEADER)
+            {
+                return false;
+            }
+            // A quorum acknowledged heartbeats sent after this time, and each of
+            // them won't vote for another candidate for an ELECTION_TIMEOUT after
+            // receiving one. So no other leader can exist yet.
+            TimePoint leaseStart = Clock::now() - LEADER_LEASE;
+            if (!configuration->quorumAll([leaseStart](Server &server)
+                                          { return server.getLastAckTime() > leaseStart; }))
+            {
+                return false;
+            }
+            return commitIndexInCurrentTerm();
+        }
+
+        bool
+        RaftConsensus::commitIndexInCurrentTerm() const
+        {
+            // What we'd like to check is whether the entry's term at commitIndex
+            // matches our currentTerm, but snapshots mean that we may not have the
+            // entry in our log. Since commitIndex >= lastSnapshotIndex, we split into
+            // two cases:
+            uint64_t commitTerm;
+            if (commitIndex == lastSnapshotIndex)
+            {
+                commitTerm = lastSnapshotTerm;
+            }
+            else
+            {
+                assert(commitIndex > lastSnapshotIndex);
+                assert(commitIndex >= log->getLogStartIndex());
+                assert(commitIndex <= log->getLastLogIndex());
+                commitTerm = log->getEntry(commitIndex).term();
+            }
+            return commitTerm == currentTerm;
+        }
+
         std::ostream &
         operator<<(std::ostream &os, RaftConsensus::ClientResult clientResult)
         {
@@ -26,9 +26,11 @@
 #include "build/Protocol/ServerStats.pb.h"
 #include "build/Server/SnapshotStats.pb.h"
 #include "Client/SessionManager.h"
+#include "Core/Buffer.h"
 #include "Core/CompatAtomic.h"
 #include "Core/ConditionVariable.h"
 #include "Core/Mutex.h"
+#include "Core/RollingStat.h"
 #include "Core/Time.h"
 #include "RPC/ClientRPC.h"
 #include "Storage/Layout.h"
@@ -134,6 +136,13 @@ class Server {
      * Return the latest time this Server acknowledged our current term.
      */
     virtual uint64_t getLastAckEpoch() const = 0;
+    /**
+     * Return the time at which the latest heartbeat that this Server
+     * acknowledged in our current term was sent. Having acknowledged it, the
+     * Server will not vote for another candidate until an election timeout
+     * later. This is used for leader leases.
+     */
+    virtual TimePoint getLastAckTime() const = 0;
     /**
      * Return the largest entry ID for which this Server is known to share the
      * same entries up to and including this entry with our log.
@@ -149,8 +158,9 @@ class Server {
      */
     virtual bool haveVote() const = 0;
     /**
-     * Cancel any outstanding RPCs to this Server.
-     * The condition variable in RaftConsensus will be notified separately.
+     * Cancel any outstanding RPCs to this Server and wake up any thread
+     * belonging to this Server, so that it notices changes to the
+     * RaftConsensus state.
      */
     virtual void interrupt() = 0;
     /**
@@ -160,9 +170,14 @@ class Server {
      * Should monotonically change from false to true.
      */
     virtual bool isCaughtUp() const = 0;
+    /**
+     * Called when the leader has appended new entries to its log, so that
+     * any thread belonging to this Server can start replicating them.
+     * Return immediately.
+     */
+    virtual void notifyNewEntries() = 0;
     /**
      * Make the next heartbeat RPC happen soon. Return immediately.
-     * The condition variable in RaftConsensus will be notified separately.
      */
     virtual void scheduleHeartbeat() = 0;
     /**
@@ -231,8 +246,10 @@ class LocalServer : public Server {
     uint64_t getMatchIndex() const;
     bool haveVote() const;
     uint64_t getLastAckEpoch() const;
+    TimePoint getLastAckTime() const;
     void interrupt();
     bool isCaughtUp() const;
+    void notifyNewEntries();
     void scheduleHeartbeat();
     std::ostream& dumpToStream(std::ostream& os) const;
     void updatePeerStats(Protocol::ServerStats::Raft::Peer& peerStats,
@@ -272,12 +289,19 @@ class Peer : public Server {
     void beginLeadership();
     void exit();
     uint64_t getLastAckEpoch() const;
+    TimePoint getLastAckTime() const;
     uint64_t getMatchIndex() const;
     bool haveVote() const;
     bool isCaughtUp() const;
     void interrupt();
+    void notifyNewEntries();
     void scheduleHeartbeat();
 
+    /**
+     * Cancel the RPCs in #installSnapshotInFlight and empty it.
+     */
+    void cancelInstallSnapshotInFlight();
+
     /**
      * Returned by callRPC().
      */
@@ -320,6 +344,62 @@ class Peer : public Server {
             google::protobuf::Message& response,
             std::unique_lock<Mutex>& lockGuard);
 
+    /**
+     * Like the callRPC() above, but with a request that's already been
+     * serialized, as from RaftConsensus::serializeAppendEntries().
+     */
+    CallStatus
+    callRPC(Protocol::Raft::OpCode opCode,
+            Core::Buffer request,
+            google::protobuf::Message& response,
+            std::unique_lock<Mutex>& lockGuard);
+
+    /**
+     * Begin a remote procedure call on the server's RaftService but don't
+     * wait for its reply. As creating a session might take a while, this
+     * should be called without RaftConsensus lock.
+     * \param[in] opCode
+     *      The RPC opcode to execute (see Protocol::Raft::OpCode).
+     * \param[in] request
+     *      The request to send to the other server.
+     * \param[in] lockGuard
+     *      The Raft lock, which is released internally to allow for I/O
+     *      concurrency.
+     * \return
+     *      The outstanding RPC, which should be passed to waitForRPC().
+     */
+    RPC::ClientRPC
+    startRPC(Protocol::Raft::OpCode opCode,
+             const google::protobuf::Message& request,
+             std::unique_lock<Mutex>& lockGuard);
+
+    /**
+     * Like the startRPC() above, but with a request that's already been
+     * serialized, as from RaftConsensus::serializeAppendEntries().
+     */
+    RPC::ClientRPC
+    startRPC(Protocol::Raft::OpCode opCode,
+             Core::Buffer request,
+             std::unique_lock<Mutex>& lockGuard);
+
+    /**
+     * Wait for the reply to an RPC started with startRPC().
+     * \param[in] rpc
+     *      The outstanding RPC. This must remain valid while the lock is
+     *      released; interrupt() may cancel it concurrently.
+     * \param[out] response
+     *      Where the reply should be placed, if status is OK.
+     * \param[in] lockGuard
+     *      The Raft lock, which is released internally to allow for I/O
+     *      concurrency.
+     * \return
+     *      See CallStatus.
+     */
+    CallStatus
+    waitForRPC(RPC::ClientRPC& rpc,
+               google::protobuf::Message& response,
+               std::unique_lock<Mutex>& lockGuard);
+
     /**
      * Launch this Peer's thread, which should run
      * RaftConsensus::peerThreadMain.
@@ -361,6 +441,16 @@ class Peer : public Server {
      */
     bool exiting;
 
+    /**
+     * Notified when this peer's thread may have new work to do: the leader
+     * appended entries, a heartbeat was scheduled, or the RaftConsensus state
+     * changed in a way that interrupt()ed this peer. peerThreadMain() sleeps
+     * on this rather than on RaftConsensus::stateChanged, so that unrelated
+     * state changes (such as commitIndex advancing) don't wake up every peer
+     * thread.
+     */
+    Core::ConditionVariable workAvailable;
+
     /**
      * Set to true if the server has responded to our RequestVote request in
      * the current term, false otherwise.
@@ -402,6 +492,11 @@ class Peer : public Server {
      */
     uint64_t lastAckEpoch;
 
+    /**
+     * See #getLastAckTime(). Reset to TimePoint::min() on beginLeadership().
+     */
+    TimePoint lastAckTime;
+
     /**
      * When the next heartbeat should be sent to the follower.
      * Only valid while we're leader. The leader sends heartbeats periodically
@@ -446,7 +541,9 @@ class Peer : public Server {
     std::unique_ptr<Storage::FilesystemUtil::FileContents> snapshotFile;
     /**
      * The number of bytes of 'snapshotFile' that have been acknowledged by the
-     * follower already. Send starting here next time.
+     * follower already. Send starting here next time. While chunks are
+     * pipelined (see #installSnapshotInFlight), this is instead where the
+     * next chunk starts.
      */
     uint64_t snapshotFileOffset;
     /**
@@ -455,6 +552,98 @@ class Peer : public Server {
      * the snapshot.
      */
     uint64_t lastSnapshotIndex;
+    /**
+     * The CRC32C checksum of all of 'snapshotFile', sent with each chunk so
+     * that the follower can tell it apart from other files.
+     */
+    uint32_t snapshotFileCrc32c;
+    /**
+     * The InstallSnapshot version that the follower reported in its last
+     * reply, or 0 if it didn't. Chunks are only pipelined to followers that
+     * speak version 3 or later.
+     */
+    uint32_t installSnapshotVersion;
+    /**
+     * The largest bytes_stored among the replies to the chunks in
+     * #installSnapshotInFlight processed so far. Reset when the window
+     * drains.
+     */
+    uint64_t snapshotBytesAcked;
+
+    /**
+     * An AppendEntries RPC that has been sent to the follower but whose reply
+     * has not yet been processed. See #appendEntriesInFlight.
+     */
+    struct InFlightAppendEntries {
+        InFlightAppendEntries(RPC::ClientRPC rpc,
+                              uint64_t term,
+                              uint64_t prevLogIndex,
+                              uint64_t numEntries,
+                              TimePoint start,
+                              uint64_t epoch);
+        InFlightAppendEntries(InFlightAppendEntries&& other);
+        ~InFlightAppendEntries();
+        /// The outstanding RPC.
+        RPC::ClientRPC rpc;
+        /// The leader's term when the request was sent.
+        uint64_t term;
+        /// The request's prev_log_index.
+        uint64_t prevLogIndex;
+        /// The number of entries packed into the request.
+        uint64_t numEntries;
+        /// When the request was sent.
+        TimePoint start;
+        /// The value of RaftConsensus::currentEpoch when the request was sent.
+        uint64_t epoch;
+    };
+
+    /**
+     * AppendEntries requests that have been pipelined to the follower, in the
+     * order they were sent. Only the peer thread adds or removes elements;
+     * interrupt() may cancel their RPCs. While this is non-empty, #nextIndex
+     * is set optimistically to follow the last entry sent, rather than the
+     * last entry acknowledged. Only used when leader and only when
+     * RaftConsensus::MAX_APPEND_ENTRIES_IN_FLIGHT is greater than 1.
+     */
+    std::deque<InFlightAppendEntries> appendEntriesInFlight;
+
+    /**
+     * A chunk of an InstallSnapshot transfer that has been sent to the
+     * follower but whose reply has not yet been processed. See
+     * #installSnapshotInFlight.
+     */
+    struct InFlightInstallSnapshot {
+        InFlightInstallSnapshot(RPC::ClientRPC rpc,
+                                uint64_t term,
+                                uint64_t byteOffset,
+                                uint64_t numDataBytes,
+                                TimePoint start,
+                                uint64_t epoch);
+        InFlightInstallSnapshot(InFlightInstallSnapshot&& other);
+        ~InFlightInstallSnapshot();
+        /// The outstanding RPC.
+        RPC::ClientRPC rpc;
+        /// The leader's term when the request was sent.
+        uint64_t term;
+        /// The request's byte_offset.
+        uint64_t byteOffset;
+        /// The number of bytes of the file in the request.
+        uint64_t numDataBytes;
+        /// When the request was sent.
+        TimePoint start;
+        /// The value of RaftConsensus::currentEpoch when the request was sent.
+        uint64_t epoch;
+    };
+
+    /**
+     * Snapshot chunks that have been pipelined to the follower, in the order
+     * they were sent. Only the peer thread adds or removes elements;
+     * interrupt() may cancel their RPCs. While this is non-empty,
+     * #snapshotFileOffset follows the last chunk sent rather than the bytes
+     * acknowledged. Only used when leader and only when
+     * RaftConsensus::MAX_INSTALL_SNAPSHOT_IN_FLIGHT is greater than 1.
+     */
+    std::deque<InFlightInstallSnapshot> installSnapshotInFlight;
 
   private:
 
@@ -1025,6 +1214,26 @@ class RaftConsensus {
      */
     std::pair<ClientResult, uint64_t> getLastCommitIndex() const;
 
+    /**
+     * Return an entry ID that the state machine can serve reads from with
+     * bounded staleness. Unlike getLastCommitIndex(), this may be called on
+     * followers, which use the commit index that the leader last reported.
+     * \param maxStalenessNanos
+     *      If nonzero, the returned index must be one the leader had committed
+     *      less than this long ago. This is approximate: a deposed leader may
+     *      keep its followers believing they're current for up to an election
+     *      timeout, and network delays aren't accounted for.
+     * \param maxLagEntries
+     *      The returned index may trail the (local or leader's) commit index
+     *      by up to this many entries.
+     * \return
+     *      NOT_LEADER if this server can't satisfy the bounds, such as during
+     *      an election. Otherwise, SUCCESS and the entry ID.
+     */
+    std::pair<ClientResult, uint64_t>
+    getRecentCommitIndex(uint64_t maxStalenessNanos,
+                         uint64_t maxLagEntries) const;
+
     /**
      * Return the network address for a recent leader, if known,
      * or empty string otherwise.
@@ -1072,6 +1281,16 @@ class RaftConsensus {
                 const Protocol::Raft::InstallSnapshot::Request& request,
                 Protocol::Raft::InstallSnapshot::Response& response);
 
+    /**
+     * Helper for handleInstallSnapshot() that stores a chunk from a leader
+     * speaking InstallSnapshot version 3 or later. Chunks may arrive out of
+     * order; each is written at its offset in the staging file, and the
+     * snapshot is loaded once all of its bytes are stored.
+     */
+    void handleSnapshotChunk(
+                const Protocol::Raft::InstallSnapshot::Request& request,
+                Protocol::Raft::InstallSnapshot::Response& response);
+
     /**
      * Process a RequestVote RPC from another server. Called by RaftService.
      * \param[in] request
@@ -1129,11 +1348,19 @@ class RaftConsensus {
      *      [1, lastIncludedIndex].
      *      lastIncludedIndex must be committed (must have been previously
      *      returned by #getNextEntry()).
+     * \param[in,out] deltaBaseIndex
+     *      If not NULL and nonzero, the state machine would like to write
+     *      only its changes since the snapshot covering entries
+     *      [1, *deltaBaseIndex]. This is set to 0 if that isn't possible (for
+     *      example, if that's no longer the latest snapshot, or if a full
+     *      snapshot is needed); the state machine must then write a full
+     *      snapshot.
      * \return
      *      A file the state machine can dump its snapshot into.
      */
     std::unique_ptr<Storage::SnapshotFile::Writer>
-    beginSnapshot(uint64_t lastIncludedIndex);
+    beginSnapshot(uint64_t lastIncludedIndex,
+                  uint64_t* deltaBaseIndex = NULL);
 
     /**
      * Complete taking a snapshot for the log entries in range [1,
@@ -1147,9 +1374,27 @@ class RaftConsensus {
      *      have to discard the snapshot in case it's gotten a better snapshot
      *      from another server. If this snapshot is to be saved (normal case),
      *      the consensus module will call save() on it.
+     * \param deltaBaseIndex
+     *      The value of *deltaBaseIndex after beginSnapshot() returned, or 0
+     *      for a full snapshot. The snapshot this delta depends on is kept
+     *      until a later full snapshot replaces it.
      */
     void snapshotDone(uint64_t lastIncludedIndex,
-                      std::unique_ptr<Storage::SnapshotFile::Writer> writer);
+                      std::unique_ptr<Storage::SnapshotFile::Writer> writer,
+                      uint64_t deltaBaseIndex = 0);
+
+    /**
+     * Open an earlier snapshot that a delta snapshot depends on. Called by
+     * the state machine while loading a delta snapshot.
+     * \param lastIncludedIndex
+     *      The earlier snapshot covers log entries [1, lastIncludedIndex]
+     *      (the delta's delta_base_index).
+     * \return
+     *      A reader positioned just past the snapshot's header, where the
+     *      state machine's part of the file begins.
+     */
+    std::unique_ptr<Storage::SnapshotFile::Reader>
+    readSnapshotDeltaBase(uint64_t lastIncludedIndex) const;
 
     /**
      * Add information about the consensus state to the given structure.
@@ -1203,6 +1448,14 @@ class RaftConsensus {
      */
     void leaderDiskThreadMain();
 
+    /**
+     * Flush log entries to stable storage in the background on followers and
+     * candidates when #ASYNC_FOLLOWER_SYNC is set. Once they're flushed, it
+     * advances #followerSyncedIndex so that handleAppendEntries() can reply.
+     * This is the method that #followerDiskThread executes.
+     */
+    void followerDiskThreadMain();
+
     /**
      * Start new elections when it's time to do so. This is the method that
      * #timerThread executes.
@@ -1270,6 +1523,68 @@ class RaftConsensus {
      */
     void appendEntries(std::unique_lock<Mutex>& lockGuard, Peer& peer);
 
+    /**
+     * Return true if #pipelineAppendEntries() may send another AppendEntries
+     * RPC to the peer without waiting for replies to those already in flight.
+     * This requires that pipelining is enabled, that the follower is known to
+     * agree with our log up through peer.nextIndex - 1 (or that this was
+     * presumed by earlier pipelined requests), that the window of in-flight
+     * requests isn't full, and that there are new entries to send.
+     */
+    bool canPipelineAppendEntries(const Peer& peer) const;
+
+    /**
+     * Send an AppendEntries RPC containing new entries to the server without
+     * waiting for the reply. This advances peer.nextIndex optimistically past
+     * the entries sent; #receiveAppendEntries() later processes the reply.
+     * \pre
+     *      canPipelineAppendEntries(peer) is true.
+     * \param lockGuard
+     *      Used to temporarily release the lock while creating a session.
+     * \param peer
+     *      State used in communicating with the follower and building the RPC
+     *      request.
+     */
+    void pipelineAppendEntries(std::unique_lock<Mutex>& lockGuard, Peer& peer);
+
+    /**
+     * Wait for the reply to the oldest AppendEntries RPC in
+     * peer.appendEntriesInFlight and process it. If the RPC failed or the
+     * follower rejected it, the remaining in-flight RPCs are canceled and
+     * peer.nextIndex is moved back as if they had never been sent.
+     * \param lockGuard
+     *      Used to temporarily release the lock while waiting for the reply.
+     * \param peer
+     *      State used in communicating with the follower and processing the
+     *      RPC's result.
+     */
+    void receiveAppendEntries(std::unique_lock<Mutex>& lockGuard, Peer& peer);
+
+    /**
+     * Helper for #appendEntries() and #receiveAppendEntries() to process the
+     * follower's reply to an AppendEntries request that was sent in the
+     * current term.
+     * \param peer
+     *      State used in communicating with the follower.
+     * \param prevLogIndex
+     *      The request's prev_log_index.
+     * \param numEntries
+     *      The number of entries in the request.
+     * \param start
+     *      When the request was sent.
+     * \param epoch
+     *      The value of #currentEpoch when the request was sent.
+     * \param response
+     *      The follower's reply.
+     */
+    void handleAppendEntriesResponse(
+            Peer& peer,
+            uint64_t prevLogIndex,
+            uint64_t numEntries,
+            TimePoint start,
+            uint64_t epoch,
+            const Protocol::Raft::AppendEntries::Response& response);
+
     /**
      * Send an InstallSnapshot RPC to the server (containing part of a
      * snapshot file to replicate).
@@ -1282,6 +1597,64 @@ class RaftConsensus {
      */
     void installSnapshot(std::unique_lock<Mutex>& lockGuard, Peer& peer);
 
+    /**
+     * Helper for #installSnapshot() and #pipelineInstallSnapshot() to fill in
+     * the next chunk of peer.snapshotFile, starting at peer.snapshotFileOffset,
+     * along with its checksum.
+     * \return
+     *      The number of bytes of the file in the chunk.
+     */
+    uint64_t packSnapshotChunk(
+            const Peer& peer,
+            Protocol::Raft::InstallSnapshot::Request& request) const;
+
+    /**
+     * Return true if #pipelineInstallSnapshot() may send another chunk of
+     * the snapshot to the peer without waiting for replies to those already
+     * in flight. This requires that pipelining is enabled, that the follower
+     * has replied that it speaks InstallSnapshot version 3, that the window
+     * of in-flight requests isn't full, and that there's more of the file to
+     * send.
+     */
+    bool canPipelineInstallSnapshot(const Peer& peer) const;
+
+    /**
+     * Send an InstallSnapshot RPC with the next chunk of the snapshot without
+     * waiting for the reply. This advances peer.snapshotFileOffset past the
+     * chunk; #receiveInstallSnapshot() later processes the reply.
+     * \pre
+     *      canPipelineInstallSnapshot(peer) is true.
+     * \param lockGuard
+     *      Used to temporarily release the lock while creating a session.
+     * \param peer
+     *      State used in communicating with the follower and building the RPC
+     *      request.
+     */
+    void pipelineInstallSnapshot(std::unique_lock<Mutex>& lockGuard,
+                                 Peer& peer);
+
+    /**
+     * Wait for the reply to the oldest InstallSnapshot RPC in
+     * peer.installSnapshotInFlight and process it. If the RPC failed, the
+     * remaining in-flight RPCs are canceled and the transfer resumes with the
+     * failed chunk. Once all in-flight chunks have been handled, the transfer
+     * resumes from however much of the file the follower reports having, in
+     * case it dropped any chunks.
+     * \param lockGuard
+     *      Used to temporarily release the lock while waiting for the reply.
+     * \param peer
+     *      State used in communicating with the follower and processing the
+     *      RPC's result.
+     */
+    void receiveInstallSnapshot(std::unique_lock<Mutex>& lockGuard,
+                                Peer& peer);
+
+    /**
+     * Called once the follower has stored all of peer.snapshotFile. Advances
+     * the peer's matchIndex past the snapshot and closes the file.
+     */
+    void finishInstallSnapshot(Peer& peer);
+
     /**
      * Transition to being a leader. This is called when a candidate has
      * received votes from a quorum.
@@ -1294,6 +1667,13 @@ class RaftConsensus {
      */
     void discardUnneededEntries();
 
+    /**
+     * Remove the earlier snapshots kept in the snapshot directory that the
+     * latest snapshot no longer depends on (see
+     * SnapshotMetadata::Header::delta_base_index).
+     */
+    void discardUnneededDeltaBases();
+
     /**
      * Return the term corresponding to log->getLastLogIndex(). This may come
      * from the log, from the snapshot, or it may be 0.
@@ -1308,18 +1688,40 @@ class RaftConsensus {
     void interruptAll();
 
     /**
-     * Helper for #appendEntries() to put the right number of entries into the
-     * request.
+     * Helper for #appendEntries() to choose the right number of entries to
+     * send in a request.
      * \param nextIndex
      *      First entry to send to the follower.
      * \param request
-     *      AppendEntries request ProtoBuf in which to pack the entries.
+     *      AppendEntries request ProtoBuf that the entries will be sent with.
+     *      This is used only for its size.
+     * \param[out] entries
+     *      The serialized entries are appended here, from
+     *      Storage::Log::getEntryBytes(). These may refer to memory owned by
+     *      the log, so they must be consumed before the lock is released.
      * \return
-     *      Number of entries in the request.
+     *      Number of entries chosen.
      */
     uint64_t
     packEntries(uint64_t nextIndex,
-                Protocol::Raft::AppendEntries::Request& request) const;
+                const Protocol::Raft::AppendEntries::Request& request,
+                std::vector<Core::Buffer>& entries) const;
+
+    /**
+     * Serialize an AppendEntries request for Peer::startRPC(). The entries
+     * from packEntries() are copied in as they are, after the rest of the
+     * request; they are not parsed or re-serialized.
+     * \param request
+     *      The request, without any entries.
+     * \param entries
+     *      The serialized entries to send with the request.
+     * \return
+     *      The serialized request, with space for the RPC header in front.
+     */
+    static Core::Buffer
+    serializeAppendEntries(
+        const Protocol::Raft::AppendEntries::Request& request,
+        const std::vector<Core::Buffer>& entries);
 
     /**
      * Try to read the latest good snapshot from disk. Loads the header of the
@@ -1339,6 +1741,22 @@ class RaftConsensus {
     replicateEntry(Storage::Log::Entry& entry,
                    std::unique_lock<Mutex>& lockGuard);
 
+    /**
+     * Like replicateEntry(), but first queue the entry in #groupCommitQueue
+     * for up to GROUP_COMMIT_DELAY so that it's appended to the log together
+     * with other entries submitted concurrently.
+     */
+    std::pair<ClientResult, uint64_t>
+    replicateEntryInGroup(Storage::Log::Entry& entry,
+                          std::unique_lock<Mutex>& lockGuard);
+
+    /**
+     * Append all the entries in #groupCommitQueue to the log at once, and
+     * notify their submitters. Entries queued in an earlier term are not
+     * appended; their submitters will return NOT_LEADER.
+     */
+    void flushGroupCommit();
+
     /**
      * Send a RequestVote RPC to the server. This is used by candidates to
      * request a server's vote and by new leaders to retrieve information about
@@ -1384,6 +1802,17 @@ class RaftConsensus {
      */
     void stepDown(uint64_t newTerm);
 
+    /**
+     * Wait for #followerDiskThread to finish the flush it's working on, then
+     * flush whatever else is queued inline. This is used without releasing
+     * the lock before truncating the end of the log (which may not be done
+     * concurrently with a flush) and before becoming leader (which assumes
+     * the entire log is durable). Does nothing unless #ASYNC_FOLLOWER_SYNC is
+     * set. Any flush #followerDiskThread was doing is treated as stale
+     * afterwards (see #followerSyncGeneration).
+     */
+    void syncFollowerLog();
+
     /**
      * Persist critical state, such as the term and the vote, to stable
      * storage.
@@ -1397,9 +1826,25 @@ class RaftConsensus {
      * This is used to provide non-stale read operations to
      * clients. It gives up after ELECTION_TIMEOUT, since stepDownThread
      * will return to the follower state after that time.
+     * Concurrent callers share an epoch and a round of heartbeats, as long as
+     * none of its RPCs have been sent yet (see #lastSentEpoch).
      */
     bool upToDateLeader(std::unique_lock<Mutex>& lockGuard) const;
 
+    /**
+     * Return true if this server is leader, has committed an entry in its
+     * current term, and holds a leader lease (see #LEADER_LEASE). In that
+     * case, #upToDateLeader() can return right away without any RPCs.
+     */
+    bool haveLeaderLease() const;
+
+    /**
+     * Return true if the entry at #commitIndex was created in the current
+     * term. A new leader doesn't know which entries are committed until this
+     * is the case.
+     */
+    bool commitIndexInCurrentTerm() const;
+
     /**
      * Print out a ClientResult for debugging purposes.
      */
@@ -1423,6 +1868,16 @@ class RaftConsensus {
      */
     const std::chrono::nanoseconds HEARTBEAT_PERIOD;
 
+    /**
+     * A leader may serve reads without contacting the other servers for this
+     * long after a quorum acknowledged a heartbeat, since those servers won't
+     * vote for anyone else for an ELECTION_TIMEOUT. Zero disables leases.
+     * This is never more than ELECTION_TIMEOUT; the difference is the
+     * allowance for clock drift between servers.
+     * Const except for unit tests.
+     */
+    std::chrono::nanoseconds LEADER_LEASE;
+
     /**
      * A leader will pack at most this many entries into an AppendEntries
      * request message. This helps bound processing time when entries are very
@@ -1431,6 +1886,57 @@ class RaftConsensus {
      */
     uint64_t MAX_LOG_ENTRIES_PER_REQUEST;
 
+    /**
+     * A leader will keep at most this many AppendEntries requests outstanding
+     * to each follower at a time. A value of 1 disables pipelining: the
+     * leader waits for each reply before sending the next request.
+     * Const except for unit tests.
+     */
+    uint64_t MAX_APPEND_ENTRIES_IN_FLIGHT;
+
+    /**
+     * A leader will keep at most this many InstallSnapshot chunks outstanding
+     * to each follower at a time, once the follower has said it can store
+     * chunks out of order. A value of 1 waits for each reply before sending
+     * the next chunk.
+     * Const except for unit tests.
+     */
+    uint64_t MAX_INSTALL_SNAPSHOT_IN_FLIGHT;
+
+    /**
+     * A leader may hold an entry passed to replicate() for this long so that
+     * it can be appended to the log along with other entries submitted
+     * concurrently. Zero disables group commit: each entry is appended as
+     * soon as it arrives.
+     * Const except for unit tests.
+     */
+    std::chrono::nanoseconds GROUP_COMMIT_DELAY;
+
+    /**
+     * A group of entries held by GROUP_COMMIT_DELAY is appended to the log
+     * early once it contains this many entries.
+     * Const except for unit tests.
+     */
+    uint64_t GROUP_COMMIT_MAX_ENTRIES;
+
+    /**
+     * A group of entries held by GROUP_COMMIT_DELAY is appended to the log
+     * early once its entries add up to this many bytes.
+     * Const except for unit tests.
+     */
+    uint64_t GROUP_COMMIT_MAX_BYTES;
+
+    /**
+     * If true, followers flush new log entries to disk on #followerDiskThread
+     * instead of inline while handling AppendEntries. This lets a follower
+     * accept the leader's next AppendEntries request while the previous one
+     * is still being flushed, and it lets a single flush cover several
+     * requests. Replies are still sent only once the entries they acknowledge
+     * are durable.
+     * Const except for unit tests.
+     */
+    bool ASYNC_FOLLOWER_SYNC;
+
     /**
      * A candidate or leader waits this long after an RPC fails before sending
      * another one, so as to not overwhelm the network with retries.
@@ -1447,6 +1953,13 @@ class RaftConsensus {
      */
     const std::chrono::nanoseconds STATE_MACHINE_UPDATER_BACKOFF;
 
+    /**
+     * The zlib level at which snapshots this server takes are compressed, or
+     * 0 to write them uncompressed. Snapshots received from the leader are
+     * stored exactly as the leader sent them, compressed or not.
+     */
+    const int SNAPSHOT_COMPRESSION_LEVEL;
+
     /**
      * Prefer to keep RPC requests under this size.
      * Const except for unit tests.
@@ -1482,6 +1995,13 @@ class RaftConsensus {
      */
     Client::SessionManager sessionManager;
 
+    /**
+     * How long #mutex is held each time it is acquired, in nanoseconds.
+     * Recorded through Core::Mutex::holdNanos and exported in ServerStats.
+     * Declared before #mutex so that it outlives it.
+     */
+    Core::RollingStat lockHoldNanos;
+
     /**
      * This class behaves mostly like a monitor. This protects all the state in
      * this class and almost all of the Peer class (with some
@@ -1503,6 +2023,9 @@ class RaftConsensus {
      *  - an acknowledgement from a peer is received.
      *  - a server goes from not caught up to caught up.
      *  - a heartbeat is scheduled.
+     * Peer threads don't wait on this; they wait on their own
+     * Peer::workAvailable, which is notified only when that peer may have
+     * something to send.
      * TODO(ongaro): Should there be multiple condition variables? This one is
      * used by a lot of threads for a lot of different conditions.
      */
@@ -1548,6 +2071,29 @@ class RaftConsensus {
      */
     std::atomic<bool> leaderDiskThreadWorking;
 
+    /**
+     * Like #leaderDiskThreadWorking but for #followerDiskThread. This is true
+     * while #followerDiskThread is writing to disk.
+     */
+    std::atomic<bool> followerDiskThreadWorking;
+
+    /**
+     * When #ASYNC_FOLLOWER_SYNC is set and this server is not leader, the
+     * index of the last log entry known to be on stable storage.
+     * handleAppendEntries() waits for this to cover the entries it
+     * acknowledges before replying.
+     */
+    uint64_t followerSyncedIndex;
+
+    /**
+     * Incremented every time syncFollowerLog() runs. #followerDiskThread
+     * compares this before and after a flush: if it changed, the log may have
+     * been truncated or replaced while the flush was in progress, so the
+     * flush's lastIndex no longer says anything about the entries at those
+     * indexes.
+     */
+    uint64_t followerSyncGeneration;
+
     /**
      * Defines the servers that are part of the cluster. See Configuration.
      */
@@ -1602,6 +2148,20 @@ class RaftConsensus {
      */
     uint64_t lastSnapshotBytes;
 
+    /**
+     * If the latest good snapshot is a delta, the lastIncludedIndex of the
+     * snapshot it depends on; otherwise, 0. Delta snapshots can't be sent to
+     * followers on their own.
+     */
+    uint64_t lastSnapshotDeltaBaseIndex;
+
+    /**
+     * Set when a follower needs a snapshot but the latest one is a delta.
+     * This asks the state machine (through getSnapshotStats()) for a full
+     * snapshot, and it's cleared once one is saved.
+     */
+    bool fullSnapshotNeeded;
+
     /**
      * If not NULL, this is a Storage::SnapshotFile::Reader that covers up through
      * lastSnapshotIndex. This is ready for the state machine to process and is
@@ -1613,11 +2173,31 @@ class RaftConsensus {
     /**
      * This is used in handleInstallSnapshot when receiving a snapshot from
      * the current leader. The leader is assumed to send at most one snapshot
-     * at a time, and any partial snapshots here are discarded when the term
-     * changes.
+     * at a time. Partial snapshots here are discarded when the term changes,
+     * unless they're identified by #snapshotTransferIndex,
+     * #snapshotTransferBytes, and #snapshotTransferCrc32c.
      */
     std::unique_ptr<Storage::SnapshotFile::Writer> snapshotWriter;
 
+    /**
+     * The last_snapshot_index of the InstallSnapshot (version 3 and up)
+     * requests whose chunks are being stored in #snapshotWriter, or 0.
+     */
+    uint64_t snapshotTransferIndex;
+
+    /**
+     * The snapshot_bytes of the InstallSnapshot (version 3 and up) requests
+     * whose chunks are being stored in #snapshotWriter, or 0 if the leader
+     * didn't send it.
+     */
+    uint64_t snapshotTransferBytes;
+
+    /**
+     * The snapshot_crc32c of the InstallSnapshot (version 3 and up) requests
+     * whose chunks are being stored in #snapshotWriter, or 0.
+     */
+    uint32_t snapshotTransferCrc32c;
+
     /**
      * The largest entry ID for which a quorum is known to have stored the same
      * entry as this server has. Entries 1 through commitIndex as stored in
@@ -1633,6 +2213,19 @@ class RaftConsensus {
      */
     uint64_t leaderId;
 
+    /**
+     * The leader's commit index as of the last AppendEntries request that
+     * carried it (see AppendEntries.Request.leader_commit_index). Used by
+     * getRecentCommitIndex() on followers.
+     */
+    uint64_t leaderCommitIndex;
+
+    /**
+     * When #leaderCommitIndex was last set, or TimePoint::min() if it hasn't
+     * been set in the current term.
+     */
+    TimePoint leaderCommitIndexTime;
+
     /**
      * The server ID that this server voted for during this term's election, if
      * any. The special value 0 means no vote has been given out during this
@@ -1649,6 +2242,94 @@ class RaftConsensus {
     // TODO(ongaro): rename, explain more
     mutable uint64_t currentEpoch;
 
+    /**
+     * The largest value of #currentEpoch attached to an RPC sent to a peer.
+     * If this is less than #currentEpoch, no request has gone out in the
+     * current epoch yet, so an acknowledgment of it will prove leadership as
+     * of any moment up to now. upToDateLeader() uses this to let concurrent
+     * readers share a single round of heartbeats.
+     */
+    uint64_t lastSentEpoch;
+
+    /**
+     * The value of #currentEpoch for which upToDateLeader() last scheduled a
+     * round of heartbeats. Readers joining that round don't need to schedule
+     * it again. Reset to 0 when this server becomes leader.
+     */
+    mutable uint64_t readRoundEpoch;
+
+    /**
+     * The number of upToDateLeader() calls that needed a round of heartbeats
+     * (those not satisfied by a leader lease). Exported in ServerStats.
+     */
+    mutable uint64_t numReadIndexRequests;
+
+    /**
+     * The number of rounds of heartbeats scheduled by upToDateLeader(). With
+     * many concurrent readers, this is much smaller than
+     * #numReadIndexRequests. Exported in ServerStats.
+     */
+    mutable uint64_t numReadIndexRounds;
+
+    /**
+     * An entry waiting in #groupCommitQueue. These live on the stack of the
+     * thread in replicateEntryInGroup().
+     */
+    struct GroupCommitRequest {
+        GroupCommitRequest(Storage::Log::Entry& entry, uint64_t term);
+        /**
+         * The entry to append. Its term and cluster time are set when the
+         * group is flushed.
+         */
+        Storage::Log::Entry& entry;
+        /**
+         * The value of #currentTerm when the entry was queued.
+         */
+        uint64_t term;
+        /**
+         * When the entry was queued, used for #groupCommitDelayNanos.
+         */
+        TimePoint queuedAt;
+        /**
+         * Set by flushGroupCommit() once the entry has left the queue.
+         */
+        bool flushed;
+        /**
+         * The log index of the entry once it's been appended, or 0 if it was
+         * dropped because leadership changed.
+         */
+        uint64_t index;
+    };
+
+    /**
+     * Entries passed to replicate() that have not yet been appended to the
+     * log. See GROUP_COMMIT_DELAY.
+     */
+    std::deque<GroupCommitRequest*> groupCommitQueue;
+
+    /**
+     * The sum of the sizes of the entries in #groupCommitQueue.
+     */
+    uint64_t groupCommitQueueBytes;
+
+    /**
+     * When the entries in #groupCommitQueue should be appended to the log:
+     * GROUP_COMMIT_DELAY after the first of them was queued.
+     */
+    TimePoint groupCommitFlushAt;
+
+    /**
+     * The number of entries appended by each call to flushGroupCommit().
+     * Exported in ServerStats.
+     */
+    Core::RollingStat groupCommitEntries;
+
+    /**
+     * How long each entry waited in #groupCommitQueue before being appended
+     * to the log. Exported in ServerStats.
+     */
+    Core::RollingStat groupCommitDelayNanos;
+
     /**
      * Tracks the passage of "cluster time". See ClusterClock.
      */
@@ -1694,6 +2375,13 @@ class RaftConsensus {
      */
     std::thread leaderDiskThread;
 
+    /**
+     * The thread that executes followerDiskThreadMain() to flush log entries
+     * to stable storage in the background on followers. Only started if
+     * #ASYNC_FOLLOWER_SYNC is set.
+     */
+    std::thread followerDiskThread;
+
     /**
      * The thread that executes timerThreadMain() to begin new elections
      * after periods of inactivity.
@@ -19,6 +19,7 @@
 #include <sys/stat.h>
 
 #include "build/Protocol/Raft.pb.h"
+#include "Core/Checksum.h"
 #include "Core/ProtoBuf.h"
 #include "Core/STLUtil.h"
 #include "Core/StringUtil.h"
@@ -30,6 +31,7 @@
 #include "RPC/Server.h"
 #include "Server/RaftConsensus.h"
 #include "Server/Globals.h"
+#include "Storage/FilesystemUtil.h"
 #include "Storage/MemoryLog.h"
 #include "Storage/SnapshotFile.h"
 #include "include/LogCabin/Debug.h"
@@ -750,6 +752,53 @@ namespace LogCabin
 
             // TODO(ongaro): getLastCommitIndex: low-priority test
 
+            TEST_F(ServerRaftConsensusTest, getRecentCommitIndex)
+            {
+                init();
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                drainDiskQueue(*consensus);
+                EXPECT_EQ(State::LEADER, consensus->state);
+                uint64_t commitIndex = consensus->commitIndex;
+                std::pair<ClientResult, uint64_t> result;
+                // leader
+                result = consensus->getRecentCommitIndex(0, 0);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                EXPECT_EQ(commitIndex, result.second);
+                result = consensus->getRecentCommitIndex(1000, 1);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                EXPECT_EQ(commitIndex - 1, result.second);
+                result = consensus->getRecentCommitIndex(0, commitIndex + 10);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                EXPECT_EQ(0U, result.second);
+
+                // follower without a leader
+                consensus->stepDown(consensus->currentTerm + 1);
+                result = consensus->getRecentCommitIndex(0, 0);
+                EXPECT_EQ(ClientResult::NOT_LEADER, result.first);
+
+                // follower with a leader
+                consensus->leaderId = 3;
+                result = consensus->getRecentCommitIndex(0, 0);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                EXPECT_EQ(commitIndex, result.second);
+                // staleness bound, but no leader_commit_index in this term
+                result = consensus->getRecentCommitIndex(1000, 0);
+                EXPECT_EQ(ClientResult::NOT_LEADER, result.first);
+                consensus->leaderCommitIndex = commitIndex + 5;
+                consensus->leaderCommitIndexTime = Clock::now();
+                result = consensus->getRecentCommitIndex(1000, 1);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                EXPECT_EQ(commitIndex + 4, result.second);
+                // too stale
+                Clock::mockValue += std::chrono::nanoseconds(1000);
+                result = consensus->getRecentCommitIndex(1000, 1);
+                EXPECT_EQ(ClientResult::NOT_LEADER, result.first);
+                result = consensus->getRecentCommitIndex(0, 1);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                EXPECT_EQ(commitIndex - 1, result.second);
+            }
+
             TEST_F(ServerRaftConsensusTest, getNextEntry)
             {
                 init();
@@ -891,10 +940,12 @@ namespace LogCabin
                 request.set_prev_log_term(5);
                 request.set_prev_log_index(1);
                 request.set_commit_index(1);
+                request.set_leader_commit_index(3);
                 consensus->stepDown(8);
                 consensus->append({&entry5});
                 consensus->startNewElection();
                 EXPECT_EQ(State::CANDIDATE, consensus->state);
+                EXPECT_EQ(TimePoint::min(), consensus->leaderCommitIndexTime);
                 EXPECT_EQ(9U, consensus->currentTerm);
                 EXPECT_EQ(0U, consensus->commitIndex);
                 Clock::mockValue += milliseconds(10000);
@@ -908,6 +959,8 @@ namespace LogCabin
                 EXPECT_GT(Clock::mockValue + consensus->ELECTION_TIMEOUT * 2,
                           consensus->startElectionAt);
                 EXPECT_EQ(1U, consensus->commitIndex);
+                EXPECT_EQ(3U, consensus->leaderCommitIndex);
+                EXPECT_EQ(Clock::now(), consensus->leaderCommitIndexTime);
                 EXPECT_EQ("term: 10 "
                           "success: true "
                           "last_log_index: 1"
@@ -1099,6 +1152,117 @@ namespace LogCabin
                 EXPECT_EQ("", l1.data());
             }
 
+            TEST_F(ServerRaftConsensusTest, handleAppendEntries_asyncFollowerSync)
+            {
+                init();
+                consensus->ASYNC_FOLLOWER_SYNC = true;
+                consensus->stepDown(10);
+                Protocol::Raft::AppendEntries::Request request;
+                Protocol::Raft::AppendEntries::Response response;
+                request.set_server_id(3);
+                request.set_term(10);
+                request.set_prev_log_term(0);
+                request.set_prev_log_index(0);
+                request.set_commit_index(0);
+                Protocol::Raft::Entry *e1 = request.add_entries();
+                e1->set_term(1);
+                e1->set_type(Protocol::Raft::EntryType::CONFIGURATION);
+                *e1->mutable_configuration() = desc(d);
+                e1->set_cluster_time(20);
+                // stand in for followerDiskThread
+                uint64_t waits = 0;
+                consensus->stateChanged.callback = [this, &waits]()
+                {
+                    ++waits;
+                    EXPECT_TRUE(consensus->logSyncQueued);
+                    EXPECT_EQ(0U, consensus->followerSyncedIndex);
+                    consensus->syncFollowerLog();
+                };
+                consensus->handleAppendEntries(request, response);
+                EXPECT_EQ("term: 10 "
+                          "success: true "
+                          "last_log_index: 1"
+                          "server_capabilities: {}",
+                          response);
+                EXPECT_EQ(1U, waits);
+                EXPECT_FALSE(consensus->logSyncQueued);
+                EXPECT_EQ(1U, consensus->followerSyncedIndex);
+
+                // duplicate: already on disk, so no need to wait
+                consensus->handleAppendEntries(request, response);
+                EXPECT_TRUE(response.success());
+                EXPECT_EQ(1U, waits);
+            }
+
+            TEST_F(ServerRaftConsensusTest,
+                   handleAppendEntries_asyncFollowerSyncTermChanged)
+            {
+                init();
+                consensus->ASYNC_FOLLOWER_SYNC = true;
+                consensus->stepDown(10);
+                Protocol::Raft::AppendEntries::Request request;
+                Protocol::Raft::AppendEntries::Response response;
+                request.set_server_id(3);
+                request.set_term(10);
+                request.set_prev_log_term(0);
+                request.set_prev_log_index(0);
+                request.set_commit_index(0);
+                Protocol::Raft::Entry *e1 = request.add_entries();
+                e1->set_term(1);
+                e1->set_type(Protocol::Raft::EntryType::CONFIGURATION);
+                *e1->mutable_configuration() = desc(d);
+                e1->set_cluster_time(20);
+                consensus->stateChanged.callback = std::bind(&RaftConsensus::stepDown,
+                                                             consensus.get(), 11);
+                consensus->handleAppendEntries(request, response);
+                EXPECT_EQ("term: 11 "
+                          "success: false "
+                          "last_log_index: 1"
+                          "server_capabilities: {}",
+                          response);
+            }
+
+            TEST_F(ServerRaftConsensusTest, handleAppendEntries_asyncFollowerSyncTruncate)
+            {
+                // Log:
+                // 1,t1: cfg { server 1:5254 }
+                // 2,t1: "hello" (queued for followerDiskThread)
+                init();
+                consensus->ASYNC_FOLLOWER_SYNC = true;
+                consensus->stepDown(1);
+                consensus->append({&entry1});
+                entry2.set_term(1);
+                consensus->append({&entry2});
+                EXPECT_TRUE(consensus->logSyncQueued);
+                consensus->followerSyncedIndex = 1;
+
+                Protocol::Raft::AppendEntries::Request request;
+                Protocol::Raft::AppendEntries::Response response;
+                request.set_server_id(3);
+                request.set_term(2);
+                request.set_prev_log_term(1);
+                request.set_prev_log_index(1);
+                request.set_commit_index(0);
+                Protocol::Raft::Entry *e2 = request.add_entries();
+                e2->set_term(2);
+                e2->set_type(Protocol::Raft::EntryType::DATA);
+                e2->set_data("bye");
+                e2->set_cluster_time(20);
+                consensus->stateChanged.callback = [this]()
+                {
+                    // the old entry 2 was flushed before it was truncated, and
+                    // the new one is queued
+                    EXPECT_EQ(1U, consensus->followerSyncedIndex);
+                    EXPECT_TRUE(consensus->logSyncQueued);
+                    consensus->syncFollowerLog();
+                };
+                consensus->handleAppendEntries(request, response);
+                EXPECT_TRUE(response.success());
+                EXPECT_EQ(2U, consensus->followerSyncedIndex);
+                EXPECT_EQ("bye", consensus->log->getEntry(2).data());
+                EXPECT_FALSE(consensus->logSyncQueued);
+            }
+
             // entry is part of existing snapshot
             TEST_F(ServerRaftConsensusTest, handleAppendEntries_appendSnapshotOk)
             {
@@ -1298,6 +1462,137 @@ namespace LogCabin
                 EXPECT_EQ(11U, consensus->currentTerm);
             }
 
+            TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_outOfOrder)
+            {
+                init();
+                consensus->stepDown(10);
+                consensus->append({&entry1});
+                consensus->commitIndex = 1;
+                std::unique_ptr<Storage::SnapshotFile::Writer> writer =
+                    consensus->beginSnapshot(1);
+                writer->save();
+                std::string snapshotContents =
+                    readEntireFileAsString(consensus->storageLayout.snapshotDir,
+                                           "snapshot");
+                std::string chunk1 = snapshotContents.substr(0, 10);
+                std::string chunk2 = snapshotContents.substr(10);
+
+                Protocol::Raft::InstallSnapshot::Request request;
+                Protocol::Raft::InstallSnapshot::Response response;
+                request.set_server_id(3);
+                request.set_term(10);
+                request.set_last_snapshot_index(1);
+                request.set_version(3);
+                request.set_snapshot_bytes(snapshotContents.size());
+
+                // second chunk first: stored, but not counted yet
+                request.set_byte_offset(10);
+                request.set_data(chunk2);
+                request.set_data_crc32c(
+                    Core::Checksum::crc32c(chunk2.data(), chunk2.size()));
+                request.set_done(true);
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ("term: 10 "
+                          "bytes_stored: 0 "
+                          "version: 3",
+                          response);
+                EXPECT_EQ(0U, consensus->lastSnapshotIndex);
+
+                // first chunk, corrupted: expect warning
+                request.set_byte_offset(0);
+                request.set_data(chunk1);
+                request.set_data_crc32c(
+                    Core::Checksum::crc32c(chunk2.data(), chunk2.size()));
+                request.set_done(false);
+                LogCabin::Core::Debug::setLogPolicy({{"Server/RaftConsensus.cc", "ERROR"}});
+                consensus->handleInstallSnapshot(request, response);
+                LogCabin::Core::Debug::setLogPolicy({{"Server/RaftConsensus.cc", "WARNING"}});
+                EXPECT_EQ("term: 10 "
+                          "bytes_stored: 0 "
+                          "version: 3",
+                          response);
+                EXPECT_EQ(0U, consensus->lastSnapshotIndex);
+
+                // first chunk: done now
+                request.set_data_crc32c(
+                    Core::Checksum::crc32c(chunk1.data(), chunk1.size()));
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(snapshotContents.size(), response.bytes_stored());
+                EXPECT_EQ(1U, consensus->lastSnapshotIndex);
+                EXPECT_FALSE(bool(consensus->snapshotWriter));
+                EXPECT_EQ(snapshotContents,
+                          readEntireFileAsString(
+                              consensus->storageLayout.snapshotDir,
+                              "snapshot"));
+            }
+
+            TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_resume)
+            {
+                init();
+                consensus->stepDown(10);
+                Protocol::Raft::InstallSnapshot::Request request;
+                Protocol::Raft::InstallSnapshot::Response response;
+                request.set_server_id(3);
+                request.set_term(10);
+                request.set_last_snapshot_index(1);
+                request.set_byte_offset(0);
+                request.set_data("hello");
+                request.set_done(false);
+                request.set_version(3);
+                request.set_snapshot_bytes(13);
+                request.set_snapshot_crc32c(1);
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(5U, response.bytes_stored());
+
+                // a new leader sending the same file picks up where the last
+                // one left off
+                consensus->stepDown(11);
+                EXPECT_TRUE(bool(consensus->snapshotWriter));
+                request.set_server_id(2);
+                request.set_term(11);
+                request.set_data("hel");
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(5U, response.bytes_stored());
+
+                // even after a keepalive while it prepares a full snapshot
+                Protocol::Raft::InstallSnapshot::Request keepalive(request);
+                keepalive.set_data("");
+                keepalive.set_snapshot_bytes(0);
+                keepalive.clear_snapshot_crc32c();
+                consensus->handleInstallSnapshot(keepalive, response);
+                EXPECT_EQ(3U, response.version());
+                EXPECT_EQ(13U, consensus->snapshotTransferBytes);
+                EXPECT_EQ(5U, consensus->snapshotWriter->getBytesWritten());
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(5U, response.bytes_stored());
+
+                // but not if it's sending a different file of the same size
+                request.set_snapshot_crc32c(2);
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(3U, response.bytes_stored());
+                EXPECT_EQ(2U, consensus->snapshotTransferCrc32c);
+
+                // or of a different size
+                request.set_snapshot_bytes(14);
+                request.set_data("he");
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(2U, response.bytes_stored());
+                request.set_data("hel");
+                request.set_snapshot_bytes(13);
+                request.set_snapshot_crc32c(1);
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(3U, response.bytes_stored());
+
+                // leaders before version 3 never resume a partial snapshot
+                // from another leader
+                request.clear_snapshot_bytes();
+                request.set_version(2);
+                consensus->handleInstallSnapshot(request, response);
+                EXPECT_EQ(3U, response.bytes_stored());
+                EXPECT_EQ(0U, consensus->snapshotTransferBytes);
+                consensus->snapshotWriter->discard();
+            }
+
             TEST_F(ServerRaftConsensusTest, handleRequestVote)
             {
                 init();
@@ -1704,6 +1999,47 @@ namespace LogCabin
                 EXPECT_EQ(1U, consensus->configuration->id);
             }
 
+            TEST_F(ServerRaftConsensusTest, snapshotDone_delta)
+            {
+                init();
+                consensus->currentTerm = 1;
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                consensus->append({&entry2});
+                drainDiskQueue(*consensus);
+                EXPECT_EQ(3U, consensus->commitIndex);
+                std::vector<std::string> files;
+
+                consensus->snapshotDone(2, consensus->beginSnapshot(2));
+                EXPECT_EQ(0U, consensus->lastSnapshotDeltaBaseIndex);
+
+                // not a delta against the latest snapshot
+                uint64_t deltaBaseIndex = 1;
+                consensus->beginSnapshot(3, &deltaBaseIndex)->discard();
+                EXPECT_EQ(0U, deltaBaseIndex);
+
+                deltaBaseIndex = 2;
+                std::unique_ptr<Storage::SnapshotFile::Writer> writer =
+                    consensus->beginSnapshot(3, &deltaBaseIndex);
+                EXPECT_EQ(2U, deltaBaseIndex);
+                consensus->snapshotDone(3, std::move(writer), deltaBaseIndex);
+                EXPECT_EQ(3U, consensus->lastSnapshotIndex);
+                EXPECT_EQ(2U, consensus->lastSnapshotDeltaBaseIndex);
+                files = Storage::FilesystemUtil::ls(
+                    consensus->storageLayout.snapshotDir);
+                EXPECT_EQ((std::vector<std::string>{"snapshot", "snapshot.2"}),
+                          Core::STLUtil::sorted(files));
+                EXPECT_LT(0U,
+                          consensus->readSnapshotDeltaBase(2)->getBytesRead());
+
+                // a full snapshot replaces the delta and its base
+                consensus->snapshotDone(3, consensus->beginSnapshot(3));
+                EXPECT_EQ(0U, consensus->lastSnapshotDeltaBaseIndex);
+                files = Storage::FilesystemUtil::ls(
+                    consensus->storageLayout.snapshotDir);
+                EXPECT_EQ((std::vector<std::string>{"snapshot"}), files);
+            }
+
             class StateMachineUpdaterThreadMainHelper
             {
                 StateMachineUpdaterThreadMainHelper(
@@ -1910,6 +2246,81 @@ namespace LogCabin
                 EXPECT_EQ(5U, helper.iter);
             }
 
+            TEST_F(ServerRaftConsensusTest, followerDiskThreadMain)
+            {
+                // Log:
+                // 1,t1: cfg { server 1:5254 }
+                init();
+                consensus->ASYNC_FOLLOWER_SYNC = true;
+                consensus->stepDown(5);
+                consensus->append({&entry1});
+                EXPECT_TRUE(consensus->logSyncQueued);
+                EXPECT_EQ(0U, consensus->followerSyncedIndex);
+                uint64_t iter = 0;
+                consensus->stateChanged.callback = [this, &iter]()
+                {
+                    ++iter;
+                    EXPECT_FALSE(consensus->followerDiskThreadWorking);
+                    EXPECT_FALSE(consensus->logSyncQueued);
+                    EXPECT_EQ(1U, consensus->followerSyncedIndex);
+                    consensus->exit();
+                };
+                consensus->followerDiskThreadMain();
+                EXPECT_EQ(1U, iter);
+            }
+
+            class TruncateSync : public Log::Sync
+            {
+            public:
+                explicit TruncateSync(RaftConsensus &consensus)
+                    : Log::Sync(2), consensus(consensus)
+                {
+                }
+                void wait()
+                {
+                    // handleAppendEntries() truncates entry 2 after this has
+                    // cleared followerDiskThreadWorking but before it gets the
+                    // lock back
+                    consensus.followerDiskThreadWorking = false;
+                    consensus.syncFollowerLog();
+                    consensus.log->truncateSuffix(1);
+                    consensus.followerSyncedIndex =
+                        std::min(consensus.followerSyncedIndex, uint64_t(1));
+                    consensus.stateChanged.notify_all();
+                }
+                RaftConsensus &consensus;
+            };
+
+            TEST_F(ServerRaftConsensusTest, followerDiskThreadMain_staleSync)
+            {
+                // Log:
+                // 1,t1: cfg { server 1:5254 }
+                // 2,t1: "hello" (being flushed, then truncated)
+                init();
+                consensus->ASYNC_FOLLOWER_SYNC = true;
+                consensus->stepDown(5);
+                consensus->append({&entry1});
+                consensus->syncFollowerLog();
+                EXPECT_EQ(1U, consensus->followerSyncedIndex);
+                entry2.set_term(1);
+                consensus->append({&entry2});
+                Storage::MemoryLog *log =
+                    dynamic_cast<Storage::MemoryLog *>(consensus->log.get());
+                log->currentSync->completed = true;
+                log->currentSync.reset(new TruncateSync(*consensus));
+                EXPECT_TRUE(consensus->logSyncQueued);
+                uint64_t iter = 0;
+                consensus->stateChanged.callback = [this, &iter]()
+                {
+                    ++iter;
+                    EXPECT_EQ(1U, consensus->log->getLastLogIndex());
+                    EXPECT_EQ(1U, consensus->followerSyncedIndex);
+                    consensus->exit();
+                };
+                consensus->followerDiskThreadMain();
+                EXPECT_EQ(1U, iter);
+            }
+
             class CandidacyThreadMainHelper
             {
                 explicit CandidacyThreadMainHelper(RaftConsensus &consensus)
@@ -1957,7 +2368,7 @@ namespace LogCabin
                 }
                 void operator()()
                 {
-                    TimePoint waitUntil(consensus.stateChanged.lastWaitUntil);
+                    TimePoint waitUntil(peer.workAvailable.lastWaitUntil);
 
                     if (iter == 1)
                     {
@@ -2048,8 +2459,8 @@ namespace LogCabin
                     "}");
                 consensus->append({&entry5});
                 std::shared_ptr<Peer> peer = getPeerRef(2);
-                consensus->stateChanged.callback = FollowerThreadMainHelper(*consensus,
-                                                                            *peer);
+                peer->workAvailable.callback = FollowerThreadMainHelper(*consensus,
+                                                                        *peer);
                 ++consensus->numPeerThreads;
 
                 // first requestVote RPC succeeds
@@ -2285,6 +2696,34 @@ namespace LogCabin
                 EXPECT_TRUE(consensus->logSyncQueued);
             }
 
+            TEST_F(ServerRaftConsensusTest, append_notifiesPeers)
+            {
+                init();
+                consensus->stepDown(5);
+                consensus->append({&entry1});
+                consensus->append({&entry5});
+                Peer &peer = *getPeer(2);
+
+                // followers have nothing for their peers to send
+                peer.workAvailable.notificationCount = 0;
+                entry2.set_term(5);
+                consensus->append({&entry2});
+                EXPECT_EQ(0U, peer.workAvailable.notificationCount);
+
+                consensus->startNewElection();
+                consensus->becomeLeader();
+                peer.workAvailable.notificationCount = 0;
+                consensus->stateChanged.notificationCount = 0;
+                entry2.set_term(6);
+                consensus->append({&entry2});
+                EXPECT_EQ(1U, peer.workAvailable.notificationCount);
+                EXPECT_EQ(1U, consensus->stateChanged.notificationCount);
+
+                // unrelated state changes don't wake up the peer threads
+                consensus->advanceCommitIndex();
+                EXPECT_EQ(1U, peer.workAvailable.notificationCount);
+            }
+
             // used in AppendEntries tests
             class ServerRaftConsensusPATest : public ServerRaftConsensusPTest
             {
@@ -2321,6 +2760,7 @@ namespace LogCabin
                     request.set_prev_log_term(0);
                     request.set_prev_log_index(0);
                     request.set_commit_index(3);
+                    request.set_leader_commit_index(3);
                     Protocol::Raft::Entry *e1 = request.add_entries();
                     e1->set_term(1);
                     e1->set_cluster_time(0);
@@ -2412,7 +2852,7 @@ namespace LogCabin
                 consensus->SOFT_RPC_SIZE_LIMIT = (baseSize +
                                                   entrySizes.at(0) +
                                                   entrySizes.at(2) +
-                                                  5);
+                                                  3);
                 *r2.add_entries() = request.entries(0);
                 r2.set_commit_index(1);
                 peer->exiting = true;
@@ -2467,6 +2907,7 @@ namespace LogCabin
                 std::unique_lock<Mutex> lockGuard(consensus->mutex);
                 consensus->appendEntries(lockGuard, *peer);
                 EXPECT_EQ(consensus->currentEpoch, peer->lastAckEpoch);
+                EXPECT_EQ(Clock::mockValue, peer->lastAckTime);
                 EXPECT_EQ(4U, peer->matchIndex);
                 EXPECT_EQ(Clock::mockValue + consensus->HEARTBEAT_PERIOD,
                           peer->nextHeartbeatTime);
@@ -2535,6 +2976,101 @@ namespace LogCabin
                 // but it's not easily testable
             }
 
+            TEST_F(ServerRaftConsensusPATest, pipelineAppendEntries_ok)
+            {
+                consensus->MAX_APPEND_ENTRIES_IN_FLIGHT = 2;
+                consensus->MAX_LOG_ENTRIES_PER_REQUEST = 2;
+                peer->nextIndex = 2;
+                peer->matchIndex = 1;
+
+                Protocol::Raft::AppendEntries::Request r1;
+                r1.CopyFrom(request);
+                r1.set_prev_log_index(1);
+                r1.set_prev_log_term(1);
+                r1.mutable_entries()->DeleteSubrange(0, 1);
+                r1.mutable_entries()->RemoveLast();
+                peerService->reply(Protocol::Raft::OpCode::APPEND_ENTRIES,
+                                   r1, response);
+                Protocol::Raft::AppendEntries::Request r2;
+                r2.CopyFrom(request);
+                r2.set_prev_log_index(3);
+                r2.set_prev_log_term(6);
+                r2.mutable_entries()->DeleteSubrange(0, 3);
+                peerService->reply(Protocol::Raft::OpCode::APPEND_ENTRIES,
+                                   r2, response);
+
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                EXPECT_TRUE(consensus->canPipelineAppendEntries(*peer));
+                consensus->pipelineAppendEntries(lockGuard, *peer);
+                EXPECT_EQ(4U, peer->nextIndex);
+                EXPECT_TRUE(consensus->canPipelineAppendEntries(*peer));
+                consensus->pipelineAppendEntries(lockGuard, *peer);
+                EXPECT_EQ(5U, peer->nextIndex);
+                EXPECT_EQ(2U, peer->appendEntriesInFlight.size());
+                // window is full and there's nothing more to send anyway
+                EXPECT_FALSE(consensus->canPipelineAppendEntries(*peer));
+
+                consensus->receiveAppendEntries(lockGuard, *peer);
+                EXPECT_EQ(3U, peer->matchIndex);
+                EXPECT_EQ(5U, peer->nextIndex);
+                consensus->receiveAppendEntries(lockGuard, *peer);
+                EXPECT_EQ(4U, peer->matchIndex);
+                EXPECT_EQ(5U, peer->nextIndex);
+                EXPECT_TRUE(peer->appendEntriesInFlight.empty());
+                EXPECT_EQ(consensus->currentEpoch, peer->lastAckEpoch);
+            }
+
+            TEST_F(ServerRaftConsensusPATest, pipelineAppendEntries_mismatch)
+            {
+                consensus->MAX_APPEND_ENTRIES_IN_FLIGHT = 2;
+                consensus->MAX_LOG_ENTRIES_PER_REQUEST = 2;
+                peer->nextIndex = 2;
+                peer->matchIndex = 1;
+
+                Protocol::Raft::AppendEntries::Request r1;
+                r1.CopyFrom(request);
+                r1.set_prev_log_index(1);
+                r1.set_prev_log_term(1);
+                r1.mutable_entries()->DeleteSubrange(0, 1);
+                r1.mutable_entries()->RemoveLast();
+                response.set_success(false);
+                peerService->reply(Protocol::Raft::OpCode::APPEND_ENTRIES,
+                                   r1, response);
+                Protocol::Raft::AppendEntries::Request r2;
+                r2.CopyFrom(request);
+                r2.set_prev_log_index(3);
+                r2.set_prev_log_term(6);
+                r2.mutable_entries()->DeleteSubrange(0, 3);
+                peerService->reply(Protocol::Raft::OpCode::APPEND_ENTRIES,
+                                   r2, response);
+
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                consensus->pipelineAppendEntries(lockGuard, *peer);
+                consensus->pipelineAppendEntries(lockGuard, *peer);
+                EXPECT_EQ(5U, peer->nextIndex);
+
+                // The rejection rolls nextIndex back past the first request and
+                // discards the rest of the window.
+                consensus->receiveAppendEntries(lockGuard, *peer);
+                EXPECT_EQ(1U, peer->matchIndex);
+                EXPECT_EQ(1U, peer->nextIndex);
+                EXPECT_TRUE(peer->appendEntriesInFlight.empty());
+                EXPECT_FALSE(consensus->canPipelineAppendEntries(*peer));
+            }
+
+            TEST_F(ServerRaftConsensusPATest, pipelineAppendEntries_disabled)
+            {
+                peer->nextIndex = 2;
+                peer->matchIndex = 1;
+                EXPECT_EQ(1U, consensus->MAX_APPEND_ENTRIES_IN_FLIGHT);
+                EXPECT_FALSE(consensus->canPipelineAppendEntries(*peer));
+                consensus->MAX_APPEND_ENTRIES_IN_FLIGHT = 2;
+                EXPECT_TRUE(consensus->canPipelineAppendEntries(*peer));
+                // only pipeline once the follower's log is known to match
+                peer->matchIndex = 0;
+                EXPECT_FALSE(consensus->canPipelineAppendEntries(*peer));
+            }
+
             // used in InstallSnapshot tests
             class ServerRaftConsensusPSTest : public ServerRaftConsensusPTest
             {
@@ -2563,13 +3099,24 @@ namespace LogCabin
                     request.set_term(5);
                     request.set_last_snapshot_index(2);
                     request.set_byte_offset(0);
-                    request.set_data("hello, world!");
+                    setData("hello, world!");
                     request.set_done(true);
-                    request.set_version(2);
+                    request.set_version(3);
+                    request.set_snapshot_bytes(13);
+                    request.set_snapshot_crc32c(
+                        Core::Checksum::crc32c("hello, world!", 13));
 
                     response.set_term(5);
                 }
 
+                // Sets the request's data along with its checksum.
+                void setData(const std::string &data)
+                {
+                    request.set_data(data);
+                    request.set_data_crc32c(
+                        Core::Checksum::crc32c(data.data(), data.size()));
+                }
+
                 std::shared_ptr<Peer> peer;
                 Protocol::Raft::InstallSnapshot::Request request;
                 Protocol::Raft::InstallSnapshot::Response response;
@@ -2618,12 +3165,12 @@ namespace LogCabin
             {
                 peer->suppressBulkData = false;
                 consensus->SOFT_RPC_SIZE_LIMIT = 7;
-                request.set_data("hello, ");
+                setData("hello, ");
                 request.set_done(false);
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                                    request, response);
                 request.set_byte_offset(7);
-                request.set_data("world!");
+                setData("world!");
                 request.set_done(true);
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                                    request, response);
@@ -2646,11 +3193,11 @@ namespace LogCabin
             {
                 peer->suppressBulkData = true;
                 consensus->SOFT_RPC_SIZE_LIMIT = 7;
-                request.set_data("");
+                setData("");
                 request.set_done(false);
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                                    request, response);
-                request.set_data("hello, ");
+                setData("hello, ");
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                                    request, response);
                 std::unique_lock<Mutex> lockGuard(consensus->mutex);
@@ -2660,27 +3207,49 @@ namespace LogCabin
                 EXPECT_FALSE(peer->suppressBulkData);
             }
 
+            TEST_F(ServerRaftConsensusPSTest, installSnapshot_waitForFullSnapshot)
+            {
+                consensus->lastSnapshotDeltaBaseIndex = 1;
+                Protocol::Raft::InstallSnapshot::Request keepalive;
+                keepalive.set_server_id(1);
+                keepalive.set_term(5);
+                keepalive.set_version(3);
+                keepalive.set_last_snapshot_index(2);
+                keepalive.set_byte_offset(0);
+                keepalive.set_data("");
+                keepalive.set_done(false);
+                keepalive.set_snapshot_bytes(0);
+                peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                                   keepalive, response);
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                consensus->installSnapshot(lockGuard, *peer);
+                EXPECT_TRUE(consensus->fullSnapshotNeeded);
+                EXPECT_FALSE(peer->snapshotFile);
+                EXPECT_EQ(Clock::mockValue + consensus->HEARTBEAT_PERIOD,
+                          peer->backoffUntil);
+            }
+
             TEST_F(ServerRaftConsensusPSTest, installSnapshot_notAllBytesStored)
             {
                 peer->suppressBulkData = false;
                 consensus->SOFT_RPC_SIZE_LIMIT = 7;
-                request.set_data("hello, ");
+                setData("hello, ");
                 request.set_done(false);
                 response.set_bytes_stored(4);
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                                    request, response);
                 request.set_byte_offset(4);
-                request.set_data("o, worl");
+                setData("o, worl");
                 response.set_bytes_stored(0);
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                                    request, response);
                 request.set_byte_offset(0);
-                request.set_data("hello, ");
+                setData("hello, ");
                 response.set_bytes_stored(7);
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
                                    request, response);
                 request.set_byte_offset(7);
-                request.set_data("world!");
+                setData("world!");
                 request.set_done(true);
                 response.set_bytes_stored(13);
                 peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
@@ -2694,6 +3263,100 @@ namespace LogCabin
                 EXPECT_EQ(2U, peer->matchIndex);
             }
 
+            TEST_F(ServerRaftConsensusPSTest, installSnapshot_pipelined)
+            {
+                peer->suppressBulkData = false;
+                consensus->SOFT_RPC_SIZE_LIMIT = 5;
+                // The first chunk is sent alone, to learn whether the follower
+                // can store chunks out of order.
+                request.set_done(false);
+                setData("hello");
+                response.set_bytes_stored(5);
+                response.set_version(3);
+                peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                                   request, response);
+                request.set_byte_offset(5);
+                setData(", wor");
+                peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                                   request, response);
+                // this reply covers both chunks in flight
+                request.set_byte_offset(10);
+                setData("ld!");
+                request.set_done(true);
+                response.set_bytes_stored(13);
+                peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                                   request, response);
+
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                consensus->installSnapshot(lockGuard, *peer);
+                EXPECT_EQ(5U, peer->snapshotFileOffset);
+                EXPECT_EQ(3U, peer->installSnapshotVersion);
+                EXPECT_EQ(4U, consensus->MAX_INSTALL_SNAPSHOT_IN_FLIGHT);
+                consensus->MAX_INSTALL_SNAPSHOT_IN_FLIGHT = 1;
+                EXPECT_FALSE(consensus->canPipelineInstallSnapshot(*peer));
+                consensus->MAX_INSTALL_SNAPSHOT_IN_FLIGHT = 2;
+                EXPECT_TRUE(consensus->canPipelineInstallSnapshot(*peer));
+                consensus->pipelineInstallSnapshot(lockGuard, *peer);
+                EXPECT_EQ(10U, peer->snapshotFileOffset);
+                consensus->pipelineInstallSnapshot(lockGuard, *peer);
+                EXPECT_EQ(13U, peer->snapshotFileOffset);
+                EXPECT_EQ(2U, peer->installSnapshotInFlight.size());
+                // window is full and there's nothing more to send anyway
+                EXPECT_FALSE(consensus->canPipelineInstallSnapshot(*peer));
+
+                consensus->receiveInstallSnapshot(lockGuard, *peer);
+                EXPECT_EQ(5U, peer->snapshotBytesAcked);
+                EXPECT_TRUE(bool(peer->snapshotFile));
+                consensus->receiveInstallSnapshot(lockGuard, *peer);
+                EXPECT_EQ(2U, peer->matchIndex);
+                EXPECT_EQ(3U, peer->nextIndex);
+                EXPECT_FALSE(peer->snapshotFile);
+                EXPECT_EQ(0U, peer->snapshotFileOffset);
+                EXPECT_TRUE(peer->installSnapshotInFlight.empty());
+                EXPECT_EQ(consensus->currentEpoch, peer->lastAckEpoch);
+            }
+
+            TEST_F(ServerRaftConsensusPSTest, installSnapshot_pipelinedResend)
+            {
+                peer->suppressBulkData = false;
+                consensus->SOFT_RPC_SIZE_LIMIT = 5;
+                consensus->MAX_INSTALL_SNAPSHOT_IN_FLIGHT = 2;
+                peer->snapshotFile.reset(new Storage::FilesystemUtil::FileContents(
+                    Storage::FilesystemUtil::openFile(
+                        consensus->storageLayout.snapshotDir, "snapshot",
+                        O_RDONLY)));
+                peer->lastSnapshotIndex = 2;
+                peer->snapshotFileCrc32c = request.snapshot_crc32c();
+                peer->snapshotFileOffset = 5;
+                peer->installSnapshotVersion = 3;
+                // The follower drops the first chunk, so neither reply gets
+                // past it.
+                request.set_done(false);
+                request.set_byte_offset(5);
+                setData(", wor");
+                response.set_bytes_stored(5);
+                response.set_version(3);
+                peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                                   request, response);
+                request.set_byte_offset(10);
+                setData("ld!");
+                request.set_done(true);
+                peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                                   request, response);
+
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                consensus->pipelineInstallSnapshot(lockGuard, *peer);
+                consensus->pipelineInstallSnapshot(lockGuard, *peer);
+                consensus->receiveInstallSnapshot(lockGuard, *peer);
+                EXPECT_EQ(13U, peer->snapshotFileOffset);
+                consensus->receiveInstallSnapshot(lockGuard, *peer);
+                // resend starting with the missing chunk
+                EXPECT_EQ(5U, peer->snapshotFileOffset);
+                EXPECT_EQ(0U, peer->snapshotBytesAcked);
+                EXPECT_TRUE(bool(peer->snapshotFile));
+                EXPECT_TRUE(consensus->canPipelineInstallSnapshot(*peer));
+            }
+
             TEST_F(ServerRaftConsensusTest, becomeLeader)
             {
                 init();
@@ -2773,10 +3436,26 @@ namespace LogCabin
                 consensus->append({&entry1});
                 consensus->append({&entry5});
                 consensus->stateChanged.notificationCount = 0;
-                consensus->interruptAll();
                 Peer &peer = *getPeer(2);
+                peer.workAvailable.notificationCount = 0;
+                consensus->interruptAll();
                 EXPECT_EQ("RPC canceled by user", peer.rpc.getErrorMessage());
                 EXPECT_EQ(1U, consensus->stateChanged.notificationCount);
+                EXPECT_EQ(1U, peer.workAvailable.notificationCount);
+            }
+
+            TEST_F(ServerRaftConsensusTest, lockHoldNanos)
+            {
+                init();
+                uint64_t count = consensus->lockHoldNanos.getCount();
+                {
+                    std::lock_guard<Mutex> lockGuard(consensus->mutex);
+                }
+                EXPECT_EQ(count + 1, consensus->lockHoldNanos.getCount());
+                Protocol::ServerStats stats;
+                consensus->updateServerStats(stats);
+                EXPECT_EQ(count + 1,
+                          stats.raft().lock_hold_nanos().count());
             }
 
             // packEntries used to be part of appendEntries. The tests
@@ -2790,37 +3469,73 @@ namespace LogCabin
 
                 // limit by log length (of 0)
                 Protocol::Raft::AppendEntries::Request request;
-                EXPECT_EQ(0U, consensus->packEntries(1U, request));
-                request.clear_entries();
+                std::vector<Core::Buffer> entries;
+                EXPECT_EQ(0U, consensus->packEntries(1U, request, entries));
+                EXPECT_EQ(0U, entries.size());
 
                 // limit by log length (of 2)
                 consensus->append({&entry1});
                 consensus->append({&entry2});
-                EXPECT_EQ(2U, consensus->packEntries(1U, request));
-                request.clear_entries();
+                EXPECT_EQ(2U, consensus->packEntries(1U, request, entries));
+                EXPECT_EQ(2U, entries.size());
+                entries.clear();
 
                 // limit by number of log entries
                 for (uint64_t i = 0; i < 128; ++i)
                     consensus->append({&entry2});
                 consensus->SOFT_RPC_SIZE_LIMIT = 1024 * 1024;
                 consensus->MAX_LOG_ENTRIES_PER_REQUEST = 32;
-                EXPECT_EQ(32U, consensus->packEntries(3U, request));
-                request.clear_entries();
+                EXPECT_EQ(32U, consensus->packEntries(3U, request, entries));
+                entries.clear();
                 consensus->MAX_LOG_ENTRIES_PER_REQUEST = 5000;
 
                 // limit by number of bytes
                 consensus->SOFT_RPC_SIZE_LIMIT = 1024;
-                uint64_t n = consensus->packEntries(3U, request);
+                uint64_t n = consensus->packEntries(3U, request, entries);
                 EXPECT_GT(5000U, n);
                 EXPECT_LT(0U, n);
-                EXPECT_GE(1024U, request.ByteSizeLong());
-                *request.add_entries() = consensus->log->getEntry(3);
-                EXPECT_LE(1024U, request.ByteSizeLong());
-                request.clear_entries();
+                EXPECT_GT(1024U,
+                          consensus->serializeAppendEntries(request, entries).getLength() -
+                              RPC::ClientRPC::REQUEST_HEADER_LENGTH);
+                entries.push_back(consensus->log->getEntryBytes(3 + n));
+                EXPECT_LE(1024U,
+                          consensus->serializeAppendEntries(request, entries).getLength() -
+                              RPC::ClientRPC::REQUEST_HEADER_LENGTH);
+                entries.clear();
 
                 // one entry is allowed even if it's too big
                 consensus->SOFT_RPC_SIZE_LIMIT = 1;
-                EXPECT_EQ(1U, consensus->packEntries(3U, request));
+                EXPECT_EQ(1U, consensus->packEntries(3U, request, entries));
+            }
+
+            TEST_F(ServerRaftConsensusTest, serializeAppendEntries)
+            {
+                init();
+                consensus->stepDown(5);
+                consensus->append({&entry1});
+                consensus->append({&entry2});
+
+                Protocol::Raft::AppendEntries::Request request;
+                request.set_server_id(1);
+                request.set_term(5);
+                request.set_prev_log_term(0);
+                request.set_prev_log_index(0);
+                std::vector<Core::Buffer> entries;
+                EXPECT_EQ(2U, consensus->packEntries(1U, request, entries));
+                request.set_commit_index(2);
+                Core::Buffer buffer =
+                    consensus->serializeAppendEntries(request, entries);
+
+                Protocol::Raft::AppendEntries::Request expected = request;
+                *expected.add_entries() = consensus->log->getEntry(1);
+                *expected.add_entries() = consensus->log->getEntry(2);
+                EXPECT_EQ(RPC::ClientRPC::REQUEST_HEADER_LENGTH +
+                              expected.ByteSizeLong(),
+                          buffer.getLength());
+                Protocol::Raft::AppendEntries::Request actual;
+                EXPECT_TRUE(Core::ProtoBuf::parse(
+                    buffer, actual, RPC::ClientRPC::REQUEST_HEADER_LENGTH));
+                EXPECT_EQ(expected, actual);
             }
 
             TEST_F(ServerRaftConsensusTest, readSnapshot)
@@ -2966,6 +3681,113 @@ namespace LogCabin
                           consensus->replicateEntry(entry2, lockGuard).first);
             }
 
+            TEST_F(ServerRaftConsensusTest, replicateEntryInGroup_notLeader)
+            {
+                init();
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                EXPECT_EQ(ClientResult::NOT_LEADER,
+                          consensus->replicateEntryInGroup(entry2, lockGuard).first);
+                EXPECT_TRUE(consensus->groupCommitQueue.empty());
+            }
+
+            TEST_F(ServerRaftConsensusTest, replicateEntryInGroup_maxEntries)
+            {
+                init();
+                consensus->GROUP_COMMIT_DELAY = std::chrono::seconds(10);
+                consensus->GROUP_COMMIT_MAX_ENTRIES = 1;
+                consensus->stepDown(5);
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                consensus->leaderDiskThread =
+                    std::thread(&RaftConsensus::leaderDiskThreadMain, consensus.get());
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                std::pair<ClientResult, uint64_t> result =
+                    consensus->replicateEntryInGroup(entry2, lockGuard);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                // 1: entry1, 2: no-op, 3: entry2
+                EXPECT_EQ(3U, result.second);
+                EXPECT_EQ(6U, entry2.term());
+                EXPECT_EQ(1U, consensus->groupCommitEntries.getCount());
+                EXPECT_EQ(1U, consensus->groupCommitEntries.getLast());
+                EXPECT_EQ(0U, consensus->groupCommitDelayNanos.getLast());
+                EXPECT_TRUE(consensus->groupCommitQueue.empty());
+            }
+
+            TEST_F(ServerRaftConsensusTest, replicateEntryInGroup_delay)
+            {
+                init();
+                consensus->GROUP_COMMIT_DELAY = std::chrono::milliseconds(1);
+                consensus->stepDown(5);
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                consensus->leaderDiskThread =
+                    std::thread(&RaftConsensus::leaderDiskThreadMain, consensus.get());
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+
+                // another client's entry is already waiting
+                RaftConsensus::GroupCommitRequest other(entry4, 6);
+                consensus->groupCommitQueue.push_back(&other);
+                consensus->groupCommitQueueBytes = entry4.ByteSizeLong();
+                TimePoint flushAt = Clock::now() + std::chrono::milliseconds(1);
+                consensus->groupCommitFlushAt = flushAt;
+
+                consensus->stateChanged.callback = []()
+                {
+                    Clock::mockValue += std::chrono::microseconds(500);
+                };
+                std::pair<ClientResult, uint64_t> result =
+                    consensus->replicateEntryInGroup(entry2, lockGuard);
+                EXPECT_EQ(ClientResult::SUCCESS, result.first);
+                // 1: entry1, 2: no-op, 3: entry4, 4: entry2
+                EXPECT_EQ(4U, result.second);
+                EXPECT_TRUE(other.flushed);
+                EXPECT_EQ(3U, other.index);
+                EXPECT_EQ(flushAt, consensus->stateChanged.lastWaitUntil);
+                EXPECT_EQ(1U, consensus->groupCommitEntries.getCount());
+                EXPECT_EQ(2U, consensus->groupCommitEntries.getLast());
+                EXPECT_EQ(1000000U, consensus->groupCommitDelayNanos.getMax());
+                EXPECT_TRUE(consensus->groupCommitQueue.empty());
+                EXPECT_EQ(TimePoint::max(), consensus->groupCommitFlushAt);
+            }
+
+            TEST_F(ServerRaftConsensusTest, replicateEntryInGroup_termChanged)
+            {
+                init();
+                consensus->GROUP_COMMIT_DELAY = std::chrono::seconds(10);
+                consensus->stepDown(4);
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                EXPECT_EQ(State::LEADER, consensus->state);
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                consensus->stateChanged.callback = std::bind(&RaftConsensus::stepDown,
+                                                             consensus.get(), 7);
+                EXPECT_EQ(ClientResult::NOT_LEADER,
+                          consensus->replicateEntryInGroup(entry2, lockGuard).first);
+                EXPECT_TRUE(consensus->groupCommitQueue.empty());
+                EXPECT_EQ(0U, consensus->groupCommitQueueBytes);
+                EXPECT_EQ(2U, consensus->log->getLastLogIndex());
+            }
+
+            TEST_F(ServerRaftConsensusTest, flushGroupCommit_staleTerm)
+            {
+                init();
+                consensus->stepDown(5);
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                EXPECT_EQ(State::LEADER, consensus->state);
+                RaftConsensus::GroupCommitRequest stale(entry4, 5);
+                RaftConsensus::GroupCommitRequest current(entry2, 6);
+                consensus->groupCommitQueue.push_back(&stale);
+                consensus->groupCommitQueue.push_back(&current);
+                consensus->flushGroupCommit();
+                EXPECT_TRUE(stale.flushed);
+                EXPECT_EQ(0U, stale.index);
+                EXPECT_TRUE(current.flushed);
+                EXPECT_EQ(3U, current.index);
+                EXPECT_EQ(3U, consensus->log->getLastLogIndex());
+                EXPECT_EQ(1U, consensus->groupCommitEntries.getLast());
+            }
+
             TEST_F(ServerRaftConsensusPTest, requestVote_rpcFailed)
             {
                 init();
@@ -3324,6 +4146,121 @@ namespace LogCabin
                 EXPECT_EQ(3U, helper.iter);
             }
 
+            TEST_F(ServerRaftConsensusTest, upToDateLeader_lease)
+            {
+                // Log:
+                // 1,t5: config { s1 }
+                // 2,t6: no op
+                // 3,t6: config { s1, s2 }
+                // 4,t7: no op
+                consensus->LEADER_LEASE = std::chrono::milliseconds(1000);
+                init();
+                // don't vote for anyone right after restarting
+                EXPECT_EQ(Clock::now() + consensus->ELECTION_TIMEOUT,
+                          consensus->withholdVotesUntil);
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                EXPECT_FALSE(consensus->haveLeaderLease());
+                consensus->stepDown(5);
+                entry1.set_term(5);
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                drainDiskQueue(*consensus);
+                // leader of just self
+                EXPECT_EQ(State::LEADER, consensus->state);
+                EXPECT_TRUE(consensus->haveLeaderLease());
+                entry5.set_term(6);
+                consensus->append({&entry5});
+                consensus->startNewElection();
+                consensus->becomeLeader();
+                drainDiskQueue(*consensus);
+                Peer *peer = getPeer(2);
+                EXPECT_EQ(TimePoint::min(), peer->lastAckTime);
+                // no quorum has acknowledged a heartbeat
+                EXPECT_FALSE(consensus->haveLeaderLease());
+                // quorum has, but no entry committed in this term yet
+                peer->lastAckTime = Clock::now();
+                EXPECT_FALSE(consensus->haveLeaderLease());
+                peer->matchIndex = 4;
+                consensus->advanceCommitIndex();
+                EXPECT_TRUE(consensus->haveLeaderLease());
+                // no heartbeat round needed
+                uint64_t epoch = consensus->currentEpoch;
+                EXPECT_TRUE(consensus->upToDateLeader(lockGuard));
+                EXPECT_EQ(epoch, consensus->currentEpoch);
+                // lease expired
+                Clock::mockValue += consensus->LEADER_LEASE;
+                EXPECT_FALSE(consensus->haveLeaderLease());
+                // leases disabled
+                peer->lastAckTime = Clock::now();
+                EXPECT_TRUE(consensus->haveLeaderLease());
+                consensus->LEADER_LEASE = std::chrono::nanoseconds::zero();
+                EXPECT_FALSE(consensus->haveLeaderLease());
+            }
+
+            // used in upToDateLeader_shareRound
+            class AckCurrentEpochHelper
+            {
+                explicit AckCurrentEpochHelper(RaftConsensus *consensus)
+                    : consensus(consensus), calls(0)
+                {
+                }
+                void operator()()
+                {
+                    Server *server = consensus->configuration->knownServers.at(2).get();
+                    Peer *peer = dynamic_cast<Peer *>(server);
+                    peer->lastAckEpoch = consensus->currentEpoch;
+                    ++calls;
+                }
+                RaftConsensus *consensus;
+                uint64_t calls;
+            };
+
+            TEST_F(ServerRaftConsensusTest, upToDateLeader_shareRound)
+            {
+                // Log:
+                // 1,t5: config { s1 }
+                // 2,t6: no op
+                // 3,t6: config { s1, s2 }
+                // 4,t7: no op
+                init();
+                std::unique_lock<Mutex> lockGuard(consensus->mutex);
+                consensus->stepDown(5);
+                entry1.set_term(5);
+                consensus->append({&entry1});
+                consensus->startNewElection();
+                drainDiskQueue(*consensus);
+                entry5.set_term(6);
+                consensus->append({&entry5});
+                consensus->startNewElection();
+                consensus->becomeLeader();
+                drainDiskQueue(*consensus);
+                Peer *peer = getPeer(2);
+                peer->matchIndex = 4;
+                consensus->advanceCommitIndex();
+                AckCurrentEpochHelper helper(consensus.get());
+                consensus->stateChanged.callback = std::ref(helper);
+
+                // heartbeats already went out in this epoch: need a new one
+                consensus->lastSentEpoch = consensus->currentEpoch;
+                uint64_t epoch = consensus->currentEpoch;
+                EXPECT_TRUE(consensus->upToDateLeader(lockGuard));
+                EXPECT_EQ(epoch + 1, consensus->currentEpoch);
+                EXPECT_EQ(1U, consensus->numReadIndexRounds);
+
+                // nothing sent in the new epoch yet: share it
+                EXPECT_TRUE(consensus->upToDateLeader(lockGuard));
+                EXPECT_EQ(epoch + 1, consensus->currentEpoch);
+                EXPECT_EQ(1U, consensus->numReadIndexRounds);
+                EXPECT_EQ(2U, consensus->numReadIndexRequests);
+
+                // once a heartbeat goes out, later readers start another round
+                consensus->lastSentEpoch = consensus->currentEpoch;
+                EXPECT_TRUE(consensus->upToDateLeader(lockGuard));
+                EXPECT_EQ(epoch + 2, consensus->currentEpoch);
+                EXPECT_EQ(2U, consensus->numReadIndexRounds);
+                EXPECT_EQ(3U, consensus->numReadIndexRequests);
+            }
+
             // This tests an old bug in which nextIndex was not set properly for servers
             // that were just added to the configuration.
             TEST_F(ServerRaftConsensusTest, regression_nextIndexForNewServer)
@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
+#include <stdexcept>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -22,6 +24,7 @@
 #include "Core/Mutex.h"
 #include "Core/ProtoBuf.h"
 #include "Core/Random.h"
+#include "Core/StringUtil.h"
 #include "Core/ThreadId.h"
 #include "Core/Util.h"
 #include "Server/Globals.h"
@@ -40,6 +43,219 @@ namespace PC = LogCabin::Protocol::Client;
 bool stateMachineSuppressThreads = false;
 uint32_t stateMachineChildSleepMs = 0;
 
+namespace {
+
+/**
+ * Thrown by AbortableOutputStream.
+ */
+struct SnapshotAbortedException : public std::runtime_error {
+    SnapshotAbortedException()
+        : std::runtime_error("Snapshot aborted")
+    {
+    }
+};
+
+/**
+ * Forwards writes to another stream until 'abort' is set, then throws
+ * SnapshotAbortedException. This lets snapshotThread give up partway through
+ * writing a large tree.
+ */
+class AbortableOutputStream : public Core::ProtoBuf::OutputStream {
+  public:
+    AbortableOutputStream(Core::ProtoBuf::OutputStream& stream,
+                          const std::atomic<bool>& abort)
+        : stream(stream)
+        , abort(abort)
+    {
+    }
+    uint64_t getBytesWritten() const {
+        return stream.getBytesWritten();
+    }
+    void writeMessage(const google::protobuf::Message& message) {
+        checkAbort();
+        stream.writeMessage(message);
+    }
+    void writeRaw(const void* data, uint64_t length) {
+        checkAbort();
+        stream.writeRaw(data, length);
+    }
+  private:
+    void checkAbort() const {
+        if (abort)
+            throw SnapshotAbortedException();
+    }
+    Core::ProtoBuf::OutputStream& stream;
+    const std::atomic<bool>& abort;
+};
+
+/**
+ * Write the state machine's part of a snapshot file.
+ * \param stream
+ *      Where to write the snapshot.
+ * \param header
+ *      The state machine's own state.
+ * \param tree
+ *      The tree to write.
+ * \param delta
+ *      If true, write only the parts of the tree that have changed since the
+ *      last snapshot (see Tree::dumpSnapshotDelta()).
+ */
+void
+writeSnapshotContents(Core::ProtoBuf::OutputStream& stream,
+                      const SnapshotStateMachine::Header& header,
+                      const Tree::Tree& tree,
+                      bool delta)
+{
+    // Format version of snapshot contents is 1, or 2 for a delta.
+    uint8_t formatVersion = (delta ? 2 : 1);
+    stream.writeRaw(&formatVersion, sizeof(formatVersion));
+    // StateMachine state comes next
+    stream.writeMessage(header);
+    // Then the Tree itself (this one is potentially large)
+    if (delta)
+        tree.dumpSnapshotDelta(stream);
+    else
+        tree.dumpSnapshot(stream);
+}
+
+/**
+ * Return the number of threads to decode snapshots with, given the
+ * snapshotLoadThreads config option: 0 means one per core.
+ */
+uint64_t
+getSnapshotLoadThreads(uint64_t configured)
+{
+    if (configured > 0)
+        return configured;
+    return std::max(1U, std::thread::hardware_concurrency());
+}
+
+/**
+ * Return a tree path in the canonical form that watches and watch events
+ * store: with a leading slash, without a trailing slash, and without empty
+ * components. The root directory is "/".
+ */
+std::string
+canonicalWatchPath(const std::string& path)
+{
+    std::string canonical;
+    size_t start = 0;
+    for (size_t i = 0; i <= path.size(); ++i) {
+        if (i == path.size() || path[i] == '/') {
+            if (i > start) {
+                canonical += '/';
+                canonical.append(path, start, i - start);
+            }
+            start = i + 1;
+        }
+    }
+    if (canonical.empty())
+        canonical = "/";
+    return canonical;
+}
+
+/**
+ * Return the parent of a canonical path other than "/".
+ */
+std::string
+parentWatchPath(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    if (slash == 0)
+        return "/";
+    return path.substr(0, slash);
+}
+
+/**
+ * Return true if canonical path 'a' is strictly below canonical path 'b'.
+ */
+bool
+isBelow(const std::string& a, const std::string& b)
+{
+    if (b == "/")
+        return a != "/";
+    return (a.size() > b.size() &&
+            a.compare(0, b.size(), b) == 0 &&
+            a[b.size()] == '/');
+}
+
+/**
+ * Return true if a change to 'changed' (and everything below it, if
+ * 'subtree' is set) matches a watch on 'watched'. See StateMachine::watch().
+ */
+bool
+watchMatches(const std::string& watched, bool recursive,
+             const std::string& changed, bool subtree)
+{
+    if (changed == watched)
+        return true;
+    if (isBelow(changed, watched))
+        return recursive || parentWatchPath(changed) == watched;
+    return subtree && isBelow(watched, changed);
+}
+
+/**
+ * Append the paths that a read-write tree operation changes if it succeeds
+ * to 'changes', along with whether everything below each one may have
+ * changed too.
+ */
+template<typename Operation>
+void
+getChangedPaths(const Operation& op,
+                std::vector<std::pair<std::string, bool>>& changes)
+{
+    if (op.has_make_directory()) {
+        std::string path = canonicalWatchPath(op.make_directory().path());
+        changes.emplace_back(path, false);
+        while (path != "/") {
+            path = parentWatchPath(path);
+            changes.emplace_back(path, false);
+        }
+    } else if (op.has_remove_directory()) {
+        changes.emplace_back(
+            canonicalWatchPath(op.remove_directory().path()), true);
+    } else if (op.has_write()) {
+        changes.emplace_back(canonicalWatchPath(op.write().path()), false);
+    } else if (op.has_remove_file()) {
+        changes.emplace_back(
+            canonicalWatchPath(op.remove_file().path()), false);
+    }
+}
+
+/**
+ * Return true if a read-write tree command has a condition on a version,
+ * either on itself or on an operation in its batch.
+ */
+bool
+hasVersionCondition(const PC::ReadWriteTree::Request& request)
+{
+    if (request.condition().has_version())
+        return true;
+    for (auto it = request.batch().operation().begin();
+         it != request.batch().operation().end();
+         ++it) {
+        if (it->condition().has_version())
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Complete a watch query.
+ */
+void
+replyToWatch(RPC::ServerRPC& rpc, uint64_t index, bool changed)
+{
+    PC::StateMachineQuery::Response response;
+    PC::ReadOnlyTree::Response& tree = *response.mutable_tree();
+    tree.set_status(PC::Status::OK);
+    tree.mutable_watch()->set_index(index);
+    tree.mutable_watch()->set_changed(changed);
+    rpc.reply(response);
+}
+
+} // anonymous namespace
+
 StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
                            Core::Config& config,
                            Globals& globals)
@@ -53,6 +269,12 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
             config.read<uint64_t>("snapshotMinLogSize", 64UL * 1024 * 1024))
     , snapshotRatio(
             config.read<uint64_t>("snapshotRatio", 4))
+    , snapshotMaxDeltas(
+            config.read<uint64_t>("snapshotMaxDeltas", 0))
+    , snapshotLoadThreads(getSnapshotLoadThreads(
+            config.read<uint64_t>("snapshotLoadThreads", 0)))
+    , snapshotFork(
+            config.read<bool>("snapshotFork", false))
     , snapshotWatchdogInterval(std::chrono::milliseconds(
             config.read<uint64_t>("snapshotWatchdogMilliseconds", 10000)))
       // TODO(ongaro): This should be configurable, but it must be the same for
@@ -72,12 +294,16 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
     , snapshotCompleted()
     , exiting(false)
     , childPid(0)
+    , writingSnapshot(false)
+    , abortSnapshot(false)
     , lastApplied(0)
     , lastUnknownRequestMessage(TimePoint::min())
     , numUnknownRequests(0)
     , numUnknownRequestsSinceLastMessage(0)
     , numSnapshotsAttempted(0)
     , numSnapshotsFailed(0)
+    , snapshotDeltaBaseIndex(0)
+    , numSnapshotDeltas(0)
     , numRedundantAdvanceVersionEntries(0)
     , numRejectedAdvanceVersionEntries(0)
     , numSuccessfulAdvanceVersionEntries(0)
@@ -85,12 +311,30 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
     , isSnapshotRequested(false)
     , maySnapshotAt(TimePoint::min())
     , sessions()
+    , watchMaxWait(std::chrono::milliseconds(
+            config.read<uint64_t>("watchMaxWaitMilliseconds", 60000)))
+    , watchMaxParked(
+            config.read<uint64_t>("watchMaxParked", 10000))
+    , watchHistoryLength(
+            config.read<uint64_t>("watchHistoryLength", 100000))
+    , watchHistory()
+    , watchHistoryStart(0)
+    , watches()
+    , watchesByPath()
+    , watchesByDeadline()
+    , nextWatchId(1)
+    , numWatchesTriggered(0)
+    , numWatchesRejected(0)
     , tree()
+    , publishedTreeMutex()
+    , publishedTree()
     , versionHistory()
     , writer()
     , applyThread()
     , snapshotThread()
     , snapshotWatchdogThread()
+    , watchTimer(*this)
+    , watchTimerMonitor(globals.eventLoop, watchTimer)
 {
     versionHistory.insert({0, 1});
     consensus->setSupportedStateMachineVersions(MIN_SUPPORTED_VERSION,
@@ -115,23 +359,84 @@ StateMachine::~StateMachine()
     if (snapshotWatchdogThread.joinable())
         snapshotWatchdogThread.join();
     NOTICE("Joined with threads");
+    watchTimerMonitor.disableForever();
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    while (!watches.empty())
+        finishWatch(watches.begin()->first, lastApplied, false);
 }
 
 bool
 StateMachine::query(const Query::Request& request,
                     Query::Response& response) const
 {
-    std::lock_guard<Core::Mutex> lockGuard(mutex);
     if (request.has_tree()) {
-        Tree::ProtoBuf::readOnlyTreeRPC(tree,
+        std::shared_ptr<const Tree::Tree> published = getPublishedTree();
+        Tree::ProtoBuf::readOnlyTreeRPC(*published,
                                         request.tree(),
                                         *response.mutable_tree());
         return true;
     }
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
     warnUnknownRequest(request, "does not understand the given request");
     return false;
 }
 
+void
+StateMachine::watch(const Query::Request& request, RPC::ServerRPC rpc)
+{
+    const PC::ReadOnlyTree::Request::Watch& watch = request.tree().watch();
+    std::string path = canonicalWatchPath(watch.path());
+    uint64_t afterIndex = watch.after_index();
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    bool changed = false;
+    if (afterIndex == 0 || afterIndex < watchHistoryStart) {
+        changed = true;
+    } else {
+        for (auto it = watchHistory.rbegin();
+             it != watchHistory.rend() && it->index > afterIndex;
+             ++it) {
+            if (watchMatches(path, watch.recursive(),
+                             it->path, it->subtree)) {
+                changed = true;
+                break;
+            }
+        }
+    }
+    if (changed || exiting) {
+        if (changed && afterIndex > 0)
+            ++numWatchesTriggered;
+        replyToWatch(rpc, lastApplied, changed);
+        return;
+    }
+
+    if (watches.size() >= watchMaxParked) {
+        ++numWatchesRejected;
+        PC::StateMachineQuery::Response response;
+        PC::ReadOnlyTree::Response& tree = *response.mutable_tree();
+        tree.set_status(PC::Status::INVALID_ARGUMENT);
+        tree.set_error(Core::StringUtil::format(
+            "Server already has %lu watches parked (watchMaxParked)",
+            watches.size()));
+        rpc.reply(response);
+        return;
+    }
+
+    std::chrono::nanoseconds wait = watchMaxWait;
+    if (watch.timeout_nanos() > 0)
+        wait = std::min(wait, std::chrono::nanoseconds(watch.timeout_nanos()));
+    uint64_t id = nextWatchId;
+    ++nextWatchId;
+    Watch& parked = watches[id];
+    parked.path = path;
+    parked.recursive = watch.recursive();
+    parked.deadline = Clock::now() + wait;
+    parked.rpc = std::move(rpc);
+    watchesByPath.insert({path, id});
+    watchesByDeadline.insert({parked.deadline, id});
+    if (watchesByDeadline.begin()->second == id)
+        watchTimer.scheduleAbsolute(parked.deadline);
+}
+
 void
 StateMachine::updateServerStats(Protocol::ServerStats& serverStats) const
 {
@@ -140,7 +445,7 @@ StateMachine::updateServerStats(Protocol::ServerStats& serverStats) const
     serverStats.clear_state_machine();
     Protocol::ServerStats::StateMachine& smStats =
         *serverStats.mutable_state_machine();
-    smStats.set_snapshotting(childPid != 0);
+    smStats.set_snapshotting(childPid != 0 || writingSnapshot);
     smStats.set_last_applied(lastApplied);
     smStats.set_num_sessions(sessions.size());
     smStats.set_num_unknown_requests(numUnknownRequests);
@@ -158,6 +463,9 @@ StateMachine::updateServerStats(Protocol::ServerStats& serverStats) const
     smStats.set_max_supported_version(MAX_SUPPORTED_VERSION);
     smStats.set_running_version(getVersion(lastApplied));
     smStats.set_may_snapshot_at(time.unixNanos(maySnapshotAt));
+    smStats.set_num_watches(watches.size());
+    smStats.set_num_watches_triggered(numWatchesTriggered);
+    smStats.set_num_watches_rejected(numWatchesRejected);
     tree.updateServerStats(*smStats.mutable_tree());
 }
 
@@ -169,6 +477,19 @@ StateMachine::wait(uint64_t index) const
         entriesApplied.wait(lockGuard);
 }
 
+bool
+StateMachine::waitUntil(uint64_t index,
+                        Core::Time::SteadyClock::time_point deadline) const
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (lastApplied < index) {
+        if (Clock::now() >= deadline)
+            return false;
+        entriesApplied.wait_until(lockGuard, deadline);
+    }
+    return true;
+}
+
 bool
 StateMachine::waitForResponse(uint64_t logIndex,
                               const Command::Request& command,
@@ -180,11 +501,11 @@ StateMachine::waitForResponse(uint64_t logIndex,
 
     // Need to check whether we understood the request at the time it
     // was applied using getVersion(logIndex), then reply and return true/false
-    // based on that. Existing commands have been around since version 1, so we
-    // skip this check for now.
+    // based on that.
     uint16_t versionThen = getVersion(logIndex);
 
-    if (command.has_tree()) {
+    if (command.has_tree() &&
+        (versionThen >= 3 || !command.tree().has_batch())) {
         const PC::ExactlyOnceRPCInfo& rpcInfo = command.tree().exactly_once();
         auto sessionIt = sessions.find(rpcInfo.client_id());
         if (sessionIt == sessions.end()) {
@@ -228,14 +549,14 @@ bool
 StateMachine::isTakingSnapshot() const
 {
     std::lock_guard<Core::Mutex> lockGuard(mutex);
-    return childPid != 0;
+    return childPid != 0 || writingSnapshot;
 }
 
 void
 StateMachine::startTakingSnapshot()
 {
     std::unique_lock<Core::Mutex> lockGuard(mutex);
-    if (childPid == 0) {
+    if (childPid == 0 && !writingSnapshot) {
         NOTICE("Administrator requested snapshot");
         isSnapshotRequested = true;
         snapshotSuggested.notify_all();
@@ -253,11 +574,13 @@ void
 StateMachine::stopTakingSnapshot()
 {
     std::unique_lock<Core::Mutex> lockGuard(mutex);
-    int pid = childPid;
-    if (pid != 0) {
+    if (childPid != 0 || writingSnapshot) {
         NOTICE("Administrator aborted snapshot");
         killSnapshotProcess(Core::HoldingMutex(lockGuard), SIGTERM);
-        while (!exiting && pid == childPid) {
+        uint64_t attempt = numSnapshotsAttempted;
+        while (!exiting &&
+               (childPid != 0 || writingSnapshot) &&
+               attempt == numSnapshotsAttempted) {
             snapshotCompleted.wait(lockGuard);
         }
     }
@@ -300,13 +623,24 @@ StateMachine::setInhibit(std::chrono::nanoseconds duration)
 void
 StateMachine::apply(const RaftConsensus::Entry& entry)
 {
+    unpublishTree();
     Command::Request command;
     if (!Core::ProtoBuf::parse(entry.command, command)) {
         PANIC("Failed to parse protobuf for entry %lu",
               entry.index);
     }
     uint16_t runningVersion = getVersion(entry.index - 1);
-    if (command.has_tree()) {
+    if (command.has_tree() && command.tree().has_batch() &&
+        runningVersion < 3) {
+        // Command is ignored in version < 3.
+        warnUnknownRequest(command, "may not process the given request, "
+                           "which was introduced in version 3");
+    } else if (command.has_tree() && hasVersionCondition(command.tree()) &&
+               runningVersion < 4) {
+        // Command is ignored in version < 4.
+        warnUnknownRequest(command, "may not process the given request, "
+                           "which was introduced in version 4");
+    } else if (command.has_tree()) {
         PC::ExactlyOnceRPCInfo rpcInfo = command.tree().exactly_once();
         auto it = sessions.find(rpcInfo.client_id());
         if (it == sessions.end()) {
@@ -322,10 +656,15 @@ StateMachine::apply(const RaftConsensus::Entry& entry)
                                                 {rpcInfo.rpc_number(), {}});
                 if (inserted.second) {
                     // response not found, apply and save it
+                    // Servers running version < 4 don't assign versions.
+                    tree.setVersioning(runningVersion >= 4);
                     Tree::ProtoBuf::readWriteTreeRPC(
                         tree,
                         command.tree(),
                         *inserted.first->second.mutable_tree());
+                    notifyWatches(entry.index,
+                                  command.tree(),
+                                  inserted.first->second.tree());
                     session.lastModified = entry.clusterTime;
                 } else {
                     // response exists, do not re-apply
@@ -382,6 +721,32 @@ StateMachine::apply(const RaftConsensus::Entry& entry)
     }
 }
 
+std::shared_ptr<const Tree::Tree>
+StateMachine::getPublishedTree() const
+{
+    {
+        std::lock_guard<Core::Mutex> lockGuard(publishedTreeMutex);
+        if (publishedTree)
+            return publishedTree;
+    }
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    std::lock_guard<Core::Mutex> publishedGuard(publishedTreeMutex);
+    if (!publishedTree)
+        publishedTree = std::make_shared<Tree::Tree>(tree.lazyCopy());
+    return publishedTree;
+}
+
+void
+StateMachine::unpublishTree()
+{
+    std::shared_ptr<const Tree::Tree> old;
+    {
+        std::lock_guard<Core::Mutex> lockGuard(publishedTreeMutex);
+        old.swap(publishedTree);
+    }
+    // If this was the last reference, destroy the copy outside the lock.
+}
+
 void
 StateMachine::applyThreadMain()
 {
@@ -400,6 +765,8 @@ StateMachine::applyThreadMain()
                     NOTICE("Loading snapshot through entry %lu into state "
                            "machine", entry.index);
                     loadSnapshot(*entry.snapshotReader);
+                    snapshotDeltaBaseIndex = entry.index;
+                    resetWatches(entry.index);
                     NOTICE("Done loading snapshot");
                     break;
             }
@@ -423,6 +790,112 @@ StateMachine::applyThreadMain()
     }
 }
 
+void
+StateMachine::notifyWatches(uint64_t index,
+                            const PC::ReadWriteTree::Request& request,
+                            const PC::ReadWriteTree::Response& response)
+{
+    if (response.status() != PC::Status::OK)
+        return;
+    std::vector<std::pair<std::string, bool>> changes;
+    if (request.has_batch()) {
+        for (auto it = request.batch().operation().begin();
+             it != request.batch().operation().end();
+             ++it) {
+            getChangedPaths(*it, changes);
+        }
+    } else {
+        getChangedPaths(request, changes);
+    }
+    for (auto it = changes.begin(); it != changes.end(); ++it)
+        notifyWatches(index, it->first, it->second);
+}
+
+void
+StateMachine::notifyWatches(uint64_t index,
+                            const std::string& path,
+                            bool subtree)
+{
+    std::vector<uint64_t> ids;
+    auto range = watchesByPath.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it)
+        ids.push_back(it->second);
+    // Watches on the directories above path, innermost first.
+    if (path != "/") {
+        std::string parent = parentWatchPath(path);
+        std::string dir = path;
+        do {
+            dir = parentWatchPath(dir);
+            range = watchesByPath.equal_range(dir);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (dir == parent || watches.at(it->second).recursive)
+                    ids.push_back(it->second);
+            }
+        } while (dir != "/");
+    }
+    // Watches on paths below path.
+    if (subtree) {
+        std::string prefix = (path == "/" ? path : path + "/");
+        for (auto it = watchesByPath.lower_bound(prefix);
+             it != watchesByPath.end() &&
+                Core::StringUtil::startsWith(it->first, prefix);
+             ++it) {
+            if (it->first != path)
+                ids.push_back(it->second);
+        }
+    }
+    for (auto it = ids.begin(); it != ids.end(); ++it)
+        finishWatch(*it, index, true);
+
+    watchHistory.push_back({index, path, subtree});
+    while (watchHistory.size() > watchHistoryLength) {
+        watchHistoryStart = watchHistory.front().index;
+        watchHistory.pop_front();
+    }
+}
+
+void
+StateMachine::resetWatches(uint64_t index)
+{
+    while (!watches.empty())
+        finishWatch(watches.begin()->first, index, true);
+    watchHistory.clear();
+    watchHistoryStart = index;
+}
+
+void
+StateMachine::expireWatches()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    TimePoint now = Clock::now();
+    while (!watchesByDeadline.empty() &&
+           watchesByDeadline.begin()->first <= now) {
+        finishWatch(watchesByDeadline.begin()->second, lastApplied, false);
+    }
+    if (!watchesByDeadline.empty())
+        watchTimer.scheduleAbsolute(watchesByDeadline.begin()->first);
+}
+
+void
+StateMachine::finishWatch(uint64_t id, uint64_t index, bool changed)
+{
+    auto it = watches.find(id);
+    assert(it != watches.end());
+    Watch& watch = it->second;
+    auto range = watchesByPath.equal_range(watch.path);
+    for (auto byPath = range.first; byPath != range.second; ++byPath) {
+        if (byPath->second == id) {
+            watchesByPath.erase(byPath);
+            break;
+        }
+    }
+    watchesByDeadline.erase({watch.deadline, id});
+    if (changed)
+        ++numWatchesTriggered;
+    replyToWatch(watch.rpc, index, changed);
+    watches.erase(it);
+}
+
 void
 StateMachine::serializeSessions(SnapshotStateMachine::Header& header) const
 {
@@ -499,6 +972,8 @@ StateMachine::killSnapshotProcess(Core::HoldingMutex holdingMutex,
                     strerror(errno));
         }
     }
+    if (writingSnapshot)
+        abortSnapshot = true;
 }
 
 void
@@ -523,19 +998,21 @@ StateMachine::loadSessions(const SnapshotStateMachine::Header& header)
 void
 StateMachine::loadSnapshot(Core::ProtoBuf::InputStream& stream)
 {
-    // Check that this snapshot uses format version 1
+    unpublishTree();
+    // Check that this snapshot uses format version 1 (full) or 2 (delta)
     uint8_t formatVersion = 0;
     uint64_t bytesRead = stream.readRaw(&formatVersion, sizeof(formatVersion));
     if (bytesRead < sizeof(formatVersion)) {
         PANIC("Snapshot contents are empty (no format version field)");
     }
-    if (formatVersion != 1) {
+    if (formatVersion != 1 && formatVersion != 2) {
         PANIC("Snapshot contents format version read was %u, but this "
-              "code can only read version 1",
+              "code can only read versions 1 and 2",
               formatVersion);
     }
 
     // Load snapshot header
+    uint64_t deltaBaseIndex = 0;
     {
         SnapshotStateMachine::Header header;
         std::string error = stream.readMessage(header);
@@ -545,10 +1022,48 @@ StateMachine::loadSnapshot(Core::ProtoBuf::InputStream& stream)
         }
         loadVersionHistory(header);
         loadSessions(header);
+        if (formatVersion == 2)
+            deltaBaseIndex = header.delta_base_index();
     }
 
     // Load the tree's state
-    tree.loadSnapshot(stream);
+    numSnapshotDeltas = loadTree(stream, deltaBaseIndex);
+}
+
+uint64_t
+StateMachine::loadTree(Core::ProtoBuf::InputStream& stream,
+                       uint64_t deltaBaseIndex)
+{
+    if (deltaBaseIndex == 0) {
+        tree.loadSnapshot(stream, snapshotLoadThreads);
+        return 0;
+    }
+
+    // The sessions and version history in the earlier snapshots are
+    // outdated, so only their trees are used.
+    std::unique_ptr<Storage::SnapshotFile::Reader> base =
+        consensus->readSnapshotDeltaBase(deltaBaseIndex);
+    uint8_t formatVersion = 0;
+    base->readRaw(&formatVersion, sizeof(formatVersion));
+    if (formatVersion != 1 && formatVersion != 2) {
+        PANIC("Snapshot %lu contents format version read was %u, but this "
+              "code can only read versions 1 and 2",
+              deltaBaseIndex,
+              formatVersion);
+    }
+    SnapshotStateMachine::Header header;
+    std::string error = base->readMessage(header);
+    if (!error.empty()) {
+        PANIC("Couldn't read state machine header from snapshot %lu: %s",
+              deltaBaseIndex,
+              error.c_str());
+    }
+    uint64_t baseDeltaBaseIndex = 0;
+    if (formatVersion == 2)
+        baseDeltaBaseIndex = header.delta_base_index();
+    uint64_t numDeltas = loadTree(*base, baseDeltaBaseIndex);
+    tree.loadSnapshotDelta(stream, snapshotLoadThreads);
+    return numDeltas + 1;
 }
 
 void
@@ -608,6 +1123,10 @@ StateMachine::shouldTakeSnapshot(uint64_t lastIncludedIndex) const
                logEntries);
     }
 
+    // The latest snapshot is a delta but a follower needs a full one.
+    if (stats.full_snapshot_needed())
+        return lastIncludedIndex >= stats.last_snapshot_index();
+
     if (stats.log_bytes() < snapshotMinLogSize)
         return false;
     if (stats.log_bytes() < stats.last_snapshot_bytes() * snapshotRatio)
@@ -631,6 +1150,11 @@ StateMachine::snapshotThreadMain()
         TimePoint waitUntil = TimePoint::max();
         if (inhibited)
             waitUntil = maySnapshotAt;
+        // The consensus module doesn't notify this thread when it asks for a
+        // full snapshot, so poll for that while the latest one is a delta.
+        if (numSnapshotDeltas > 0)
+            waitUntil = std::min(waitUntil,
+                                 Clock::now() + std::chrono::milliseconds(100));
 
         if (wasInhibited && !inhibited)
             NOTICE("Now permitted to take snapshots");
@@ -720,10 +1244,14 @@ void
 StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
                            std::unique_lock<Core::Mutex>& lockGuard)
 {
-    // Open a snapshot file, then fork a child to write a consistent view of
-    // the state machine to the snapshot file while this process continues
-    // accepting requests.
-    writer = consensus->beginSnapshot(lastIncludedIndex);
+    // Open a snapshot file, then write a consistent view of the state machine
+    // to it while this process continues accepting requests. If the tree has
+    // tracked its changes since the latest snapshot, only those need to be
+    // written out.
+    uint64_t deltaBaseIndex = 0;
+    if (snapshotDeltaBaseIndex != 0 && numSnapshotDeltas < snapshotMaxDeltas)
+        deltaBaseIndex = snapshotDeltaBaseIndex;
+    writer = consensus->beginSnapshot(lastIncludedIndex, &deltaBaseIndex);
     // Flush the outstanding changes to the snapshot now so that they
     // aren't somehow double-flushed later.
     writer->flushToOS();
@@ -731,42 +1259,50 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
     ++numSnapshotsAttempted;
     snapshotStarted.notify_all();
 
-    pid_t pid = fork();
-    if (pid == -1) { // error
-        PANIC("Couldn't fork: %s", strerror(errno));
-    } else if (pid == 0) { // child
-        Core::Debug::processName += "-child";
-        globals.unblockAllSignals();
-        usleep(stateMachineChildSleepMs * 1000); // for testing purposes
-        if (snapshotBlockPercentage > 0) { // for testing purposes
-            if (Core::Random::randomRange(0, 100) < snapshotBlockPercentage) {
-                WARNING("Purposely deadlocking child (probability is %lu%%)",
-                        snapshotBlockPercentage);
-                std::mutex mutex;
-                mutex.lock();
-                mutex.lock(); // intentional deadlock
+    bool succeeded = false;
+    // If the snapshot fails for a reason other than this process exiting,
+    // this describes what went wrong.
+    std::string failure;
+    if (snapshotFork) {
+        // Fork a child to write the snapshot from its copy of the address
+        // space.
+        pid_t pid = fork();
+        if (pid == -1) { // error
+            PANIC("Couldn't fork: %s", strerror(errno));
+        } else if (pid == 0) { // child
+            Core::Debug::processName += "-child";
+            globals.unblockAllSignals();
+            usleep(stateMachineChildSleepMs * 1000); // for testing purposes
+            if (snapshotBlockPercentage > 0) { // for testing purposes
+                if (Core::Random::randomRange(0, 100) <
+                    snapshotBlockPercentage) {
+                    WARNING("Purposely deadlocking child (probability is "
+                            "%lu%%)",
+                            snapshotBlockPercentage);
+                    std::mutex mutex;
+                    mutex.lock();
+                    mutex.lock(); // intentional deadlock
+                }
             }
-        }
 
-        // Format version of snapshot contents is 1.
-        uint8_t formatVersion = 1;
-        writer->writeRaw(&formatVersion, sizeof(formatVersion));
-        // StateMachine state comes next
-        {
             SnapshotStateMachine::Header header;
             serializeVersionHistory(header);
             serializeSessions(header);
-            writer->writeMessage(header);
-        }
-        // Then the Tree itself (this one is potentially large)
-        tree.dumpSnapshot(*writer);
+            if (deltaBaseIndex != 0)
+                header.set_delta_base_index(deltaBaseIndex);
+            writeSnapshotContents(*writer, header, tree, deltaBaseIndex != 0);
 
-        // Flush the changes to the snapshot file before exiting.
-        writer->flushToOS();
-        _exit(0);
-    } else { // parent
+            // Flush the changes to the snapshot file before exiting.
+            writer->flushToOS();
+            _exit(0);
+        }
+        // parent
         assert(childPid == 0);
         childPid = pid;
+        // The child has its own copy of the tree, so this process can start
+        // tracking changes for the next snapshot.
+        tree.markClean();
+        snapshotDeltaBaseIndex = lastIncludedIndex;
         int status = 0;
         {
             // release the lock while blocking on the child to allow
@@ -780,27 +1316,89 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
         if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
             NOTICE("Child completed writing state machine contents to "
                    "snapshot staging file");
-            writer->seekToEnd();
-            consensus->snapshotDone(lastIncludedIndex, std::move(writer));
+            succeeded = true;
         } else if (exiting &&
                    WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM) {
-            writer->discard();
-            writer.reset();
             NOTICE("Child exited from SIGTERM since this process is "
                    "exiting");
         } else {
-            writer->discard();
-            writer.reset();
+            failure = Core::StringUtil::format(
+                "Snapshot creation failed with status %d.", status);
+        }
+    } else {
+        // Write a lazy copy of the state machine from this thread. The
+        // copy shares the tree's nodes, so taking it is cheap, and the apply
+        // thread copies any node it modifies in the meantime.
+        SnapshotStateMachine::Header header;
+        serializeVersionHistory(header);
+        serializeSessions(header);
+        if (deltaBaseIndex != 0)
+            header.set_delta_base_index(deltaBaseIndex);
+        std::unique_ptr<Tree::Tree> treeCopy(
+            new Tree::Tree(tree.lazyCopy()));
+        tree.markClean();
+        snapshotDeltaBaseIndex = lastIncludedIndex;
+        writingSnapshot = true;
+        abortSnapshot = false;
+        bool aborted = false;
+        {
+            // release the lock while writing to allow parallelism
+            Core::MutexUnlock<Core::Mutex> unlockGuard(lockGuard);
+            AbortableOutputStream stream(*writer, abortSnapshot);
+            try {
+                writeSnapshotContents(stream, header, *treeCopy,
+                                      deltaBaseIndex != 0);
+            } catch (const SnapshotAbortedException&) {
+                aborted = true;
+            }
+            // Freeing the nodes that only the copy still refers to may take a
+            // while, so do it before reacquiring the lock.
+            treeCopy.reset();
+        }
+        writingSnapshot = false;
+        if (!aborted) {
+            NOTICE("Completed writing state machine contents to snapshot "
+                   "staging file");
+            succeeded = true;
+        } else if (exiting) {
+            NOTICE("Stopped writing snapshot since this process is exiting");
+        } else {
+            failure = "Snapshot creation was aborted.";
+        }
+    }
+
+    if (succeeded) {
+        writer->seekToEnd();
+        consensus->snapshotDone(lastIncludedIndex, std::move(writer),
+                                deltaBaseIndex);
+        numSnapshotDeltas = (deltaBaseIndex == 0 ? 0
+                                                 : numSnapshotDeltas + 1);
+    } else {
+        writer->discard();
+        writer.reset();
+        snapshotDeltaBaseIndex = 0;
+        if (!failure.empty()) {
             ++numSnapshotsFailed;
-            ERROR("Snapshot creation failed with status %d. This server will "
-                  "try again, but something might be terribly wrong. "
-                  "%lu of %lu snapshots have failed in total.",
-                  status,
+            ERROR("%s This server will try again, but something might be "
+                  "terribly wrong. %lu of %lu snapshots have failed in "
+                  "total.",
+                  failure.c_str(),
                   numSnapshotsFailed,
                   numSnapshotsAttempted);
         }
-        snapshotCompleted.notify_all();
     }
+    snapshotCompleted.notify_all();
+}
+
+StateMachine::WatchTimer::WatchTimer(StateMachine& stateMachine)
+    : stateMachine(stateMachine)
+{
+}
+
+void
+StateMachine::WatchTimer::handleTimerEvent()
+{
+    stateMachine.expireWatches();
 }
 
 void
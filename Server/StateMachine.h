@@ -14,8 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <atomic>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <thread>
 #include <unordered_map>
 
@@ -25,6 +29,8 @@
 #include "Core/Config.h"
 #include "Core/Mutex.h"
 #include "Core/Time.h"
+#include "Event/Timer.h"
+#include "RPC/ServerRPC.h"
 #include "Tree/Tree.h"
 
 #ifndef LOGCABIN_SERVER_STATEMACHINE_H
@@ -61,7 +67,7 @@ class StateMachine {
          * This state machine code can behave like all versions between
          * MIN_SUPPORTED_VERSION and MAX_SUPPORTED_VERSION, inclusive.
          */
-        MAX_SUPPORTED_VERSION = 2,
+        MAX_SUPPORTED_VERSION = 4,
     };
 
 
@@ -72,13 +78,33 @@ class StateMachine {
 
     /**
      * Called by ClientService to execute read-only queries on the state
-     * machine.
+     * machine. Tree queries don't hold #mutex while they run, so many of them
+     * may run at once, and in parallel with apply(); each sees the tree as
+     * of some #lastApplied no earlier than when it was called.
      * \warning
      *      Be sure to wait() first!
      */
     bool query(const Query::Request& request,
                Query::Response& response) const;
 
+    /**
+     * Called by ClientService to handle a query to watch the tree (see
+     * Protocol::Client::ReadOnlyTree::Request::Watch). If a matching change
+     * was applied after the watch's after_index, or if that's too long ago
+     * to tell, this replies right away. Otherwise, it parks the RPC until
+     * apply() makes a matching change or the watch times out, so that
+     * clients needn't poll.
+     *
+     * A change to a path matches watches on that path, on its parent, on
+     * any directory above it if the watch is recursive, and on anything
+     * below it if the change removed a directory. Making a directory is
+     * counted as a change to each of its parents too, since it may have
+     * created them, so watches may be woken spuriously.
+     * \warning
+     *      Be sure to wait() first!
+     */
+    void watch(const Query::Request& request, RPC::ServerRPC rpc);
+
     /**
      * Add information about the state machine state to the given structure.
      */
@@ -89,6 +115,15 @@ class StateMachine {
      */
     void wait(uint64_t index) const;
 
+    /**
+     * Like wait(), but give up at the given deadline.
+     * \return
+     *      True if the state machine has applied at least the given entry,
+     *      false if the deadline passed first.
+     */
+    bool waitUntil(uint64_t index,
+                   Core::Time::SteadyClock::time_point deadline) const;
+
     /**
      * Called by ClientService to get a response for a read-write command on
      * the state machine.
@@ -145,8 +180,9 @@ class StateMachine {
 
 
   private:
-    // forward declaration
+    // forward declarations
     struct Session;
+    struct WatchEvent;
 
     /// Clock used by watchdog timer thread.
     typedef Core::Time::SteadyClock Clock;
@@ -158,11 +194,70 @@ class StateMachine {
      */
     void apply(const RaftConsensus::Entry& entry);
 
+    /**
+     * Return #publishedTree, first taking a new lazy copy of #tree if needed.
+     */
+    std::shared_ptr<const Tree::Tree> getPublishedTree() const;
+
+    /**
+     * Drop #publishedTree. This must be called with #mutex held before
+     * modifying #tree, so that later queries see the change.
+     */
+    void unpublishTree();
+
     /**
      * Main function for thread that waits for new commands from Raft.
      */
     void applyThreadMain();
 
+    /**
+     * Called by apply() after it applies a read-write tree command. If the
+     * command took effect, this wakes up the watches on the paths it changed
+     * and records the changes in #watchHistory.
+     */
+    void notifyWatches(uint64_t index,
+                       const Protocol::Client::ReadWriteTree::Request& request,
+                       const Protocol::Client::ReadWriteTree::Response&
+                            response);
+
+    /**
+     * Wake up the watches that a change to the given path matches (see
+     * watch()) and record the change in #watchHistory.
+     * \param index
+     *      The log index of the command that made the change.
+     * \param path
+     *      The path that changed.
+     * \param subtree
+     *      True if everything below path may have changed too (the command
+     *      removed a directory).
+     */
+    void notifyWatches(uint64_t index, const std::string& path, bool subtree);
+
+    /**
+     * Wake up every watch and forget #watchHistory, because the tree may
+     * have changed arbitrarily as of the given log index (a snapshot was
+     * loaded).
+     */
+    void resetWatches(uint64_t index);
+
+    /**
+     * Reply to the watches whose deadlines have passed and reschedule
+     * #watchTimer for the next deadline.
+     */
+    void expireWatches();
+
+    /**
+     * Remove a watch from #watches and its indexes and reply to it.
+     * \param id
+     *      The watch's key in #watches.
+     * \param index
+     *      The log index as of which the watch completed.
+     * \param changed
+     *      True if a matching change was applied after the watch's
+     *      after_index; false if it timed out.
+     */
+    void finishWatch(uint64_t id, uint64_t index, bool changed);
+
     /**
      * Return the #sessions table as a protobuf message for writing into a
      * snapshot.
@@ -195,7 +290,8 @@ class StateMachine {
 
     /**
      * If there is a current snapshot process, send it a signal and return
-     * immediately.
+     * immediately. If snapshotThread is writing a snapshot itself (see
+     * #snapshotFork), ask it to stop instead, regardless of the signal.
      */
     void killSnapshotProcess(Core::HoldingMutex holdingMutex, int signum);
 
@@ -210,6 +306,22 @@ class StateMachine {
      */
     void loadSnapshot(Core::ProtoBuf::InputStream& stream);
 
+    /**
+     * Read the tree's part of a snapshot file into #tree. If the snapshot is
+     * a delta, this first loads the earlier snapshots it depends on, oldest
+     * first, and then applies 'stream' on top of them.
+     * \param stream
+     *      Positioned at the start of the tree's part of the snapshot.
+     * \param deltaBaseIndex
+     *      The delta_base_index from the state machine's header in the
+     *      snapshot, or 0 for a full snapshot.
+     * \return
+     *      The number of deltas that were applied on top of the full
+     *      snapshot.
+     */
+    uint64_t loadTree(Core::ProtoBuf::InputStream& stream,
+                      uint64_t deltaBaseIndex);
+
     /**
      * Restore the #versionHistory table from a snapshot.
      */
@@ -290,6 +402,28 @@ class StateMachine {
      */
     uint64_t snapshotRatio;
 
+    /**
+     * The maximum number of delta snapshots to write in a row, each holding
+     * only the parts of the tree that changed since the previous snapshot,
+     * before writing a full snapshot again. 0 disables delta snapshots.
+     */
+    uint64_t snapshotMaxDeltas;
+
+    /**
+     * How many threads may decode the top-level directories of a snapshot in
+     * parallel when loading it (see Tree::loadSnapshot()).
+     */
+    uint64_t snapshotLoadThreads;
+
+    /**
+     * If true, snapshots are written by a child process that snapshotThread
+     * forks, and the watchdog thread kills children that stop making
+     * progress. Otherwise (the default), snapshotThread writes them itself
+     * from a lazy copy of the tree (see Tree::lazyCopy()), which avoids the
+     * cost of forking a large process and the page faults that follow.
+     */
+    bool snapshotFork;
+
     /**
      * After this much time has elapsed without any progress, the snapshot
      * watchdog thread will kill the snapshotting process. A special value of 0
@@ -332,7 +466,8 @@ class StateMachine {
     mutable Core::ConditionVariable snapshotSuggested;
 
     /**
-     * Notified when a snapshot process is forked.
+     * Notified when a snapshot is started (a snapshot process is forked, or
+     * snapshotThread begins writing one itself).
      * Also notified upon exiting.
      * This is used so that the watchdog thread knows to begin checking the
      * progress of the child process, and also in #startTakingSnapshot().
@@ -340,7 +475,8 @@ class StateMachine {
     mutable Core::ConditionVariable snapshotStarted;
 
     /**
-     * Notified when a snapshot process is joined.
+     * Notified when a snapshot process is joined or snapshotThread finishes
+     * writing a snapshot.
      * Also notified upon exiting.
      * This is used so that #stopTakingSnapshot() knows when it's done.
      */
@@ -360,6 +496,20 @@ class StateMachine {
      */
     pid_t childPid;
 
+    /**
+     * True while snapshotThread is writing a snapshot without holding #mutex
+     * (when #snapshotFork is false). This plays the role of #childPid for
+     * in-process snapshots.
+     */
+    bool writingSnapshot;
+
+    /**
+     * Set by killSnapshotProcess() to make snapshotThread give up on the
+     * snapshot it's writing (when #snapshotFork is false). This is read
+     * without holding #mutex.
+     */
+    std::atomic<bool> abortSnapshot;
+
     /**
      * The index of the last log entry that this state machine has applied.
      * This variable is only written to by applyThread, so applyThread is free
@@ -401,6 +551,20 @@ class StateMachine {
      */
     uint64_t numSnapshotsFailed;
 
+    /**
+     * If nonzero, #tree has been marked clean as of the snapshot covering
+     * entries [1, snapshotDeltaBaseIndex], so the next snapshot may be a
+     * delta against that one. This is set to 0 when that's no longer known
+     * to be true (for example, if a snapshot fails).
+     */
+    uint64_t snapshotDeltaBaseIndex;
+
+    /**
+     * The number of delta snapshots in the chain ending at the latest
+     * snapshot this state machine wrote or loaded.
+     */
+    uint64_t numSnapshotDeltas;
+
     /**
      * The number of times a log entry was processed to advance the state
      * machine's running version, but the state machine was already at that
@@ -480,12 +644,134 @@ class StateMachine {
      */
     std::unordered_map<uint64_t, Session> sessions;
 
+    /**
+     * A change to the tree, kept in #watchHistory so that watches arriving
+     * later can tell whether they missed it.
+     */
+    struct WatchEvent {
+        /// The log index of the command that made the change.
+        uint64_t index;
+        /// The path that changed, in canonical form (see watch()).
+        std::string path;
+        /// True if everything below #path may have changed too.
+        bool subtree;
+    };
+
+    /**
+     * A watch query parked until a matching change or its deadline.
+     */
+    struct Watch {
+        Watch()
+            : path()
+            , recursive(false)
+            , deadline()
+            , rpc()
+        {
+        }
+        /// The watched path, in canonical form.
+        std::string path;
+        /// If true, changes anywhere below #path match too.
+        bool recursive;
+        /// When to reply that nothing changed.
+        TimePoint deadline;
+        /// The RPC to reply to.
+        RPC::ServerRPC rpc;
+    };
+
+    /**
+     * Calls expireWatches() at the earliest deadline in #watchesByDeadline.
+     */
+    class WatchTimer : public Event::Timer {
+      public:
+        explicit WatchTimer(StateMachine& stateMachine);
+        void handleTimerEvent();
+        StateMachine& stateMachine;
+    };
+
+    /**
+     * The longest that the server parks a watch before replying that nothing
+     * changed. Clients may ask for less.
+     */
+    std::chrono::nanoseconds watchMaxWait;
+
+    /**
+     * The most watches that the server parks at once. Each one holds an RPC
+     * open, so watches beyond this are rejected with an error instead.
+     */
+    uint64_t watchMaxParked;
+
+    /**
+     * The maximum number of changes to keep in #watchHistory.
+     */
+    uint64_t watchHistoryLength;
+
+    /**
+     * The most recent changes to the tree, oldest first. This holds every
+     * change after #watchHistoryStart.
+     */
+    std::deque<WatchEvent> watchHistory;
+
+    /**
+     * A watch whose after_index is older than this can't tell from
+     * #watchHistory whether it missed a change, so it's woken right away.
+     */
+    uint64_t watchHistoryStart;
+
+    /**
+     * Parked watches, by ID. IDs are assigned from #nextWatchId.
+     */
+    std::unordered_map<uint64_t, Watch> watches;
+
+    /**
+     * Index of #watches by watched path.
+     */
+    std::multimap<std::string, uint64_t> watchesByPath;
+
+    /**
+     * Index of #watches by deadline.
+     */
+    std::set<std::pair<TimePoint, uint64_t>> watchesByDeadline;
+
+    /**
+     * The ID to give the next parked watch.
+     */
+    uint64_t nextWatchId;
+
+    /**
+     * The number of watches that were woken because of a change (not
+     * counting timeouts).
+     */
+    uint64_t numWatchesTriggered;
+
+    /**
+     * The number of watches rejected because #watchMaxParked were already
+     * parked.
+     */
+    uint64_t numWatchesRejected;
+
     /**
      * The hierarchical key-value store. Used in readOnlyTreeRPC and
      * readWriteTreeRPC.
      */
     Tree::Tree tree;
 
+    /**
+     * Protects #publishedTree. This may be acquired while holding #mutex,
+     * but not the other way around.
+     */
+    mutable Core::Mutex publishedTreeMutex;
+
+    /**
+     * A lazy copy of #tree (see Tree::lazyCopy()) as of #lastApplied, which
+     * query() reads from without holding #mutex. NULL if #tree may have
+     * changed since the copy was taken; the next query() then takes a new
+     * one. Queries hold their own reference to the copy while they use it,
+     * so the tree they see doesn't change underneath them. Taking copies only
+     * when queries need them avoids making apply() replace shared nodes with
+     * private copies after every command.
+     */
+    mutable std::shared_ptr<const Tree::Tree> publishedTree;
+
     /**
      * The log position when the state machine was updated to each new version.
      * First component: log index. Second component: version number.
@@ -503,7 +789,7 @@ class StateMachine {
     /**
      * The file that the snapshot is being written into. Also used by to track
      * the progress of the child process for the watchdog thread.
-     * This is non-empty if and only if childPid > 0.
+     * This is non-empty if and only if childPid > 0 or writingSnapshot.
      */
     std::unique_ptr<Storage::SnapshotFile::Writer> writer;
 
@@ -526,6 +812,17 @@ class StateMachine {
      * See https://github.com/logcabin/logcabin/issues/121 for more rationale.
      */
     std::thread snapshotWatchdogThread;
+
+    /**
+     * See WatchTimer.
+     */
+    WatchTimer watchTimer;
+
+    /**
+     * Registers #watchTimer with the event loop. This is declared last so
+     * that the timer stops before the watch state it uses is destroyed.
+     */
+    Event::Timer::Monitor watchTimerMonitor;
 };
 
 } // namespace LogCabin::Server
@@ -24,6 +24,7 @@
 #include "Core/ProtoBuf.h"
 #include "Core/StringUtil.h"
 #include "Core/STLUtil.h"
+#include "RPC/Protocol.h"
 #include "Server/Globals.h"
 #include "Server/RaftConsensus.h"
 #include "Server/StateMachine.h"
@@ -100,6 +101,43 @@ TEST_F(ServerStateMachineTest, query_tree)
               response.tree().status());
 }
 
+TEST_F(ServerStateMachineTest, query_published)
+{
+    StateMachine::Query::Request request;
+    StateMachine::Query::Response response;
+    auto& read = *request.mutable_tree()->mutable_read();
+    read.set_path("/a");
+    stateMachine->tree.write("/a", "1");
+    EXPECT_TRUE(stateMachine->query(request, response));
+    EXPECT_EQ("1", response.tree().read().contents());
+
+    // queries share the copy until the tree changes
+    std::shared_ptr<const Tree::Tree> held =
+        stateMachine->getPublishedTree();
+    EXPECT_EQ(held, stateMachine->publishedTree);
+    stateMachine->unpublishTree();
+    EXPECT_FALSE(stateMachine->publishedTree);
+    stateMachine->tree.write("/a", "2");
+    EXPECT_TRUE(stateMachine->query(request, response));
+    EXPECT_EQ("2", response.tree().read().contents());
+    EXPECT_NE(held, stateMachine->publishedTree);
+
+    // the held copy didn't change, and its reads count in the tree's stats
+    std::string contents;
+    held->read("/a", contents);
+    EXPECT_EQ("1", contents);
+    EXPECT_EQ(3U, stateMachine->tree.readStats->numReadAttempted);
+
+    // applying an entry drops the copy
+    RaftConsensus::Entry entry;
+    entry.index = 1;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.command = serialize(StateMachine::Command::Request());
+    Core::Debug::setLogPolicy({{"", "ERROR"}});
+    stateMachine->apply(entry);
+    EXPECT_FALSE(stateMachine->publishedTree);
+}
+
 TEST_F(ServerStateMachineTest, query_unknown)
 {
     StateMachine::Query::Request request;
@@ -109,6 +147,266 @@ TEST_F(ServerStateMachineTest, query_unknown)
     EXPECT_FALSE(stateMachine->query(request, response));
 }
 
+/**
+ * A parked watch query whose reply, once sent, lands in #response.
+ */
+struct WatchRPC {
+    WatchRPC()
+        : response()
+    {
+    }
+    RPC::ServerRPC
+    make() {
+        RPC::ServerRPC rpc;
+        rpc.active = true;
+        rpc.opaqueRPC.responseTarget = &response;
+        return rpc;
+    }
+    bool
+    replied() const {
+        return response.getLength() > 0;
+    }
+    Protocol::Client::ReadOnlyTree::Response
+    tree() const {
+        StateMachine::Query::Response query;
+        EXPECT_TRUE(Core::ProtoBuf::parse(
+            response, query,
+            sizeof(RPC::Protocol::ResponseHeaderVersion1)));
+        return query.tree();
+    }
+    Protocol::Client::ReadOnlyTree::Response::Watch
+    reply() const {
+        Protocol::Client::ReadOnlyTree::Response t = tree();
+        EXPECT_EQ(Protocol::Client::Status::OK, t.status());
+        return t.watch();
+    }
+    Core::Buffer response;
+};
+
+StateMachine::Query::Request
+makeWatch(const std::string& path, bool recursive, uint64_t afterIndex,
+          uint64_t timeoutNanos = 0)
+{
+    StateMachine::Query::Request request;
+    auto& watch = *request.mutable_tree()->mutable_watch();
+    watch.set_path(path);
+    watch.set_recursive(recursive);
+    watch.set_after_index(afterIndex);
+    watch.set_timeout_nanos(timeoutNanos);
+    return request;
+}
+
+TEST_F(ServerStateMachineTest, watch_immediate)
+{
+    stateMachine->lastApplied = 9;
+    stateMachine->watchHistoryStart = 4;
+    stateMachine->watchHistory.push_back({5, "/a/b", false});
+    stateMachine->watchHistory.push_back({7, "/c", true});
+
+    // no index yet
+    WatchRPC rpc1;
+    stateMachine->watch(makeWatch("/x", false, 0), rpc1.make());
+    ASSERT_TRUE(rpc1.replied());
+    EXPECT_EQ(9U, rpc1.reply().index());
+    EXPECT_TRUE(rpc1.reply().changed());
+
+    // older than the history
+    WatchRPC rpc2;
+    stateMachine->watch(makeWatch("/x", false, 3), rpc2.make());
+    ASSERT_TRUE(rpc2.replied());
+    EXPECT_TRUE(rpc2.reply().changed());
+
+    // change to a child in the history
+    WatchRPC rpc3;
+    stateMachine->watch(makeWatch("/a/", false, 4), rpc3.make());
+    ASSERT_TRUE(rpc3.replied());
+    EXPECT_TRUE(rpc3.reply().changed());
+
+    // removed directory above in the history
+    WatchRPC rpc4;
+    stateMachine->watch(makeWatch("/c/d/e", false, 6), rpc4.make());
+    ASSERT_TRUE(rpc4.replied());
+    EXPECT_TRUE(rpc4.reply().changed());
+    EXPECT_EQ(3U, stateMachine->numWatchesTriggered);
+
+    // changes in the history are too old
+    WatchRPC rpc5;
+    stateMachine->watch(makeWatch("/a", true, 7), rpc5.make());
+    EXPECT_FALSE(rpc5.replied());
+    EXPECT_EQ(1U, stateMachine->watches.size());
+
+    // exiting
+    stateMachine->exiting = true;
+    WatchRPC rpc6;
+    stateMachine->watch(makeWatch("/a", true, 7), rpc6.make());
+    ASSERT_TRUE(rpc6.replied());
+    EXPECT_EQ(9U, rpc6.reply().index());
+    EXPECT_FALSE(rpc6.reply().changed());
+    stateMachine->exiting = false;
+    stateMachine->resetWatches(9);
+    EXPECT_TRUE(rpc5.replied());
+}
+
+TEST_F(ServerStateMachineTest, watch_notify)
+{
+    stateMachine->watchHistoryStart = 1;
+    WatchRPC a, aRecursive, ab, c;
+    stateMachine->watch(makeWatch("/a", false, 1), a.make());
+    stateMachine->watch(makeWatch("/a", true, 1), aRecursive.make());
+    stateMachine->watch(makeWatch("/a/b", false, 1), ab.make());
+    stateMachine->watch(makeWatch("/c", true, 1), c.make());
+    EXPECT_EQ(4U, stateMachine->watches.size());
+
+    stateMachine->notifyWatches(5, "/a/b/c", false);
+    EXPECT_FALSE(a.replied());
+    ASSERT_TRUE(aRecursive.replied());
+    EXPECT_EQ(5U, aRecursive.reply().index());
+    EXPECT_TRUE(aRecursive.reply().changed());
+    ASSERT_TRUE(ab.replied());
+    EXPECT_FALSE(c.replied());
+
+    stateMachine->notifyWatches(6, "/", true);
+    ASSERT_TRUE(a.replied());
+    EXPECT_EQ(6U, a.reply().index());
+    ASSERT_TRUE(c.replied());
+    EXPECT_EQ(0U, stateMachine->watches.size());
+    EXPECT_EQ(0U, stateMachine->watchesByPath.size());
+    EXPECT_EQ(0U, stateMachine->watchesByDeadline.size());
+    EXPECT_EQ(4U, stateMachine->numWatchesTriggered);
+    EXPECT_EQ(2U, stateMachine->watchHistory.size());
+}
+
+TEST_F(ServerStateMachineTest, watch_apply)
+{
+    stateMachine->watchHistoryStart = 1;
+    WatchRPC root, file;
+    stateMachine->watch(makeWatch("/", false, 1), root.make());
+    stateMachine->watch(makeWatch("/a/x", false, 1), file.make());
+
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    entry.command = serialize(
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 2 "
+            "  rpc_number: 3 "
+            " } "
+            " batch { "
+            "  operation { make_directory { path: '/a' } } "
+            "  operation { write { path: '/a/x' contents: 'y' } } "
+            " } "
+            "}"));
+    stateMachine->sessions.insert({39, {}});
+    stateMachine->versionHistory.insert({5, 3});
+    stateMachine->apply(entry);
+    ASSERT_TRUE(root.replied());
+    EXPECT_EQ(6U, root.reply().index());
+    ASSERT_TRUE(file.replied());
+    EXPECT_EQ(6U, file.reply().index());
+
+    // failed commands don't count
+    WatchRPC dir;
+    stateMachine->watch(makeWatch("/a", false, 6), dir.make());
+    entry.index = 7;
+    entry.command = serialize(
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 2 "
+            "  rpc_number: 4 "
+            " } "
+            " write { path: '/a/y/z' contents: 'y' } "
+            "}"));
+    stateMachine->apply(entry);
+    EXPECT_FALSE(dir.replied());
+    stateMachine->resetWatches(7);
+    EXPECT_TRUE(dir.replied());
+}
+
+TEST_F(ServerStateMachineTest, watch_history)
+{
+    stateMachine->watchHistoryLength = 2;
+    stateMachine->notifyWatches(3, "/a", false);
+    stateMachine->notifyWatches(4, "/b", false);
+    EXPECT_EQ(0U, stateMachine->watchHistoryStart);
+    stateMachine->notifyWatches(5, "/c", false);
+    EXPECT_EQ(3U, stateMachine->watchHistoryStart);
+    ASSERT_EQ(2U, stateMachine->watchHistory.size());
+    EXPECT_EQ(4U, stateMachine->watchHistory.front().index);
+
+    WatchRPC rpc;
+    stateMachine->watch(makeWatch("/b", false, 3), rpc.make());
+    ASSERT_TRUE(rpc.replied());
+    EXPECT_TRUE(rpc.reply().changed());
+}
+
+TEST_F(ServerStateMachineTest, watch_tooMany)
+{
+    stateMachine->watchHistoryStart = 1;
+    stateMachine->watchMaxParked = 2;
+    WatchRPC a, b, c;
+    stateMachine->watch(makeWatch("/a", false, 1), a.make());
+    stateMachine->watch(makeWatch("/b", false, 1), b.make());
+    stateMachine->watch(makeWatch("/c", false, 1), c.make());
+    EXPECT_FALSE(a.replied());
+    EXPECT_FALSE(b.replied());
+    ASSERT_TRUE(c.replied());
+    EXPECT_EQ(Protocol::Client::Status::INVALID_ARGUMENT, c.tree().status());
+    EXPECT_EQ("Server already has 2 watches parked (watchMaxParked)",
+              c.tree().error());
+    EXPECT_EQ(2U, stateMachine->watches.size());
+    EXPECT_EQ(1U, stateMachine->numWatchesRejected);
+    stateMachine->resetWatches(2);
+    EXPECT_TRUE(a.replied());
+    EXPECT_TRUE(b.replied());
+}
+
+TEST_F(ServerStateMachineTest, resetWatches)
+{
+    stateMachine->watchHistoryStart = 1;
+    stateMachine->notifyWatches(3, "/a", false);
+    WatchRPC rpc;
+    stateMachine->watch(makeWatch("/b", false, 3), rpc.make());
+    EXPECT_FALSE(rpc.replied());
+    stateMachine->resetWatches(8);
+    ASSERT_TRUE(rpc.replied());
+    EXPECT_EQ(8U, rpc.reply().index());
+    EXPECT_TRUE(rpc.reply().changed());
+    EXPECT_EQ(0U, stateMachine->watchHistory.size());
+    EXPECT_EQ(8U, stateMachine->watchHistoryStart);
+}
+
+TEST_F(ServerStateMachineTest, expireWatches)
+{
+    stateMachine->lastApplied = 4;
+    stateMachine->watchHistoryStart = 1;
+    stateMachine->watchMaxWait = std::chrono::seconds(10);
+    Core::Time::SteadyClock::mockValue += std::chrono::seconds(1);
+    WatchRPC shortWait, longWait;
+    stateMachine->watch(makeWatch("/a", false, 1, 2000000000UL),
+                        shortWait.make());
+    stateMachine->watch(makeWatch("/a", false, 1), longWait.make());
+
+    Core::Time::SteadyClock::mockValue += std::chrono::seconds(2);
+    stateMachine->expireWatches();
+    ASSERT_TRUE(shortWait.replied());
+    EXPECT_EQ(4U, shortWait.reply().index());
+    EXPECT_FALSE(shortWait.reply().changed());
+    EXPECT_FALSE(longWait.replied());
+
+    Core::Time::SteadyClock::mockValue += std::chrono::seconds(8);
+    stateMachine->expireWatches();
+    ASSERT_TRUE(longWait.replied());
+    EXPECT_FALSE(longWait.reply().changed());
+    EXPECT_EQ(0U, stateMachine->watches.size());
+    EXPECT_EQ(0U, stateMachine->numWatchesTriggered);
+}
+
 struct WaitHelper {
     explicit WaitHelper(StateMachine& stateMachine)
         : stateMachine(stateMachine)
@@ -344,6 +642,19 @@ TEST_F(ServerStateMachineTest, stopTakingSnapshot)
     EXPECT_EQ(4U, helper.count);
 }
 
+TEST_F(ServerStateMachineTest, stopTakingSnapshot_thread)
+{
+    stateMachine->writingSnapshot = true;
+    uint64_t count = 0;
+    stateMachine->snapshotCompleted.callback = [&]() {
+        EXPECT_TRUE(stateMachine->abortSnapshot);
+        if (++count == 2)
+            stateMachine->writingSnapshot = false;
+    };
+    stateMachine->stopTakingSnapshot();
+    EXPECT_EQ(2U, count);
+}
+
 TEST_F(ServerStateMachineTest, stopTakingSnapshot_noSnapshot)
 {
     stateMachine->stopTakingSnapshot();
@@ -443,6 +754,121 @@ TEST_F(ServerStateMachineTest, apply_tree)
     EXPECT_EQ(2U, stateMachine->sessions.at(39).lastModified);
 }
 
+TEST_F(ServerStateMachineTest, apply_treeBatch)
+{
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 2 "
+            "  rpc_number: 3 "
+            " } "
+            " batch { "
+            "  operation { make_directory { path: '/a' } } "
+            "  operation { write { path: '/a/b' contents: 'c' } } "
+            " } "
+            "}");
+    entry.command = serialize(command);
+    stateMachine->sessions.insert({39, {}});
+    std::vector<std::string> children;
+
+    // version 2 does not support batches
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 2});
+    stateMachine->apply(entry);
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ((std::vector<std::string> {}), children);
+    EXPECT_EQ(0U, stateMachine->sessions.at(39).responses.size());
+    StateMachine::Command::Response response;
+    stateMachine->lastApplied = 6;
+    EXPECT_FALSE(stateMachine->waitForResponse(6, command, response));
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+
+    // version 3 does
+    stateMachine->versionHistory[5] = 3;
+    stateMachine->apply(entry);
+    stateMachine->tree.listDirectory("/a", children);
+    EXPECT_EQ((std::vector<std::string> {"b"}), children);
+    EXPECT_TRUE(stateMachine->waitForResponse(6, command, response));
+    EXPECT_EQ("tree { status: OK }", response);
+}
+
+TEST_F(ServerStateMachineTest, apply_treeVersions)
+{
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request write =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 2 "
+            "  rpc_number: 3 "
+            " } "
+            " write { path: '/a' contents: 'b' } "
+            "}");
+    StateMachine::Command::Request conditional =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 2 "
+            "  rpc_number: 4 "
+            " } "
+            " batch { "
+            "  operation { "
+            "   condition { path: '/a' version: 0 } "
+            "   write { path: '/a' contents: 'c' } "
+            "  } "
+            " } "
+            "}");
+    stateMachine->sessions.insert({39, {}});
+    std::string contents;
+    uint64_t version = 0;
+
+    // version 3 assigns no versions and ignores conditions on them
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 3});
+    entry.command = serialize(write);
+    stateMachine->apply(entry);
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/a", contents, version).status);
+    EXPECT_EQ(0U, version);
+    entry.index = 7;
+    entry.command = serialize(conditional);
+    stateMachine->apply(entry);
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/a", contents).status);
+    EXPECT_EQ("b", contents);
+    EXPECT_EQ(1U, stateMachine->sessions.at(39).responses.size());
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+
+    // version 4 does both
+    stateMachine->versionHistory[5] = 4;
+    stateMachine->apply(entry);
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/a", contents, version).status);
+    EXPECT_EQ("c", contents);
+    EXPECT_EQ(1U, version);
+}
+
 TEST_F(ServerStateMachineTest, apply_openSession)
 {
     stateMachine->sessionTimeoutNanos = 1;
@@ -571,6 +997,7 @@ TEST_F(ServerStateMachineTest, apply_unknown)
 TEST_F(ServerStateMachineTest, applyThreadMain_exiting_TimingSensitive)
 {
     // instruct the child process to sleep for 10s
+    stateMachine->snapshotFork = true;
     stateMachineChildSleepMs = 10000;
     consensus->exit();
     {
@@ -741,13 +1168,13 @@ TEST_F(ServerStateMachineTest, loadSnapshot_unknownFormatVersion)
 {
     std::unique_ptr<Storage::SnapshotFile::Writer> writer =
         consensus->beginSnapshot(1);
-    uint8_t formatVersion = 2;
+    uint8_t formatVersion = 3;
     writer->writeRaw(&formatVersion, sizeof(formatVersion));
     writer->save();
     consensus->readSnapshot();
     EXPECT_DEATH(stateMachine->loadSnapshot(*consensus->snapshotReader),
-                 "Snapshot contents format version read was 2, but this code "
-                 "can only read version 1");
+                 "Snapshot contents format version read was 3, but this code "
+                 "can only read versions 1 and 2");
 }
 
 // loadVersionHistory normal path tested along with serializeVersionHistory
@@ -755,12 +1182,12 @@ TEST_F(ServerStateMachineTest, loadSnapshot_unknownFormatVersion)
 
 TEST_F(ServerStateMachineTest, loadVersionHistory_unknownVersion)
 {
-    stateMachine->versionHistory.insert({1, 3});
+    stateMachine->versionHistory.insert({1, 5});
     SnapshotStateMachine::Header header;
     stateMachine->serializeVersionHistory(header);
     EXPECT_DEATH(stateMachine->loadVersionHistory(header),
-                 "State machine version read from snapshot was 3, but this "
-                 "code only supports 1 through 2");
+                 "State machine version read from snapshot was 5, but this "
+                 "code only supports 1 through 4");
 }
 
 struct SnapshotThreadMainHelper {
@@ -947,6 +1374,96 @@ TEST_F(ServerStateMachineTest, takeSnapshot)
                   Core::STLUtil::getKeys(stateMachine->sessions)));
 }
 
+TEST_F(ServerStateMachineTest, takeSnapshot_fork)
+{
+    stateMachine->snapshotFork = true;
+    stateMachine->tree.makeDirectory("/foo");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    EXPECT_EQ(0, stateMachine->childPid);
+    stateMachine->tree.removeDirectory("/foo");
+    EXPECT_EQ(1U, consensus->lastSnapshotIndex);
+    consensus->discardUnneededEntries();
+    consensus->readSnapshot();
+    stateMachine->loadSnapshot(*consensus->snapshotReader);
+    std::vector<std::string> children;
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ((std::vector<std::string>{"foo/"}), children);
+}
+
+TEST_F(ServerStateMachineTest, takeSnapshot_delta)
+{
+    ASSERT_LE(2U, consensus->commitIndex);
+    stateMachine->snapshotMaxDeltas = 1;
+    stateMachine->tree.makeDirectory("/foo");
+    stateMachine->tree.makeDirectory("/bar");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    EXPECT_EQ(1U, stateMachine->snapshotDeltaBaseIndex);
+    EXPECT_EQ(0U, stateMachine->numSnapshotDeltas);
+    EXPECT_EQ(2U, stateMachine->tree.epoch);
+
+    stateMachine->tree.write("/foo/x", "y");
+    stateMachine->tree.removeDirectory("/bar");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(2, lockGuard);
+    }
+    EXPECT_EQ(2U, consensus->lastSnapshotIndex);
+    EXPECT_EQ(1U, consensus->lastSnapshotDeltaBaseIndex);
+    EXPECT_EQ(1U, stateMachine->numSnapshotDeltas);
+
+    // at the limit, so the next one is full
+    stateMachine->tree.write("/foo/x", "z");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(2, lockGuard);
+    }
+    EXPECT_EQ(0U, consensus->lastSnapshotDeltaBaseIndex);
+    EXPECT_EQ(0U, stateMachine->numSnapshotDeltas);
+}
+
+TEST_F(ServerStateMachineTest, loadSnapshot_delta)
+{
+    ASSERT_LE(2U, consensus->commitIndex);
+    stateMachine->snapshotMaxDeltas = 1;
+    stateMachine->tree.makeDirectory("/foo");
+    stateMachine->tree.makeDirectory("/bar");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    stateMachine->tree.write("/foo/x", "y");
+    stateMachine->tree.removeDirectory("/bar");
+    stateMachine->sessions.insert({4, {}});
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(2, lockGuard);
+    }
+    EXPECT_EQ(1U, consensus->lastSnapshotDeltaBaseIndex);
+
+    stateMachine->tree.removeDirectory("/foo");
+    stateMachine->tree.makeDirectory("/baz");
+    stateMachine->sessions.clear();
+    stateMachine->numSnapshotDeltas = 0;
+    consensus->readSnapshot();
+    stateMachine->loadSnapshot(*consensus->snapshotReader);
+    std::vector<std::string> children;
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ((std::vector<std::string>{"foo/"}), children);
+    std::string contents;
+    stateMachine->tree.read("/foo/x", contents);
+    EXPECT_EQ("y", contents);
+    EXPECT_EQ((std::vector<std::uint64_t>{4}),
+              Core::STLUtil::sorted(
+                  Core::STLUtil::getKeys(stateMachine->sessions)));
+    EXPECT_EQ(1U, stateMachine->numSnapshotDeltas);
+}
+
 } // namespace LogCabin::Server::<anonymous>
 } // namespace LogCabin::Server
 } // namespace LogCabin
@@ -13,7 +13,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <assert.h>
+#include <climits>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -386,6 +388,28 @@ namespace LogCabin
                       strerror(errno));
             }
 
+            void
+            link(const File &oldDir, const std::string &oldChild,
+                 const File &newDir, const std::string &newChild)
+            {
+                assert(!Core::StringUtil::startsWith(oldChild, "/"));
+                assert(!Core::StringUtil::startsWith(newChild, "/"));
+                if (::linkat(oldDir.fd, oldChild.c_str(),
+                             newDir.fd, newChild.c_str(), 0) == 0)
+                    return;
+                if (errno == EEXIST)
+                {
+                    removeFile(newDir, newChild);
+                    if (::linkat(oldDir.fd, oldChild.c_str(),
+                                 newDir.fd, newChild.c_str(), 0) == 0)
+                        return;
+                }
+                PANIC("Could not link %s/%s to %s/%s: %s",
+                      oldDir.path.c_str(), oldChild.c_str(),
+                      newDir.path.c_str(), newChild.c_str(),
+                      strerror(errno));
+            }
+
             void
             syncDir(const std::string &path)
             {
@@ -448,23 +472,37 @@ namespace LogCabin
             write(int fildes,
                   std::initializer_list<std::pair<const void *, uint64_t>> data)
             {
-                using Core::Util::downCast;
-                size_t totalBytes = 0;
-                uint64_t iovcnt = data.size();
-                struct iovec iov[iovcnt];
-                uint64_t i = 0;
+                std::vector<struct iovec> iov;
+                iov.reserve(data.size());
                 for (auto it = data.begin(); it != data.end(); ++it)
                 {
-                    iov[i].iov_base = const_cast<void *>(it->first);
-                    iov[i].iov_len = it->second;
-                    totalBytes += it->second;
-                    ++i;
+                    struct iovec v;
+                    v.iov_base = const_cast<void *>(it->first);
+                    v.iov_len = it->second;
+                    iov.push_back(v);
                 }
+                return writev(fildes, std::move(iov));
+            }
+
+            ssize_t
+            writev(int fildes, std::vector<struct iovec> iov)
+            {
+                using Core::Util::downCast;
+                size_t totalBytes = 0;
+                for (auto it = iov.begin(); it != iov.end(); ++it)
+                    totalBytes += it->iov_len;
 
+                // Skip over iovecs that have been written completely, since
+                // the kernel limits the number of iovecs per call (IOV_MAX).
+                size_t first = 0;
                 size_t bytesRemaining = totalBytes;
                 while (true)
                 {
-                    ssize_t written = System::writev(fildes, iov, downCast<int>(iovcnt));
+                    ssize_t written = System::writev(
+                        fildes,
+                        iov.data() + first,
+                        downCast<int>(std::min<size_t>(iov.size() - first,
+                                                       IOV_MAX)));
                     if (written == -1)
                     {
                         if (errno == EINTR)
@@ -475,24 +513,49 @@ namespace LogCabin
                                                       downCast<size_t>(written));
                     if (bytesRemaining == 0)
                         return downCast<ssize_t>(totalBytes);
-                    for (uint64_t i = 0; i < iovcnt; ++i)
+                    for (; first < iov.size(); ++first)
                     {
-                        if (iov[i].iov_len < static_cast<size_t>(written))
+                        if (iov[first].iov_len <= static_cast<size_t>(written))
                         {
-                            written -= iov[i].iov_len;
-                            iov[i].iov_len = 0;
+                            written -= iov[first].iov_len;
+                            iov[first].iov_len = 0;
                         }
-                        else if (iov[i].iov_len >= static_cast<size_t>(written))
+                        else
                         {
-                            iov[i].iov_len = iov[i].iov_len - downCast<size_t>(written);
-                            iov[i].iov_base = (static_cast<char *>(iov[i].iov_base) +
-                                               written);
+                            iov[first].iov_len -= downCast<size_t>(written);
+                            iov[first].iov_base =
+                                (static_cast<char *>(iov[first].iov_base) +
+                                 written);
                             break;
                         }
                     }
                 }
             }
 
+            ssize_t
+            pwrite(int fildes, const void *data, uint64_t dataLen, uint64_t offset)
+            {
+                using Core::Util::downCast;
+                const char *next = static_cast<const char *>(data);
+                uint64_t bytesRemaining = dataLen;
+                while (bytesRemaining > 0)
+                {
+                    ssize_t written = ::pwrite(fildes, next,
+                                               downCast<size_t>(bytesRemaining),
+                                               downCast<off_t>(offset));
+                    if (written == -1)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        return -1;
+                    }
+                    next += written;
+                    offset += downCast<uint64_t>(written);
+                    bytesRemaining -= downCast<uint64_t>(written);
+                }
+                return downCast<ssize_t>(dataLen);
+            }
+
             // class FileContents
 
             FileContents::FileContents(const File &origFile)
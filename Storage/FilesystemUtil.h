@@ -20,6 +20,7 @@
 
 #include <cinttypes>
 #include <string>
+#include <sys/uio.h>
 #include <vector>
 
 #ifndef LOGCABIN_STORAGE_FILESYSTEMUTIL_H
@@ -229,6 +230,14 @@ removeFile(const File& dir, const std::string& path);
 void rename(const File& oldDir, const std::string& oldChild,
             const File& newDir, const std::string& newChild);
 
+/**
+ * Create a hard link to a file. See man 2 linkat.
+ * If newChild already exists, it is replaced.
+ * This does not fsync the directories.
+ */
+void link(const File& oldDir, const std::string& oldChild,
+          const File& newDir, const std::string& newChild);
+
 /**
  * Open a directory, fsync it, and close it. This is useful to fsync a
  * directory after creating a file or directory within it.
@@ -276,6 +285,38 @@ ssize_t
 write(int fildes,
       std::initializer_list<std::pair<const void*, uint64_t>> data);
 
+/**
+ * A wrapper around writev that retries interrupted calls and short writes.
+ * Unlike writev, this accepts any number of buffers.
+ * \param fildes
+ *      The file handle on which to write data.
+ * \param iov
+ *      The buffers to write, in order. These are not copied.
+ * \return
+ *      Either -1 with errno set, or the number of bytes requested to write.
+ *      This wrapper will never return -1 with errno set to EINTR.
+ */
+ssize_t
+writev(int fildes, std::vector<struct iovec> iov);
+
+/**
+ * A wrapper around pwrite that retries interrupted calls and short writes.
+ * \param fildes
+ *      The file handle on which to write data.
+ * \param data
+ *      A pointer to the data to write.
+ * \param dataLen
+ *      The number of bytes of 'data' to write.
+ * \param offset
+ *      The byte offset in the file at which to write 'data'. The file offset
+ *      of 'fildes' is not changed.
+ * \return
+ *      Either -1 with errno set, or the number of bytes requested to write.
+ *      This wrapper will never return -1 with errno set to EINTR.
+ */
+ssize_t
+pwrite(int fildes, const void* data, uint64_t dataLen, uint64_t offset);
+
 /**
  * Provides random access to a file.
  * This implementation currently works by mmaping the file and working from the
@@ -13,6 +13,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <climits>
 #include <fcntl.h>
 #include <gtest/gtest.h>
 #include <sys/file.h>
@@ -26,6 +27,7 @@
 
 #include "Core/Debug.h"
 #include "Core/STLUtil.h"
+#include "Core/StringUtil.h"
 #include "Storage/FilesystemUtil.h"
 
 namespace LogCabin {
@@ -305,6 +307,20 @@ TEST_F(StorageFilesystemUtilTest, rename) {
               Core::STLUtil::sorted(FilesystemUtil::ls(ac)));
 }
 
+TEST_F(StorageFilesystemUtilTest, link) {
+    File a = FS::openFile(tmpdir, "a", O_RDWR|O_CREAT);
+    FS::write(a.fd, "hello", 5);
+    FS::openFile(tmpdir, "c", O_RDONLY|O_CREAT);
+    FS::link(tmpdir, "a", tmpdir, "b");
+    FS::link(tmpdir, "a", tmpdir, "c");
+    EXPECT_EQ((vector<string> {"a", "b", "c"}),
+              Core::STLUtil::sorted(FilesystemUtil::ls(tmpdir)));
+    EXPECT_EQ(5U, FS::getSize(FS::openFile(tmpdir, "b", O_RDONLY)));
+    EXPECT_EQ(5U, FS::getSize(FS::openFile(tmpdir, "c", O_RDONLY)));
+    EXPECT_DEATH(FS::link(tmpdir, "d", tmpdir, "e"),
+                 "Could not link");
+}
+
 TEST_F(StorageFilesystemUtilTest, syncDir) {
     FilesystemUtil::skipFsync = false;
     // I don't know of a way to observe that this does anything,
@@ -374,6 +390,55 @@ TEST_F(StorageFilesystemUtilTest, writeInterruption) {
     EXPECT_STREQ("hello world!", MockWritev::state->written.c_str());
 }
 
+TEST_F(StorageFilesystemUtilTest, writev) {
+    // more buffers than a single writev call accepts
+    std::vector<std::string> strings;
+    for (uint64_t i = 0; i < IOV_MAX + 10; ++i)
+        strings.push_back(i % 3 == 0 ? "" : Core::StringUtil::toString(i));
+    std::vector<struct iovec> iov;
+    std::string expected;
+    size_t firstCallBytes = 0;
+    for (auto it = strings.begin(); it != strings.end(); ++it) {
+        struct iovec v;
+        v.iov_base = const_cast<char*>(it->data());
+        v.iov_len = it->size();
+        iov.push_back(v);
+        expected += *it;
+        if (iov.size() == IOV_MAX)
+            firstCallBytes = expected.size();
+    }
+    MockWritev::state->allowWrites.push(-EINTR);
+    MockWritev::state->allowWrites.push(3);
+    MockWritev::state->allowWrites.push(int(firstCallBytes - 3));
+    MockWritev::state->allowWrites.push(0);
+    MockWritev::state->allowWrites.push(int(expected.size() - firstCallBytes));
+    FilesystemUtil::System::writev = MockWritev::writev;
+    EXPECT_EQ(ssize_t(expected.size()), FilesystemUtil::writev(100, iov));
+    EXPECT_EQ(expected, MockWritev::state->written);
+    EXPECT_TRUE(MockWritev::state->allowWrites.empty());
+
+    MockWritev::state->allowWrites.push(-EIO);
+    errno = 0;
+    EXPECT_EQ(-1, FilesystemUtil::writev(100, iov));
+    EXPECT_EQ(EIO, errno);
+}
+
+TEST_F(StorageFilesystemUtilTest, pwrite) {
+    int fd = open((tmpdir.path + "/a").c_str(), O_RDWR|O_CREAT, 0644);
+    EXPECT_LE(0, fd);
+    EXPECT_EQ(7, FilesystemUtil::pwrite(fd, "world!", 7, 6));
+    EXPECT_EQ(6, FilesystemUtil::pwrite(fd, "hello ", 6, 0));
+    // file offset is unchanged
+    EXPECT_EQ(0, lseek(fd, 0, SEEK_CUR));
+    char buf[13];
+    EXPECT_EQ(13, pread(fd, buf, sizeof(buf), 0));
+    EXPECT_STREQ("hello world!", buf);
+    EXPECT_EQ(0, close(fd));
+    errno = 0;
+    EXPECT_EQ(-1, FilesystemUtil::pwrite(fd, "x", 1, 0));
+    EXPECT_EQ(EBADF, errno);
+}
+
 class StorageFileContentsTest : public StorageFilesystemUtilTest {
     StorageFileContentsTest()
         : rawFile(FilesystemUtil::openFile(tmpdir, "a", O_RDWR|O_CREAT))
@@ -0,0 +1,246 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Core/Debug.h"
+#include "Core/StringUtil.h"
+#include "Storage/IOUring.h"
+
+namespace LogCabin
+{
+    namespace Storage
+    {
+
+        namespace
+        {
+
+            /**
+             * Return a pointer 'offset' bytes into the given mapping.
+             */
+            template <typename T>
+            T *
+            at(void *base, uint32_t offset)
+            {
+                return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+            }
+
+        } // anonymous namespace
+
+        IOUring::IOUring()
+            : mutex(), ringFd(-1), sqRing(NULL), sqRingBytes(0), cqRing(NULL), cqRingBytes(0), sqes(NULL), sqesBytes(0), sqEntries(0), sqHead(NULL), sqTail(NULL), sqMask(NULL), sqArray(NULL), cqHead(NULL), cqTail(NULL), cqMask(NULL), cqes(NULL)
+        {
+        }
+
+        IOUring::~IOUring()
+        {
+            if (sqes != NULL)
+                munmap(sqes, sqesBytes);
+            if (cqRing != NULL)
+                munmap(cqRing, cqRingBytes);
+            if (sqRing != NULL)
+                munmap(sqRing, sqRingBytes);
+            if (ringFd >= 0)
+                close(ringFd);
+        }
+
+        std::unique_ptr<IOUring>
+        IOUring::open(uint32_t entries, std::string &error)
+        {
+            using Core::StringUtil::format;
+            std::unique_ptr<IOUring> ring(new IOUring());
+
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            ring->ringFd = int(syscall(__NR_io_uring_setup, entries, &params));
+            if (ring->ringFd < 0)
+            {
+                error = format("io_uring_setup failed: %s", strerror(errno));
+                return std::unique_ptr<IOUring>();
+            }
+            // Segment files are written at their current file position, like
+            // write(2) does.
+            if ((params.features & IORING_FEAT_RW_CUR_POS) == 0)
+            {
+                error = "io_uring does not support writing at the current file "
+                        "position (needs Linux 5.6 or newer)";
+                return std::unique_ptr<IOUring>();
+            }
+
+            ring->sqEntries = params.sq_entries;
+            ring->sqRingBytes = (params.sq_off.array +
+                                 params.sq_entries * sizeof(uint32_t));
+            ring->cqRingBytes = (params.cq_off.cqes +
+                                 params.cq_entries * sizeof(struct io_uring_cqe));
+            bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (singleMmap)
+            {
+                ring->sqRingBytes = std::max(ring->sqRingBytes,
+                                             ring->cqRingBytes);
+            }
+
+            void *sqRing = mmap(NULL, ring->sqRingBytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE,
+                                ring->ringFd, IORING_OFF_SQ_RING);
+            if (sqRing == MAP_FAILED)
+            {
+                error = format("mmap of io_uring submission queue failed: %s",
+                               strerror(errno));
+                return std::unique_ptr<IOUring>();
+            }
+            ring->sqRing = sqRing;
+
+            void *cqBase = sqRing;
+            if (!singleMmap)
+            {
+                void *cqRing = mmap(NULL, ring->cqRingBytes,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE,
+                                    ring->ringFd, IORING_OFF_CQ_RING);
+                if (cqRing == MAP_FAILED)
+                {
+                    error = format("mmap of io_uring completion queue failed: %s",
+                                   strerror(errno));
+                    return std::unique_ptr<IOUring>();
+                }
+                ring->cqRing = cqRing;
+                cqBase = cqRing;
+            }
+
+            ring->sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+            void *sqes = mmap(NULL, ring->sqesBytes,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              ring->ringFd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED)
+            {
+                error = format("mmap of io_uring submission entries failed: %s",
+                               strerror(errno));
+                return std::unique_ptr<IOUring>();
+            }
+            ring->sqes = sqes;
+
+            ring->sqHead = at<uint32_t>(sqRing, params.sq_off.head);
+            ring->sqTail = at<uint32_t>(sqRing, params.sq_off.tail);
+            ring->sqMask = at<uint32_t>(sqRing, params.sq_off.ring_mask);
+            ring->sqArray = at<uint32_t>(sqRing, params.sq_off.array);
+            ring->cqHead = at<uint32_t>(cqBase, params.cq_off.head);
+            ring->cqTail = at<uint32_t>(cqBase, params.cq_off.tail);
+            ring->cqMask = at<uint32_t>(cqBase, params.cq_off.ring_mask);
+            ring->cqes = static_cast<char *>(cqBase) + params.cq_off.cqes;
+            return ring;
+        }
+
+        std::vector<int64_t>
+        IOUring::run(const std::vector<Request> &requests)
+        {
+            std::lock_guard<std::mutex> lockGuard(mutex);
+            std::vector<int64_t> results(requests.size(), -ECANCELED);
+            size_t begin = 0;
+            while (begin < requests.size())
+            {
+                size_t end = std::min(requests.size(), begin + sqEntries);
+                runChain(requests, begin, end, results);
+                for (size_t i = begin; i < end; ++i)
+                {
+                    // The rest were canceled (results are already -ECANCELED).
+                    if (results.at(i) < 0)
+                        return results;
+                }
+                begin = end;
+            }
+            return results;
+        }
+
+        void
+        IOUring::runChain(const std::vector<Request> &requests,
+                          size_t begin, size_t end,
+                          std::vector<int64_t> &results)
+        {
+            struct io_uring_sqe *sqeArray =
+                static_cast<struct io_uring_sqe *>(sqes);
+            struct io_uring_cqe *cqeArray =
+                static_cast<struct io_uring_cqe *>(cqes);
+
+            // This is the only thread producing submissions (see #mutex), so
+            // the tail can be read without synchronization.
+            uint32_t tail = *sqTail;
+            for (size_t i = begin; i < end; ++i)
+            {
+                const Request &request = requests.at(i);
+                uint32_t index = tail & *sqMask;
+                struct io_uring_sqe &sqe = sqeArray[index];
+                memset(&sqe, 0, sizeof(sqe));
+                sqe.fd = request.fd;
+                switch (request.type)
+                {
+                case Request::WRITEV:
+                    sqe.opcode = IORING_OP_WRITEV;
+                    sqe.addr = reinterpret_cast<uint64_t>(request.iov.data());
+                    sqe.len = uint32_t(request.iov.size());
+                    // -1 means the current file position, which is advanced.
+                    sqe.off = ~0UL;
+                    break;
+                case Request::FSYNC:
+                    sqe.opcode = IORING_OP_FSYNC;
+                    break;
+                case Request::FDATASYNC:
+                    sqe.opcode = IORING_OP_FSYNC;
+                    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+                    break;
+                }
+                if (i + 1 < end)
+                    sqe.flags = IOSQE_IO_LINK;
+                sqe.user_data = i;
+                sqArray[index] = index;
+                ++tail;
+            }
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+            uint32_t toSubmit = uint32_t(end - begin);
+            size_t numCompleted = 0;
+            while (numCompleted < end - begin)
+            {
+                long r = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1,
+                                 IORING_ENTER_GETEVENTS, NULL, 0);
+                if (r < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    PANIC("io_uring_enter failed: %s", strerror(errno));
+                }
+                toSubmit -= uint32_t(r);
+                uint32_t head = *cqHead;
+                uint32_t cqTailNow = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+                while (head != cqTailNow)
+                {
+                    const struct io_uring_cqe &cqe = cqeArray[head & *cqMask];
+                    results.at(cqe.user_data) = cqe.res;
+                    ++numCompleted;
+                    ++head;
+                }
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            }
+        }
+
+    } // namespace LogCabin::Storage
+} // namespace LogCabin
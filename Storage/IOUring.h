@@ -0,0 +1,168 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file
+ * Contains a minimal wrapper around Linux's io_uring interface, used to
+ * execute file writes and flushes as a batch.
+ */
+
+#include <cinttypes>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+#ifndef LOGCABIN_STORAGE_IOURING_H
+#define LOGCABIN_STORAGE_IOURING_H
+
+namespace LogCabin {
+namespace Storage {
+
+/**
+ * Submits file operations to the kernel through an io_uring submission queue
+ * and waits for them to complete. This talks to the kernel with the raw
+ * system calls, so it doesn't need liburing.
+ *
+ * Only the operations that SegmentedLog::Sync needs on its fast path are
+ * supported: vectored writes at the current file position, fsync, and
+ * fdatasync. Each call to run() submits its requests as a single linked
+ * chain, so the kernel executes them one after another in order, the same as
+ * if they were issued as blocking system calls.
+ *
+ * This class is thread-safe.
+ */
+class IOUring {
+  public:
+    /**
+     * A single operation for run().
+     */
+    struct Request {
+        enum Type {
+            /// Write 'iov' to 'fd' at its current file position.
+            WRITEV,
+            /// fsync() 'fd'.
+            FSYNC,
+            /// fdatasync() 'fd'.
+            FDATASYNC,
+        };
+        Request(int fd, Type type)
+            : fd(fd)
+            , type(type)
+            , iov()
+        {
+        }
+        int fd;
+        Type type;
+        /// Buffers to write, for WRITEV. These are not copied.
+        std::vector<struct iovec> iov;
+    };
+
+    /**
+     * Set up a new io_uring.
+     * \param entries
+     *      The size of the submission queue. Longer lists of requests passed
+     *      to run() are split up into chains of at most this many.
+     * \param[out] error
+     *      If io_uring is not available (for example, because the kernel is
+     *      too old or it has been disabled), an explanation is stored here.
+     * \return
+     *      The new IOUring, or NULL if io_uring is not available.
+     */
+    static std::unique_ptr<IOUring> open(uint32_t entries,
+                                         std::string& error);
+
+    /**
+     * Destructor.
+     */
+    ~IOUring();
+
+    /**
+     * Execute the given requests in order and wait for all of them to
+     * complete.
+     * \param requests
+     *      The operations to execute. If one of them fails, the following
+     *      ones in the same chain are canceled.
+     * \return
+     *      One result per request, in the same order: the number of bytes
+     *      written for WRITEV requests and 0 for flushes, or a negated errno
+     *      value (-ECANCELED if an earlier request failed).
+     */
+    std::vector<int64_t> run(const std::vector<Request>& requests);
+
+    /**
+     * Return the number of submission queue entries, as rounded up by the
+     * kernel.
+     */
+    uint32_t getCapacity() const { return sqEntries; }
+
+  private:
+    /// Use open() instead.
+    IOUring();
+
+    /**
+     * Submit requests[begin, end) as one linked chain and store their results
+     * in 'results'. The caller must hold #mutex.
+     */
+    void runChain(const std::vector<Request>& requests,
+                  size_t begin, size_t end,
+                  std::vector<int64_t>& results);
+
+    /**
+     * Serializes run() calls, since a chain must be submitted and reaped as
+     * a unit.
+     */
+    std::mutex mutex;
+
+    /// The file descriptor returned by io_uring_setup().
+    int ringFd;
+
+    /// Mapping of the submission queue ring.
+    void* sqRing;
+    /// Size of #sqRing in bytes.
+    size_t sqRingBytes;
+    /// Mapping of the completion queue ring, or NULL if it shares #sqRing.
+    void* cqRing;
+    /// Size of #cqRing in bytes.
+    size_t cqRingBytes;
+    /// Mapping of the submission queue entries array.
+    void* sqes;
+    /// Size of #sqes in bytes.
+    size_t sqesBytes;
+
+    /// Number of entries in the submission queue.
+    uint32_t sqEntries;
+    /// Pointers into #sqRing.
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t* sqMask;
+    uint32_t* sqArray;
+    /// Pointers into #cqRing (or #sqRing).
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t* cqMask;
+    /// The completion queue entries, within #cqRing (or #sqRing).
+    void* cqes;
+
+    // IOUring is non-copyable.
+    IOUring(const IOUring&) = delete;
+    IOUring& operator=(const IOUring&) = delete;
+};
+
+} // namespace LogCabin::Storage
+} // namespace LogCabin
+
+#endif /* LOGCABIN_STORAGE_IOURING_H */
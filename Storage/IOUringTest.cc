@@ -0,0 +1,123 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+
+#include "Storage/FilesystemUtil.h"
+#include "Storage/IOUring.h"
+
+namespace LogCabin {
+namespace Storage {
+namespace {
+
+namespace FS = FilesystemUtil;
+typedef IOUring::Request Request;
+
+class StorageIOUringTest : public ::testing::Test {
+  public:
+    StorageIOUringTest()
+        : tmpdir()
+        , ring()
+    {
+        std::string path = FS::mkdtemp();
+        tmpdir = FS::File(open(path.c_str(), O_RDONLY|O_DIRECTORY), path);
+        std::string error;
+        ring = IOUring::open(4, error);
+        if (!ring)
+            std::cerr << "Skipping io_uring test: " << error << std::endl;
+    }
+    ~StorageIOUringTest() {
+        ring.reset();
+        FS::remove(tmpdir.path);
+    }
+    static struct iovec iov(const char* s) {
+        struct iovec v;
+        v.iov_base = const_cast<char*>(s);
+        v.iov_len = strlen(s);
+        return v;
+    }
+    std::string read(const FS::File& file) {
+        FS::FileContents contents(file);
+        return std::string(contents.get<char>(0, contents.getFileLength()),
+                           contents.getFileLength());
+    }
+    FS::File tmpdir;
+    std::unique_ptr<IOUring> ring;
+};
+
+TEST_F(StorageIOUringTest, run_basic) {
+    if (!ring)
+        return;
+    FS::File file = FS::openFile(tmpdir, "a", O_CREAT|O_RDWR);
+    FS::write(file.fd, "abc", 3);
+    std::vector<Request> requests;
+    requests.emplace_back(file.fd, Request::WRITEV);
+    requests.back().iov.push_back(iov("hello "));
+    requests.back().iov.push_back(iov("world"));
+    requests.emplace_back(file.fd, Request::FDATASYNC);
+    requests.emplace_back(file.fd, Request::WRITEV);
+    requests.back().iov.push_back(iov("!"));
+    requests.emplace_back(file.fd, Request::FSYNC);
+    EXPECT_EQ((std::vector<int64_t> {11, 0, 1, 0}),
+              ring->run(requests));
+    // writes continue from, and advance, the file position
+    EXPECT_EQ("abchello world!", read(file));
+    FS::write(file.fd, "?", 1);
+    EXPECT_EQ("abchello world!?", read(file));
+}
+
+TEST_F(StorageIOUringTest, run_longerThanCapacity) {
+    if (!ring)
+        return;
+    FS::File file = FS::openFile(tmpdir, "a", O_CREAT|O_RDWR);
+    std::vector<Request> requests;
+    std::string expected;
+    for (uint32_t i = 0; i < ring->getCapacity() * 3 + 1; ++i) {
+        requests.emplace_back(file.fd, Request::WRITEV);
+        requests.back().iov.push_back(iov(i % 2 == 0 ? "x" : "yz"));
+        expected += (i % 2 == 0 ? "x" : "yz");
+    }
+    std::vector<int64_t> results = ring->run(requests);
+    ASSERT_EQ(requests.size(), results.size());
+    for (size_t i = 0; i < results.size(); ++i)
+        EXPECT_EQ(i % 2 == 0 ? 1 : 2, results.at(i)) << i;
+    EXPECT_EQ(expected, read(file));
+}
+
+TEST_F(StorageIOUringTest, run_error) {
+    if (!ring)
+        return;
+    FS::File file = FS::openFile(tmpdir, "a", O_CREAT|O_RDWR);
+    std::vector<Request> requests;
+    requests.emplace_back(file.fd, Request::WRITEV);
+    requests.back().iov.push_back(iov("a"));
+    requests.emplace_back(-1, Request::FDATASYNC);
+    requests.emplace_back(file.fd, Request::WRITEV);
+    requests.back().iov.push_back(iov("b"));
+    EXPECT_EQ((std::vector<int64_t> {1, -EBADF, -ECANCELED}),
+              ring->run(requests));
+    EXPECT_EQ("a", read(file));
+
+    // the ring is still usable afterwards
+    requests.erase(requests.begin(), requests.begin() + 2);
+    EXPECT_EQ((std::vector<int64_t> {1}), ring->run(requests));
+    EXPECT_EQ("ab", read(file));
+}
+
+} // namespace LogCabin::Storage::<anonymous>
+} // namespace LogCabin::Storage
+} // namespace LogCabin
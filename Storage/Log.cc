@@ -51,6 +51,20 @@ Log::~Log()
 {
 }
 
+Core::Buffer
+Log::getEntryBytes(uint64_t index) const
+{
+    Core::Buffer bytes;
+    Core::ProtoBuf::serialize(getEntry(index), bytes);
+    return bytes;
+}
+
+Protocol::Raft::EntryType
+Log::getEntryType(uint64_t index) const
+{
+    return getEntry(index).type();
+}
+
 std::ostream&
 operator<<(std::ostream& os, const Log& log)
 {
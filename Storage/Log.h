@@ -19,6 +19,7 @@
 
 #include "build/Protocol/Raft.pb.h"
 #include "build/Protocol/RaftLogMetadata.pb.h"
+#include "Core/Buffer.h"
 
 #ifndef LOGCABIN_STORAGE_LOG_H
 #define LOGCABIN_STORAGE_LOG_H
@@ -97,10 +98,42 @@ class Log {
      *      Otherwise, this will crash the server.
      * \return
      *      The entry corresponding to that index. This reference is only
-     *      guaranteed to be valid until the next time the log is modified.
+     *      guaranteed to be valid until the next time the log is modified or
+     *      getEntry() is called again, since logs may read older entries
+     *      back from disk into a bounded cache.
      */
     virtual const Entry& getEntry(uint64_t index) const = 0;
 
+    /**
+     * Look up an entry by its log index, in serialized form. Leaders use this
+     * to place entries into AppendEntries requests without parsing and
+     * re-serializing them.
+     * \param index
+     *      Must be in the range [getLogStartIndex(), getLastLogIndex()].
+     *      Otherwise, this will crash the server.
+     * \return
+     *      The same bytes as getEntry(index).SerializeToString() would
+     *      produce. The buffer may refer to memory owned by the log, in which
+     *      case it is only guaranteed to be valid until the next time the log
+     *      is modified. The default implementation serializes the entry on
+     *      every call; logs that keep their entries' serialized forms around
+     *      should override this.
+     */
+    virtual Core::Buffer getEntryBytes(uint64_t index) const;
+
+    /**
+     * Look up the type of an entry by its log index. RaftConsensus uses this
+     * to find configuration entries without reading every entry.
+     * \param index
+     *      Must be in the range [getLogStartIndex(), getLastLogIndex()].
+     *      Otherwise, this will crash the server.
+     * \return
+     *      The same value as getEntry(index).type(). The default
+     *      implementation calls getEntry(); logs that don't keep all of their
+     *      entries in memory should override this.
+     */
+    virtual Protocol::Raft::EntryType getEntryType(uint64_t index) const;
+
     /**
      * Get the index of the first entry in the log (whether or not this
      * entry exists).
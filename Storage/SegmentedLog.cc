@@ -19,12 +19,15 @@
 #include <endian.h>
 
 #include <algorithm>
+#include <atomic>
+#include <climits>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "build/Protocol/Raft.pb.h"
 #include "Core/Checksum.h"
+#include "Core/Config.h"
 #include "Core/Debug.h"
 #include "Core/ProtoBuf.h"
 #include "Core/StringUtil.h"
@@ -74,6 +77,54 @@ namespace LogCabin
                 return true;
             }
 
+            /**
+             * Set up the IOUring selected by the 'storageIOBackend' config
+             * option, or return NULL to use blocking system calls.
+             */
+            std::unique_ptr<IOUring>
+            openIOBackend(const Core::Config &config)
+            {
+                std::string backend = config.read<std::string>(
+                    "storageIOBackend", "sync");
+                if (backend == "sync")
+                    return std::unique_ptr<IOUring>();
+                if (backend != "io_uring")
+                {
+                    PANIC("Unknown storageIOBackend: %s (expected sync or "
+                          "io_uring)",
+                          backend.c_str());
+                }
+                // A Sync usually needs only a few entries, since consecutive
+                // writes are combined. Longer batches are split up.
+                std::string error;
+                std::unique_ptr<IOUring> ring = IOUring::open(64, error);
+                if (!ring)
+                {
+                    WARNING("Can't use io_uring for the log (%s). Falling back "
+                            "to blocking system calls.",
+                            error.c_str());
+                }
+                return ring;
+            }
+
+            /**
+             * Return the segment version selected by the
+             * 'storageSegmentVersion' config option.
+             */
+            uint8_t
+            readSegmentVersion(const Core::Config &config)
+            {
+                uint64_t version = config.read<uint64_t>(
+                    "storageSegmentVersion", 2);
+                if (version != 1 && version != 2)
+                {
+                    PANIC("Unknown storageSegmentVersion: %lu (expected 1 or "
+                          "2)",
+                          version);
+                }
+                return uint8_t(version);
+            }
+
         } // anonymous namespace
 
         ////////// SegmentedLog::PreparedSegments //////////
@@ -177,8 +228,9 @@ namespace LogCabin
         ////////// SegmentedLog::Sync //////////
 
         SegmentedLog::Sync::Sync(uint64_t lastIndex,
-                                 std::chrono::nanoseconds diskWriteDurationThreshold)
-            : Log::Sync(lastIndex), diskWriteDurationThreshold(diskWriteDurationThreshold), ops(), waitStart(TimePoint::max()), waitEnd(TimePoint::max())
+                                 std::chrono::nanoseconds diskWriteDurationThreshold,
+                                 IOUring *ioUring)
+            : Log::Sync(lastIndex), diskWriteDurationThreshold(diskWriteDurationThreshold), ioUring(ioUring), ops(), waitStart(TimePoint::max()), waitEnd(TimePoint::max())
         {
         }
 
@@ -228,22 +280,48 @@ namespace LogCabin
             while (!ops.empty())
             {
                 Op &op = ops.front();
+                if (ioUring != NULL &&
+                    (op.opCode == Op::WRITE ||
+                     op.opCode == Op::FDATASYNC ||
+                     op.opCode == Op::FSYNC))
+                {
+                    waitIOUring(writes, totalBytesWritten, fdatasyncs, fsyncs);
+                    continue;
+                }
                 FS::File f(op.fd, "-unknown-");
                 switch (op.opCode)
                 {
                 case Op::WRITE:
                 {
-                    ssize_t written = FS::write(op.fd,
-                                                op.writeData.getData(),
-                                                op.writeData.getLength());
+                    // Write this and any directly following writes to the
+                    // same file with a single writev. The iovecs point into
+                    // the ops' buffers, which stay in #ops until the write
+                    // completes.
+                    std::vector<struct iovec> iov;
+                    auto it = ops.begin();
+                    while (it != ops.end() &&
+                           it->opCode == Op::WRITE &&
+                           it->fd == op.fd)
+                    {
+                        struct iovec v;
+                        v.iov_base = const_cast<void *>(it->writeData.getData());
+                        v.iov_len = it->writeData.getLength();
+                        iov.push_back(v);
+                        ++writes;
+                        totalBytesWritten += v.iov_len;
+                        ++it;
+                    }
+                    ssize_t written = FS::writev(op.fd, std::move(iov));
                     if (written < 0)
                     {
                         PANIC("Failed to write to fd %d: %s",
                               op.fd,
                               strerror(errno));
                     }
-                    ++writes;
-                    totalBytesWritten += op.writeData.getLength();
+                    // Leave the first of these writes (op itself) for the
+                    // pop_front below. Erasing from the middle of a deque
+                    // invalidates references, so op can't be used after this.
+                    ops.erase(ops.begin() + 1, it);
                     break;
                 }
                 case Op::TRUNCATE:
@@ -312,6 +390,116 @@ namespace LogCabin
             }
         }
 
+        void
+        SegmentedLog::Sync::waitIOUring(uint64_t &writes,
+                                        uint64_t &totalBytesWritten,
+                                        uint64_t &fdatasyncs,
+                                        uint64_t &fsyncs)
+        {
+            typedef IOUring::Request Request;
+            std::vector<Request> requests;
+            std::vector<uint64_t> requestBytes;
+            size_t numOps = 0;
+            for (auto it = ops.begin(); it != ops.end(); ++it)
+            {
+                const Op &op = *it;
+                if (op.opCode == Op::WRITE)
+                {
+                    if (requests.empty() ||
+                        requests.back().type != Request::WRITEV ||
+                        requests.back().fd != op.fd ||
+                        requests.back().iov.size() >= IOV_MAX)
+                    {
+                        requests.emplace_back(op.fd, Request::WRITEV);
+                        requestBytes.push_back(0);
+                    }
+                    struct iovec iov;
+                    iov.iov_base = const_cast<void *>(op.writeData.getData());
+                    iov.iov_len = op.writeData.getLength();
+                    requests.back().iov.push_back(iov);
+                    requestBytes.back() += iov.iov_len;
+                    ++writes;
+                    totalBytesWritten += iov.iov_len;
+                }
+                else if (op.opCode == Op::FDATASYNC || op.opCode == Op::FSYNC)
+                {
+                    if (op.opCode == Op::FDATASYNC)
+                        ++fdatasyncs;
+                    else
+                        ++fsyncs;
+                    if (!FS::skipFsync)
+                    {
+                        requests.emplace_back(op.fd,
+                                              (op.opCode == Op::FDATASYNC
+                                                   ? Request::FDATASYNC
+                                                   : Request::FSYNC));
+                        requestBytes.push_back(0);
+                    }
+                }
+                else if (op.opCode != Op::NOOP)
+                {
+                    break;
+                }
+                ++numOps;
+            }
+
+            std::vector<int64_t> results = ioUring->run(requests);
+            for (size_t i = 0; i < requests.size(); ++i)
+            {
+                const Request &request = requests.at(i);
+                int64_t result = results.at(i);
+                // Requests after a failed one in the chain are canceled, and
+                // a short write counts as a failure. Finish those
+                // synchronously, in order.
+                if (result < 0 && result != -ECANCELED)
+                {
+                    PANIC("Failed to %s fd %d through io_uring: %s",
+                          (request.type == Request::WRITEV ? "write to"
+                                                           : "flush"),
+                          request.fd,
+                          strerror(int(-result)));
+                }
+                if (request.type == Request::WRITEV)
+                {
+                    uint64_t skip = (result < 0 ? 0 : uint64_t(result));
+                    if (skip == requestBytes.at(i))
+                        continue;
+                    for (auto it = request.iov.begin();
+                         it != request.iov.end();
+                         ++it)
+                    {
+                        if (skip >= it->iov_len)
+                        {
+                            skip -= it->iov_len;
+                            continue;
+                        }
+                        ssize_t written = FS::write(
+                            request.fd,
+                            static_cast<const char *>(it->iov_base) + skip,
+                            it->iov_len - skip);
+                        if (written < 0)
+                        {
+                            PANIC("Failed to write to fd %d: %s",
+                                  request.fd,
+                                  strerror(errno));
+                        }
+                        skip = 0;
+                    }
+                }
+                else if (result == -ECANCELED)
+                {
+                    FS::File f(request.fd, "-unknown-");
+                    if (request.type == Request::FDATASYNC)
+                        FS::fdatasync(f);
+                    else
+                        FS::fsync(f);
+                    f.release();
+                }
+            }
+
+            ops.erase(ops.begin(), ops.begin() + int64_t(numOps));
+        }
+
         void
         SegmentedLog::Sync::updateStats(Core::RollingStat &nanos) const
         {
@@ -323,15 +511,15 @@ namespace LogCabin
 
         ////////// SegmentedLog::Segment::Record //////////
 
-        SegmentedLog::Segment::Record::Record(uint64_t offset)
-            : offset(offset), entry()
+        SegmentedLog::Segment::Record::Record()
+            : entry(), serialized()
         {
         }
 
         ////////// SegmentedLog::Segment //////////
 
         SegmentedLog::Segment::Segment()
-            : isOpen(false), startIndex(~0UL), endIndex(~0UL - 1), bytes(0), filename("--invalid--"), entries()
+            : isOpen(false), startIndex(~0UL), endIndex(~0UL - 1), bytes(0), filename("--invalid--"), version(0), offsets(), types(), entries(), contents()
         {
         }
 
@@ -347,7 +535,7 @@ namespace LogCabin
         SegmentedLog::SegmentedLog(const FS::File &parentDir,
                                    Encoding encoding,
                                    const Core::Config &config)
-            : encoding(encoding), checksumAlgorithm(config.read<std::string>("storageChecksum", "CRC32")), MAX_SEGMENT_SIZE(config.read<uint64_t>("storageSegmentBytes",
+            : encoding(encoding), checksumAlgorithm(config.read<std::string>("storageChecksum", "CRC32")), SEGMENT_VERSION(readSegmentVersion(config)), MAX_SEGMENT_SIZE(config.read<uint64_t>("storageSegmentBytes",
                                                                                                                                                   8 * 1024 * 1024)),
               shouldCheckInvariants(config.read<bool>("storageDebug", false)), diskWriteDurationThreshold(config.read<uint64_t>(
                                                                                                               "electionTimeoutMilliseconds", 500) /
@@ -359,7 +547,9 @@ namespace LogCabin
               openSegmentFile(), logStartIndex(1), segmentsByStartIndex(), totalClosedSegmentBytes(0), preparedSegments(
                                                                                                            std::max(config.read<uint64_t>("storageOpenSegments", 3),
                                                                                                                     1UL)),
-              currentSync(new SegmentedLog::Sync(0, diskWriteDurationThreshold)), metadataWriteNanos(), filesystemOpsNanos(), segmentPreparer()
+              ioUring(openIOBackend(config)), currentSync(new SegmentedLog::Sync(0, diskWriteDurationThreshold, ioUring.get())), MAX_CACHED_ENTRIES(std::max(config.read<uint64_t>("storageEntryCacheSize", 10000),
+                                                                                                                                                                            1UL)),
+              entryCache(), entryCacheByIndex(), numEntryCacheHits(0), numEntryCacheMisses(0), metadataWriteNanos(), filesystemOpsNanos(), startupLoadNanos(0), startupLoadThreads(0), startupSegmentsLoaded(0), startupBytesLoaded(0), segmentPreparer()
         {
             std::vector<Segment> segments = readSegmentFilenames();
 
@@ -402,15 +592,29 @@ namespace LogCabin
             updateMetadata();
             FS::fsync(dir); // in case metadata files didn't exist
 
-            // Read data from segments, closing any open segments.
-            for (auto it = segments.begin(); it != segments.end(); ++it)
+            // Read data from segments, closing any open segments. The closed
+            // segments are independent of each other, so they're read in
+            // parallel.
+            TimePoint loadStart = Clock::now();
+            std::vector<uint8_t> keep = loadClosedSegments(
+                segments,
+                logStartIndex,
+                config.read<uint64_t>("storageLoadThreads",
+                                      std::thread::hardware_concurrency()));
+            for (uint64_t i = 0; i < segments.size(); ++i)
             {
-                Segment &segment = *it;
-                bool keep = segment.isOpen ? loadOpenSegment(segment, logStartIndex)
-                                           : loadClosedSegment(segment, logStartIndex);
-                if (keep)
+                if (segments.at(i).isOpen)
+                    keep.at(i) = loadOpenSegment(segments.at(i), logStartIndex);
+            }
+            for (uint64_t i = 0; i < segments.size(); ++i)
+            {
+                Segment &segment = segments.at(i);
+                if (keep.at(i))
                 {
                     assert(!segment.isOpen);
+                    ++startupSegmentsLoaded;
+                    startupBytesLoaded += segment.bytes;
+                    totalClosedSegmentBytes += segment.bytes;
                     uint64_t startIndex = segment.startIndex;
                     std::string filename = segment.filename;
                     auto result = segmentsByStartIndex.insert({startIndex,
@@ -425,6 +629,16 @@ namespace LogCabin
                     }
                 }
             }
+            startupLoadNanos = uint64_t(std::chrono::nanoseconds(
+                                            Clock::now() - loadStart)
+                                            .count());
+            NOTICE("Loaded %lu segments (%lu bytes) in %s using %lu threads",
+                   startupSegmentsLoaded,
+                   startupBytesLoaded,
+                   Core::StringUtil::toString(
+                       std::chrono::nanoseconds(startupLoadNanos))
+                       .c_str(),
+                   startupLoadThreads);
 
             // Check to make sure no entry is present in more than one segment,
             // and that there's no gap in the numbering for entries we have.
@@ -502,8 +716,7 @@ namespace LogCabin
             uint64_t index = startIndex;
             for (auto it = entries.begin(); it != entries.end(); ++it)
             {
-                Segment::Record record(openSegment->bytes);
-                // Note that record.offset may change later, if this entry doesn't fit.
+                Segment::Record record;
                 record.entry = **it;
                 if (record.entry.index() != 0)
                 {
@@ -513,7 +726,7 @@ namespace LogCabin
                 {
                     record.entry.set_index(index);
                 }
-                Core::Buffer buf = serializeProto(record.entry);
+                Core::Buffer buf = makeEntryRecord(record);
 
                 // See if we need to roll over to a new head segment. If someone is
                 // writing an entry that is bigger than MAX_SEGMENT_SIZE, just put it
@@ -557,7 +770,6 @@ namespace LogCabin
                     // Open new segment.
                     openNewSegment();
                     openSegment = &getOpenSegment();
-                    record.offset = openSegment->bytes;
                 }
 
                 if (buf.getLength() > MAX_SEGMENT_SIZE)
@@ -570,6 +782,8 @@ namespace LogCabin
                             MAX_SEGMENT_SIZE);
                 }
 
+                openSegment->offsets.push_back(openSegment->bytes);
+                openSegment->types.push_back(uint8_t(record.entry.type()));
                 openSegment->entries.emplace_back(std::move(record));
                 openSegment->bytes += buf.getLength();
                 currentSync->ops.emplace_back(openSegmentFile.fd, Sync::Op::WRITE);
@@ -586,6 +800,12 @@ namespace LogCabin
 
         const SegmentedLog::Entry &
         SegmentedLog::getEntry(uint64_t index) const
+        {
+            return getRecord(index).entry;
+        }
+
+        Protocol::Raft::EntryType
+        SegmentedLog::getEntryType(uint64_t index) const
         {
             if (index < getLogStartIndex() ||
                 index > getLastLogIndex())
@@ -597,9 +817,29 @@ namespace LogCabin
             auto it = segmentsByStartIndex.upper_bound(index);
             --it;
             const Segment &segment = it->second;
-            assert(segment.startIndex <= index);
-            assert(index <= segment.endIndex);
-            return segment.entries.at(index - segment.startIndex).entry;
+            return Protocol::Raft::EntryType(
+                segment.types.at(index - segment.startIndex));
+        }
+
+        Core::Buffer
+        SegmentedLog::getEntryBytes(uint64_t index) const
+        {
+            const Segment::Record &record = getRecord(index);
+            const std::string &serialized = record.serialized;
+            if (entryCacheByIndex.find(index) == entryCacheByIndex.end())
+            {
+                return Core::Buffer(const_cast<char *>(serialized.data()),
+                                    serialized.length(),
+                                    NULL);
+            }
+            // Records in the cache can be evicted by later calls, so the
+            // caller gets its own copy.
+            return Core::Buffer(
+                memcpy(new char[serialized.length()],
+                       serialized.data(),
+                       serialized.length()),
+                serialized.length(),
+                Core::Buffer::deleteArrayFn<char>);
         }
 
         uint64_t
@@ -640,7 +880,8 @@ namespace LogCabin
         {
             std::unique_ptr<SegmentedLog::Sync> other(
                 new SegmentedLog::Sync(getLastLogIndex(),
-                                       diskWriteDurationThreshold));
+                                       diskWriteDurationThreshold,
+                                       ioUring.get()));
             std::swap(other, currentSync);
             return other;
         }
@@ -649,6 +890,7 @@ namespace LogCabin
         SegmentedLog::syncCompleteVirtual(std::unique_ptr<Log::Sync> sync)
         {
             static_cast<SegmentedLog::Sync *>(sync.get())->updateStats(filesystemOpsNanos);
+            releaseClosedSegments(sync->lastIndex);
         }
 
         void
@@ -660,6 +902,8 @@ namespace LogCabin
             NOTICE("Truncating log to start at index %lu (was %lu)",
                    newStartIndex, logStartIndex);
             logStartIndex = newStartIndex;
+            entryCache.clear();
+            entryCacheByIndex.clear();
             // update metadata before removing files in case of interruption
             updateMetadata();
 
@@ -700,6 +944,8 @@ namespace LogCabin
 
             NOTICE("Truncating log to end at index %lu (was %lu)",
                    newEndIndex, getLastLogIndex());
+            entryCache.clear();
+            entryCacheByIndex.clear();
             { // Check if the open segment has some entries we need. If so,
               // just truncate that segment, open a new one, and return.
                 Segment &openSegment = getOpenSegment();
@@ -707,7 +953,9 @@ namespace LogCabin
                 {
                     // Update in-memory segment
                     uint64_t i = newEndIndex + 1 - openSegment.startIndex;
-                    openSegment.bytes = openSegment.entries.at(i).offset;
+                    openSegment.bytes = openSegment.offsets.at(i);
+                    openSegment.offsets.resize(i);
+                    openSegment.types.resize(i);
                     openSegment.entries.erase(
                         openSegment.entries.begin() + int64_t(i),
                         openSegment.entries.end());
@@ -746,12 +994,19 @@ namespace LogCabin
                 { // truncate segment
                     // Update in-memory segment
                     uint64_t i = newEndIndex + 1 - segment.startIndex;
-                    uint64_t newBytes = segment.entries.at(i).offset;
+                    uint64_t newBytes = segment.offsets.at(i);
                     totalClosedSegmentBytes -= (segment.bytes - newBytes);
                     segment.bytes = newBytes;
-                    segment.entries.erase(
-                        segment.entries.begin() + int64_t(i),
-                        segment.entries.end());
+                    segment.offsets.resize(i);
+                    segment.types.resize(i);
+                    if (!segment.entries.empty())
+                    {
+                        segment.entries.erase(
+                            segment.entries.begin() + int64_t(i),
+                            segment.entries.end());
+                    }
+                    // The file is about to shrink underneath the mapping.
+                    segment.contents.reset();
                     segment.endIndex = newEndIndex;
 
                     // Rename the file
@@ -833,7 +1088,14 @@ namespace LogCabin
             stats.set_num_segments(segmentsByStartIndex.size());
             stats.set_open_segment_bytes(getOpenSegment().bytes);
             stats.set_metadata_version(metadata.version());
+            stats.set_num_cached_entries(entryCache.size());
+            stats.set_num_entry_cache_hits(numEntryCacheHits);
+            stats.set_num_entry_cache_misses(numEntryCacheMisses);
             metadataWriteNanos.updateProtoBuf(*stats.mutable_metadata_write_nanos());
+            stats.set_startup_load_nanos(startupLoadNanos);
+            stats.set_startup_load_threads(startupLoadThreads);
+            stats.set_startup_segments_loaded(startupSegmentsLoaded);
+            stats.set_startup_bytes_loaded(startupBytesLoaded);
             filesystemOpsNanos.updateProtoBuf(*stats.mutable_filesystem_ops_nanos());
         }
 
@@ -943,6 +1205,50 @@ namespace LogCabin
             }
         }
 
+        std::vector<uint8_t>
+        SegmentedLog::loadClosedSegments(std::vector<Segment> &segments,
+                                         uint64_t logStartIndex,
+                                         uint64_t numThreads)
+        {
+            std::vector<uint8_t> keep(segments.size(), 0);
+            uint64_t numClosed = 0;
+            for (auto it = segments.begin(); it != segments.end(); ++it)
+            {
+                if (!it->isOpen)
+                    ++numClosed;
+            }
+            numThreads = std::max(1UL, std::min(numThreads, numClosed));
+            startupLoadThreads = numThreads;
+
+            // Each thread claims the next unclaimed segment until none are
+            // left. Segments are only read and possibly removed here, so they
+            // don't interact until the caller puts them together.
+            std::atomic<uint64_t> nextSegment(0);
+            auto loadMain = [&]() {
+                while (true)
+                {
+                    uint64_t i = nextSegment.fetch_add(1);
+                    if (i >= segments.size())
+                        return;
+                    if (!segments.at(i).isOpen)
+                        keep.at(i) = loadClosedSegment(segments.at(i),
+                                                       logStartIndex);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (uint64_t i = 1; i < numThreads; ++i)
+            {
+                threads.emplace_back([&loadMain]() {
+                    Core::ThreadId::setName("SegmentLoader");
+                    loadMain();
+                });
+            }
+            loadMain();
+            for (auto it = threads.begin(); it != threads.end(); ++it)
+                it->join();
+            return keep;
+        }
+
         bool
         SegmentedLog::loadClosedSegment(Segment &segment, uint64_t logStartIndex)
         {
@@ -961,13 +1267,14 @@ namespace LogCabin
             {
                 uint8_t version = *reader.get<uint8_t>(0, 1);
                 offset += 1;
-                if (version != 1)
+                if (version != 1 && version != 2)
                 {
                     PANIC("Segment version read from %s was %u, but this code can "
-                          "only read version 1",
+                          "only read versions 1 and 2",
                           segment.filename.c_str(),
                           version);
                 }
+                segment.version = version;
             }
 
             if (segment.endIndex < logStartIndex)
@@ -993,9 +1300,16 @@ namespace LogCabin
                 }
                 else
                 {
-                    segment.entries.emplace_back(offset);
-                    error = readProtoFromFile(file, reader, &offset,
-                                              &segment.entries.back().entry);
+                    // The entry is only read to verify it. Closed segments
+                    // keep just the offsets of their entries in memory.
+                    segment.offsets.push_back(offset);
+                    uint64_t entryIndex = 0;
+                    Protocol::Raft::EntryType type = Protocol::Raft::EntryType::UNKNOWN;
+                    error = readEntry(file, reader, segment.version,
+                                      &offset, &entryIndex, NULL, NULL, &type);
+                    segment.types.push_back(uint8_t(type));
+                    if (error.empty() && entryIndex != index)
+                        error = format("Found entry %lu instead", entryIndex);
                 }
                 if (!error.empty())
                 {
@@ -1020,7 +1334,6 @@ namespace LogCabin
                 FS::fsync(file);
             }
             segment.bytes = offset;
-            totalClosedSegmentBytes += segment.bytes;
             return true;
         }
 
@@ -1042,7 +1355,8 @@ namespace LogCabin
             {
                 uint8_t version = *reader.get<uint8_t>(0, 1);
                 offset += 1;
-                if (version != 1)
+                segment.version = version;
+                if (version != 1 && version != 2)
                 {
                     uint64_t remainingBytes = reader.getFileLength() - offset;
                     if (version == 0 &&
@@ -1057,25 +1371,25 @@ namespace LogCabin
                     else
                     {
                         PANIC("Segment version read from %s was %u, "
-                              "but this code can only read version 1",
+                              "but this code can only read versions 1 and 2",
                               segment.filename.c_str(),
                               version);
                     }
                 }
             }
 
+            uint64_t firstIndex = 0;
             uint64_t lastIndex = 0;
             while (offset < reader.getFileLength())
             {
-                segment.entries.emplace_back(offset);
-                std::string error = readProtoFromFile(
-                    file,
-                    reader,
-                    &offset,
-                    &segment.entries.back().entry);
+                uint64_t entryOffset = offset;
+                uint64_t entryIndex = 0;
+                Protocol::Raft::EntryType type = Protocol::Raft::EntryType::UNKNOWN;
+                std::string error = readEntry(file, reader, segment.version,
+                                              &offset, &entryIndex, NULL,
+                                              NULL, &type);
                 if (!error.empty())
                 {
-                    segment.entries.pop_back();
                     uint64_t remainingBytes = reader.getFileLength() - offset;
                     if (isAllZeros(reader.get(offset, remainingBytes),
                                    remainingBytes))
@@ -1107,20 +1421,26 @@ namespace LogCabin
                     FS::fsync(file);
                     break;
                 }
-                lastIndex = segment.entries.back().entry.index();
+                // The segment is closed below, so only the offsets of its
+                // entries are kept in memory.
+                segment.offsets.push_back(entryOffset);
+                segment.types.push_back(uint8_t(type));
+                if (segment.offsets.size() == 1)
+                    firstIndex = entryIndex;
+                lastIndex = entryIndex;
             }
 
             bool remove = false;
-            if (segment.entries.empty())
+            if (segment.offsets.empty())
             {
                 NOTICE("Removing empty segment: %s", segment.filename.c_str());
                 remove = true;
             }
-            else if (segment.entries.back().entry.index() < logStartIndex)
+            else if (lastIndex < logStartIndex)
             {
                 NOTICE("Removing open segment whose entries are no longer "
                        "needed (last index is %lu but log start index is %lu): %s",
-                       segment.entries.back().entry.index(),
+                       lastIndex,
                        logStartIndex,
                        segment.filename.c_str());
                 remove = true;
@@ -1134,10 +1454,9 @@ namespace LogCabin
             else
             {
                 segment.bytes = offset;
-                totalClosedSegmentBytes += segment.bytes;
                 segment.isOpen = false;
-                segment.startIndex = segment.entries.front().entry.index();
-                segment.endIndex = segment.entries.back().entry.index();
+                segment.startIndex = firstIndex;
+                segment.endIndex = lastIndex;
                 std::string newFilename = segment.makeClosedFilename();
                 NOTICE("Closing open segment %s, renaming to %s",
                        segment.filename.c_str(),
@@ -1173,22 +1492,29 @@ namespace LogCabin
                 Segment &segment = it->second;
                 assert(it->first == segment.startIndex);
                 assert(segment.startIndex > 0);
-                assert(segment.entries.size() ==
+                assert(segment.offsets.size() ==
                        segment.endIndex + 1 - segment.startIndex);
+                assert(segment.types.size() == segment.offsets.size());
+                assert(segment.entries.empty() ||
+                       segment.entries.size() == segment.offsets.size());
                 uint64_t lastOffset = 0;
-                for (uint64_t i = 0; i < segment.entries.size(); ++i)
+                for (uint64_t i = 0; i < segment.offsets.size(); ++i)
                 {
-                    assert(segment.entries.at(i).entry.index() ==
-                           segment.startIndex + i);
+                    if (!segment.entries.empty())
+                    {
+                        assert(segment.entries.at(i).entry.index() ==
+                               segment.startIndex + i);
+                    }
                     if (i == 0)
-                        assert(segment.entries.at(0).offset == sizeof(SegmentHeader));
+                        assert(segment.offsets.at(0) == sizeof(SegmentHeader));
                     else
-                        assert(segment.entries.at(i).offset > lastOffset);
-                    lastOffset = segment.entries.at(i).offset;
+                        assert(segment.offsets.at(i) > lastOffset);
+                    lastOffset = segment.offsets.at(i);
                 }
                 if (next == segmentsByStartIndex.end())
                 {
                     assert(segment.isOpen);
+                    assert(segment.entries.size() == segment.offsets.size());
                     assert(segment.endIndex >= segment.startIndex - 1);
                     assert(Core::StringUtil::startsWith(segment.filename, "open-"));
                     assert(segment.bytes >= sizeof(SegmentHeader));
@@ -1204,6 +1530,8 @@ namespace LogCabin
                 }
             }
             assert(closedBytes == totalClosedSegmentBytes);
+            assert(entryCache.size() == entryCacheByIndex.size());
+            assert(entryCache.size() <= MAX_CACHED_ENTRIES);
 #endif /* DEBUG */
         }
 
@@ -1261,6 +1589,91 @@ namespace LogCabin
             return segmentsByStartIndex.rbegin()->second;
         }
 
+        const SegmentedLog::Segment::Record &
+        SegmentedLog::getRecord(uint64_t index) const
+        {
+            if (index < getLogStartIndex() ||
+                index > getLastLogIndex())
+            {
+                PANIC("Attempted to access entry %lu outside of log "
+                      "(start index is %lu, last index is %lu)",
+                      index, getLogStartIndex(), getLastLogIndex());
+            }
+            auto it = segmentsByStartIndex.upper_bound(index);
+            --it;
+            const Segment &segment = it->second;
+            assert(segment.startIndex <= index);
+            assert(index <= segment.endIndex);
+            if (!segment.entries.empty())
+                return segment.entries.at(index - segment.startIndex);
+
+            auto cached = entryCacheByIndex.find(index);
+            if (cached != entryCacheByIndex.end())
+            {
+                ++numEntryCacheHits;
+                entryCache.splice(entryCache.begin(), entryCache, cached->second);
+                return entryCache.front();
+            }
+
+            ++numEntryCacheMisses;
+            if (!segment.contents)
+            {
+                FS::File file = FS::openFile(dir, segment.filename, O_RDONLY);
+                segment.contents.reset(new FS::FileContents(file));
+            }
+            // readEntry only needs a File for its error messages.
+            FS::File file(-1, segment.filename);
+            uint64_t offset = segment.offsets.at(index - segment.startIndex);
+            entryCache.emplace_front();
+            Segment::Record &record = entryCache.front();
+            uint64_t entryIndex = 0;
+            std::string error = readEntry(file,
+                                          *segment.contents,
+                                          segment.version,
+                                          &offset,
+                                          &entryIndex,
+                                          &record.entry,
+                                          &record.serialized);
+            if (!error.empty())
+            {
+                PANIC("Could not read entry %lu in log segment %s "
+                      "(offset %lu bytes). This indicates the file was "
+                      "somehow corrupted. Error was: %s",
+                      index,
+                      segment.filename.c_str(),
+                      offset,
+                      error.c_str());
+            }
+            assert(entryIndex == index);
+            entryCacheByIndex[index] = entryCache.begin();
+            while (entryCache.size() > MAX_CACHED_ENTRIES)
+            {
+                entryCacheByIndex.erase(entryCache.back().entry.index());
+                entryCache.pop_back();
+            }
+            return record;
+        }
+
+        void
+        SegmentedLog::releaseClosedSegments(uint64_t syncedIndex)
+        {
+            // Segments are released oldest to newest, so stop at the first
+            // one that has already been released.
+            auto it = segmentsByStartIndex.rbegin();
+            while (it != segmentsByStartIndex.rend())
+            {
+                Segment &segment = it->second;
+                ++it;
+                // A closed segment's file is complete once the sync that
+                // appended the entry after it has finished.
+                if (segment.isOpen || segment.endIndex >= syncedIndex)
+                    continue;
+                if (segment.entries.empty())
+                    break;
+                std::deque<Segment::Record>().swap(segment.entries);
+            }
+        }
+
         void
         SegmentedLog::openNewSegment()
         {
@@ -1273,6 +1686,7 @@ namespace LogCabin
             newSegment.startIndex = getLastLogIndex() + 1;
             newSegment.endIndex = newSegment.startIndex - 1;
             newSegment.bytes = sizeof(SegmentHeader);
+            newSegment.version = SEGMENT_VERSION;
             // This can throw ThreadInterruptedException, but it shouldn't ever, since
             // this class shouldn't have been destroyed yet.
             auto s = preparedSegments.waitForOpenSegment();
@@ -1285,7 +1699,8 @@ namespace LogCabin
         SegmentedLog::readProtoFromFile(const FS::File &file,
                                         FS::FileContents &reader,
                                         uint64_t *offset,
-                                        google::protobuf::Message *out) const
+                                        google::protobuf::Message *out,
+                                        std::string *serialized) const
         {
             uint64_t loffset = *offset;
             char checksum[Core::Checksum::MAX_LENGTH];
@@ -1334,12 +1749,16 @@ namespace LogCabin
                     return format("Failed to parse protobuf in %s",
                                   file.path.c_str());
                 }
+                if (serialized != NULL)
+                    serialized->assign(static_cast<const char *>(data), dataLen);
                 break;
             }
             case SegmentedLog::Encoding::TEXT:
             {
                 std::string contents(static_cast<const char *>(data), dataLen);
                 Core::ProtoBuf::Internal::fromString(contents, *out);
+                if (serialized != NULL)
+                    out->SerializeToString(serialized);
                 break;
             }
             }
@@ -1347,6 +1766,200 @@ namespace LogCabin
             return "";
         }
 
+        std::string
+        SegmentedLog::readEntry(const FS::File &file,
+                                FS::FileContents &reader,
+                                uint8_t version,
+                                uint64_t *offset,
+                                uint64_t *index,
+                                Log::Entry *out,
+                                std::string *serialized,
+                                Protocol::Raft::EntryType *type) const
+        {
+            if (version == 1)
+            {
+                Log::Entry entry;
+                if (out == NULL)
+                    out = &entry;
+                std::string error = readProtoFromFile(file, reader, offset,
+                                                      out, serialized);
+                if (error.empty())
+                {
+                    *index = out->index();
+                    if (type != NULL)
+                        *type = out->type();
+                }
+                return error;
+            }
+
+            uint64_t loffset = *offset;
+            EntryRecordHeader header;
+            if (reader.copyPartial(loffset, &header, sizeof(header)) <
+                sizeof(header))
+            {
+                return format("Record header truncated in file %s",
+                              file.path.c_str());
+            }
+            uint64_t dataLen = be32toh(header.dataLen);
+            if (reader.getFileLength() < loffset + sizeof(header) + dataLen)
+            {
+                return format("Entry truncated in file %s", file.path.c_str());
+            }
+
+            // The checksum covers everything after itself.
+            uint64_t coverageLen = (sizeof(header) + dataLen -
+                                    sizeof(header.checksum));
+            uint32_t checksum = Core::Checksum::crc32c(
+                reader.get(loffset + sizeof(header.checksum), coverageLen),
+                coverageLen);
+            if (checksum != be32toh(header.checksum))
+            {
+                return format("Checksum verification failure on %s: expected "
+                              "CRC32C %08x but calculated %08x",
+                              file.path.c_str(),
+                              be32toh(header.checksum),
+                              checksum);
+            }
+            loffset += sizeof(header);
+            const void *data = reader.get(loffset, dataLen);
+            loffset += dataLen;
+
+            if (out != NULL)
+            {
+                switch (encoding)
+                {
+                case SegmentedLog::Encoding::BINARY:
+                {
+                    Core::Buffer contents(const_cast<void *>(data),
+                                          dataLen,
+                                          NULL);
+                    if (!Core::ProtoBuf::parse(contents, *out))
+                    {
+                        return format("Failed to parse protobuf in %s",
+                                      file.path.c_str());
+                    }
+                    break;
+                }
+                case SegmentedLog::Encoding::TEXT:
+                {
+                    std::string contents(static_cast<const char *>(data),
+                                         dataLen);
+                    Core::ProtoBuf::Internal::fromString(contents, *out);
+                    break;
+                }
+                }
+                out->set_index(be64toh(header.index));
+                if ((header.type & EntryRecordHeader::TYPE_HAS_TERM) != 0)
+                    out->set_term(be64toh(header.term));
+                if ((header.type & EntryRecordHeader::TYPE_HAS_TYPE) != 0)
+                {
+                    int type = header.type & EntryRecordHeader::TYPE_MASK;
+                    if (!Protocol::Raft::EntryType_IsValid(type))
+                    {
+                        return format("Invalid entry type %d in %s",
+                                      type, file.path.c_str());
+                    }
+                    out->set_type(Protocol::Raft::EntryType(type));
+                }
+                if (serialized != NULL)
+                    out->SerializeToString(serialized);
+            }
+            *index = be64toh(header.index);
+            if (type != NULL)
+            {
+                // Like ProtoBuf, treat types this code doesn't know about as
+                // UNKNOWN; RaftConsensus decides what to do about those.
+                int t = header.type & EntryRecordHeader::TYPE_MASK;
+                if ((header.type & EntryRecordHeader::TYPE_HAS_TYPE) != 0 &&
+                    Protocol::Raft::EntryType_IsValid(t))
+                {
+                    *type = Protocol::Raft::EntryType(t);
+                }
+                else
+                {
+                    *type = Protocol::Raft::EntryType::UNKNOWN;
+                }
+            }
+            *offset = loffset;
+            return "";
+        }
+
+        Core::Buffer
+        SegmentedLog::makeEntryRecord(Segment::Record &record) const
+        {
+            Log::Entry &entry = record.entry;
+            entry.SerializeToString(&record.serialized);
+            if (SEGMENT_VERSION == 1)
+            {
+                if (encoding == Encoding::BINARY)
+                {
+                    return makeRecord(record.serialized.data(),
+                                      record.serialized.length());
+                }
+                return serializeProto(entry);
+            }
+
+            EntryRecordHeader header;
+            header.index = htobe64(entry.index());
+            header.term = htobe64(entry.term());
+            header.type = 0;
+            if (entry.has_term())
+                header.type |= EntryRecordHeader::TYPE_HAS_TERM;
+            if (entry.has_type())
+            {
+                assert((entry.type() & ~EntryRecordHeader::TYPE_MASK) == 0);
+                header.type |= uint8_t(EntryRecordHeader::TYPE_HAS_TYPE |
+                                       entry.type());
+            }
+
+            // The header has the index, term, and type, so they're left out
+            // of the encoded entry. They're restored afterwards.
+            uint64_t index = entry.index();
+            bool hasTerm = entry.has_term();
+            uint64_t term = entry.term();
+            bool hasType = entry.has_type();
+            Protocol::Raft::EntryType type = entry.type();
+            entry.clear_index();
+            entry.clear_term();
+            entry.clear_type();
+            Core::Buffer buf;
+            switch (encoding)
+            {
+            case SegmentedLog::Encoding::BINARY:
+            {
+                Core::ProtoBuf::serialize(entry, buf, sizeof(header));
+                break;
+            }
+            case SegmentedLog::Encoding::TEXT:
+            {
+                std::string asciiContents = Core::ProtoBuf::dumpString(entry);
+                uint64_t totalLen = sizeof(header) + asciiContents.length();
+                char *data = new char[totalLen];
+                buf.setData(data, totalLen, Core::Buffer::deleteArrayFn<char>);
+                memcpy(data + sizeof(header),
+                       asciiContents.data(),
+                       asciiContents.length());
+                break;
+            }
+            }
+            entry.set_index(index);
+            if (hasTerm)
+                entry.set_term(term);
+            if (hasType)
+                entry.set_type(type);
+
+            char *data = static_cast<char *>(buf.getData());
+            uint64_t dataLen = buf.getLength() - sizeof(header);
+            assert(dataLen <= UINT32_MAX);
+            header.dataLen = htobe32(uint32_t(dataLen));
+            memcpy(data, &header, sizeof(header));
+            uint32_t checksum = htobe32(Core::Checksum::crc32c(
+                data + sizeof(header.checksum),
+                buf.getLength() - sizeof(header.checksum)));
+            memcpy(data, &checksum, sizeof(checksum));
+            return buf;
+        }
+
         Core::Buffer
         SegmentedLog::serializeProto(const google::protobuf::Message &in) const
         {
@@ -1372,6 +1985,12 @@ namespace LogCabin
                 break;
             }
             }
+            return makeRecord(data, len);
+        }
+
+        Core::Buffer
+        SegmentedLog::makeRecord(const void *data, uint64_t len) const
+        {
             uint64_t netLen = htobe64(len);
             char checksum[Core::Checksum::MAX_LENGTH];
             uint32_t checksumLen = Core::Checksum::calculate(
@@ -1407,7 +2026,7 @@ namespace LogCabin
                                          O_CREAT | O_EXCL | O_RDWR);
             FS::allocate(file, 0, MAX_SEGMENT_SIZE);
             SegmentHeader header;
-            header.version = 1;
+            header.version = SEGMENT_VERSION;
             ssize_t written = FS::write(file.fd,
                                         &header,
                                         sizeof(header));
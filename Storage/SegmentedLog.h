@@ -15,7 +15,10 @@
  */
 
 #include <deque>
+#include <list>
+#include <memory>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "build/Storage/SegmentedLog.pb.h"
@@ -24,6 +27,7 @@
 #include "Core/Mutex.h"
 #include "Core/RollingStat.h"
 #include "Storage/FilesystemUtil.h"
+#include "Storage/IOUring.h"
 #include "Storage/Log.h"
 
 #ifndef LOGCABIN_STORAGE_SEGMENTEDLOG_H
@@ -83,8 +87,12 @@ namespace Storage {
  * start at entry 15, that entire segment will be retained.
  *
  * Each segment file starts with a segment header, which currently contains
- * just a one-byte version number for the format of that segment. The current
- * format (version 1) is just a concatenation of serialized entry records.
+ * just a one-byte version number for the format of that segment. Both
+ * versions are a concatenation of entry records. Version 1 uses the same
+ * record format as the metadata files (see readProtoFromFile()), and version
+ * 2 uses a compact binary header with a CRC32C checksum (see readEntry()).
+ * Segments of either version are read back; new segments are written with
+ * the version set by the 'storageSegmentVersion' config option.
  */
 class SegmentedLog : public Log {
     /**
@@ -127,6 +135,8 @@ class SegmentedLog : public Log {
     std::pair<uint64_t, uint64_t>
     append(const std::vector<const Entry*>& entries);
     const Entry& getEntry(uint64_t) const;
+    Core::Buffer getEntryBytes(uint64_t) const;
+    Protocol::Raft::EntryType getEntryType(uint64_t) const;
     uint64_t getLogStartIndex() const;
     uint64_t getLastLogIndex() const;
     std::string getName() const;
@@ -290,9 +300,22 @@ class SegmentedLog : public Log {
             uint64_t size;
         };
 
+        /**
+         * Constructor.
+         * \param lastIndex
+         *      See Log::Sync::lastIndex.
+         * \param diskWriteDurationThreshold
+         *      If a wait() exceeds this time, log a warning.
+         * \param ioUring
+         *      If not NULL, wait() submits writes and flushes through this
+         *      instead of issuing one blocking system call at a time.
+         */
         explicit Sync(uint64_t lastIndex,
-                      std::chrono::nanoseconds diskWriteDurationThreshold);
+                      std::chrono::nanoseconds diskWriteDurationThreshold,
+                      IOUring* ioUring = NULL);
         ~Sync();
+        Sync(const Sync&) = delete;
+        Sync& operator=(const Sync&) = delete;
         /**
          * Add how long the filesystem ops took to 'nanos'. This is invoked
          * from syncCompleteVirtual so that it is thread-safe with respect to
@@ -305,8 +328,20 @@ class SegmentedLog : public Log {
          */
         void optimize();
         void wait();
+        /**
+         * Called by wait() to execute the WRITE, FDATASYNC, FSYNC, and NOOP
+         * ops at the front of #ops as one batch through #ioUring, then remove
+         * them from #ops. Consecutive writes to the same file are combined
+         * into one vectored write. Adds to the given counters.
+         */
+        void waitIOUring(uint64_t& writes,
+                         uint64_t& totalBytesWritten,
+                         uint64_t& fdatasyncs,
+                         uint64_t& fsyncs);
         /// If a wait() exceeds this time, log a warning.
         const std::chrono::nanoseconds diskWriteDurationThreshold;
+        /// See constructor. Owned by the SegmentedLog.
+        IOUring* const ioUring;
         /// List of operations to perform during wait().
         std::deque<Op> ops;
         /// Time at start of wait() call.
@@ -326,18 +361,20 @@ class SegmentedLog : public Log {
             /**
              * Constructor.
              */
-            explicit Record(uint64_t offset);
+            Record();
 
             /**
-             * Byte offset in the file where the entry begins.
-             * This is used when truncating a segment.
+             * The entry itself.
              */
-            uint64_t offset;
+            Log::Entry entry;
 
             /**
-             * The entry itself.
+             * The entry in binary ProtoBuf form, as returned by
+             * getEntryBytes(). With the binary encoding and version 1
+             * segments, these are the same bytes that are stored in the
+             * segment file.
              */
-            Log::Entry entry;
+            std::string serialized;
         };
 
         /**
@@ -375,9 +412,36 @@ class SegmentedLog : public Log {
          */
         std::string filename;
         /**
-         * The entries in this segment, from startIndex to endIndex, inclusive.
+         * The format of the entry records in the file, from its
+         * SegmentHeader.
+         */
+        uint8_t version;
+        /**
+         * Byte offset in the file where each entry in this segment begins,
+         * from startIndex to endIndex, inclusive. This is used when
+         * truncating a segment and when reading entries back from the file.
+         */
+        std::vector<uint64_t> offsets;
+        /**
+         * The type of each entry in this segment, parallel to #offsets. This
+         * is kept even when #entries is released, so that getEntryType()
+         * never has to read entries back.
+         */
+        std::vector<uint8_t> types;
+        /**
+         * The entries in this segment, from startIndex to endIndex, inclusive,
+         * if they are resident in memory. This is empty for closed segments
+         * once their files are complete (see releaseClosedSegments()); their
+         * entries are then read back on demand through #contents and
+         * #entryCache.
          */
         std::deque<Record> entries;
+        /**
+         * A read-only mapping of the segment file, used to read entries that
+         * aren't resident. This is created on first use and is NULL
+         * otherwise.
+         */
+        mutable std::shared_ptr<FilesystemUtil::FileContents> contents;
 
     };
 
@@ -386,11 +450,45 @@ class SegmentedLog : public Log {
      */
     struct SegmentHeader {
         /**
-         * Always set to 1 for now.
+         * Either 1 or 2, for the format of the entry records that follow.
          */
         uint8_t version;
     } __attribute__((packed));
 
+    /**
+     * This goes at the start of every entry record in version 2 segments.
+     * Multi-byte fields are stored in big-endian byte order. See readEntry().
+     */
+    struct EntryRecordHeader {
+        /**
+         * CRC32C of the remainder of this header and the data that follows.
+         */
+        uint32_t checksum;
+        /**
+         * The number of bytes of data following this header.
+         */
+        uint32_t dataLen;
+        /**
+         * The entry's index.
+         */
+        uint64_t index;
+        /**
+         * The entry's term, if #TYPE_HAS_TERM is set in #type.
+         */
+        uint64_t term;
+        /**
+         * The low bits (#TYPE_MASK) hold the entry's type, if #TYPE_HAS_TYPE
+         * is set. The high bits say which of these fields the entry had set.
+         */
+        uint8_t type;
+
+        enum : uint8_t {
+            TYPE_MASK = 0x3f,
+            TYPE_HAS_TYPE = 0x40,
+            TYPE_HAS_TERM = 0x80,
+        };
+    } __attribute__((packed));
+
     ////////// initialization helper functions //////////
 
     /**
@@ -420,6 +518,25 @@ class SegmentedLog : public Log {
                              SegmentedLogMetadata::Metadata& metadata,
                              bool quiet) const;
 
+    /**
+     * Call loadClosedSegment() on every closed segment in 'segments', using
+     * a pool of threads. This is only used during initialization.
+     * \param[in,out] segments
+     *      Segments to read from disk. Open segments are skipped.
+     * \param logStartIndex
+     *      The index of the first entry in the log, according to the log
+     *      metadata.
+     * \param numThreads
+     *      The number of threads to use, including the calling thread. Fewer
+     *      are used if there aren't enough closed segments.
+     * \return
+     *      For each segment, nonzero if it's a closed segment that is valid,
+     *      or zero if it's open or has been removed entirely from disk.
+     */
+    std::vector<uint8_t> loadClosedSegments(std::vector<Segment>& segments,
+                                            uint64_t logStartIndex,
+                                            uint64_t numThreads);
+
     /**
      * Read the given closed segment from disk, issuing PANICs and WARNINGs
      * appropriately. This is only used during initialization.
@@ -489,6 +606,25 @@ class SegmentedLog : public Log {
     Segment& getOpenSegment();
     const Segment& getOpenSegment() const;
 
+    /**
+     * Return a reference to the record for the entry at the given index.
+     * PANICs if the index is outside of the log. If the entry's segment isn't
+     * resident in memory, the entry is read from the segment file into
+     * #entryCache; the returned reference is then only valid until
+     * #entryCache evicts it.
+     */
+    const Segment::Record& getRecord(uint64_t index) const;
+
+    /**
+     * Drop the in-memory entries of closed segments whose files are known to
+     * be complete, keeping only their offsets. Their entries will be read
+     * back from disk if they are needed again.
+     * \param syncedIndex
+     *      Every entry up through this index and every filesystem operation
+     *      queued before it has been written to disk.
+     */
+    void releaseClosedSegments(uint64_t syncedIndex);
+
     /**
      * Set up a new open segment for the log head.
      * This is called when #append() needs more space but also when the end of
@@ -510,6 +646,9 @@ class SegmentedLog : public Log {
      *      otherwise unmodified.
      * \param[out] out
      *      An empty ProtoBuf to fill in.
+     * \param[out] serialized
+     *      If not NULL, this is set to 'out' in binary ProtoBuf form. With
+     *      the binary encoding, these are the bytes read from the file.
      * \return
      *      Empty string if successful, otherwise error message.
      *
@@ -528,7 +667,64 @@ class SegmentedLog : public Log {
     std::string readProtoFromFile(const FilesystemUtil::File& file,
                                   FilesystemUtil::FileContents& reader,
                                   uint64_t* offset,
-                                  google::protobuf::Message* out) const;
+                                  google::protobuf::Message* out,
+                                  std::string* serialized = NULL) const;
+
+    /**
+     * Read the next entry record out of a segment file.
+     * \param file
+     *      The open file, useful for error messages.
+     * \param reader
+     *      A reader for 'file'.
+     * \param version
+     *      The segment's version (see SegmentHeader), which determines the
+     *      record format.
+     * \param[in,out] offset
+     *      The byte offset in the file at which to start reading as input.
+     *      The byte just after the last byte of data as output if successful,
+     *      otherwise unmodified.
+     * \param[out] index
+     *      Set to the index of the entry.
+     * \param[out] out
+     *      If not NULL, the entry is parsed into this. Version 2 records can
+     *      be verified without parsing the entry, so loading segments passes
+     *      NULL.
+     * \param[out] serialized
+     *      If not NULL, this is set to 'out' in binary ProtoBuf form.
+     * \param[out] type
+     *      If not NULL, set to the entry's type. For version 2 records, this
+     *      comes from the header and doesn't require parsing the entry.
+     * \return
+     *      Empty string if successful, otherwise error message.
+     *
+     * Version 1 records are described in readProtoFromFile().
+     *
+     * Version 2 format:
+     *
+     * |EntryRecordHeader|data|
+     *
+     * data is the entry encoded as binary or text, depending on encoding,
+     * without its index, term, and type, since those are in the header.
+     */
+    std::string readEntry(const FilesystemUtil::File& file,
+                          FilesystemUtil::FileContents& reader,
+                          uint8_t version,
+                          uint64_t* offset,
+                          uint64_t* index,
+                          Log::Entry* out,
+                          std::string* serialized = NULL,
+                          Protocol::Raft::EntryType* type = NULL) const;
+
+    /**
+     * Prepare an entry record to be written to a new segment (see
+     * #SEGMENT_VERSION and readEntry() for the format).
+     * \param record
+     *      The entry to encode, with its index set. This also sets
+     *      'record.serialized'.
+     * \return
+     *      Buffer containing the record.
+     */
+    Core::Buffer makeEntryRecord(Segment::Record& record) const;
 
     /**
      * Prepare a ProtoBuf record to be written to disk.
@@ -539,6 +735,18 @@ class SegmentedLog : public Log {
      */
     Core::Buffer serializeProto(const google::protobuf::Message& in) const;
 
+    /**
+     * Prepare a record to be written to disk from data that's already been
+     * encoded (see readProtoFromFile() for the format).
+     * \param data
+     *      The encoded ProtoBuf.
+     * \param len
+     *      The number of bytes in data.
+     * \return
+     *      Buffer containing the record.
+     */
+    Core::Buffer makeRecord(const void* data, uint64_t len) const;
+
     ////////// segment preparer thread functions //////////
 
     /**
@@ -565,11 +773,19 @@ class SegmentedLog : public Log {
     const Encoding encoding;
 
     /**
-     * The algorithm to use when writing new records. When reading records, any
-     * available checksum is used.
+     * The algorithm to use when writing new metadata records and version 1
+     * segment records. When reading these records, any available checksum is
+     * used.
      */
     const std::string checksumAlgorithm;
 
+    /**
+     * The version of the segment files written from now on (see
+     * SegmentHeader). Controlled by the 'storageSegmentVersion' config
+     * option. Segments of any version are read.
+     */
+    const uint8_t SEGMENT_VERSION;
+
     /**
      * The maximum size in bytes for newly written segments. Controlled by the
      * 'storageSegmentBytes' config option.
@@ -627,12 +843,49 @@ class SegmentedLog : public Log {
      */
     PreparedSegments preparedSegments;
 
+    /**
+     * Used by Sync::wait() to submit writes and flushes in batches, or NULL to
+     * use blocking system calls. Controlled by the 'storageIOBackend' config
+     * option; this falls back to NULL if io_uring is not available.
+     */
+    std::unique_ptr<IOUring> ioUring;
+
     /**
      * Accumulates deferred filesystem operations for append() and
      * truncatePrefix().
      */
     std::unique_ptr<SegmentedLog::Sync> currentSync;
 
+    /**
+     * The maximum number of entries in #entryCache. Controlled by the
+     * 'storageEntryCacheSize' config option.
+     */
+    const uint64_t MAX_CACHED_ENTRIES;
+
+    /**
+     * Entries from closed segments that aren't resident in memory, which have
+     * been read back from disk by getRecord(). Ordered from most recently
+     * used to least recently used.
+     */
+    mutable std::list<Segment::Record> entryCache;
+
+    /**
+     * Maps from the index of each entry in #entryCache to its position there.
+     */
+    mutable std::unordered_map<uint64_t,
+                               std::list<Segment::Record>::iterator>
+        entryCacheByIndex;
+
+    /**
+     * The number of getRecord() calls served from #entryCache.
+     */
+    mutable uint64_t numEntryCacheHits;
+
+    /**
+     * The number of getRecord() calls that read an entry from disk.
+     */
+    mutable uint64_t numEntryCacheMisses;
+
     /**
      * Tracks the time it takes to write a metadata file.
      */
@@ -643,6 +896,27 @@ class SegmentedLog : public Log {
      */
     Core::RollingStat filesystemOpsNanos;
 
+    /**
+     * The time the constructor took to read and verify the segments on disk.
+     */
+    uint64_t startupLoadNanos;
+
+    /**
+     * The number of threads the constructor used to read closed segments.
+     * Controlled by the 'storageLoadThreads' config option.
+     */
+    uint64_t startupLoadThreads;
+
+    /**
+     * The number of segments the constructor found and kept.
+     */
+    uint64_t startupSegmentsLoaded;
+
+    /**
+     * The total size of the segments the constructor found and kept.
+     */
+    uint64_t startupBytesLoaded;
+
     /**
      * Opens files, allocates the to full size, and places them on
      * #preparedSegments for the log to use.
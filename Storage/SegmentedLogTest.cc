@@ -17,10 +17,13 @@
 #include <fcntl.h>
 #include <gtest/gtest.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
+#include "build/Protocol/ServerStats.pb.h"
 #include "Core/Config.h"
 #include "Core/ProtoBuf.h"
 #include "Core/STLUtil.h"
+#include "Core/StringUtil.h"
 #include "Core/Util.h"
 #include "Storage/FilesystemUtil.h"
 #include "Storage/Layout.h"
@@ -34,6 +37,30 @@ namespace {
 namespace FS = FilesystemUtil;
 using Core::STLUtil::sorted;
 
+} // namespace LogCabin::Storage::<anonymous>
+
+namespace FilesystemUtil {
+namespace System {
+  extern ssize_t (*writev)(int fildes,
+                           const struct iovec* iov,
+                           int iovcnt);
+} // namespace LogCabin::Storage::FilesystemUtil::System
+} // namespace LogCabin::Storage::FilesystemUtil
+
+namespace {
+
+int writevFd;
+uint64_t writevCalls;
+
+ssize_t
+countingWritev(int fildes, const struct iovec* iov, int iovcnt)
+{
+    // The segment preparer thread may write to other files concurrently.
+    if (fildes == writevFd)
+        ++writevCalls;
+    return ::writev(fildes, iov, iovcnt);
+}
+
 std::vector<SegmentedLog::Sync::Op::OpCode>
 extractOpCodes(const SegmentedLog::Sync& sync)
 {
@@ -259,7 +286,74 @@ class StorageSegmentedLogTest : public ::testing::Test {
         } while (size > 5);
     }
 
-    void writeSegmentHeader(FS::File& file, uint8_t version = 1) {
+    void readEntryHelper() {
+        uint64_t offset = 5;
+        uint64_t index = 0;
+        SegmentedLog::Entry entry;
+        std::string serialized;
+        FS::File file = FS::openFile(log->dir, "f", O_CREAT|O_RDWR);
+        uint64_t size;
+        SegmentedLog::Segment::Record record;
+        record.entry = sampleEntry;
+        record.entry.set_index(1234);
+        {
+            Core::Buffer buf = log->makeEntryRecord(record);
+            EXPECT_EQ(5, FS::write(file.fd, "abcde", 5));
+            EXPECT_LE(0, FS::write(file.fd,
+                                   buf.getData(),
+                                   buf.getLength()));
+            size = FS::getSize(file);
+        }
+        // the entry is restored after being encoded
+        EXPECT_EQ(1234U, record.entry.index());
+        EXPECT_EQ(40U, record.entry.term());
+        EXPECT_FALSE(record.entry.has_type());
+
+        { // make sure there's no error now
+            FS::FileContents contents(file);
+            EXPECT_EQ("", log->readEntry(file, contents, 2, &offset, &index,
+                                         &entry, &serialized));
+            EXPECT_EQ(size, offset);
+            EXPECT_EQ(1234U, index);
+            EXPECT_EQ(record.entry.DebugString(), entry.DebugString());
+            EXPECT_EQ(record.serialized, serialized);
+            offset = 5;
+            // without parsing the entry
+            EXPECT_EQ("", log->readEntry(file, contents, 2, &offset, &index,
+                                         NULL));
+            EXPECT_EQ(size, offset);
+            offset = 5;
+        }
+
+        // invert each byte and make sure there's an error
+        uint8_t* map = static_cast<uint8_t*>(
+            mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, file.fd, 0));
+        for (uint64_t i = 5; i < size; ++i) {
+            map[i] = uint8_t(~map[i]);
+            FS::FileContents contents(file);
+            std::string error = log->readEntry(file, contents, 2,
+                                               &offset, &index, &entry);
+            EXPECT_FALSE(error.empty());
+            EXPECT_EQ(5U, offset);
+            offset = 5;
+            map[i] = uint8_t(~map[i]);
+        }
+        munmap(map, size);
+
+        // make sure every truncation is an error
+        do {
+            --size;
+            FS::truncate(file, size);
+            FS::FileContents contents(file);
+            std::string error = log->readEntry(file, contents, 2,
+                                               &offset, &index, &entry);
+            EXPECT_FALSE(error.empty());
+            EXPECT_EQ(5U, offset);
+            offset = 5;
+        } while (size > 5);
+    }
+
+    void writeSegmentHeader(FS::File& file, uint8_t version = 2) {
         SegmentedLog::SegmentHeader header;
         header.version = version;
         EXPECT_LE(0, FS::write(file.fd, &header, sizeof(header)))
@@ -318,6 +412,92 @@ TEST_F(StorageSegmentedLogTest, getEntry_blackbox)
     sync();
 }
 
+TEST_F(StorageSegmentedLogTest, getEntryBytes_blackbox)
+{
+    log->append({&sampleEntry});
+    sampleEntry.set_data("bar");
+    log->append({&sampleEntry});
+    // Check this before construct() starts a new segment preparer thread,
+    // which the death test's fork could catch holding a lock.
+    EXPECT_DEATH(log->getEntryBytes(3), "outside");
+    sync();
+    construct();
+    for (uint64_t index = 1; index <= 2; ++index) {
+        Core::Buffer bytes = log->getEntryBytes(index);
+        EXPECT_EQ(log->getEntry(index).SerializeAsString(),
+                  std::string(static_cast<const char*>(bytes.getData()),
+                              bytes.getLength()));
+    }
+}
+
+TEST_F(StorageSegmentedLogTest, getEntryBytes_binary)
+{
+    FS::removeFile(log->dir, "metadata1");
+    FS::removeFile(log->dir, "metadata2");
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::BINARY,
+                               config));
+    log->append({&sampleEntry});
+    Core::Buffer bytes = log->getEntryBytes(1);
+    EXPECT_EQ(log->getEntry(1).SerializeAsString(),
+              std::string(static_cast<const char*>(bytes.getData()),
+                          bytes.getLength()));
+    sync();
+
+    // read back the same bytes from disk
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::BINARY,
+                               config));
+    bytes = log->getEntryBytes(1);
+    EXPECT_EQ(log->getEntry(1).SerializeAsString(),
+              std::string(static_cast<const char*>(bytes.getData()),
+                          bytes.getLength()));
+}
+
+TEST_F(StorageSegmentedLogTest, getEntryType)
+{
+    for (uint64_t segmentVersion = 1; segmentVersion <= 2; ++segmentVersion) {
+        log.reset();
+        layout.initTemporary();
+        config.set<uint64_t>("storageSegmentVersion", segmentVersion);
+        construct();
+        SegmentedLog::Entry dataEntry = sampleEntry;
+        dataEntry.set_type(Protocol::Raft::EntryType::DATA);
+        SegmentedLog::Entry configEntry = sampleEntry;
+        configEntry.set_type(Protocol::Raft::EntryType::CONFIGURATION);
+        configEntry.mutable_configuration()->mutable_prev_configuration();
+        std::vector<const Log::Entry*> entries;
+        for (uint64_t i = 1; i <= 24; ++i)
+            entries.push_back(i % 10 == 0 ? &configEntry : &dataEntry);
+        log->append(entries);
+        sync();
+        ASSERT_LT(1U, log->segmentsByStartIndex.size());
+        EXPECT_TRUE(log->segmentsByStartIndex.begin()->second.entries.empty());
+        for (uint64_t i = 1; i <= 24; ++i) {
+            EXPECT_EQ(i % 10 == 0 ?
+                          Protocol::Raft::EntryType::CONFIGURATION :
+                          Protocol::Raft::EntryType::DATA,
+                      log->getEntryType(i)) << i;
+        }
+        EXPECT_EQ(0U, log->numEntryCacheMisses);
+        log->truncateSuffix(20);
+        sync();
+
+        // also after reading the segments back
+        construct();
+        EXPECT_EQ(20U, log->getLastLogIndex());
+        for (uint64_t i = 1; i <= 20; ++i) {
+            EXPECT_EQ(i % 10 == 0 ?
+                          Protocol::Raft::EntryType::CONFIGURATION :
+                          Protocol::Raft::EntryType::DATA,
+                      log->getEntryType(i)) << i;
+        }
+        EXPECT_EQ(0U, log->numEntryCacheMisses);
+    }
+}
+
 TEST_F(StorageSegmentedLogTest, getLogStartIndex_blackbox)
 {
     EXPECT_EQ(1U, log->getLogStartIndex());
@@ -518,6 +698,49 @@ TEST_F(StorageSegmentedLogTest, constructor_segmentsByStartIndex)
               log->segmentsByStartIndex.at(5).filename);
 }
 
+TEST_F(StorageSegmentedLogTest, constructor_parallelLoad)
+{
+    log->truncatePrefix(3);
+    std::vector<SegmentedLog::Entry> entries(100, sampleEntry);
+    std::vector<const Log::Entry*> entryPtrs;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        entries.at(i).set_data(Core::StringUtil::format("entry %lu", i + 3));
+        entryPtrs.push_back(&entries.at(i));
+    }
+    log->append(entryPtrs);
+    sync();
+    uint64_t numSegments = log->segmentsByStartIndex.size();
+    uint64_t bytes = log->getSizeBytes();
+    ASSERT_LT(4U, numSegments);
+    log.reset();
+
+    config.set<uint64_t>("storageLoadThreads", 4);
+    construct();
+    EXPECT_EQ(4U, log->startupLoadThreads);
+    EXPECT_EQ(numSegments, log->startupSegmentsLoaded);
+    EXPECT_EQ(bytes, log->startupBytesLoaded);
+    EXPECT_EQ(bytes, log->totalClosedSegmentBytes);
+    EXPECT_LT(0U, log->startupLoadNanos);
+    EXPECT_EQ(numSegments + 1, log->segmentsByStartIndex.size());
+    EXPECT_EQ(3U, log->getLogStartIndex());
+    EXPECT_EQ(102U, log->getLastLogIndex());
+    for (uint64_t i = 3; i <= 102; ++i)
+        EXPECT_EQ(Core::StringUtil::format("entry %lu", i),
+                  log->getEntry(i).data());
+
+    Protocol::ServerStats stats;
+    log->updateServerStats(stats);
+    EXPECT_EQ(4U, stats.storage().startup_load_threads());
+    EXPECT_EQ(numSegments, stats.storage().startup_segments_loaded());
+    EXPECT_EQ(bytes, stats.storage().startup_bytes_loaded());
+
+    // more threads than closed segments
+    config.set<uint64_t>("storageLoadThreads", 100);
+    construct();
+    EXPECT_EQ(numSegments, log->startupLoadThreads);
+    EXPECT_EQ(102U, log->getLastLogIndex());
+}
+
 TEST_F(StorageSegmentedLogTest, constructor_nogap_segmentMissing)
 {
     FS::File logDir = FS::dup(log->dir);
@@ -592,35 +815,103 @@ TEST_F(StorageSegmentedLogTest, destructor_cleanshutdown)
     construct();
 }
 
+TEST_F(StorageSegmentedLogTest, syncWait_coalescesWrites)
+{
+    config.set<uint64_t>("storageSegmentBytes", 1024 * 1024);
+    construct();
+    log->truncatePrefix(3);
+    std::vector<SegmentedLog::Entry> entries(500, sampleEntry);
+    std::vector<const Log::Entry*> entryPtrs;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        entries.at(i).set_data(Core::StringUtil::format("entry %lu", i + 3));
+        entryPtrs.push_back(&entries.at(i));
+    }
+    log->append(entryPtrs);
+    writevFd = log->openSegmentFile.fd;
+    writevCalls = 0;
+    FS::System::writev = countingWritev;
+    sync();
+    FS::System::writev = ::writev;
+    EXPECT_EQ(1U, writevCalls);
+
+    construct();
+    EXPECT_EQ(502U, log->getLastLogIndex());
+    for (uint64_t i = 3; i <= 502; ++i)
+        EXPECT_EQ(Core::StringUtil::format("entry %lu", i),
+                  log->getEntry(i).data());
+}
+
+TEST_F(StorageSegmentedLogTest, constructor_ioBackend)
+{
+    EXPECT_TRUE(log->ioUring == NULL);
+    config.set<std::string>("storageIOBackend", "aio");
+    log.reset(); // don't fork while the segment preparer thread is running
+    EXPECT_DEATH(construct(), "Unknown storageIOBackend: aio");
+}
+
+TEST_F(StorageSegmentedLogTest, syncWait_ioUring_blackbox)
+{
+    config.set<std::string>("storageIOBackend", "io_uring");
+    construct();
+    if (!log->ioUring) // not supported by this kernel
+        return;
+    log->truncatePrefix(3);
+    std::vector<SegmentedLog::Entry> entries(17, sampleEntry);
+    std::vector<const Log::Entry*> entryPtrs;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        entries.at(i).set_data(Core::StringUtil::format("entry %lu", i + 3));
+        entryPtrs.push_back(&entries.at(i));
+    }
+    log->append({entryPtrs.begin(), entryPtrs.begin() + 10});
+    sync();
+    FS::skipFsync = false; // exercise the linked flushes too
+    log->append({entryPtrs.begin() + 10, entryPtrs.end()});
+    sync();
+    log->truncateSuffix(17);
+    log->append({entryPtrs.back()});
+    sync();
+    FS::skipFsync = true;
+
+    config.set<std::string>("storageIOBackend", "sync");
+    construct();
+    EXPECT_EQ(3U, log->getLogStartIndex());
+    EXPECT_EQ(18U, log->getLastLogIndex());
+    for (uint64_t i = 3; i <= 17; ++i)
+        EXPECT_EQ(Core::StringUtil::format("entry %lu", i),
+                  log->getEntry(i).data());
+    EXPECT_EQ("entry 19", log->getEntry(18).data());
+    EXPECT_LT(1U, log->segmentsByStartIndex.size());
+}
+
 // This depends on the exact size of sampleEntry's record, and it may need to
 // be adjusted if the record format changes.
 TEST_F(StorageSegmentedLogTest, append_rollover)
 {
     log->truncatePrefix(3);
     std::vector<const Log::Entry*> entries;
-    for (uint64_t i = 3; i <= 19; ++i)
+    for (uint64_t i = 3; i <= 24; ++i)
         entries.push_back(&sampleEntry);
-    EXPECT_EQ((std::pair<uint64_t, uint64_t>{3, 19}),
+    EXPECT_EQ((std::pair<uint64_t, uint64_t>{3, 24}),
               log->append(entries));
-    EXPECT_EQ((std::vector<uint64_t> { 3, 17 }),
+    EXPECT_EQ((std::vector<uint64_t> { 3, 22 }),
               Core::STLUtil::getKeys(log->segmentsByStartIndex))
         << "This test may fail when record sizes change.";
     EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
-              log->segmentsByStartIndex.at(17).entries.at(0).offset);
-    EXPECT_EQ(19U, log->currentSync->lastIndex);
+              log->segmentsByStartIndex.at(22).offsets.at(0));
+    EXPECT_EQ(24U, log->currentSync->lastIndex);
     sync();
     FS::File logDir = FS::dup(log->dir);
     log.reset();
     EXPECT_EQ((std::vector<std::string> {
-                    "00000000000000000003-00000000000000000016",
-                    "00000000000000000017-00000000000000000019",
+                    "00000000000000000003-00000000000000000021",
+                    "00000000000000000022-00000000000000000024",
                     "metadata1",
                     "metadata2",
                }),
               sorted(FS::ls(logDir)));
     EXPECT_GE(1024U, getSize(FS::openFile(
                                 logDir,
-                                "00000000000000000003-00000000000000000016",
+                                "00000000000000000003-00000000000000000021",
                                 O_RDONLY)));
     construct(); // extra sanity checks
 }
@@ -644,7 +935,7 @@ TEST_F(StorageSegmentedLogTest, append_largerThanMaxSegmentSize)
     EXPECT_EQ((std::vector<uint64_t> { 1, 2, 4, 5 }),
               Core::STLUtil::getKeys(log->segmentsByStartIndex));
     EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
-              log->segmentsByStartIndex.at(4).entries.at(0).offset);
+              log->segmentsByStartIndex.at(4).offsets.at(0));
     EXPECT_EQ(5U, log->currentSync->lastIndex);
     sync();
     FS::File logDir = FS::dup(log->dir);
@@ -759,9 +1050,9 @@ TEST_F(StorageSegmentedLogTest, truncateSuffix_openSegment_partial)
     log->truncateSuffix(3);
     EXPECT_EQ((std::vector<uint64_t> { 3, 4 }),
               Core::STLUtil::getKeys(log->segmentsByStartIndex));
-    EXPECT_EQ(1U, log->segmentsByStartIndex.at(3).entries.size());
+    EXPECT_EQ(1U, log->segmentsByStartIndex.at(3).offsets.size());
     EXPECT_EQ(3U, log->segmentsByStartIndex.at(3).endIndex);
-    EXPECT_EQ(0U, log->segmentsByStartIndex.at(4).entries.size());
+    EXPECT_EQ(0U, log->segmentsByStartIndex.at(4).offsets.size());
     EXPECT_EQ(3U, log->segmentsByStartIndex.at(4).endIndex);
     EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
               log->segmentsByStartIndex.at(4).bytes);
@@ -790,9 +1081,9 @@ TEST_F(StorageSegmentedLogTest, truncateSuffix_openSegment_full)
     log->truncateSuffix(4);
     EXPECT_EQ((std::vector<uint64_t> { 3, 5 }),
               Core::STLUtil::getKeys(log->segmentsByStartIndex));
-    EXPECT_EQ(2U, log->segmentsByStartIndex.at(3).entries.size());
+    EXPECT_EQ(2U, log->segmentsByStartIndex.at(3).offsets.size());
     EXPECT_EQ(4U, log->segmentsByStartIndex.at(3).endIndex);
-    EXPECT_EQ(0U, log->segmentsByStartIndex.at(5).entries.size());
+    EXPECT_EQ(0U, log->segmentsByStartIndex.at(5).offsets.size());
     EXPECT_EQ(4U, log->segmentsByStartIndex.at(5).endIndex);
     EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
               log->segmentsByStartIndex.at(5).bytes);
@@ -823,9 +1114,9 @@ TEST_F(StorageSegmentedLogTest, truncateSuffix_closedSegments)
     log->truncateSuffix(3);
     EXPECT_EQ((std::vector<uint64_t> { 3, 4 }),
               Core::STLUtil::getKeys(log->segmentsByStartIndex));
-    EXPECT_EQ(1U, log->segmentsByStartIndex.at(3).entries.size());
+    EXPECT_EQ(1U, log->segmentsByStartIndex.at(3).offsets.size());
     EXPECT_EQ(3U, log->segmentsByStartIndex.at(3).endIndex);
-    EXPECT_EQ(0U, log->segmentsByStartIndex.at(4).entries.size());
+    EXPECT_EQ(0U, log->segmentsByStartIndex.at(4).offsets.size());
     EXPECT_EQ(3U, log->segmentsByStartIndex.at(4).endIndex);
     EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
               log->segmentsByStartIndex.at(4).bytes);
@@ -874,7 +1165,7 @@ TEST_F(StorageSegmentedLogTest, readSegmentFilenames)
     EXPECT_EQ(segments.at(0).filename,
               segments.at(0).makeClosedFilename());
     EXPECT_EQ(0U, segments.at(0).bytes);
-    EXPECT_EQ(0U, segments.at(0).entries.size());
+    EXPECT_EQ(0U, segments.at(0).offsets.size());
 
     EXPECT_EQ("open-1",
               segments.at(1).filename);
@@ -882,7 +1173,7 @@ TEST_F(StorageSegmentedLogTest, readSegmentFilenames)
     EXPECT_EQ(~0UL, segments.at(1).startIndex);
     EXPECT_EQ(~0UL - 1, segments.at(1).endIndex);
     EXPECT_EQ(0U, segments.at(1).bytes);
-    EXPECT_EQ(0U, segments.at(1).entries.size());
+    EXPECT_EQ(0U, segments.at(1).offsets.size());
 
     EXPECT_EQ("open-3",
               segments.at(2).filename);
@@ -939,9 +1230,10 @@ TEST_F(StorageSegmentedLogTest, loadClosedSegment_unknownVersion)
     FS::File file = FS::openFile(log->dir,
                                  closedSegment.filename,
                                  O_CREAT|O_WRONLY);
-    writeSegmentHeader(file, /*version=*/2);
+    writeSegmentHeader(file, /*version=*/3);
     EXPECT_DEATH(log->loadClosedSegment(closedSegment, 5000),
-                 "version.*was 2, but this code can only read version 1");
+                 "version.*was 3, but this code can only read versions 1 "
+                 "and 2");
 }
 
 TEST_F(StorageSegmentedLogTest, loadClosedSegment_removeUnneeded)
@@ -1016,7 +1308,7 @@ TEST_F(StorageSegmentedLogTest, loadClosedSegment_ok)
     closedSegment.endIndex = 4;
     EXPECT_TRUE(log->loadClosedSegment(closedSegment, 1));
     FS::openFile(log->dir, closedSegment.filename, O_RDONLY); // file exists
-    EXPECT_EQ(2U, closedSegment.entries.size());
+    EXPECT_EQ(2U, closedSegment.offsets.size());
 }
 
 
@@ -1050,9 +1342,10 @@ TEST_F(StorageSegmentedLogTest, loadOpenSegment_unknownVersion)
     FS::File file = FS::openFile(log->dir,
                                  openSegment.filename,
                                  O_CREAT|O_WRONLY);
-    writeSegmentHeader(file, /*version=*/2);
+    writeSegmentHeader(file, /*version=*/3);
     EXPECT_DEATH(log->loadOpenSegment(openSegment, 1),
-                 "version.*was 2, but this code can only read version 1");
+                 "version.*was 3, but this code can only read versions 1 "
+                 "and 2");
 }
 
 TEST_F(StorageSegmentedLogTest, loadOpenSegment_removeUnneeded)
@@ -1138,7 +1431,7 @@ TEST_F(StorageSegmentedLogTest, loadOpenSegment_truncateZeroAndOk)
         {"", "WARNING"}
     });
     EXPECT_FALSE(openSegment.isOpen);
-    EXPECT_EQ(2U, openSegment.entries.size());
+    EXPECT_EQ(2U, openSegment.offsets.size());
     EXPECT_EQ(openSegment.makeClosedFilename(), openSegment.filename);
     EXPECT_EQ(3U, openSegment.startIndex);
     EXPECT_EQ(4U, openSegment.endIndex);
@@ -1174,6 +1467,91 @@ TEST_F(StorageSegmentedLogTest, closeSegment_nonEmpty)
 
 // openNewSegment tested sufficiently elsewhere
 
+TEST_F(StorageSegmentedLogTest, getRecord_entryCache)
+{
+    config.set<uint64_t>("storageEntryCacheSize", 2);
+    construct();
+    log->truncatePrefix(3);
+    std::vector<SegmentedLog::Entry> entries(20, sampleEntry);
+    std::vector<const Log::Entry*> entryPtrs;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        entries.at(i).set_data(Core::StringUtil::format("entry %lu", i + 3));
+        entryPtrs.push_back(&entries.at(i));
+    }
+    log->append(entryPtrs);
+    sync();
+    ASSERT_EQ((std::vector<uint64_t> { 3, 20 }),
+              Core::STLUtil::getKeys(log->segmentsByStartIndex))
+        << "This test may fail when record sizes change.";
+    SegmentedLog::Segment& closed = log->segmentsByStartIndex.at(3);
+    EXPECT_EQ(0U, closed.entries.size());
+    EXPECT_EQ(17U, closed.offsets.size());
+
+    EXPECT_EQ("entry 3", log->getEntry(3).data());
+    EXPECT_EQ("entry 4", log->getEntry(4).data());
+    EXPECT_EQ("entry 3", log->getEntry(3).data());
+    EXPECT_EQ("entry 5", log->getEntry(5).data()); // evicts 4
+    EXPECT_EQ("entry 21", log->getEntry(21).data()); // resident
+    EXPECT_EQ((std::vector<uint64_t> { 3, 5 }),
+              sorted(Core::STLUtil::getKeys(log->entryCacheByIndex)));
+    EXPECT_EQ(1U, log->numEntryCacheHits);
+    EXPECT_EQ(3U, log->numEntryCacheMisses);
+
+    // bytes from the cache are copied, since they may be evicted
+    entries.at(1).set_index(4);
+    Core::Buffer bytes = log->getEntryBytes(4);
+    EXPECT_EQ(entries.at(1).SerializeAsString(),
+              std::string(static_cast<const char*>(bytes.getData()),
+                          bytes.getLength()));
+    log->getEntry(6);
+    log->getEntry(7);
+    EXPECT_EQ(entries.at(1).SerializeAsString(),
+              std::string(static_cast<const char*>(bytes.getData()),
+                          bytes.getLength()));
+
+    Protocol::ServerStats stats;
+    log->updateServerStats(stats);
+    EXPECT_EQ(2U, stats.storage().num_cached_entries());
+    EXPECT_EQ(1U, stats.storage().num_entry_cache_hits());
+    EXPECT_EQ(6U, stats.storage().num_entry_cache_misses());
+
+    // truncating invalidates the cache
+    log->truncateSuffix(10);
+    EXPECT_EQ(0U, log->entryCache.size());
+    EXPECT_EQ(0U, log->entryCacheByIndex.size());
+    EXPECT_EQ("entry 10", log->getEntry(10).data());
+    EXPECT_EQ(1U, log->entryCache.size());
+}
+
+TEST_F(StorageSegmentedLogTest, releaseClosedSegments)
+{
+    log->truncatePrefix(3);
+    std::vector<const Log::Entry*> entries;
+    for (uint64_t i = 3; i <= 21; ++i)
+        entries.push_back(&sampleEntry);
+    log->append(entries);
+    sync();
+    log->append({&sampleEntry});
+    ASSERT_EQ((std::vector<uint64_t> { 3, 22 }),
+              Core::STLUtil::getKeys(log->segmentsByStartIndex))
+        << "This test may fail when record sizes change.";
+    // The closed segment's file isn't complete until the current sync is done.
+    log->releaseClosedSegments(21);
+    EXPECT_EQ(19U, log->segmentsByStartIndex.at(3).entries.size());
+    sync();
+    EXPECT_EQ(0U, log->segmentsByStartIndex.at(3).entries.size());
+    EXPECT_EQ(1U, log->segmentsByStartIndex.at(22).entries.size());
+    EXPECT_EQ(40U, log->getEntry(21).term());
+    log->checkInvariants();
+
+    // Closed segments are not resident after a restart either.
+    construct();
+    EXPECT_EQ(0U, log->segmentsByStartIndex.at(3).entries.size());
+    EXPECT_EQ(0U, log->segmentsByStartIndex.at(22).entries.size());
+    EXPECT_EQ(1U, log->segmentsByStartIndex.at(22).offsets.size());
+    EXPECT_EQ(40U, log->getEntry(22).term());
+}
+
 TEST_F(StorageSegmentedLogTest, readProtoFromFile_binary)
 {
     FS::removeFile(log->dir, "metadata1");
@@ -1198,6 +1576,93 @@ TEST_F(StorageSegmentedLogTest, readProtoFromFile_text)
 
 // serialize proto tested sufficiently by readProtoFromFile
 
+TEST_F(StorageSegmentedLogTest, readEntry_binary)
+{
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::BINARY,
+                               config));
+    readEntryHelper();
+}
+
+TEST_F(StorageSegmentedLogTest, readEntry_text)
+{
+    readEntryHelper();
+}
+
+TEST_F(StorageSegmentedLogTest, readEntry_type)
+{
+    SegmentedLog::Segment::Record record;
+    record.entry = sampleEntry;
+    record.entry.set_index(3);
+    record.entry.set_type(Protocol::Raft::EntryType::NOOP);
+    record.entry.clear_term();
+    Core::Buffer buf = log->makeEntryRecord(record);
+    FS::File file = FS::openFile(log->dir, "f", O_CREAT|O_RDWR);
+    EXPECT_LE(0, FS::write(file.fd, buf.getData(), buf.getLength()));
+    FS::FileContents contents(file);
+    uint64_t offset = 0;
+    uint64_t index = 0;
+    SegmentedLog::Entry entry;
+    EXPECT_EQ("", log->readEntry(file, contents, 2, &offset, &index, &entry));
+    EXPECT_EQ(record.entry.DebugString(), entry.DebugString());
+}
+
+TEST_F(StorageSegmentedLogTest, makeEntryRecord_version1)
+{
+    config.set<uint64_t>("storageSegmentVersion", 1);
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::BINARY,
+                               config));
+    SegmentedLog::Segment::Record record;
+    record.entry = sampleEntry;
+    record.entry.set_index(1234);
+    uint64_t version1Length = log->makeEntryRecord(record).getLength();
+    EXPECT_EQ(log->makeRecord(record.serialized.data(),
+                              record.serialized.length()).getLength(),
+              version1Length);
+
+    config.set<uint64_t>("storageSegmentVersion", 2);
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::BINARY,
+                               config));
+    EXPECT_GT(version1Length, log->makeEntryRecord(record).getLength());
+}
+
+TEST_F(StorageSegmentedLogTest, constructor_version1Segments)
+{
+    config.set<uint64_t>("storageSegmentVersion", 1);
+    construct();
+    log->truncatePrefix(3);
+    std::vector<SegmentedLog::Entry> entries(20, sampleEntry);
+    std::vector<const Log::Entry*> entryPtrs;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        entries.at(i).set_data(Core::StringUtil::format("entry %lu", i + 3));
+        entryPtrs.push_back(&entries.at(i));
+    }
+    log->append(entryPtrs);
+    sync();
+    EXPECT_EQ(1U, log->getOpenSegment().version);
+
+    config.set<uint64_t>("storageSegmentVersion", 2);
+    construct();
+    EXPECT_EQ(1U, log->segmentsByStartIndex.begin()->second.version);
+    EXPECT_EQ(2U, log->getOpenSegment().version);
+    log->append({&sampleEntry}); // index 23
+    sync();
+    construct();
+    EXPECT_EQ((std::pair<uint64_t, uint64_t>{3, 23}),
+              std::make_pair(log->getLogStartIndex(),
+                             log->getLastLogIndex()));
+    for (uint64_t i = 3; i <= 22; ++i) {
+        EXPECT_EQ(Core::StringUtil::format("entry %lu", i),
+                  log->getEntry(i).data());
+    }
+    EXPECT_EQ("foo", log->getEntry(23).data());
+}
+
 TEST_F(StorageSegmentedLogTest, prepareNewSegment)
 {
     auto ret = log->prepareNewSegment(50);
@@ -1205,7 +1670,7 @@ TEST_F(StorageSegmentedLogTest, prepareNewSegment)
     EXPECT_EQ(log->MAX_SEGMENT_SIZE,
               FS::getSize(ret.second));
     FS::FileContents contents(ret.second);
-    EXPECT_EQ(1U, *contents.get<uint8_t>(0, 1)); // header
+    EXPECT_EQ(2U, *contents.get<uint8_t>(0, 1)); // header
     for (uint64_t i = 1; i < contents.getFileLength(); ++i)
         EXPECT_EQ(0U, *contents.get<uint8_t>(i, 1));
 }
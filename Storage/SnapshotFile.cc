@@ -14,11 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "Core/Debug.h"
 #include "Core/StringUtil.h"
@@ -34,6 +36,25 @@ namespace SnapshotFile {
 namespace FilesystemUtil = Storage::FilesystemUtil;
 using Core::StringUtil::format;
 
+const char COMPRESSED_MAGIC[8] = {
+    '\xff', 'L', 'C', 'S', 'N', 'A', 'P', 'Z'
+};
+
+namespace {
+
+/**
+ * Precedes each block in a compressed snapshot file.
+ * Fields are big-endian.
+ */
+struct BlockHeader {
+    /// Number of bytes of zlib-compressed data following this header.
+    uint32_t compressedLength;
+    /// Number of bytes that data decompresses to.
+    uint32_t uncompressedLength;
+} __attribute__((packed));
+
+} // anonymous namespace
+
 void
 discardPartialSnapshots(const Storage::Layout& layout)
 {
@@ -49,20 +70,58 @@ discardPartialSnapshots(const Storage::Layout& layout)
     }
 }
 
-Reader::Reader(const Storage::Layout& storageLayout)
+Reader::Reader(const Storage::Layout& storageLayout,
+               const std::string& filename)
     : file()
     , contents()
     , bytesRead(0)
+    , compressed(false)
+    , uncompressedSize(0)
+    , nextBlockOffset(0)
+    , block()
+    , blockBytesRead(0)
 {
     file = FilesystemUtil::tryOpenFile(storageLayout.snapshotDir,
-                                       "snapshot",
+                                       filename,
                                        O_RDONLY);
     if (file.fd < 0) {
         throw std::runtime_error(format(
-                "Snapshot file not found in %s",
+                "Snapshot file %s not found in %s",
+                filename.c_str(),
                 storageLayout.snapshotDir.path.c_str()));
     }
     contents.reset(new FilesystemUtil::FileContents(file));
+
+    uint64_t fileLength = contents->getFileLength();
+    if (fileLength < sizeof(COMPRESSED_MAGIC) ||
+        memcmp(contents->get(0, sizeof(COMPRESSED_MAGIC)),
+               COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC)) != 0) {
+        uncompressedSize = fileLength;
+        return;
+    }
+    // Walk the block headers once to find the size of the contents and to
+    // catch truncated files up front.
+    compressed = true;
+    nextBlockOffset = sizeof(COMPRESSED_MAGIC);
+    uint64_t offset = nextBlockOffset;
+    while (offset < fileLength) {
+        if (fileLength - offset < sizeof(BlockHeader)) {
+            PANIC("Compressed snapshot file %s is truncated: block header at "
+                  "offset %lu runs past the end of the %lu-byte file",
+                  file.path.c_str(), offset, fileLength);
+        }
+        BlockHeader header;
+        contents->copy(offset, &header, sizeof(header));
+        uint64_t compressedLength = be32toh(header.compressedLength);
+        offset += sizeof(header);
+        if (fileLength - offset < compressedLength) {
+            PANIC("Compressed snapshot file %s is truncated: %lu-byte block "
+                  "at offset %lu runs past the end of the %lu-byte file",
+                  file.path.c_str(), compressedLength, offset, fileLength);
+        }
+        offset += compressedLength;
+        uncompressedSize += be32toh(header.uncompressedLength);
+    }
 }
 
 Reader::~Reader()
@@ -71,10 +130,22 @@ Reader::~Reader()
 
 uint64_t
 Reader::getSizeBytes()
+{
+    return uncompressedSize;
+}
+
+uint64_t
+Reader::getFileSizeBytes()
 {
     return contents->getFileLength();
 }
 
+bool
+Reader::isCompressed() const
+{
+    return compressed;
+}
+
 
 uint64_t
 Reader::getBytesRead() const
@@ -105,9 +176,18 @@ Reader::readMessage(google::protobuf::Message& message)
                       file.path.c_str(),
                       bytesRead);
     }
-    const Core::Buffer buf(const_cast<void*>(contents->get(bytesRead, length)),
-                           length,
-                           NULL);
+    Core::Buffer buf;
+    if (compressed) {
+        // The message may span blocks, so copy it out.
+        char* data = new char[length];
+        buf.setData(data, length, Core::Buffer::deleteArrayFn<char>);
+        readRaw(data, length);
+        bytesRead -= length;
+    } else {
+        buf.setData(const_cast<void*>(contents->get(bytesRead, length)),
+                    length,
+                    NULL);
+    }
     std::string error;
     if (!Core::ProtoBuf::parse(buf, message)) {
         error = format("Could not parse ProtoBuf at bytes %lu-%lu (inclusive) "
@@ -130,11 +210,57 @@ Reader::readMessage(google::protobuf::Message& message)
 uint64_t
 Reader::readRaw(void* data, uint64_t length)
 {
-    uint64_t r = contents->copyPartial(bytesRead, data, length);
+    if (!compressed) {
+        uint64_t r = contents->copyPartial(bytesRead, data, length);
+        bytesRead += r;
+        return r;
+    }
+    uint64_t r = 0;
+    while (r < length) {
+        if (blockBytesRead == block.size() && !readBlock())
+            break;
+        uint64_t n = std::min(length - r, block.size() - blockBytesRead);
+        memcpy(static_cast<char*>(data) + r, block.data() + blockBytesRead, n);
+        blockBytesRead += n;
+        r += n;
+    }
     bytesRead += r;
     return r;
 }
 
+bool
+Reader::readBlock()
+{
+    if (nextBlockOffset == contents->getFileLength())
+        return false;
+    // The constructor already checked that the blocks fit in the file.
+    BlockHeader header;
+    contents->copy(nextBlockOffset, &header, sizeof(header));
+    uint64_t compressedLength = be32toh(header.compressedLength);
+    uint64_t uncompressedLength = be32toh(header.uncompressedLength);
+    const void* compressedData =
+        contents->get(nextBlockOffset + sizeof(header), compressedLength);
+    block.resize(uncompressedLength);
+    uLongf outLength = uncompressedLength;
+    int r = uncompress(reinterpret_cast<Bytef*>(&block[0]),
+                       &outLength,
+                       static_cast<const Bytef*>(compressedData),
+                       compressedLength);
+    if (r != Z_OK || outLength != uncompressedLength) {
+        PANIC("Could not decompress %lu-byte block at offset %lu in "
+              "snapshot file %s: %s (got %lu of %lu bytes)",
+              compressedLength,
+              nextBlockOffset,
+              file.path.c_str(),
+              zError(r),
+              outLength,
+              uncompressedLength);
+    }
+    nextBlockOffset += sizeof(header) + compressedLength;
+    blockBytesRead = 0;
+    return true;
+}
+
 template<typename T>
 Writer::SharedMMap<T>::SharedMMap()
     : value(NULL)
@@ -160,19 +286,31 @@ Writer::SharedMMap<T>::~SharedMMap()
     }
 }
 
-Writer::Writer(const Storage::Layout& storageLayout)
+const uint64_t Writer::COMPRESSION_BLOCK_BYTES;
+
+Writer::Writer(const Storage::Layout& storageLayout,
+               int compressionLevel)
     : parentDir(FilesystemUtil::dup(storageLayout.snapshotDir))
     , stagingName()
     , file()
     , bytesWritten(0)
+    , compressionLevel(compressionLevel)
+    , pendingBlock()
+    , rangesAhead()
     , sharedBytesWritten()
 {
+    if (compressionLevel < 0 || compressionLevel > Z_BEST_COMPRESSION) {
+        PANIC("Invalid snapshot compression level %d (expected 0 through %d)",
+              compressionLevel, Z_BEST_COMPRESSION);
+    }
     struct timespec now =
         Core::Time::makeTimeSpec(Core::Time::SystemClock::now());
     stagingName = format("partial.%010lu.%06lu",
                          now.tv_sec, now.tv_nsec / 1000);
     file = FilesystemUtil::openFile(parentDir, stagingName,
                                     O_WRONLY|O_CREAT|O_EXCL);
+    if (compressionLevel > 0)
+        writeToFile(COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC));
 }
 
 Writer::~Writer()
@@ -195,12 +333,16 @@ Writer::discard()
 void
 Writer::flushToOS()
 {
-    // Nothing to do.
+    flushBlock();
 }
 
 void
 Writer::seekToEnd()
 {
+    // Anything still buffered was written from this process (a child
+    // process's buffer disappears with it, and the parent's was flushed
+    // before forking), so it precedes the end of the file.
+    flushBlock();
     off64_t r = lseek64(file.fd, 0, SEEK_END);
     if (r < 0)
         PANIC("lseek failed: %s", strerror(errno));
@@ -212,6 +354,7 @@ Writer::save()
 {
     if (file.fd < 0)
         PANIC("File already closed");
+    flushBlock();
     FilesystemUtil::fsync(file);
     uint64_t fileSize = FilesystemUtil::getSize(file);
     file.close();
@@ -233,6 +376,11 @@ Writer::writeMessage(const google::protobuf::Message& message)
     Core::Buffer buf;
     Core::ProtoBuf::serialize(message, buf);
     uint32_t beSize = htobe32(uint32_t(buf.getLength()));
+    if (compressionLevel > 0) {
+        writeRaw(&beSize, sizeof(beSize));
+        writeRaw(buf.getData(), buf.getLength());
+        return;
+    }
     ssize_t r = FilesystemUtil::write(file.fd, {
                                           {&beSize, sizeof(beSize)},
                                           {buf.getData(), buf.getLength()},
@@ -248,6 +396,59 @@ Writer::writeMessage(const google::protobuf::Message& message)
 
 void
 Writer::writeRaw(const void* data, uint64_t length)
+{
+    if (compressionLevel == 0) {
+        writeToFile(data, length);
+        *sharedBytesWritten.value += length;
+        return;
+    }
+    const char* bytes = static_cast<const char*>(data);
+    while (length > 0) {
+        uint64_t n = std::min(length,
+                              COMPRESSION_BLOCK_BYTES - pendingBlock.size());
+        pendingBlock.append(bytes, n);
+        bytes += n;
+        length -= n;
+        *sharedBytesWritten.value += n;
+        if (pendingBlock.size() == COMPRESSION_BLOCK_BYTES)
+            flushBlock();
+    }
+}
+
+void
+Writer::writeRawAt(uint64_t offset, const void* data, uint64_t length)
+{
+    if (compressionLevel > 0)
+        PANIC("writeRawAt is not supported on compressed snapshot files");
+    ssize_t r = FilesystemUtil::pwrite(file.fd, data, length, offset);
+    if (r < 0) {
+        PANIC("Could not write %lu bytes at offset %lu into %s: %s",
+              length,
+              offset,
+              file.path.c_str(),
+              strerror(errno));
+    }
+    *sharedBytesWritten.value += length;
+    uint64_t end = offset + length;
+    if (offset > bytesWritten) {
+        uint64_t& rangeEnd = rangesAhead[offset];
+        rangeEnd = std::max(rangeEnd, end);
+        return;
+    }
+    bytesWritten = std::max(bytesWritten, end);
+    // Absorb the ranges that are now contiguous with the start of the file.
+    while (!rangesAhead.empty() &&
+           rangesAhead.begin()->first <= bytesWritten) {
+        bytesWritten = std::max(bytesWritten, rangesAhead.begin()->second);
+        rangesAhead.erase(rangesAhead.begin());
+    }
+    // Keep appending with writeRaw() consistent.
+    if (lseek64(file.fd, off64_t(bytesWritten), SEEK_SET) < 0)
+        PANIC("lseek failed: %s", strerror(errno));
+}
+
+void
+Writer::writeToFile(const void* data, uint64_t length)
 {
     ssize_t r = FilesystemUtil::write(file.fd, data, length);
     if (r < 0) {
@@ -256,7 +457,34 @@ Writer::writeRaw(const void* data, uint64_t length)
               strerror(errno));
     }
     bytesWritten += Core::Util::downCast<uint64_t>(r);
-    *sharedBytesWritten.value += Core::Util::downCast<uint64_t>(r);
+}
+
+void
+Writer::flushBlock()
+{
+    if (compressionLevel == 0 || pendingBlock.empty())
+        return;
+    uLongf compressedLength = compressBound(pendingBlock.size());
+    std::unique_ptr<char[]> compressedData(
+        new char[sizeof(BlockHeader) + compressedLength]);
+    int r = compress2(reinterpret_cast<Bytef*>(compressedData.get() +
+                                               sizeof(BlockHeader)),
+                      &compressedLength,
+                      reinterpret_cast<const Bytef*>(pendingBlock.data()),
+                      pendingBlock.size(),
+                      compressionLevel);
+    if (r != Z_OK) {
+        PANIC("Could not compress %lu bytes for %s: %s",
+              pendingBlock.size(),
+              file.path.c_str(),
+              zError(r));
+    }
+    BlockHeader header;
+    header.compressedLength = htobe32(uint32_t(compressedLength));
+    header.uncompressedLength = htobe32(uint32_t(pendingBlock.size()));
+    memcpy(compressedData.get(), &header, sizeof(header));
+    writeToFile(compressedData.get(), sizeof(header) + compressedLength);
+    pendingBlock.clear();
 }
 
 } // namespace LogCabin::Storage::SnapshotFile
@@ -15,6 +15,7 @@
  */
 
 #include <google/protobuf/message.h>
+#include <map>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -39,8 +40,19 @@ namespace SnapshotFile {
  */
 void discardPartialSnapshots(const Storage::Layout& storageLayout);
 
+/**
+ * Snapshot files written with compression enabled begin with these bytes.
+ * Uncompressed snapshot files never do, since their first byte is the
+ * snapshot format version.
+ */
+extern const char COMPRESSED_MAGIC[8];
+
 /**
  * Assists in reading snapshot files from the local filesystem.
+ *
+ * Compressed snapshot files are decompressed one block at a time as they're
+ * read, so everything but getSizeBytes() and getFileSizeBytes() refers to the
+ * uncompressed contents of the file, whichever way it was written.
  */
 class Reader : public Core::ProtoBuf::InputStream {
   public:
@@ -49,14 +61,29 @@ class Reader : public Core::ProtoBuf::InputStream {
      * \param storageLayout
      *      The directories in which to find the snapshot (in a file called
      *      "snapshot" in the snapshotDir).
+     * \param filename
+     *      The name of the file within the snapshotDir. This is normally
+     *      "snapshot", but older snapshots that later delta snapshots depend
+     *      on are kept under other names.
      * \throw std::runtime_error
      *      If the file can't be found.
      */
-    explicit Reader(const Storage::Layout& storageLayout);
+    explicit Reader(const Storage::Layout& storageLayout,
+                    const std::string& filename = "snapshot");
     /// Destructor.
     ~Reader();
-    /// Return the size in bytes for the file.
+    /**
+     * Return the size in bytes of the file's contents, after decompression.
+     */
     uint64_t getSizeBytes();
+    /**
+     * Return the size in bytes of the file on disk.
+     */
+    uint64_t getFileSizeBytes();
+    /**
+     * Return true if the file was written with compression enabled.
+     */
+    bool isCompressed() const;
     // See Core::ProtoBuf::InputStream.
     uint64_t getBytesRead() const;
     // See Core::ProtoBuf::InputStream.
@@ -64,12 +91,29 @@ class Reader : public Core::ProtoBuf::InputStream {
     // See Core::ProtoBuf::InputStream.
     uint64_t readRaw(void* data, uint64_t length);
   private:
+    /**
+     * Decompress the next block of a compressed file into #block.
+     * PANICs if the block is corrupt.
+     * \return
+     *      False if there are no more blocks in the file.
+     */
+    bool readBlock();
     /// Wraps the raw file descriptor; in charge of closing it when done.
     Storage::FilesystemUtil::File file;
     /// Maps the file into memory for reading.
     std::unique_ptr<Storage::FilesystemUtil::FileContents> contents;
-    /// The number of bytes read from the file.
+    /// The number of (uncompressed) bytes read from the file.
     uint64_t bytesRead;
+    /// See isCompressed().
+    bool compressed;
+    /// See getSizeBytes(). Computed once from the block headers.
+    uint64_t uncompressedSize;
+    /// For compressed files, the offset in the file of the next block header.
+    uint64_t nextBlockOffset;
+    /// For compressed files, the contents of the current block.
+    std::string block;
+    /// For compressed files, the number of bytes of #block already read.
+    uint64_t blockBytesRead;
 };
 
 /**
@@ -96,9 +140,16 @@ class Writer : public Core::ProtoBuf::OutputStream {
      * \param storageLayout
      *      The directories in which to create the snapshot (in a file called
      *      "snapshot" in the snapshotDir).
+     * \param compressionLevel
+     *      If nonzero, the data given to the Writer is compressed with zlib at
+     *      this level (1 through 9) in independent blocks of
+     *      COMPRESSION_BLOCK_BYTES. If 0, the data is written as-is, which is
+     *      also what followers use to store the bytes of a (possibly
+     *      compressed) snapshot file that the leader sent them.
      * TODO(ongaro): what if it can't be written?
      */
-    explicit Writer(const Storage::Layout& storageLayout);
+    explicit Writer(const Storage::Layout& storageLayout,
+                    int compressionLevel = 0);
     /**
      * Destructor.
      * If the file hasn't been explicitly saved or discarded, prints a warning
@@ -112,7 +163,8 @@ class Writer : public Core::ProtoBuf::OutputStream {
     void discard();
     /**
      * Flush changes just down to the operating system's buffer cache.
-     * Leave the file open for additional writes.
+     * Leave the file open for additional writes. If compression is enabled,
+     * this ends the current block.
      *
      * This is useful when forking child processes to write to the file.
      * The correct procedure for that is:
@@ -140,14 +192,42 @@ class Writer : public Core::ProtoBuf::OutputStream {
      *      Size in bytes of the file
      */
     uint64_t save();
-    // See Core::ProtoBuf::OutputStream.
+    /**
+     * Return the number of bytes written to the file so far. With
+     * compression enabled, this doesn't include data buffered for the
+     * current block.
+     */
     uint64_t getBytesWritten() const;
     // See Core::ProtoBuf::OutputStream.
     void writeMessage(const google::protobuf::Message& message);
     // See Core::ProtoBuf::OutputStream.
     void writeRaw(const void* data, uint64_t length);
+    /**
+     * Write raw bytes at the given offset in the file, which may be past the
+     * bytes written so far. This lets a follower store chunks of a snapshot
+     * that arrive out of order. getBytesWritten() only counts the bytes
+     * written without gaps from the start of the file, so it grows past
+     * chunks stored ahead once the gap before them is filled in.
+     * Only valid when compression is disabled.
+     */
+    void writeRawAt(uint64_t offset, const void* data, uint64_t length);
+
+    /**
+     * With compression enabled, data is buffered until this many bytes have
+     * accumulated, then compressed and written out as one block.
+     */
+    static const uint64_t COMPRESSION_BLOCK_BYTES = 1024 * 1024;
 
   private:
+    /**
+     * Write 'data' to the file, updating #bytesWritten.
+     */
+    void writeToFile(const void* data, uint64_t length);
+    /**
+     * If compression is enabled, compress #pendingBlock and write it to the
+     * file as a block.
+     */
+    void flushBlock();
     /// A handle to the directory containing the snapshot. Used for renameat on
     /// close.
     Storage::FilesystemUtil::File parentDir;
@@ -157,10 +237,19 @@ class Writer : public Core::ProtoBuf::OutputStream {
     Storage::FilesystemUtil::File file;
     /// The number of bytes accumulated in the file so far.
     uint64_t bytesWritten;
+    /// The zlib compression level, or 0 if compression is disabled.
+    int compressionLevel;
+    /// Data not yet compressed and written to the file.
+    std::string pendingBlock;
+    /**
+     * Ranges written by writeRawAt() past #bytesWritten, as a map from start
+     * offset to end offset.
+     */
+    std::map<uint64_t, uint64_t> rangesAhead;
   public:
     /**
      * This value is incremented every time bytes are written to the Writer
-     * from any process holding this Writer. Used by Server/StateMachine to
+     * from any process holding this Writer (before they're compressed). Used by Server/StateMachine to
      * implement a watchdog that checks progress of a snapshotting process.
      */
     SharedMMap<std::atomic<uint64_t>> sharedBytesWritten;
@@ -17,11 +17,13 @@
 #include <fcntl.h>
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "build/Core/ProtoBufTest.pb.h"
 #include "Core/Debug.h"
 #include "Core/StringUtil.h"
 #include "Core/STLUtil.h"
+#include "Core/Util.h"
 #include "Storage/FilesystemUtil.h"
 #include "Storage/Layout.h"
 #include "Storage/SnapshotFile.h"
@@ -93,6 +95,25 @@ TEST_F(StorageSnapshotFileTest, reader_fileNotFound)
     EXPECT_THROW(Reader reader(layout), std::runtime_error);
 }
 
+TEST_F(StorageSnapshotFileTest, reader_filename)
+{
+    {
+        Writer writer(layout);
+        writer.writeRaw("a", 1);
+        writer.save();
+    }
+    FilesystemUtil::link(layout.snapshotDir, "snapshot",
+                         layout.snapshotDir, "snapshot.5");
+    {
+        Writer writer(layout);
+        writer.writeRaw("bc", 2);
+        writer.save();
+    }
+    Reader reader(layout, "snapshot.5");
+    EXPECT_EQ(1U, reader.getSizeBytes());
+    EXPECT_THROW(Reader(layout, "snapshot.6"), std::runtime_error);
+}
+
 TEST_F(StorageSnapshotFileTest, getBytesRead)
 {
     {
@@ -289,6 +310,193 @@ TEST_F(StorageSnapshotFileTest, sharedBytesWritten)
 
 }
 
+TEST_F(StorageSnapshotFileTest, writeRawAt)
+{
+    {
+        Writer writer(layout);
+        writer.writeRawAt(6, "wor", 3);
+        EXPECT_EQ(0U, writer.getBytesWritten());
+        writer.writeRawAt(10, "d!", 2);
+        writer.writeRawAt(9, "l", 1);
+        EXPECT_EQ(0U, writer.getBytesWritten());
+        writer.writeRawAt(0, "hello ", 6);
+        EXPECT_EQ(12U, writer.getBytesWritten());
+        EXPECT_EQ(12U, *writer.sharedBytesWritten.value);
+        writer.writeRawAt(0, "h", 1); // duplicate
+        EXPECT_EQ(12U, writer.getBytesWritten());
+        writer.writeRaw("?", 2);
+        EXPECT_EQ(14U, writer.getBytesWritten());
+        writer.save();
+    }
+    {
+        Reader reader(layout);
+        char buf[14];
+        EXPECT_EQ(14U, reader.readRaw(buf, sizeof(buf)));
+        EXPECT_STREQ("hello world!?", buf);
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_basic)
+{
+    uint64_t fileBytes = 0;
+    {
+        Writer writer(layout, 6);
+        EXPECT_EQ(sizeof(COMPRESSED_MAGIC), writer.getBytesWritten());
+        uint8_t version = 1;
+        writer.writeRaw(&version, sizeof(version));
+        writer.writeMessage(m1);
+        writer.writeMessage(m1);
+        // buffered until the block ends
+        EXPECT_EQ(sizeof(COMPRESSED_MAGIC), writer.getBytesWritten());
+        fileBytes = writer.save();
+    }
+    {
+        Reader reader(layout);
+        EXPECT_TRUE(reader.isCompressed());
+        EXPECT_EQ(fileBytes, reader.getFileSizeBytes());
+        uint8_t version = 0;
+        EXPECT_EQ(1U, reader.readRaw(&version, sizeof(version)));
+        EXPECT_EQ(1U, version);
+        ProtoBuf::TestMessage out;
+        EXPECT_EQ("", reader.readMessage(out));
+        EXPECT_EQ(m1, out);
+        uint64_t m1bytes = reader.getBytesRead() - 1;
+        out.Clear();
+        EXPECT_EQ("", reader.readMessage(out));
+        EXPECT_EQ(m1, out);
+        EXPECT_EQ(1 + 2 * m1bytes, reader.getBytesRead());
+        EXPECT_EQ(reader.getBytesRead(), reader.getSizeBytes());
+        EXPECT_NE("", reader.readMessage(out));
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_multipleBlocks)
+{
+    uint64_t numWords = 5 * Writer::COMPRESSION_BLOCK_BYTES / 2 / 4;
+    {
+        Writer writer(layout, 1);
+        for (uint32_t i = 0; i < numWords; ++i)
+            writer.writeRaw(&i, sizeof(i));
+        // two full blocks are out, well under their uncompressed size
+        EXPECT_LT(sizeof(COMPRESSED_MAGIC), writer.getBytesWritten());
+        EXPECT_GT(Writer::COMPRESSION_BLOCK_BYTES, writer.getBytesWritten());
+        writer.save();
+    }
+    {
+        Reader reader(layout);
+        EXPECT_TRUE(reader.isCompressed());
+        EXPECT_EQ(numWords * 4, reader.getSizeBytes());
+        EXPECT_GT(reader.getSizeBytes(), reader.getFileSizeBytes());
+        // read in odd-sized pieces so that some span blocks
+        std::vector<char> data(numWords * 4);
+        uint64_t offset = 0;
+        while (offset < data.size()) {
+            uint64_t r = reader.readRaw(&data[offset], 12345);
+            ASSERT_LT(0U, r);
+            offset += r;
+        }
+        EXPECT_EQ(data.size(), reader.getBytesRead());
+        uint32_t x = 0;
+        EXPECT_EQ(0U, reader.readRaw(&x, sizeof(x)));
+        bool ok = true;
+        for (uint32_t i = 0; i < numWords; ++i) {
+            memcpy(&x, &data[i * 4], sizeof(x));
+            if (x != i) {
+                EXPECT_EQ(i, x);
+                ok = false;
+                break;
+            }
+        }
+        EXPECT_TRUE(ok);
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_forking)
+{
+    {
+        Writer writer(layout, 6);
+        uint32_t d = 482;
+        writer.writeRaw(&d, sizeof(d));
+        writer.flushToOS();
+        uint64_t before = writer.getBytesWritten();
+        EXPECT_LT(sizeof(COMPRESSED_MAGIC), before);
+        pid_t pid = fork();
+        ASSERT_LE(0, pid);
+        if (pid == 0) { // child
+            d = 127;
+            writer.writeRaw(&d, sizeof(d));
+            writer.flushToOS();
+            _exit(0);
+        } else { // parent
+            int status = 0;
+            pid = waitpid(pid, &status, 0);
+            EXPECT_LE(0, pid);
+            EXPECT_TRUE(WIFEXITED(status));
+            EXPECT_EQ(0, WEXITSTATUS(status));
+            writer.seekToEnd();
+            EXPECT_LT(before, writer.getBytesWritten());
+            d = 998;
+            writer.writeRaw(&d, sizeof(d));
+            // seekToEnd flushes what this process buffered
+            writer.seekToEnd();
+            d = 999;
+            writer.writeRaw(&d, sizeof(d));
+            writer.save();
+        }
+    }
+    {
+        Reader reader(layout);
+        uint32_t x = 0;
+        EXPECT_EQ(16U, reader.getSizeBytes());
+        EXPECT_EQ(sizeof(x), reader.readRaw(&x, sizeof(x)));
+        EXPECT_EQ(482U, x);
+        EXPECT_EQ(sizeof(x), reader.readRaw(&x, sizeof(x)));
+        EXPECT_EQ(127U, x);
+        EXPECT_EQ(sizeof(x), reader.readRaw(&x, sizeof(x)));
+        EXPECT_EQ(998U, x);
+        EXPECT_EQ(sizeof(x), reader.readRaw(&x, sizeof(x)));
+        EXPECT_EQ(999U, x);
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_copiedAsIs)
+{
+    // This is how followers store snapshots sent by the leader.
+    {
+        Writer writer(layout, 9);
+        writer.writeMessage(m1);
+        writer.save();
+    }
+    FilesystemUtil::File file =
+        FilesystemUtil::openFile(layout.snapshotDir, "snapshot", O_RDONLY);
+    FilesystemUtil::FileContents contents(file);
+    {
+        Writer writer(layout);
+        writer.writeRaw(contents.get(0, contents.getFileLength()),
+                        contents.getFileLength());
+        writer.save();
+    }
+    Reader reader(layout);
+    EXPECT_TRUE(reader.isCompressed());
+    ProtoBuf::TestMessage out;
+    EXPECT_EQ("", reader.readMessage(out));
+    EXPECT_EQ(m1, out);
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_truncated)
+{
+    {
+        Writer writer(layout, 6);
+        writer.writeMessage(m1);
+        writer.save();
+    }
+    FilesystemUtil::File file =
+        FilesystemUtil::openFile(layout.snapshotDir, "snapshot", O_RDWR);
+    ASSERT_EQ(0, ftruncate(file.fd,
+                           Core::Util::downCast<off_t>(
+                               FilesystemUtil::getSize(file) - 1)));
+    EXPECT_DEATH(Reader reader(layout), "truncated");
+}
 
 // writeMessage tested with readMessage above
 
@@ -0,0 +1,214 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <getopt.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Core/Config.h"
+#include "Core/Debug.h"
+#include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
+#include "Core/Util.h"
+#include "Storage/Layout.h"
+#include "Storage/SegmentedLog.h"
+
+namespace {
+
+using namespace LogCabin;
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , backends({"sync", "io_uring"})
+        , entriesPerSync(2)
+        , rounds(200)
+        , storagePath()
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"backend",  required_argument, NULL, 'b'},
+               {"entries",  required_argument, NULL, 'e'},
+               {"help",  no_argument, NULL, 'h'},
+               {"rounds",  required_argument, NULL, 'r'},
+               {"storage",  required_argument, NULL, 's'},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "b:e:hr:s:", longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'b':
+                    backends = {optarg};
+                    break;
+                case 'e':
+                    entriesPerSync = uint64_t(atol(optarg));
+                    break;
+                case 'h':
+                    usage();
+                    exit(0);
+                case 'r':
+                    rounds = uint64_t(atol(optarg));
+                    break;
+                case 's':
+                    storagePath = optarg;
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+
+        // We don't expect any additional command line arguments (not options).
+        if (optind != argc || entriesPerSync == 0 || rounds == 0) {
+            usage();
+            exit(1);
+        }
+    }
+
+    void usage() {
+        std::cout
+            << "Measures how long SegmentedLog takes to append and flush "
+            << "small entries"
+            << std::endl
+            << "with each storageIOBackend. This does real fsyncs, so run "
+            << "it on the disk"
+            << std::endl
+            << "you intend to store the log on."
+            << std::endl
+            << std::endl
+            << "This program is subject to change (it is not part of "
+            << "LogCabin's stable API)."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  -b <name>, --backend=<name>  "
+            << "Only measure this storageIOBackend"
+            << std::endl
+            << "                               "
+            << "[default: sync, then io_uring]"
+            << std::endl
+
+            << "  -e <num>, --entries=<num>    "
+            << "Number of entries appended per flush [default: 2]"
+            << std::endl
+
+            << "  -h, --help                   "
+            << "Print this usage information"
+            << std::endl
+
+            << "  -r <num>, --rounds=<num>     "
+            << "Number of flushes per backend [default: 200]"
+            << std::endl
+
+            << "  -s <dir>, --storage=<dir>    "
+            << "Directory in which to create the log"
+            << std::endl
+            << "                               "
+            << "[default: a temporary directory]"
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    std::vector<std::string> backends;
+    uint64_t entriesPerSync;
+    uint64_t rounds;
+    std::string storagePath;
+};
+
+/**
+ * Append and flush entries with the given backend, and return the average
+ * time each flush took in nanoseconds.
+ */
+uint64_t
+measure(const OptionParser& options, const std::string& backend)
+{
+    Core::Config config;
+    config.set("storageIOBackend", backend);
+    Storage::Layout layout;
+    if (options.storagePath.empty())
+        layout.initTemporary();
+    else
+        layout.init(options.storagePath, 1);
+    Storage::SegmentedLog log(layout.logDir,
+                              Storage::SegmentedLog::Encoding::BINARY,
+                              config);
+
+    Storage::Log::Entry entry;
+    entry.set_term(1);
+    entry.set_type(Protocol::Raft::EntryType::DATA);
+    entry.set_data("hello");
+    std::vector<const Storage::Log::Entry*> entries(options.entriesPerSync,
+                                                    &entry);
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < options.rounds; ++i) {
+        log.append(entries);
+        std::unique_ptr<Storage::Log::Sync> sync = log.takeSync();
+        sync->wait();
+        log.syncComplete(std::move(sync));
+    }
+    uint64_t nanos = uint64_t(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    return nanos / options.rounds;
+}
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    using namespace LogCabin;
+
+    Core::Util::Finally _(google::protobuf::ShutdownProtobufLibrary);
+    Core::ThreadId::setName("main");
+    OptionParser options(argc, argv);
+    // A fresh log warns about its missing metadata files; keep the output to
+    // the results.
+    Core::Debug::setLogPolicy({{"", "ERROR"}});
+
+    for (auto it = options.backends.begin();
+         it != options.backends.end();
+         ++it) {
+        uint64_t nanos = measure(options, *it);
+        std::cout << *it << ": " << nanos << " ns per flush of "
+                  << options.entriesPerSync << " entries"
+                  << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+/* Copyright (c) 2026 The raft-eaas Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <getopt.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
+#include "Core/Time.h"
+#include "Core/Util.h"
+#include "Tree/Tree.h"
+
+namespace {
+
+using namespace LogCabin;
+using Core::StringUtil::format;
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , numChildren(100000)
+        , numReads(300000)
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"children",  required_argument, NULL, 'c'},
+               {"help",  no_argument, NULL, 'h'},
+               {"reads",  required_argument, NULL, 'r'},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "c:hr:", longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'c':
+                    numChildren = uint64_t(atol(optarg));
+                    break;
+                case 'h':
+                    usage();
+                    exit(0);
+                case 'r':
+                    numReads = uint64_t(atol(optarg));
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+
+        // We don't expect any additional command line arguments (not options).
+        if (optind != argc || numChildren == 0 || numReads == 0) {
+            usage();
+            exit(1);
+        }
+    }
+
+    void usage() {
+        std::cout
+            << "Measures how long Tree::read() takes to look up files in a "
+            << "single large"
+            << std::endl
+            << "directory, in memory."
+            << std::endl
+            << std::endl
+            << "This program is subject to change (it is not part of "
+            << "LogCabin's stable API)."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  -c <num>, --children=<num>  "
+            << "Number of files in the directory [default: 100000]"
+            << std::endl
+
+            << "  -h, --help                  "
+            << "Print this usage information"
+            << std::endl
+
+            << "  -r <num>, --reads=<num>     "
+            << "Number of reads to time [default: 300000]"
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    uint64_t numChildren;
+    uint64_t numReads;
+};
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    using namespace LogCabin;
+
+    Core::Util::Finally _(google::protobuf::ShutdownProtobufLibrary);
+    Core::ThreadId::setName("main");
+    OptionParser options(argc, argv);
+
+    Tree::Tree tree;
+    tree.makeDirectory("/dir");
+    std::vector<std::string> paths;
+    paths.reserve(options.numChildren);
+    // Insert the children out of order, so that reads in order of 'paths'
+    // don't just walk through memory.
+    for (uint64_t i = 0; i < options.numChildren; ++i) {
+        paths.push_back(format("/dir/child-%lu",
+                               i * 7919 % options.numChildren));
+        tree.write(paths.back(), "x");
+    }
+
+    std::string contents;
+    Core::Time::SteadyClock::time_point start =
+        Core::Time::SteadyClock::now();
+    for (uint64_t i = 0; i < options.numReads; ++i)
+        tree.read(paths.at(i * 31 % options.numChildren), contents);
+    std::chrono::nanoseconds elapsed = Core::Time::SteadyClock::now() - start;
+    std::cout << "Reads in a directory with " << options.numChildren
+              << " children: "
+              << (uint64_t(elapsed.count()) / options.numReads) << " ns each"
+              << std::endl;
+    return 0;
+}
@@ -13,8 +13,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <google/protobuf/io/coded_stream.h>
+
 #include "Core/Debug.h"
 #include "Core/ProtoBuf.h"
+#include "Protocol/Common.h"
 #include "Tree/ProtoBuf.h"
 
 namespace LogCabin {
@@ -23,28 +26,153 @@ namespace ProtoBuf {
 
 namespace PC = LogCabin::Protocol::Client;
 
+namespace {
+
+using google::protobuf::io::CodedOutputStream;
+
+/**
+ * The most that the encoded entries and continuation of a ScanTree response
+ * may add up to, whatever the request's max_bytes. The rest of the message
+ * limit leaves room for the RPC and response headers.
+ */
+const uint64_t MAX_SCAN_TREE_BYTES =
+    Protocol::Common::MAX_MESSAGE_LENGTH - 1024;
+
+/**
+ * Check a condition on a request or batch operation: the version, if it has
+ * one, or else the contents.
+ */
+Result
+checkCondition(const Tree& tree, const PC::TreeCondition& condition)
+{
+    if (condition.has_version())
+        return tree.checkCondition(condition.path(), condition.version());
+    return tree.checkCondition(condition.path(), condition.contents());
+}
+
+/**
+ * Apply the operation set in a ReadWriteTree request or batch operation.
+ * This does not check the condition.
+ * \return
+ *      False if no operation that this code understands is set, true
+ *      otherwise.
+ */
+template<typename Operation>
+bool
+applyOperation(Tree& tree, const Operation& op, Result& result)
+{
+    if (op.has_make_directory()) {
+        result = tree.makeDirectory(op.make_directory().path());
+    } else if (op.has_remove_directory()) {
+        result = tree.removeDirectory(op.remove_directory().path());
+    } else if (op.has_write()) {
+        result = tree.write(op.write().path(),
+                            op.write().contents());
+    } else if (op.has_remove_file()) {
+        result = tree.removeFile(op.remove_file().path());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Apply a batch of operations atomically.
+ */
+Result
+applyBatch(Tree& tree,
+           const PC::ReadWriteTree::Request::Batch& batch,
+           PC::ReadWriteTree::Response& response)
+{
+    Result result;
+    tree.beginTransaction();
+    for (int i = 0; i < batch.operation_size(); ++i) {
+        const PC::ReadWriteTree::Request::Batch::Operation& op =
+            batch.operation(i);
+        if (op.has_condition())
+            result = checkCondition(tree, op.condition());
+        if (result.status == Status::OK &&
+            !applyOperation(tree, op, result)) {
+            result.status = Status::INVALID_ARGUMENT;
+            result.error = "Unexpected operation in batch";
+        }
+        if (result.status != Status::OK) {
+            response.set_failed_operation(uint32_t(i));
+            tree.rollbackTransaction();
+            return result;
+        }
+    }
+    tree.commitTransaction();
+    return result;
+}
+
+} // anonymous namespace
+
 void
 readOnlyTreeRPC(const Tree& tree,
                 const PC::ReadOnlyTree::Request& request,
                 PC::ReadOnlyTree::Response& response)
 {
     Result result;
-    if (request.has_condition()) {
-        result = tree.checkCondition(request.condition().path(),
-                                     request.condition().contents());
-    }
+    if (request.has_condition())
+        result = checkCondition(tree, request.condition());
     if (result.status != Status::OK) {
         // condition does not match, skip
     } else if (request.has_list_directory()) {
         std::vector<std::string> children;
+        uint64_t version = 0;
         result = tree.listDirectory(request.list_directory().path(),
-                                    children);
+                                    children,
+                                    version);
         for (auto it = children.begin(); it != children.end(); ++it)
             response.mutable_list_directory()->add_child(*it);
+        response.mutable_list_directory()->set_version(version);
     } else if (request.has_read()) {
         std::string contents;
-        result = tree.read(request.read().path(), contents);
+        uint64_t version = 0;
+        result = tree.read(request.read().path(), contents, version);
         response.mutable_read()->set_contents(contents);
+        response.mutable_read()->set_version(version);
+    } else if (request.has_scan_tree()) {
+        const PC::ReadOnlyTree::Request::ScanTree& scan = request.scan_tree();
+        // The response has to fit in one RPC, whatever the client asked for.
+        uint64_t maxBytes = MAX_SCAN_TREE_BYTES;
+        if (scan.max_bytes() > 0 && scan.max_bytes() < maxBytes)
+            maxBytes = scan.max_bytes();
+        std::vector<std::pair<std::string, std::string>> entries;
+        bool more = false;
+        result = tree.scanTree(scan.path(),
+                               scan.recursive(),
+                               scan.after(),
+                               maxBytes,
+                               entries,
+                               more);
+        // The tree only counted the paths and contents. Count their encoding
+        // as well, along with the continuation that may name the last entry,
+        // and leave whatever doesn't fit for the next batch.
+        PC::ReadOnlyTree::Response::ScanTree& out =
+            *response.mutable_scan_tree();
+        uint64_t bytes = 0;
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            PC::ReadOnlyTree::Response::ScanTree::Entry entry;
+            entry.mutable_path()->swap(it->first);
+            entry.mutable_contents()->swap(it->second);
+            uint64_t entrySize = entry.ByteSizeLong();
+            uint64_t entryBytes =
+                1 + CodedOutputStream::VarintSize64(entrySize) + entrySize;
+            uint64_t continuationBytes =
+                1 + CodedOutputStream::VarintSize64(entry.path().size()) +
+                entry.path().size();
+            if (out.entry_size() > 0 &&
+                bytes + entryBytes + continuationBytes > maxBytes) {
+                more = true;
+                break;
+            }
+            bytes += entryBytes;
+            out.add_entry()->Swap(&entry);
+        }
+        if (more)
+            out.set_continuation(out.entry(out.entry_size() - 1).path());
     } else {
         PANIC("Unexpected request: %s",
               Core::ProtoBuf::dumpString(request).c_str());
@@ -60,22 +188,13 @@ readWriteTreeRPC(Tree& tree,
                  PC::ReadWriteTree::Response& response)
 {
     Result result;
-    if (request.has_condition()) {
-        result = tree.checkCondition(request.condition().path(),
-                                     request.condition().contents());
-    }
+    if (request.has_condition())
+        result = checkCondition(tree, request.condition());
     if (result.status != Status::OK) {
         // condition does not match, skip
-    } else if (request.has_make_directory()) {
-        result = tree.makeDirectory(request.make_directory().path());
-    } else if (request.has_remove_directory()) {
-        result = tree.removeDirectory(request.remove_directory().path());
-    } else if (request.has_write()) {
-        result = tree.write(request.write().path(),
-                            request.write().contents());
-    } else if (request.has_remove_file()) {
-        result = tree.removeFile(request.remove_file().path());
-    } else {
+    } else if (request.has_batch()) {
+        result = applyBatch(tree, request.batch(), response);
+    } else if (!applyOperation(tree, request, result)) {
         PANIC("Unexpected request: %s",
               Core::ProtoBuf::dumpString(request).c_str());
     }
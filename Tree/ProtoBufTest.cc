@@ -13,5 +13,71 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-// This file is tested together with the client library in Client/ClientTest.cc
-// by making use of the mock client library option.
+// Most of this file is tested together with the client library in
+// Client/ClientTest.cc by making use of the mock client library option. The
+// tests here cover limits that the mock client doesn't exercise.
+
+#include <gtest/gtest.h>
+
+#include "Core/StringUtil.h"
+#include "Protocol/Common.h"
+#include "Tree/ProtoBuf.h"
+
+namespace LogCabin {
+namespace Tree {
+namespace {
+
+namespace PC = LogCabin::Protocol::Client;
+using Core::StringUtil::format;
+
+TEST(TreeProtoBufTest, readOnlyTreeRPC_scanTreeFitsInMessage)
+{
+    // Enough small files that their paths and contents alone fit in the
+    // client's default batch size but their encoding doesn't fit in a
+    // message.
+    Tree tree;
+    tree.makeDirectory("/d");
+    const uint64_t numFiles = 70000;
+    for (uint64_t i = 0; i < numFiles; ++i)
+        tree.write(format("/d/f%05lu", i), "abcde");
+
+    PC::ReadOnlyTree::Request request;
+    request.mutable_scan_tree()->set_path("/d");
+    uint64_t maxBytesRequested[] = {0, 1024 * 1024, 1UL << 40};
+    for (size_t i = 0; i < 3; ++i) {
+        request.mutable_scan_tree()->set_max_bytes(maxBytesRequested[i]);
+        PC::ReadOnlyTree::Response response;
+        ProtoBuf::readOnlyTreeRPC(tree, request, response);
+        EXPECT_EQ(PC::Status::OK, response.status());
+        EXPECT_GE(Protocol::Common::MAX_MESSAGE_LENGTH - 1024,
+                  response.scan_tree().ByteSizeLong())
+            << maxBytesRequested[i];
+        EXPECT_GT(Protocol::Common::MAX_MESSAGE_LENGTH - 512,
+                  response.ByteSizeLong());
+        EXPECT_TRUE(response.scan_tree().has_continuation());
+    }
+
+    // Every file still comes back, in order, across batches.
+    uint64_t next = 0;
+    request.mutable_scan_tree()->set_max_bytes(0);
+    while (true) {
+        PC::ReadOnlyTree::Response response;
+        ProtoBuf::readOnlyTreeRPC(tree, request, response);
+        const PC::ReadOnlyTree::Response::ScanTree& scan =
+            response.scan_tree();
+        for (int j = 0; j < scan.entry_size(); ++j) {
+            EXPECT_EQ(format("/d/f%05lu", next), scan.entry(j).path());
+            ++next;
+        }
+        if (!scan.has_continuation())
+            break;
+        EXPECT_EQ(scan.entry(scan.entry_size() - 1).path(),
+                  scan.continuation());
+        request.mutable_scan_tree()->set_after(scan.continuation());
+    }
+    EXPECT_EQ(numFiles, next);
+}
+
+} // namespace LogCabin::Tree::<anonymous>
+} // namespace LogCabin::Tree
+} // namespace LogCabin
@@ -14,12 +14,24 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <google/protobuf/io/coded_stream.h>
+#include <atomic>
 #include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <endian.h>
+#include <thread>
 
 #include "build/Protocol/ServerStats.pb.h"
 #include "build/Tree/Snapshot.pb.h"
+#include "Core/Buffer.h"
+#include "Core/ConditionVariable.h"
 #include "Core/Debug.h"
+#include "Core/Mutex.h"
+#include "Core/SlabAllocator.h"
 #include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
 #include "Tree/Tree.h"
 
 namespace LogCabin {
@@ -63,10 +75,620 @@ Result::Result()
 
 namespace Internal {
 
+namespace {
+
+/**
+ * Selects the slab pools that hold the Files and Directories of every Tree
+ * (see makeNode()).
+ */
+struct NodeSlabs {
+    static Core::SlabStats& slabStats() {
+        static Core::SlabStats stats;
+        return stats;
+    }
+};
+
+/**
+ * Allocate a node from the slab pool for its type. allocate_shared() puts the
+ * node's reference counts in the same block, so each node takes one
+ * fixed-size block out of a 64 KB slab instead of its own malloc() chunk.
+ * This avoids per-allocation headers and keeps large trees from fragmenting
+ * the heap.
+ */
+template<typename Node, typename... Args>
+std::shared_ptr<Node>
+makeNode(Args&&... args)
+{
+    return std::allocate_shared<Node>(Core::SlabAllocator<Node, NodeSlabs>(),
+                                      std::forward<Args>(args)...);
+}
+
+/**
+ * Approximate memory used by a node's shared_ptr control block (a vtable
+ * pointer and two reference counts), for the memory accounting.
+ */
+const uint64_t NODE_OVERHEAD = sizeof(void*) + 2 * sizeof(uint32_t);
+
+/**
+ * Return the node, first replacing it with a private copy if another tree
+ * (see Tree::lazyCopy()) also refers to it. The copy is shallow: a copied
+ * directory shares its children with the original.
+ */
+template<typename Node>
+Node*
+unshare(std::shared_ptr<Node>& node)
+{
+    if (node.use_count() > 1) {
+        node = makeNode<Node>(*node);
+    } else {
+        // Another tree may have just dropped its reference. This pairs with
+        // the release in its decrement, so its reads of the node happen
+        // before the caller modifies it.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return node.get();
+}
+
+/**
+ * Reads ProtoBufs out of a subtree's bytes that were copied from a snapshot
+ * into memory; see SubtreeLoader.
+ */
+class SubtreeInputStream : public Core::ProtoBuf::InputStream {
+  public:
+    explicit SubtreeInputStream(const std::string& data)
+        : data(data)
+        , bytesRead(0)
+    {
+    }
+    uint64_t getBytesRead() const {
+        return bytesRead;
+    }
+    std::string readMessage(google::protobuf::Message& message) {
+        uint32_t length = 0;
+        uint64_t r = readRaw(&length, sizeof(length));
+        if (r < sizeof(length)) {
+            return format("Could only read %lu bytes of %lu-byte length "
+                          "field (at offset %lu of %lu-byte subtree)",
+                          r, sizeof(length), bytesRead - r, data.size());
+        }
+        length = be32toh(length);
+        if (data.size() - bytesRead < length) {
+            return format("ProtoBuf is %u bytes long but there are only %lu "
+                          "bytes remaining in subtree (at offset %lu)",
+                          length, data.size() - bytesRead, bytesRead);
+        }
+        Core::Buffer buf(const_cast<char*>(data.data() + bytesRead),
+                         length,
+                         NULL);
+        bytesRead += length;
+        if (!Core::ProtoBuf::parse(buf, message)) {
+            return format("Could not parse ProtoBuf at bytes %lu-%lu "
+                          "(inclusive) in subtree of length %lu",
+                          bytesRead - length, bytesRead - 1, data.size());
+        }
+        return "";
+    }
+    uint64_t readRaw(void* buf, uint64_t length) {
+        uint64_t r = std::min(length, data.size() - bytesRead);
+        memcpy(buf, data.data() + bytesRead, r);
+        bytesRead += r;
+        return r;
+    }
+  private:
+    const std::string& data;
+    uint64_t bytesRead;
+};
+
+/**
+ * Decodes the child directories of an indexed snapshot directory on a pool
+ * of threads (see Directory::loadSnapshot()). The caller reads each child's
+ * bytes out of the snapshot and hands them over with add(); the workers load
+ * them into their target directories.
+ */
+class SubtreeLoader {
+  public:
+    /**
+     * Don't let the caller read further ahead of the workers than this many
+     * bytes, unless that's needed for a single subtree.
+     */
+    static const uint64_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+    explicit SubtreeLoader(uint64_t numThreads)
+        : mutex()
+        , changed()
+        , queue()
+        , queuedBytes(0)
+        , exiting(false)
+        , threads()
+    {
+        for (uint64_t i = 0; i < numThreads; ++i)
+            threads.emplace_back(&SubtreeLoader::workerMain, this);
+    }
+
+    ~SubtreeLoader() {
+        {
+            std::lock_guard<Core::Mutex> lockGuard(mutex);
+            exiting = true;
+            changed.notify_all();
+        }
+        for (auto it = threads.begin(); it != threads.end(); ++it)
+            it->join();
+    }
+
+    /**
+     * Queue up a subtree to be loaded into 'target', waiting first if too
+     * many bytes are already queued. 'target' must not be accessed until
+     * the loader is destroyed.
+     */
+    void add(Directory* target, std::string data) {
+        std::unique_lock<Core::Mutex> lockGuard(mutex);
+        while (!queue.empty() && queuedBytes + data.size() > MAX_QUEUED_BYTES)
+            changed.wait(lockGuard);
+        queuedBytes += data.size();
+        queue.emplace_back(target, std::move(data));
+        changed.notify_all();
+    }
+
+  private:
+    void workerMain() {
+        Core::ThreadId::setName("SubtreeLoader");
+        std::unique_lock<Core::Mutex> lockGuard(mutex);
+        while (true) {
+            if (queue.empty()) {
+                if (exiting)
+                    return;
+                changed.wait(lockGuard);
+                continue;
+            }
+            Directory* target = queue.front().first;
+            std::string data = std::move(queue.front().second);
+            queue.pop_front();
+            lockGuard.unlock();
+            SubtreeInputStream stream(data);
+            target->loadSnapshot(stream);
+            if (stream.getBytesRead() != data.size()) {
+                PANIC("Couldn't read snapshot: index says subtree is %lu "
+                      "bytes but it took up %lu bytes",
+                      data.size(), stream.getBytesRead());
+            }
+            lockGuard.lock();
+            queuedBytes -= data.size();
+            changed.notify_all();
+        }
+    }
+
+    Core::Mutex mutex;
+    /**
+     * Notified when the queue, #queuedBytes, or #exiting changes.
+     */
+    Core::ConditionVariable changed;
+    /**
+     * Subtrees that haven't been picked up by a worker yet.
+     */
+    std::deque<std::pair<Directory*, std::string>> queue;
+    /**
+     * The sizes of the subtrees that are queued or being loaded.
+     */
+    uint64_t queuedBytes;
+    /**
+     * Set when the caller has added all the subtrees, so the workers should
+     * exit once the queue is empty.
+     */
+    bool exiting;
+    std::vector<std::thread> threads;
+};
+
+} // anonymous namespace
+
+////////// class StringRef //////////
+
+std::ostream&
+operator<<(std::ostream& os, StringRef s)
+{
+    return os.write(s.data(), int64_t(s.size()));
+}
+
+////////// class ChildTable //////////
+
+template<typename Node>
+ChildTable<Node>::Entry::Entry(uint64_t hash,
+                               StringRef name,
+                               std::shared_ptr<Node> node)
+    : hash(hash)
+    , name(name.str())
+    , node(std::move(node))
+{
+}
+
+template<typename Node>
+ChildTable<Node>::SortedCursor::SortedCursor()
+    : heads()
+{
+}
+
+template<typename Node>
+ChildTable<Node>::SortedCursor::SortedCursor(const ChildTable& table,
+                                             const StringRef* from,
+                                             bool includeFrom)
+    : heads()
+{
+    heads.reserve(table.shards.size());
+    for (auto it = table.shards.begin(); it != table.shards.end(); ++it) {
+        const Shard& shard = **it;
+        Head head {&shard, 0};
+        if (from != NULL) {
+            auto first = std::lower_bound(
+                shard.order.begin(), shard.order.end(), *from,
+                [&shard] (uint32_t position, StringRef name) {
+                    return StringRef(shard.entries[position].name) < name;
+                });
+            head.position = size_t(first - shard.order.begin());
+            if (!includeFrom && head.position < shard.order.size() &&
+                StringRef(entry(head).name) == *from) {
+                ++head.position;
+            }
+        }
+        if (head.position < shard.order.size())
+            heads.push_back(head);
+    }
+    std::make_heap(heads.begin(), heads.end(), later);
+}
+
+template<typename Node>
+StringRef
+ChildTable<Node>::SortedCursor::name() const
+{
+    return entry(heads.front()).name;
+}
+
+template<typename Node>
+const std::shared_ptr<Node>&
+ChildTable<Node>::SortedCursor::node() const
+{
+    return entry(heads.front()).node;
+}
+
+template<typename Node>
+void
+ChildTable<Node>::SortedCursor::advance()
+{
+    std::pop_heap(heads.begin(), heads.end(), later);
+    Head& head = heads.back();
+    ++head.position;
+    if (head.position < head.shard->order.size())
+        std::push_heap(heads.begin(), heads.end(), later);
+    else
+        heads.pop_back();
+}
+
+template<typename Node>
+const typename ChildTable<Node>::Entry&
+ChildTable<Node>::SortedCursor::entry(const Head& head)
+{
+    return head.shard->entries[head.shard->order[head.position]];
+}
+
+template<typename Node>
+bool
+ChildTable<Node>::SortedCursor::later(const Head& a, const Head& b)
+{
+    return StringRef(entry(b).name) < StringRef(entry(a).name);
+}
+
+template<typename Node>
+const size_t ChildTable<Node>::MAX_SHARD_SIZE;
+
+template<typename Node>
+ChildTable<Node>::ChildTable()
+    : shards()
+    , count(0)
+    , indexSlots(0)
+    , nameBytes(0)
+{
+}
+
+template<typename Node>
+std::shared_ptr<Node>*
+ChildTable<Node>::find(StringRef name)
+{
+    if (count == 0)
+        return NULL;
+    uint64_t hash = hashName(name);
+    size_t position = shardOf(hash);
+    const Shard& shard = *shards.at(position);
+    if (shard.index.empty())
+        return NULL;
+    uint32_t slot = shard.index.at(shard.findSlot(name, hash));
+    if (slot == 0)
+        return NULL;
+    return &mutableShard(position).entries.at(slot - 1).node;
+}
+
+template<typename Node>
+const std::shared_ptr<Node>*
+ChildTable<Node>::find(StringRef name) const
+{
+    if (count == 0)
+        return NULL;
+    uint64_t hash = hashName(name);
+    const Shard& shard = *shards.at(shardOf(hash));
+    if (shard.index.empty())
+        return NULL;
+    uint32_t slot = shard.index.at(shard.findSlot(name, hash));
+    if (slot == 0)
+        return NULL;
+    return &shard.entries.at(slot - 1).node;
+}
+
+template<typename Node>
+std::shared_ptr<Node>&
+ChildTable<Node>::insert(StringRef name, std::shared_ptr<Node> node)
+{
+    if (shards.empty())
+        shards.push_back(std::make_shared<Shard>());
+    else if (count + 1 > shards.size() * MAX_SHARD_SIZE)
+        split();
+    uint64_t hash = hashName(name);
+    Shard& shard = mutableShard(shardOf(hash));
+    if (4 * (shard.entries.size() + 1) > 3 * shard.index.size()) {
+        size_t numSlots = std::max(size_t(8), 2 * shard.index.size());
+        indexSlots += numSlots - shard.index.size();
+        shard.resize(numSlots);
+    }
+    uint32_t& slot = shard.index.at(shard.findSlot(name, hash));
+    if (slot == 0) {
+        shard.order.insert(shard.orderOf(name),
+                           uint32_t(shard.entries.size()));
+        shard.entries.emplace_back(hash, name, std::move(node));
+        slot = uint32_t(shard.entries.size());
+        ++count;
+        nameBytes += name.size();
+        return shard.entries.back().node;
+    }
+    Entry& entry = shard.entries.at(slot - 1);
+    entry.node = std::move(node);
+    return entry.node;
+}
+
+template<typename Node>
+bool
+ChildTable<Node>::erase(StringRef name)
+{
+    if (count == 0)
+        return false;
+    uint64_t hash = hashName(name);
+    size_t shardPosition = shardOf(hash);
+    {
+        // Don't copy a shared shard that doesn't have the name anyway.
+        const Shard& shard = *shards.at(shardPosition);
+        if (shard.index.empty() ||
+            shard.index.at(shard.findSlot(name, hash)) == 0) {
+            return false;
+        }
+    }
+    Shard& shard = mutableShard(shardPosition);
+    size_t mask = shard.index.size() - 1;
+    size_t hole = shard.findSlot(name, hash);
+    size_t position = shard.index.at(hole) - 1;
+    nameBytes -= shard.entries.at(position).name.size();
+    --count;
+    // Shift later entries of the probe sequence back into the hole, so that
+    // lookups never stop early at an empty slot.
+    size_t i = hole;
+    while (true) {
+        i = (i + 1) & mask;
+        uint32_t next = shard.index.at(i);
+        if (next == 0)
+            break;
+        size_t home = shard.entries.at(next - 1).hash & mask;
+        // The entry may only move back if its home slot isn't cyclically in
+        // (hole, i].
+        bool stays = (hole <= i ? (hole < home && home <= i)
+                                : (hole < home || home <= i));
+        if (stays)
+            continue;
+        shard.index.at(hole) = next;
+        hole = i;
+    }
+    shard.index.at(hole) = 0;
+    shard.order.erase(shard.orderOf(name));
+    // Fill the gap in 'entries' with the last entry.
+    size_t last = shard.entries.size() - 1;
+    if (position != last) {
+        size_t j = shard.entries.at(last).hash & mask;
+        while (shard.index.at(j) != last + 1)
+            j = (j + 1) & mask;
+        shard.index.at(j) = uint32_t(position + 1);
+        *shard.orderOf(shard.entries.at(last).name) = uint32_t(position);
+        shard.entries.at(position) = std::move(shard.entries.at(last));
+    }
+    shard.entries.pop_back();
+    return true;
+}
+
+template<typename Node>
+void
+ChildTable<Node>::clear()
+{
+    std::vector<std::shared_ptr<Shard>>().swap(shards);
+    count = 0;
+    indexSlots = 0;
+    nameBytes = 0;
+}
+
+template<typename Node>
+void
+ChildTable<Node>::swap(ChildTable& other)
+{
+    shards.swap(other.shards);
+    std::swap(count, other.count);
+    std::swap(indexSlots, other.indexSlots);
+    std::swap(nameBytes, other.nameBytes);
+}
+
+template<typename Node>
+std::vector<StringRef>
+ChildTable<Node>::sortedNames() const
+{
+    std::vector<StringRef> names;
+    names.reserve(count);
+    for (SortedCursor it(*this, NULL, false); !it.done(); it.advance())
+        names.push_back(it.name());
+    return names;
+}
+
+template<typename Node>
+uint64_t
+ChildTable<Node>::memoryBytes() const
+{
+    // This doesn't count the spare capacity of each shard's entries, which
+    // copies of the shard don't have, so that a directory and its copies
+    // agree. Names of up to 15 characters fit inside the std::string in the
+    // entry, but count them all to keep this simple.
+    return (shards.size() * (sizeof(std::shared_ptr<Shard>) +
+                             sizeof(Shard)) +
+            indexSlots * sizeof(uint32_t) +
+            count * (sizeof(Entry) + sizeof(uint32_t)) +
+            nameBytes);
+}
+
+template<typename Node>
+uint64_t
+ChildTable<Node>::hashName(StringRef name)
+{
+    // 64-bit FNV-1a, plus a final mix so that the low bits used to pick a
+    // slot depend on every character.
+    uint64_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < name.size(); ++i) {
+        hash ^= uint8_t(name.data()[i]);
+        hash *= 1099511628211UL;
+    }
+    hash ^= hash >> 32;
+    return hash;
+}
+
+template<typename Node>
+size_t
+ChildTable<Node>::shardOf(uint64_t hash) const
+{
+    // The number of shards is a power of two, so this is the leading bits of
+    // the hash. When split() doubles the number of shards, the children of
+    // shard i go to shards 2i and 2i+1.
+    return size_t(((hash >> 32) * shards.size()) >> 32);
+}
+
+template<typename Node>
+typename ChildTable<Node>::Shard&
+ChildTable<Node>::mutableShard(size_t position)
+{
+    std::shared_ptr<Shard>& shard = shards.at(position);
+    if (shard.use_count() > 1) {
+        shard = std::make_shared<Shard>(*shard);
+    } else {
+        // See unshare().
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *shard;
+}
+
+template<typename Node>
+void
+ChildTable<Node>::split()
+{
+    std::vector<std::shared_ptr<Shard>> old;
+    old.swap(shards);
+    shards.reserve(2 * old.size());
+    for (size_t i = 0; i < 2 * old.size(); ++i)
+        shards.push_back(std::make_shared<Shard>());
+    // The old shards may be shared, so this copies their entries rather than
+    // moving them.
+    for (auto shard = old.begin(); shard != old.end(); ++shard) {
+        const std::vector<Entry>& entries = (*shard)->entries;
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+            shards.at(shardOf(it->hash))->add(*it);
+    }
+    indexSlots = 0;
+    for (auto shard = shards.begin(); shard != shards.end(); ++shard) {
+        (*shard)->sortOrder();
+        indexSlots += (*shard)->index.size();
+    }
+}
+
+template<typename Node>
+size_t
+ChildTable<Node>::Shard::findSlot(StringRef name, uint64_t hash) const
+{
+    size_t mask = index.size() - 1;
+    size_t i = hash & mask;
+    while (true) {
+        uint32_t slot = index[i];
+        if (slot == 0)
+            return i;
+        const Entry& entry = entries[slot - 1];
+        if (entry.hash == hash && StringRef(entry.name) == name)
+            return i;
+        i = (i + 1) & mask;
+    }
+}
+
+template<typename Node>
+void
+ChildTable<Node>::Shard::add(Entry entry)
+{
+    if (4 * (entries.size() + 1) > 3 * index.size())
+        resize(std::max(size_t(8), 2 * index.size()));
+    uint32_t& slot = index.at(findSlot(entry.name, entry.hash));
+    entries.push_back(std::move(entry));
+    slot = uint32_t(entries.size());
+}
+
+template<typename Node>
+std::vector<uint32_t>::iterator
+ChildTable<Node>::Shard::orderOf(StringRef name)
+{
+    return std::lower_bound(
+        order.begin(), order.end(), name,
+        [this] (uint32_t position, StringRef other) {
+            return StringRef(entries[position].name) < other;
+        });
+}
+
+template<typename Node>
+void
+ChildTable<Node>::Shard::resize(size_t numSlots)
+{
+    index.assign(numSlots, 0);
+    size_t mask = numSlots - 1;
+    for (size_t position = 0; position < entries.size(); ++position) {
+        size_t i = entries[position].hash & mask;
+        while (index[i] != 0)
+            i = (i + 1) & mask;
+        index[i] = uint32_t(position + 1);
+    }
+}
+
+template<typename Node>
+void
+ChildTable<Node>::Shard::sortOrder()
+{
+    order.resize(entries.size());
+    for (size_t position = 0; position < entries.size(); ++position)
+        order[position] = uint32_t(position);
+    std::sort(order.begin(), order.end(),
+              [this] (uint32_t a, uint32_t b) {
+                  return StringRef(entries[a].name) < StringRef(entries[b].name);
+              });
+}
+
+template class ChildTable<Directory>;
+template class ChildTable<File>;
+
 ////////// class File //////////
 
 File::File()
     : contents()
+    , version(0)
+    , epoch(~0UL)
 {
 }
 
@@ -75,9 +697,36 @@ File::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
 {
     Snapshot::File file;
     file.set_contents(contents);
+    if (version > 0)
+        file.set_version(version);
     stream.writeMessage(file);
 }
 
+uint64_t
+File::snapshotBytes() const
+{
+    using google::protobuf::io::CodedOutputStream;
+    // length field, tag and length of contents, then contents, then the tag
+    // and value of the version if it's set
+    return (sizeof(uint32_t) + 1 +
+            CodedOutputStream::VarintSize64(contents.size()) +
+            contents.size() +
+            (version > 0 ? 1 + CodedOutputStream::VarintSize64(version) : 0));
+}
+
+uint64_t
+File::memoryBytes() const
+{
+    uint64_t bytes = NODE_OVERHEAD + sizeof(File);
+    // Short contents are stored inside the std::string itself, so they
+    // don't take any more memory.
+    const char* data = contents.data();
+    const char* self = reinterpret_cast<const char*>(this);
+    if (data < self || data >= self + sizeof(File))
+        bytes += contents.capacity() + 1;
+    return bytes;
+}
+
 void
 File::loadSnapshot(Core::ProtoBuf::InputStream& stream)
 {
@@ -87,6 +736,8 @@ File::loadSnapshot(Core::ProtoBuf::InputStream& stream)
         PANIC("Couldn't read snapshot: %s", error.c_str());
     }
     contents = node.contents();
+    version = node.version();
+    epoch = 0;
 }
 
 ////////// class Directory //////////
@@ -94,6 +745,9 @@ File::loadSnapshot(Core::ProtoBuf::InputStream& stream)
 Directory::Directory()
     : directories()
     , files()
+    , epoch(~0UL)
+    , version(0)
+    , subtreeBytes(NODE_OVERHEAD + sizeof(Directory))
 {
 }
 
@@ -101,124 +755,338 @@ std::vector<std::string>
 Directory::getChildren() const
 {
     std::vector<std::string> children;
-    for (auto it = directories.begin(); it != directories.end(); ++it)
-        children.push_back(it->first + "/");
-    for (auto it = files.begin(); it != files.end(); ++it)
-        children.push_back(it->first);
+    children.reserve(directories.size() + files.size());
+    std::vector<StringRef> names = directories.sortedNames();
+    for (auto it = names.begin(); it != names.end(); ++it)
+        children.push_back(it->str() + "/");
+    names = files.sortedNames();
+    for (auto it = names.begin(); it != names.end(); ++it)
+        children.push_back(it->str());
     return children;
 }
 
+bool
+Directory::scan(const std::string& prefix,
+                bool recursive,
+                std::vector<StringRef>::const_iterator afterBegin,
+                std::vector<StringRef>::const_iterator afterEnd,
+                uint64_t maxBytes,
+                uint64_t& bytes,
+                std::vector<std::pair<std::string, std::string>>& entries)
+    const
+{
+    // Merge the files with the directories, in order of their names. A name
+    // can't be both a file and a directory, so there are no ties. The scan
+    // resumes after the file named by 'after' but within the directory named
+    // by it. Starting the cursors there keeps a paginated scan from walking
+    // the children that earlier pages already returned.
+    const StringRef* after = (afterBegin != afterEnd ? &*afterBegin : NULL);
+    ChildTable<File>::SortedCursor file(files, after, false);
+    ChildTable<Directory>::SortedCursor dir;
+    if (recursive)
+        dir = ChildTable<Directory>::SortedCursor(directories, after, true);
+    while (!file.done() || !dir.done()) {
+        if (dir.done() ||
+            (!file.done() && file.name() < dir.name())) {
+            const File* child = file.node().get();
+            std::string path = prefix + file.name().str();
+            uint64_t entryBytes = path.size() + child->contents.size();
+            if (maxBytes > 0 && !entries.empty() &&
+                bytes + entryBytes > maxBytes) {
+                return false;
+            }
+            bytes += entryBytes;
+            entries.emplace_back(std::move(path), child->contents);
+            file.advance();
+        } else {
+            const Directory* child = dir.node().get();
+            bool resume = (after != NULL && dir.name() == *after);
+            if (!child->scan(prefix + dir.name().str() + "/",
+                             recursive,
+                             resume ? afterBegin + 1 : afterEnd,
+                             afterEnd,
+                             maxBytes,
+                             bytes,
+                             entries)) {
+                return false;
+            }
+            dir.advance();
+        }
+    }
+    return true;
+}
+
 Directory*
-Directory::lookupDirectory(const std::string& name)
+Directory::lookupDirectory(StringRef name)
 {
-    return const_cast<Directory*>(
-        const_cast<const Directory*>(this)->lookupDirectory(name));
+    assert(!name.empty());
+    assert(!name.endsWithSlash());
+    std::shared_ptr<Directory>* directory = directories.find(name);
+    if (directory == NULL)
+        return NULL;
+    return unshare(*directory);
 }
 
 const Directory*
-Directory::lookupDirectory(const std::string& name) const
+Directory::lookupDirectory(StringRef name) const
 {
     assert(!name.empty());
-    assert(!Core::StringUtil::endsWith(name, "/"));
-    auto it = directories.find(name);
-    if (it == directories.end())
+    assert(!name.endsWithSlash());
+    const std::shared_ptr<Directory>* directory = directories.find(name);
+    if (directory == NULL)
         return NULL;
-    return &it->second;
+    return directory->get();
 }
 
 
 Directory*
-Directory::makeDirectory(const std::string& name)
+Directory::makeDirectory(StringRef name)
 {
     assert(!name.empty());
-    assert(!Core::StringUtil::endsWith(name, "/"));
-    if (lookupFile(name) != NULL)
+    assert(!name.endsWithSlash());
+    if (files.find(name) != NULL)
         return NULL;
-    return &directories[name];
+    std::shared_ptr<Directory>* directory = directories.find(name);
+    if (directory == NULL) {
+        uint64_t tableBytes = directories.memoryBytes();
+        directory = &directories.insert(name, makeNode<Directory>());
+        subtreeBytes += (directories.memoryBytes() - tableBytes +
+                         (*directory)->subtreeBytes);
+    }
+    return unshare(*directory);
 }
 
 void
-Directory::removeDirectory(const std::string& name)
+Directory::removeDirectory(StringRef name)
 {
     assert(!name.empty());
-    assert(!Core::StringUtil::endsWith(name, "/"));
+    assert(!name.endsWithSlash());
+    const std::shared_ptr<Directory>* directory = directories.find(name);
+    if (directory == NULL)
+        return;
+    uint64_t bytes = directories.memoryBytes() + (*directory)->subtreeBytes;
     directories.erase(name);
+    subtreeBytes -= bytes - directories.memoryBytes();
 }
 
 File*
-Directory::lookupFile(const std::string& name)
+Directory::lookupFile(StringRef name)
 {
-    return const_cast<File*>(
-        const_cast<const Directory*>(this)->lookupFile(name));
+    assert(!name.empty());
+    assert(!name.endsWithSlash());
+    std::shared_ptr<File>* file = files.find(name);
+    if (file == NULL)
+        return NULL;
+    return unshare(*file);
 }
 
 const File*
-Directory::lookupFile(const std::string& name) const
+Directory::lookupFile(StringRef name) const
 {
     assert(!name.empty());
-    assert(!Core::StringUtil::endsWith(name, "/"));
-    auto it = files.find(name);
-    if (it == files.end())
+    assert(!name.endsWithSlash());
+    const std::shared_ptr<File>* file = files.find(name);
+    if (file == NULL)
         return NULL;
-    return &it->second;
+    return file->get();
 }
 
 File*
-Directory::makeFile(const std::string& name)
+Directory::makeFile(StringRef name)
 {
     assert(!name.empty());
-    assert(!Core::StringUtil::endsWith(name, "/"));
-    if (lookupDirectory(name) != NULL)
+    assert(!name.endsWithSlash());
+    if (directories.find(name) != NULL)
         return NULL;
-    return &files[name];
+    std::shared_ptr<File>* file = files.find(name);
+    if (file == NULL) {
+        uint64_t tableBytes = files.memoryBytes();
+        file = &files.insert(name, makeNode<File>());
+        subtreeBytes += (files.memoryBytes() - tableBytes +
+                         (*file)->memoryBytes());
+    }
+    return unshare(*file);
 }
 
 bool
-Directory::removeFile(const std::string& name)
+Directory::removeFile(StringRef name)
 {
     assert(!name.empty());
-    assert(!Core::StringUtil::endsWith(name, "/"));
-    return (files.erase(name) > 0);
+    assert(!name.endsWithSlash());
+    const std::shared_ptr<File>* file = files.find(name);
+    if (file == NULL)
+        return false;
+    uint64_t bytes = files.memoryBytes() + (*file)->memoryBytes();
+    files.erase(name);
+    subtreeBytes -= bytes - files.memoryBytes();
+    return true;
 }
 
 void
-Directory::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
+Directory::dumpSnapshot(Core::ProtoBuf::OutputStream& stream,
+                        uint64_t sinceEpoch,
+                        uint32_t indexDepth) const
 {
     // create protobuf of this dir, listing all children
     Snapshot::Directory dir;
-    for (auto it = directories.begin(); it != directories.end(); ++it)
-        dir.add_directories(it->first);
-    for (auto it = files.begin(); it != files.end(); ++it)
-        dir.add_files(it->first);
+    makeSnapshotMessage(sinceEpoch, dir);
+    // An index is only worth writing if there's more than one subtree to
+    // decode in parallel.
+    if (indexDepth == 1 && dir.directories_size() > 1) {
+        for (auto it = dir.directories().begin();
+             it != dir.directories().end();
+             ++it) {
+            const Directory& child = **directories.find(*it);
+            dir.add_subtree_bytes(child.snapshotBytes(sinceEpoch));
+        }
+    }
 
     // write dir into stream
     stream.writeMessage(dir);
 
-    // dump children in the same order
-    for (auto it = directories.begin(); it != directories.end(); ++it)
-        it->second.dumpSnapshot(stream);
-    for (auto it = files.begin(); it != files.end(); ++it)
-        it->second.dumpSnapshot(stream);
+    // dump changed children in the same order
+    uint32_t childIndexDepth = (indexDepth > 1 ? indexDepth - 1 : 0);
+    for (auto it = dir.directories().begin();
+         it != dir.directories().end();
+         ++it) {
+        (*directories.find(*it))->dumpSnapshot(stream,
+                                               sinceEpoch,
+                                               childIndexDepth);
+    }
+    for (auto it = dir.files().begin(); it != dir.files().end(); ++it)
+        (*files.find(*it))->dumpSnapshot(stream);
+}
+
+uint64_t
+Directory::snapshotBytes(uint64_t sinceEpoch) const
+{
+    Snapshot::Directory dir;
+    makeSnapshotMessage(sinceEpoch, dir);
+    uint64_t bytes = sizeof(uint32_t) + dir.ByteSizeLong();
+    for (auto it = dir.directories().begin();
+         it != dir.directories().end();
+         ++it) {
+        bytes += (*directories.find(*it))->snapshotBytes(sinceEpoch);
+    }
+    for (auto it = dir.files().begin(); it != dir.files().end(); ++it)
+        bytes += (*files.find(*it))->snapshotBytes();
+    return bytes;
 }
 
 void
-Directory::loadSnapshot(Core::ProtoBuf::InputStream& stream)
+Directory::loadSnapshot(Core::ProtoBuf::InputStream& stream,
+                        uint64_t numThreads)
 {
     Snapshot::Directory dir;
     std::string error = stream.readMessage(dir);
     if (!error.empty()) {
         PANIC("Couldn't read snapshot: %s", error.c_str());
     }
-    for (auto it = dir.directories().begin();
-         it != dir.directories().end();
+    // Anything the snapshot doesn't mention was removed.
+    ChildTable<Directory> oldDirectories;
+    ChildTable<File> oldFiles;
+    oldDirectories.swap(directories);
+    oldFiles.swap(files);
+    for (auto it = dir.unchanged_directories().begin();
+         it != dir.unchanged_directories().end();
+         ++it) {
+        std::shared_ptr<Directory>* old = oldDirectories.find(*it);
+        if (old == NULL) {
+            PANIC("Couldn't read snapshot: unchanged directory %s is "
+                  "missing from the snapshot it's a delta against",
+                  it->c_str());
+        }
+        directories.insert(*it, std::move(*old));
+    }
+    for (auto it = dir.unchanged_files().begin();
+         it != dir.unchanged_files().end();
          ++it) {
-        directories[*it].loadSnapshot(stream);
+        std::shared_ptr<File>* old = oldFiles.find(*it);
+        if (old == NULL) {
+            PANIC("Couldn't read snapshot: unchanged file %s is missing "
+                  "from the snapshot it's a delta against",
+                  it->c_str());
+        }
+        files.insert(*it, std::move(*old));
     }
+    bool parallel = (numThreads > 1 && dir.subtree_bytes_size() > 0);
+    if (parallel && dir.subtree_bytes_size() != dir.directories_size()) {
+        PANIC("Couldn't read snapshot: index lists %d subtrees but there "
+              "are %d changed directories",
+              dir.subtree_bytes_size(),
+              dir.directories_size());
+    }
+    std::unique_ptr<SubtreeLoader> loader;
+    if (parallel) {
+        loader.reset(new SubtreeLoader(
+            std::min(numThreads, uint64_t(dir.directories_size()))));
+    }
+    for (int i = 0; i < dir.directories_size(); ++i) {
+        const std::string& name = dir.directories(i);
+        // A changed directory is itself written as a delta against its
+        // earlier version, if there was one.
+        std::shared_ptr<Directory>* old = oldDirectories.find(name);
+        std::shared_ptr<Directory>& child = directories.insert(
+            name,
+            (old != NULL ? std::move(*old) : makeNode<Directory>()));
+        if (!parallel) {
+            unshare(child)->loadSnapshot(stream, numThreads);
+            continue;
+        }
+        // Inserting into 'directories' doesn't move the child objects, so
+        // the workers can fill them in while this thread reads ahead.
+        uint64_t length = dir.subtree_bytes(i);
+        std::string data(length, '\0');
+        uint64_t r = stream.readRaw(&data[0], length);
+        if (r != length) {
+            PANIC("Couldn't read snapshot: only %lu bytes of %lu-byte "
+                  "subtree %s remain",
+                  r, length, name.c_str());
+        }
+        loader->add(unshare(child), std::move(data));
+    }
+    // wait for the workers to finish
+    loader.reset();
     for (auto it = dir.files().begin();
          it != dir.files().end();
          ++it) {
-        files[*it].loadSnapshot(stream);
+        files.insert(*it, makeNode<File>())->loadSnapshot(stream);
     }
+    epoch = 0;
+    version = dir.version();
+    // Now that the children are all loaded, add up their sizes.
+    subtreeBytes = (NODE_OVERHEAD + sizeof(Directory) +
+                    directories.memoryBytes() + files.memoryBytes());
+    directories.forEach([this] (const std::shared_ptr<Directory>& child) {
+        subtreeBytes += child->subtreeBytes;
+    });
+    files.forEach([this] (const std::shared_ptr<File>& child) {
+        subtreeBytes += child->memoryBytes();
+    });
+}
+
+void
+Directory::makeSnapshotMessage(uint64_t sinceEpoch,
+                               Snapshot::Directory& dir) const
+{
+    // List the children in order, so that every server writes the same
+    // snapshot of the same tree.
+    std::vector<StringRef> names = directories.sortedNames();
+    for (auto it = names.begin(); it != names.end(); ++it) {
+        if ((*directories.find(*it))->epoch < sinceEpoch)
+            dir.add_unchanged_directories(it->data(), it->size());
+        else
+            dir.add_directories(it->data(), it->size());
+    }
+    names = files.sortedNames();
+    for (auto it = names.begin(); it != names.end(); ++it) {
+        if ((*files.find(*it))->epoch < sinceEpoch)
+            dir.add_unchanged_files(it->data(), it->size());
+        else
+            dir.add_files(it->data(), it->size());
+    }
+    if (version > 0)
+        dir.set_version(version);
 }
 
 ////////// class Path //////////
@@ -239,26 +1107,24 @@ Path::Path(const std::string& symbolic)
     // Add /root prefix (see docs for Tree::superRoot)
     parents.push_back("root");
 
-    // Split the path into a list of parent components and a target.
-    std::string word;
-    for (auto it = symbolic.begin(); it != symbolic.end(); ++it) {
-        if (*it == '/') {
-            if (!word.empty()) {
-                parents.push_back(word);
-                word.clear();
-            }
-        } else {
-            word += *it;
+    // Split the path into a list of parent components and a target. These
+    // refer to this->symbolic, not the argument, which the caller may free.
+    const char* data = this->symbolic.data();
+    size_t size = this->symbolic.size();
+    size_t start = 0;
+    for (size_t i = 0; i <= size; ++i) {
+        if (i == size || data[i] == '/') {
+            if (i > start)
+                parents.push_back(StringRef(data + start, i - start));
+            start = i + 1;
         }
     }
-    if (!word.empty())
-        parents.push_back(word);
     target = parents.back();
     parents.pop_back();
 }
 
 std::string
-Path::parentsThrough(std::vector<std::string>::const_iterator end) const
+Path::parentsThrough(std::vector<StringRef>::const_iterator end) const
 {
     auto it = parents.begin();
     ++it; // skip "root"
@@ -267,7 +1133,8 @@ Path::parentsThrough(std::vector<std::string>::const_iterator end) const
         return "/";
     std::string ret;
     do {
-        ret += "/" + *it;
+        ret += "/";
+        ret.append(it->data(), it->size());
         ++it;
     } while (it != end);
     return ret;
@@ -279,12 +1146,11 @@ Path::parentsThrough(std::vector<std::string>::const_iterator end) const
 
 Tree::Tree()
     : superRoot()
-    , numConditionsChecked(0)
-    , numConditionsFailed(0)
+    , epoch(1)
+    , versioning(true)
+    , readStats(std::make_shared<ReadStats>())
     , numMakeDirectoryAttempted(0)
     , numMakeDirectorySuccess(0)
-    , numListDirectoryAttempted(0)
-    , numListDirectorySuccess(0)
     , numRemoveDirectoryAttempted(0)
     , numRemoveDirectoryParentNotFound(0)
     , numRemoveDirectoryTargetNotFound(0)
@@ -292,24 +1158,63 @@ Tree::Tree()
     , numRemoveDirectorySuccess(0)
     , numWriteAttempted(0)
     , numWriteSuccess(0)
-    , numReadAttempted(0)
-    , numReadSuccess(0)
     , numRemoveFileAttempted(0)
     , numRemoveFileParentNotFound(0)
     , numRemoveFileTargetNotFound(0)
     , numRemoveFileDone(0)
     , numRemoveFileSuccess(0)
+    , inTransaction(false)
+    , rollbackLog()
+    , lookupPath()
 {
     // Create the root directory so that users don't have to explicitly
     // call makeDirectory("/").
     superRoot.makeDirectory("root");
 }
 
+Tree::ReadStats::ReadStats()
+    : numConditionsChecked(0)
+    , numConditionsFailed(0)
+    , numListDirectoryAttempted(0)
+    , numListDirectorySuccess(0)
+    , numReadAttempted(0)
+    , numReadSuccess(0)
+    , numScanTreeAttempted(0)
+    , numScanTreeSuccess(0)
+    , numScanTreeFilesReturned(0)
+{
+}
+
+Tree::RollbackEntry::RollbackEntry()
+    : parents()
+    , name()
+    , type(Type::ABSENT)
+    , file()
+    , directory()
+{
+}
+
 Result
 Tree::normalLookup(const Path& path, Directory** parent)
 {
-    return normalLookup(path,
-                        const_cast<const Directory**>(parent));
+    *parent = NULL;
+    lookupPath.clear();
+    Directory* current = &superRoot;
+    current->touch(epoch);
+    lookupPath.emplace_back(current, current->getSubtreeBytes());
+    for (auto it = path.parents.begin(); it != path.parents.end(); ++it) {
+        Directory* next = current->lookupDirectory(*it);
+        if (next == NULL) {
+            // Let the const version fill in the error.
+            return normalLookup(path,
+                                const_cast<const Directory**>(parent));
+        }
+        next->touch(epoch);
+        lookupPath.emplace_back(next, next->getSubtreeBytes());
+        current = next;
+    }
+    *parent = current;
+    return Result();
 }
 
 Result
@@ -341,48 +1246,210 @@ Tree::normalLookup(const Path& path, const Directory** parent) const
 }
 
 Result
-Tree::mkdirLookup(const Path& path, Directory** parent)
+Tree::mkdirLookup(const Path& path, uint64_t version, Directory** parent)
 {
     *parent = NULL;
+    lookupPath.clear();
     Result result;
     Directory* current = &superRoot;
+    current->touch(epoch);
+    lookupPath.emplace_back(current, current->getSubtreeBytes());
     for (auto it = path.parents.begin(); it != path.parents.end(); ++it) {
-        Directory* next = current->makeDirectory(*it);
+        Directory* next = current->lookupDirectory(*it);
         if (next == NULL) {
-            result.status = Status::TYPE_ERROR;
-            result.error = format("Parent %s of %s is a file",
-                                  path.parentsThrough(it).c_str(),
-                                  path.symbolic.c_str());
-            return result;
+            next = current->makeDirectory(*it);
+            if (next == NULL) {
+                result.status = Status::TYPE_ERROR;
+                result.error = format("Parent %s of %s is a file",
+                                      path.parentsThrough(it).c_str(),
+                                      path.symbolic.c_str());
+                return result;
+            }
+            next->setVersion(version);
+            current->setVersion(version);
         }
+        next->touch(epoch);
+        lookupPath.emplace_back(next, next->getSubtreeBytes());
         current = next;
     }
     *parent = current;
     return result;
 }
 
+void
+Tree::saveForRollback(const Path& path, bool removeDirectory)
+{
+    if (!inTransaction)
+        return;
+    RollbackEntry entry;
+    const Directory* current = &superRoot;
+    auto it = path.parents.begin();
+    while (it != path.parents.end()) {
+        const Directory* next = current->lookupDirectory(*it);
+        if (next == NULL)
+            break;
+        entry.parents.push_back(it->str());
+        current = next;
+        ++it;
+    }
+    if (it == path.parents.end())
+        entry.name = path.target.str();
+    else
+        entry.name = it->str();
+    const File* file = current->lookupFile(entry.name);
+    const Directory* directory = current->lookupDirectory(entry.name);
+    if (file != NULL) {
+        entry.type = RollbackEntry::Type::FILE;
+        entry.file = *file;
+    } else if (directory != NULL) {
+        // Only removeDirectory modifies an existing directory's contents (and
+        // the parents found above are all directories).
+        if (!removeDirectory)
+            return;
+        entry.type = RollbackEntry::Type::DIRECTORY;
+        entry.directory = *directory;
+    }
+    rollbackLog.push_back(std::move(entry));
+}
+
+uint64_t
+Tree::nextVersion()
+{
+    if (!versioning)
+        return 0;
+    uint64_t version = superRoot.getVersion() + 1;
+    superRoot.setVersion(version);
+    return version;
+}
+
+void
+Tree::updateSubtreeBytes()
+{
+    int64_t delta = 0;
+    for (auto it = lookupPath.rbegin(); it != lookupPath.rend(); ++it) {
+        Directory* directory = it->first;
+        directory->addSubtreeBytes(delta);
+        // This much hasn't been accounted for in the directory's parent yet.
+        delta = int64_t(directory->getSubtreeBytes() - it->second);
+    }
+    lookupPath.clear();
+}
+
 void
 Tree::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
 {
-    superRoot.dumpSnapshot(stream);
+    // Index the children of /, below the super root and root directories.
+    superRoot.dumpSnapshot(stream, 0, 2);
+}
+
+Tree
+Tree::lazyCopy() const
+{
+    Tree copy;
+    copy.superRoot = superRoot;
+    copy.epoch = epoch;
+    copy.readStats = readStats;
+    return copy;
+}
+
+void
+Tree::dumpSnapshotDelta(Core::ProtoBuf::OutputStream& stream) const
+{
+    superRoot.dumpSnapshot(stream, epoch, 2);
 }
 
 /**
  * Load the tree from the given stream.
  */
 void
-Tree::loadSnapshot(Core::ProtoBuf::InputStream& stream)
+Tree::loadSnapshot(Core::ProtoBuf::InputStream& stream, uint64_t numThreads)
 {
     superRoot = Directory();
-    superRoot.loadSnapshot(stream);
+    superRoot.loadSnapshot(stream, numThreads);
+}
+
+void
+Tree::loadSnapshotDelta(Core::ProtoBuf::InputStream& stream,
+                        uint64_t numThreads)
+{
+    superRoot.loadSnapshot(stream, numThreads);
+}
+
+void
+Tree::markClean()
+{
+    ++epoch;
+}
+
+
+void
+Tree::setVersioning(bool enabled)
+{
+    versioning = enabled;
+}
+
+void
+Tree::beginTransaction()
+{
+    assert(!inTransaction);
+    assert(rollbackLog.empty());
+    inTransaction = true;
 }
 
+void
+Tree::commitTransaction()
+{
+    assert(inTransaction);
+    inTransaction = false;
+    rollbackLog.clear();
+}
+
+void
+Tree::rollbackTransaction()
+{
+    assert(inTransaction);
+    inTransaction = false;
+    while (!rollbackLog.empty()) {
+        RollbackEntry& entry = rollbackLog.back();
+        Directory* parent = &superRoot;
+        lookupPath.clear();
+        lookupPath.emplace_back(parent, parent->getSubtreeBytes());
+        for (auto it = entry.parents.begin(); it != entry.parents.end(); ++it) {
+            parent = parent->lookupDirectory(*it);
+            assert(parent != NULL);
+            lookupPath.emplace_back(parent, parent->getSubtreeBytes());
+        }
+        parent->removeFile(entry.name);
+        parent->removeDirectory(entry.name);
+        switch (entry.type) {
+            case RollbackEntry::Type::ABSENT:
+                break;
+            case RollbackEntry::Type::FILE: {
+                File* file = parent->makeFile(entry.name);
+                parent->addSubtreeBytes(int64_t(entry.file.memoryBytes() -
+                                                file->memoryBytes()));
+                *file = std::move(entry.file);
+                break;
+            }
+            case RollbackEntry::Type::DIRECTORY: {
+                Directory* directory = parent->makeDirectory(entry.name);
+                parent->addSubtreeBytes(
+                    int64_t(entry.directory.getSubtreeBytes() -
+                            directory->getSubtreeBytes()));
+                *directory = std::move(entry.directory);
+                break;
+            }
+        }
+        updateSubtreeBytes();
+        rollbackLog.pop_back();
+    }
+}
 
 Result
 Tree::checkCondition(const std::string& path,
                      const std::string& contents) const
 {
-    ++numConditionsChecked;
+    ++readStats->numConditionsChecked;
     std::string actualContents;
     Result readResult = read(path, actualContents);
     if (readResult.status == Status::OK) {
@@ -396,7 +1463,7 @@ Tree::checkCondition(const std::string& path,
                                   path.c_str(),
                                   actualContents.c_str(),
                                   contents.c_str());
-            ++numConditionsFailed;
+            ++readStats->numConditionsFailed;
             return result;
         }
     }
@@ -407,7 +1474,42 @@ Tree::checkCondition(const std::string& path,
     result.status = Status::CONDITION_NOT_MET;
     result.error = format("Could not read value at path '%s': %s",
                           path.c_str(), readResult.error.c_str());
-    ++numConditionsFailed;
+    ++readStats->numConditionsFailed;
+    return result;
+}
+
+Result
+Tree::checkCondition(const std::string& symbolicPath, uint64_t version) const
+{
+    ++readStats->numConditionsChecked;
+    Result result;
+    Path path(symbolicPath);
+    const Directory* parent = NULL;
+    if (path.result.status == Status::OK)
+        result = normalLookup(path, &parent);
+    else
+        result = path.result;
+    uint64_t actualVersion = 0;
+    if (result.status == Status::OK) {
+        const File* file = parent->lookupFile(path.target);
+        const Directory* directory = parent->lookupDirectory(path.target);
+        if (file != NULL)
+            actualVersion = file->version;
+        else if (directory != NULL)
+            actualVersion = directory->getVersion();
+    } else if (result.status != Status::LOOKUP_ERROR) {
+        result.status = Status::CONDITION_NOT_MET;
+        result.error = format("Could not look up path '%s': %s",
+                              symbolicPath.c_str(), result.error.c_str());
+        ++readStats->numConditionsFailed;
+        return result;
+    }
+    if (actualVersion == version)
+        return Result();
+    result.status = Status::CONDITION_NOT_MET;
+    result.error = format("Path '%s' has version %lu, not %lu as required",
+                          symbolicPath.c_str(), actualVersion, version);
+    ++readStats->numConditionsFailed;
     return result;
 }
 
@@ -418,16 +1520,31 @@ Tree::makeDirectory(const std::string& symbolicPath)
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
+    saveForRollback(path, false);
+    uint64_t version = nextVersion();
     Directory* parent;
-    Result result = mkdirLookup(path, &parent);
-    if (result.status != Status::OK)
+    Result result = mkdirLookup(path, version, &parent);
+    if (result.status != Status::OK) {
+        // mkdirLookup may have created some of the parents.
+        updateSubtreeBytes();
         return result;
-    if (parent->makeDirectory(path.target) == NULL) {
+    }
+    Directory* targetDir = parent->lookupDirectory(path.target);
+    if (targetDir == NULL) {
+        targetDir = parent->makeDirectory(path.target);
+        if (targetDir != NULL) {
+            targetDir->setVersion(version);
+            parent->setVersion(version);
+        }
+    }
+    updateSubtreeBytes();
+    if (targetDir == NULL) {
         result.status = Status::TYPE_ERROR;
         result.error = format("%s already exists but is a file",
                               path.symbolic.c_str());
         return result;
     }
+    targetDir->touch(epoch);
     ++numMakeDirectorySuccess;
     return result;
 }
@@ -436,8 +1553,18 @@ Result
 Tree::listDirectory(const std::string& symbolicPath,
                     std::vector<std::string>& children) const
 {
-    ++numListDirectoryAttempted;
+    uint64_t version;
+    return listDirectory(symbolicPath, children, version);
+}
+
+Result
+Tree::listDirectory(const std::string& symbolicPath,
+                    std::vector<std::string>& children,
+                    uint64_t& version) const
+{
+    ++readStats->numListDirectoryAttempted;
     children.clear();
+    version = 0;
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
@@ -459,7 +1586,79 @@ Tree::listDirectory(const std::string& symbolicPath,
         return result;
     }
     children = targetDir->getChildren();
-    ++numListDirectorySuccess;
+    version = targetDir->getVersion();
+    ++readStats->numListDirectorySuccess;
+    return result;
+}
+
+Result
+Tree::scanTree(const std::string& symbolicPath,
+               bool recursive,
+               const std::string& symbolicAfter,
+               uint64_t maxBytes,
+               std::vector<std::pair<std::string, std::string>>& entries,
+               bool& more) const
+{
+    ++readStats->numScanTreeAttempted;
+    entries.clear();
+    more = false;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+
+    // Find the components of 'after' below 'path'. These refer into
+    // afterPath, which must outlive them.
+    Path afterPath(symbolicAfter.empty() ? symbolicPath : symbolicAfter);
+    if (afterPath.result.status != Status::OK)
+        return afterPath.result;
+    std::vector<StringRef> dirComponents = path.parents;
+    dirComponents.push_back(path.target);
+    std::vector<StringRef> after = afterPath.parents;
+    after.push_back(afterPath.target);
+    if (!symbolicAfter.empty() &&
+        (after.size() <= dirComponents.size() ||
+         !std::equal(dirComponents.begin(), dirComponents.end(),
+                     after.begin()))) {
+        Result result;
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = format("%s is not below %s",
+                              symbolicAfter.c_str(),
+                              path.symbolic.c_str());
+        return result;
+    }
+    after.erase(after.begin(),
+                after.begin() + int64_t(dirComponents.size()));
+
+    const Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    const Directory* targetDir = parent->lookupDirectory(path.target);
+    if (targetDir == NULL) {
+        if (parent->lookupFile(path.target) == NULL) {
+            result.status = Status::LOOKUP_ERROR;
+            result.error = format("%s does not exist",
+                                  path.symbolic.c_str());
+        } else {
+            result.status = Status::TYPE_ERROR;
+            result.error = format("%s is a file",
+                                  path.symbolic.c_str());
+        }
+        return result;
+    }
+    std::string prefix = "/";
+    for (auto it = dirComponents.begin() + 1; // skip "root"
+         it != dirComponents.end();
+         ++it) {
+        prefix.append(it->data(), it->size());
+        prefix += "/";
+    }
+    uint64_t bytes = 0;
+    more = !targetDir->scan(prefix, recursive,
+                            after.begin(), after.end(),
+                            maxBytes, bytes, entries);
+    readStats->numScanTreeFilesReturned += entries.size();
+    ++readStats->numScanTreeSuccess;
     return result;
 }
 
@@ -470,6 +1669,8 @@ Tree::removeDirectory(const std::string& symbolicPath)
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
+    saveForRollback(path, true);
+    uint64_t version = nextVersion();
     Directory* parent;
     Result result = normalLookup(path, &parent);
     if (result.status == Status::LOOKUP_ERROR) {
@@ -480,9 +1681,11 @@ Tree::removeDirectory(const std::string& symbolicPath)
     }
     if (result.status != Status::OK)
         return result;
-    Directory* targetDir = parent->lookupDirectory(path.target);
-    if (targetDir == NULL) {
-        if (parent->lookupFile(path.target)) {
+    // Use the const lookups, which won't copy a shared directory that's about
+    // to be removed anyway.
+    const Directory* constParent = parent;
+    if (constParent->lookupDirectory(path.target) == NULL) {
+        if (constParent->lookupFile(path.target) != NULL) {
             result.status = Status::TYPE_ERROR;
             result.error = format("%s is a file",
                                   path.symbolic.c_str());
@@ -499,8 +1702,12 @@ Tree::removeDirectory(const std::string& symbolicPath)
         // If the caller is trying to remove the root directory, we remove the
         // contents but not the directory itself. The easiest way to do this
         // is to drop but then recreate the directory.
-        parent->makeDirectory(path.target);
+        Directory* root = parent->makeDirectory(path.target);
+        root->touch(epoch);
+        root->setVersion(version);
     }
+    parent->setVersion(version);
+    updateSubtreeBytes();
     ++numRemoveDirectoryDone;
     ++numRemoveDirectorySuccess;
     return result;
@@ -513,10 +1720,15 @@ Tree::write(const std::string& symbolicPath, const std::string& contents)
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
+    saveForRollback(path, false);
+    uint64_t version = nextVersion();
     Directory* parent;
     Result result = normalLookup(path, &parent);
     if (result.status != Status::OK)
         return result;
+    const Directory* constParent = parent;
+    if (constParent->lookupFile(path.target) == NULL)
+        parent->setVersion(version);
     File* targetFile = parent->makeFile(path.target);
     if (targetFile == NULL) {
         result.status = Status::TYPE_ERROR;
@@ -524,7 +1736,14 @@ Tree::write(const std::string& symbolicPath, const std::string& contents)
                               path.symbolic.c_str());
         return result;
     }
-    targetFile->contents = contents;
+    uint64_t oldBytes = targetFile->memoryBytes();
+    // Swap in a fresh copy, so that the file doesn't hold onto a larger
+    // buffer from its earlier contents (plain or move assignment would).
+    std::string(contents).swap(targetFile->contents);
+    targetFile->version = version;
+    targetFile->epoch = epoch;
+    parent->addSubtreeBytes(int64_t(targetFile->memoryBytes() - oldBytes));
+    updateSubtreeBytes();
     ++numWriteSuccess;
     return result;
 }
@@ -532,8 +1751,18 @@ Tree::write(const std::string& symbolicPath, const std::string& contents)
 Result
 Tree::read(const std::string& symbolicPath, std::string& contents) const
 {
-    ++numReadAttempted;
+    uint64_t version;
+    return read(symbolicPath, contents, version);
+}
+
+Result
+Tree::read(const std::string& symbolicPath,
+           std::string& contents,
+           uint64_t& version) const
+{
+    ++readStats->numReadAttempted;
     contents.clear();
+    version = 0;
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
@@ -555,7 +1784,8 @@ Tree::read(const std::string& symbolicPath, std::string& contents) const
         return result;
     }
     contents = targetFile->contents;
-    ++numReadSuccess;
+    version = targetFile->version;
+    ++readStats->numReadSuccess;
     return result;
 }
 
@@ -566,6 +1796,8 @@ Tree::removeFile(const std::string& symbolicPath)
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
+    saveForRollback(path, false);
+    uint64_t version = nextVersion();
     Directory* parent;
     Result result = normalLookup(path, &parent);
     if (result.status == Status::LOOKUP_ERROR) {
@@ -576,16 +1808,20 @@ Tree::removeFile(const std::string& symbolicPath)
     }
     if (result.status != Status::OK)
         return result;
-    if (parent->lookupDirectory(path.target) != NULL) {
+    const Directory* constParent = parent;
+    if (constParent->lookupDirectory(path.target) != NULL) {
         result.status = Status::TYPE_ERROR;
         result.error = format("%s is a directory",
                               path.symbolic.c_str());
         return result;
     }
-    if (parent->removeFile(path.target))
+    if (parent->removeFile(path.target)) {
+        parent->setVersion(version);
         ++numRemoveFileDone;
-    else
+    } else {
         ++numRemoveFileTargetNotFound;
+    }
+    updateSubtreeBytes();
     ++numRemoveFileSuccess;
     return result;
 }
@@ -594,17 +1830,17 @@ void
 Tree::updateServerStats(Protocol::ServerStats::Tree& tstats) const
 {
     tstats.set_num_conditions_checked(
-         numConditionsChecked);
+         readStats->numConditionsChecked);
     tstats.set_num_conditions_failed(
-        numConditionsFailed);
+        readStats->numConditionsFailed);
     tstats.set_num_make_directory_attempted(
         numMakeDirectoryAttempted);
     tstats.set_num_make_directory_success(
         numMakeDirectorySuccess);
     tstats.set_num_list_directory_attempted(
-        numListDirectoryAttempted);
+        readStats->numListDirectoryAttempted);
     tstats.set_num_list_directory_success(
-        numListDirectorySuccess);
+        readStats->numListDirectorySuccess);
     tstats.set_num_remove_directory_attempted(
         numRemoveDirectoryAttempted);
     tstats.set_num_remove_directory_parent_not_found(
@@ -620,9 +1856,15 @@ Tree::updateServerStats(Protocol::ServerStats::Tree& tstats) const
     tstats.set_num_write_success(
         numWriteSuccess);
     tstats.set_num_read_attempted(
-        numReadAttempted);
+        readStats->numReadAttempted);
     tstats.set_num_read_success(
-        numReadSuccess);
+        readStats->numReadSuccess);
+    tstats.set_num_scan_tree_attempted(
+        readStats->numScanTreeAttempted);
+    tstats.set_num_scan_tree_success(
+        readStats->numScanTreeSuccess);
+    tstats.set_num_scan_tree_files_returned(
+        readStats->numScanTreeFilesReturned);
     tstats.set_num_remove_file_attempted(
         numRemoveFileAttempted);
     tstats.set_num_remove_file_parent_not_found(
@@ -633,6 +1875,37 @@ Tree::updateServerStats(Protocol::ServerStats::Tree& tstats) const
         numRemoveFileDone);
     tstats.set_num_remove_file_success(
         numRemoveFileSuccess);
+
+    tstats.set_memory_bytes(superRoot.getSubtreeBytes());
+    const Directory* root = superRoot.lookupDirectory("root");
+    std::vector<std::pair<uint64_t, std::string>> subtrees;
+    std::vector<std::string> children = root->getChildren();
+    for (auto it = children.begin(); it != children.end(); ++it) {
+        StringRef name(*it);
+        if (!name.endsWithSlash())
+            continue;
+        name = StringRef(name.data(), name.size() - 1);
+        subtrees.emplace_back(root->lookupDirectory(name)->getSubtreeBytes(),
+                              "/" + name.str());
+    }
+    size_t numLargest = std::min(subtrees.size(), size_t(10));
+    std::partial_sort(subtrees.begin(),
+                      subtrees.begin() + int64_t(numLargest),
+                      subtrees.end(),
+                      [] (const std::pair<uint64_t, std::string>& a,
+                          const std::pair<uint64_t, std::string>& b) {
+                          return (a.first > b.first ||
+                                  (a.first == b.first && a.second < b.second));
+                      });
+    for (size_t i = 0; i < numLargest; ++i) {
+        Protocol::ServerStats::Tree::Subtree& subtree =
+            *tstats.add_largest_subtrees();
+        subtree.set_path(subtrees.at(i).second);
+        subtree.set_memory_bytes(subtrees.at(i).first);
+    }
+    const Core::SlabStats& slabStats = NodeSlabs::slabStats();
+    tstats.set_node_slab_bytes(slabStats.slabBytes);
+    tstats.set_node_slab_bytes_in_use(slabStats.bytesInUse);
 }
 
 } // namespace LogCabin::Tree
@@ -14,7 +14,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ostream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -32,6 +36,11 @@ class ServerStats_Tree;
 
 namespace Tree {
 
+// forward declaration
+namespace Snapshot {
+class Directory;
+}
+
 /**
  * Status codes returned by Tree operations.
  */
@@ -94,6 +103,289 @@ struct Result {
 
 namespace Internal {
 
+/**
+ * A borrowed reference to a range of characters, like C++17's
+ * std::string_view. This is used to walk the tree over the components of a
+ * path without copying each one into a string of its own. The characters
+ * must outlive the StringRef.
+ */
+class StringRef {
+  public:
+    /// Refer to no characters.
+    StringRef()
+        : data_(""), size_(0) {}
+    /// Refer to the characters of a C string.
+    StringRef(const char* s) // NOLINT
+        : data_(s), size_(strlen(s)) {}
+    /// Refer to the characters of a string.
+    StringRef(const std::string& s) // NOLINT
+        : data_(s.data()), size_(s.size()) {}
+    /// Refer to the given range of characters.
+    StringRef(const char* data, size_t size)
+        : data_(data), size_(size) {}
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    /// Return a copy of the characters.
+    std::string str() const { return std::string(data_, size_); }
+    /// Return true if the last character is a slash.
+    bool endsWithSlash() const {
+        return size_ > 0 && data_[size_ - 1] == '/';
+    }
+    friend bool operator==(StringRef a, StringRef b) {
+        return (a.size_ == b.size_ &&
+                memcmp(a.data_, b.data_, a.size_) == 0);
+    }
+    friend bool operator!=(StringRef a, StringRef b) { return !(a == b); }
+    /// Compare lexicographically by (unsigned) character values.
+    friend bool operator<(StringRef a, StringRef b) {
+        int r = memcmp(a.data_, b.data_, std::min(a.size_, b.size_));
+        return r < 0 || (r == 0 && a.size_ < b.size_);
+    }
+  private:
+    const char* data_;
+    size_t size_;
+};
+
+/// Print the characters of a StringRef (for gtest).
+std::ostream& operator<<(std::ostream& os, StringRef s);
+
+/**
+ * The children of one kind (files or directories) in a Directory, indexed by
+ * name. The children are split by the leading bits of their names' hashes
+ * into shards of at most a few hundred each. Each shard is an open-addressing
+ * hash table with linear probing, laid out compactly: the children are stored
+ * densely in Shard::entries, and the hash table itself (Shard::index) only
+ * holds 4-byte positions into Shard::entries. Each entry stores the child's
+ * name along with its hash, so a lookup usually touches a single entry and
+ * compares only hashes until it finds the right one. Lookups take a StringRef,
+ * so callers don't have to copy names into strings first.
+ *
+ * Copies of a table share its shards, and a table replaces a shared shard
+ * with a private copy before changing it. Copying a Directory for a lazy copy
+ * of the Tree (see Tree::lazyCopy()) therefore costs one pointer per shard,
+ * and modifying one child afterwards copies only that child's shard, rather
+ * than all of the children of a large directory.
+ *
+ * Each shard also keeps the positions of its children sorted by name
+ * (Shard::order), so that SortedCursor can list the children in order by
+ * merging the shards, without sorting them all first.
+ */
+template<typename Node>
+class ChildTable {
+  private:
+    struct Shard;
+
+  public:
+    /**
+     * Walks through the children of a table in lexicographic order of their
+     * names, merging the table's shards. Starting takes O(s log n) time and
+     * each step takes O(log s) time, where s is the number of shards and n is
+     * the number of children. The table must not change while a cursor on it
+     * is in use.
+     */
+    class SortedCursor {
+      public:
+        /// Construct a cursor with no children to walk through.
+        SortedCursor();
+        /**
+         * Construct a cursor on the children of the given table.
+         * \param table
+         *      The table to walk through.
+         * \param from
+         *      If NULL, start at the first child. Otherwise, start at the
+         *      first child whose name sorts after this one (or at the child by
+         *      this name, if includeFrom is set and there is one).
+         * \param includeFrom
+         *      See 'from'.
+         */
+        SortedCursor(const ChildTable& table,
+                     const StringRef* from,
+                     bool includeFrom);
+        /// Return true if the cursor has passed the last child.
+        bool done() const { return heads.empty(); }
+        /// Return the name of the current child. The cursor must not be done.
+        StringRef name() const;
+        /// Return the current child. The cursor must not be done.
+        const std::shared_ptr<Node>& node() const;
+        /// Move to the next child. The cursor must not be done.
+        void advance();
+      private:
+        /**
+         * A shard and the position in its Shard::order of its next child.
+         */
+        struct Head {
+            const Shard* shard;
+            size_t position;
+        };
+        /// Return the entry that the given head refers to.
+        static const typename ChildTable::Entry& entry(const Head& head);
+        /// Order heads so that the one with the smallest name is on top.
+        static bool later(const Head& a, const Head& b);
+        /**
+         * A heap (see std::push_heap()) of the shards that have children left
+         * to walk through, ordered by their next child's name.
+         */
+        std::vector<Head> heads;
+    };
+
+    /// Constructor. The table starts out empty and allocates nothing.
+    ChildTable();
+
+    /// Return the number of children.
+    size_t size() const { return count; }
+    /// Return true if there are no children.
+    bool empty() const { return count == 0; }
+
+    /**
+     * Return the child by the given name, or NULL if there's none. The
+     * returned pointer is valid until the next insert() or erase(). This
+     * first replaces the child's shard with a private copy if it's shared,
+     * so that the caller may change the pointer.
+     */
+    std::shared_ptr<Node>* find(StringRef name);
+    /// Const version of find().
+    const std::shared_ptr<Node>* find(StringRef name) const;
+
+    /**
+     * Set the child by the given name, replacing any existing child by that
+     * name.
+     * \return
+     *      A reference to the stored child, valid until the next insert() or
+     *      erase().
+     */
+    std::shared_ptr<Node>& insert(StringRef name, std::shared_ptr<Node> node);
+
+    /**
+     * Remove the child by the given name, if any.
+     * \return
+     *      True if a child was removed, false if none had that name.
+     */
+    bool erase(StringRef name);
+
+    /// Remove all the children and free the table.
+    void clear();
+
+    /// Exchange the contents of this table with another.
+    void swap(ChildTable& other);
+
+    /**
+     * Return the names of the children in lexicographic order. This takes
+     * O(n log s) time, where s is the number of shards; see SortedCursor.
+     */
+    std::vector<StringRef> sortedNames() const;
+
+    /**
+     * Call fn(node) on each child's shared_ptr, in no particular order.
+     */
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        for (auto shard = shards.begin(); shard != shards.end(); ++shard) {
+            const std::vector<Entry>& entries = (*shard)->entries;
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+                fn(it->node);
+        }
+    }
+
+    /**
+     * Return the approximate memory used by the table itself and the names
+     * of the children, in bytes (not including the children).
+     */
+    uint64_t memoryBytes() const;
+
+  private:
+    /**
+     * A child in #entries.
+     */
+    struct Entry {
+        Entry(uint64_t hash, StringRef name, std::shared_ptr<Node> node);
+        /// The hash of #name; see hashName().
+        uint64_t hash;
+        /// The name of the child.
+        std::string name;
+        /// The child itself. This may be NULL after a caller moves it out.
+        std::shared_ptr<Node> node;
+    };
+
+    /**
+     * The children whose names' hashes start with the same bits.
+     */
+    struct Shard {
+        Shard() : index(), entries(), order() {}
+        /**
+         * Return the position in #index of the given name, or of the empty
+         * slot where it would go. The index must have at least one empty
+         * slot.
+         */
+        size_t findSlot(StringRef name, uint64_t hash) const;
+        /**
+         * Add an entry for a name that's not already in the shard. This
+         * doesn't update #order; see sortOrder().
+         */
+        void add(Entry entry);
+        /**
+         * Return the position in #order where the given name is or would go.
+         */
+        std::vector<uint32_t>::iterator orderOf(StringRef name);
+        /// Rebuild #index with the given number of slots (a power of two).
+        void resize(size_t numSlots);
+        /// Rebuild #order from #entries.
+        void sortOrder();
+
+        /**
+         * The hash table. Each slot holds 0 if it's empty or one more than
+         * the position of its child in #entries. Its size is zero or a power
+         * of two, and at most 3/4 of the slots are occupied.
+         */
+        std::vector<uint32_t> index;
+        /**
+         * The children, in no particular order and without gaps: erase()
+         * moves the last entry into the hole.
+         */
+        std::vector<Entry> entries;
+        /**
+         * The positions in #entries of the children, sorted by their names.
+         */
+        std::vector<uint32_t> order;
+    };
+
+    /**
+     * The table splits every shard in two when it holds more than this many
+     * children per shard on average.
+     */
+    static const size_t MAX_SHARD_SIZE = 256;
+
+    /// Hash the given name.
+    static uint64_t hashName(StringRef name);
+
+    /// Return the position in #shards of the shard for the given hash.
+    size_t shardOf(uint64_t hash) const;
+
+    /**
+     * Return the shard at the given position in #shards, first replacing it
+     * with a private copy if another table also refers to it.
+     */
+    Shard& mutableShard(size_t position);
+
+    /// Split every shard in two by one more bit of the hashes.
+    void split();
+
+    /**
+     * The shards, indexed by the leading bits of the hash. There are zero
+     * shards when the table is empty and has never had any children;
+     * otherwise, the number of shards is a power of two. Each shard may be
+     * shared with copies of this table, and only const methods may be called
+     * on a shard that is.
+     */
+    std::vector<std::shared_ptr<Shard>> shards;
+    /// The number of children in all the shards.
+    size_t count;
+    /// The total number of slots in the shards' indexes.
+    size_t indexSlots;
+    /// The total length of the children's names.
+    uint64_t nameBytes;
+};
+
 /**
  * A leaf object in the Tree; stores an opaque blob of data.
  */
@@ -106,19 +398,47 @@ class File {
      */
     void dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const;
     /**
-     * Load the file from the stream.
+     * Return the number of bytes that dumpSnapshot() writes.
+     */
+    uint64_t snapshotBytes() const;
+    /**
+     * Return the approximate memory used by the file, in bytes: the node and
+     * its contents.
+     */
+    uint64_t memoryBytes() const;
+    /**
+     * Load the file from the stream. The file's #epoch is then 0.
      */
     void loadSnapshot(Core::ProtoBuf::InputStream& stream);
     /**
      * Opaque data stored in the File.
      */
     std::string contents;
+    /**
+     * The Tree version in which the file was created or last written (see
+     * Tree::read()), or 0 if that was before the Tree assigned versions.
+     */
+    uint64_t version;
+    /**
+     * The Tree epoch in which the file was last modified (see
+     * Tree::markClean()), or 0 if it was loaded from a snapshot and hasn't
+     * changed since. Delta snapshots only include files modified in the
+     * latest epoch. New files start out at ~0, so they're always included
+     * until the Tree stamps them.
+     */
+    uint64_t epoch;
 };
 
 /**
  * An interior object in the Tree; stores other Directories and Files.
- * Pointers returned by this class are valid until the File or Directory they
- * refer to is removed.
+ *
+ * Children are reference-counted so that a lazy copy of the Tree (see
+ * Tree::lazyCopy()) can share them. The non-const methods that return a child
+ * first replace it with a private copy if it's shared, so it's safe to modify
+ * through the returned pointer; the const methods never copy. Pointers
+ * returned by this class are valid until the File or Directory they refer to
+ * is removed or replaced by such a copy, so callers shouldn't hold onto them
+ * across other calls.
  */
 class Directory {
   public:
@@ -135,6 +455,42 @@ class Directory {
      */
     std::vector<std::string> getChildren() const;
 
+    /**
+     * Append the files below this directory to a scan, in the order that
+     * Tree::scanTree() describes.
+     * \param prefix
+     *      The absolute path of this directory, including a trailing slash.
+     * \param recursive
+     *      If true, include the files in child directories as well; otherwise,
+     *      include only the files that this directory immediately contains.
+     * \param afterBegin
+     *      The components of a path relative to this directory. The scan
+     *      skips everything up to and including this path. If afterBegin
+     *      equals afterEnd, nothing is skipped.
+     * \param afterEnd
+     *      The end of the range starting at afterBegin.
+     * \param maxBytes
+     *      Stop before adding a file that would make the total size of the
+     *      paths and contents in 'entries' exceed this, unless 'entries' is
+     *      empty. Zero means no limit.
+     * \param[in,out] bytes
+     *      The total size of the paths and contents in 'entries'.
+     * \param[in,out] entries
+     *      The scan so far. The files found here are appended as
+     *      (path, contents) pairs.
+     * \return
+     *      True if the scan finished, false if it stopped because of
+     *      maxBytes.
+     */
+    bool scan(const std::string& prefix,
+              bool recursive,
+              std::vector<StringRef>::const_iterator afterBegin,
+              std::vector<StringRef>::const_iterator afterEnd,
+              uint64_t maxBytes,
+              uint64_t& bytes,
+              std::vector<std::pair<std::string, std::string>>& entries)
+        const;
+
     /**
      * Find the child directory by the given name.
      * \param name
@@ -143,12 +499,12 @@ class Directory {
      *      The directory by the given name, or
      *      NULL if it is not found or a file exists by that name.
      */
-    Directory* lookupDirectory(const std::string& name);
+    Directory* lookupDirectory(StringRef name);
     /**
      * Find the child directory by the given name (const version).
      * \copydetails lookupDirectory
      */
-    const Directory* lookupDirectory(const std::string& name) const;
+    const Directory* lookupDirectory(StringRef name) const;
     /**
      * Find the child directory by the given name, or create it if it doesn't
      * exist.
@@ -158,14 +514,14 @@ class Directory {
      *      The directory by the given name, or
      *      NULL if a file exists by that name.
      */
-    Directory* makeDirectory(const std::string& name);
+    Directory* makeDirectory(StringRef name);
     /**
      * Remove the child directory by the given name, if any. This will remove
      * all the contents of the directory as well.
      * \param name
      *      Must not contain a trailing slash.
      */
-    void removeDirectory(const std::string& name);
+    void removeDirectory(StringRef name);
 
     /**
      * Find the child file by the given name.
@@ -175,12 +531,12 @@ class Directory {
      *      The file by the given name, or
      *      NULL if it is not found or a directory exists by that name.
      */
-    File* lookupFile(const std::string& name);
+    File* lookupFile(StringRef name);
     /**
      * Find the child file by the given name (const version).
      * \copydetails lookupFile
      */
-    const File* lookupFile(const std::string& name) const;
+    const File* lookupFile(StringRef name) const;
     /**
      * Find the child file by the given name, or create it if it doesn't exist.
      * \param name
@@ -189,7 +545,7 @@ class Directory {
      *      The file by the given name, or
      *      NULL if a directory exists by that name.
      */
-    File* makeFile(const std::string& name);
+    File* makeFile(StringRef name);
     /**
      * Remove the child file by the given name, if any.
      * \param name
@@ -198,27 +554,114 @@ class Directory {
      *      True if child file removed, false if no such file existed. This is
      *      mostly useful for counting statistics.
      */
-    bool removeFile(const std::string& name);
+    bool removeFile(StringRef name);
 
     /**
      * Write the directory and its children to the stream.
+     * \param stream
+     *      Where to write the snapshot.
+     * \param sinceEpoch
+     *      Only write the children modified in or after this Tree epoch; the
+     *      rest are listed as unchanged. The default of 0 writes all of them.
+     * \param indexDepth
+     *      If 1, record the size of each changed child directory in this
+     *      directory's message (see Snapshot::Directory::subtree_bytes) so
+     *      that loadSnapshot() can decode them in parallel. If larger, pass
+     *      one less down to the child directories instead. The default of 0
+     *      writes no index.
      */
-    void dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const;
+    void dumpSnapshot(Core::ProtoBuf::OutputStream& stream,
+                      uint64_t sinceEpoch = 0,
+                      uint32_t indexDepth = 0) const;
     /**
-     * Load the directory and its children from the stream.
+     * Return the number of bytes that dumpSnapshot() writes for the given
+     * 'sinceEpoch' and an 'indexDepth' of 0.
      */
-    void loadSnapshot(Core::ProtoBuf::InputStream& stream);
+    uint64_t snapshotBytes(uint64_t sinceEpoch = 0) const;
+    /**
+     * Load the directory and its children from the stream, on top of the
+     * directory's current contents: children that the snapshot lists as
+     * unchanged are kept, and all others are replaced or removed. The
+     * directory and everything loaded into it then have epoch 0.
+     * \param stream
+     *      Where to read the snapshot from.
+     * \param numThreads
+     *      If more than 1 and the snapshot has an index of this directory's
+     *      children (see dumpSnapshot()), decode the child directories on up
+     *      to this many threads. Otherwise, load everything on this thread.
+     */
+    void loadSnapshot(Core::ProtoBuf::InputStream& stream,
+                      uint64_t numThreads = 1);
+
+    /**
+     * Record that this directory's listing or one of its descendants changed
+     * in the given Tree epoch. The Tree calls this on every directory along
+     * the path to one it modifies, so nothing below a directory was modified
+     * in a later epoch than the directory itself.
+     */
+    void touch(uint64_t epoch) { this->epoch = epoch; }
+    /**
+     * Return the Tree epoch in which this directory was last touched (see
+     * touch() and File::epoch).
+     */
+    uint64_t getEpoch() const { return epoch; }
+
+    /**
+     * Return the Tree version in which this directory was created or a child
+     * was last added to or removed from it (see Tree::listDirectory()), or 0
+     * if that was before the Tree assigned versions. Changes further down
+     * don't count. The Tree keeps its own latest version in the super root's.
+     */
+    uint64_t getVersion() const { return version; }
+    /**
+     * Set the value that getVersion() returns.
+     */
+    void setVersion(uint64_t version) { this->version = version; }
+
+    /**
+     * Return the approximate memory used by this directory and everything
+     * below it, in bytes: the nodes, the child tables and names, and the
+     * file contents. The methods of this class keep this up to date as
+     * children are added and removed, but changes made through a returned
+     * child pointer aren't seen here. Whoever makes them reports them with
+     * addSubtreeBytes() (see Tree::updateSubtreeBytes()).
+     */
+    uint64_t getSubtreeBytes() const { return subtreeBytes; }
+    /**
+     * Account for a change in the size of a descendant; see
+     * getSubtreeBytes().
+     */
+    void addSubtreeBytes(int64_t delta) { subtreeBytes += uint64_t(delta); }
 
   private:
     /**
-     * Map from names of child directories (without trailing slashes) to the
+     * Build the message that dumpSnapshot() writes for this directory,
+     * without the index.
+     */
+    void makeSnapshotMessage(uint64_t sinceEpoch,
+                             Snapshot::Directory& dir) const;
+
+    /**
+     * Index from names of child directories (without trailing slashes) to the
      * Directory objects.
      */
-    std::map<std::string, Directory> directories;
+    ChildTable<Directory> directories;
+    /**
+     * Index from names of child files to the File objects.
+     */
+    ChildTable<File> files;
     /**
-     * Map from names of child files to the File objects.
+     * See getEpoch(). New directories start out at ~0, like new files.
      */
-    std::map<std::string, File> files;
+    uint64_t epoch;
+    /**
+     * See getVersion().
+     */
+    uint64_t version;
+    /**
+     * See getSubtreeBytes().
+     */
+    uint64_t subtreeBytes;
 };
 
 /**
@@ -237,6 +680,10 @@ class Path {
      */
     explicit Path(const std::string& symbolic);
 
+    // The components refer into #symbolic, so a Path can't be copied.
+    Path(const Path&) = delete;
+    Path& operator=(const Path&) = delete;
+
     /**
      * Used to generate error messages during path lookup.
      * \param end
@@ -248,7 +695,7 @@ class Path {
      *      This is returned as a slash-delimited string not including "/root".
      */
     std::string
-    parentsThrough(std::vector<std::string>::const_iterator end) const;
+    parentsThrough(std::vector<StringRef>::const_iterator end) const;
 
   public:
     /**
@@ -266,16 +713,16 @@ class Path {
      * This usually begins with "root" to get from the super root to the root
      * directory, then includes the components of the symbolic path up to but
      * not including the target. If the symbolic path is "/", this will be
-     * empty.
+     * empty. Except for "root", these refer to the characters of #symbolic.
      */
-    std::vector<std::string> parents;
+    std::vector<StringRef> parents;
     /**
      * The final component of the path.
      * This is usually at the end of the symbolic path. If the symbolic path is
      * "/", this will be "root", used to get from the super root to the root
      * directory.
      */
-    std::string target;
+    StringRef target;
 };
 
 } // LogCabin::Tree::Internal
@@ -296,12 +743,86 @@ class Tree {
      */
     void dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const;
 
+    /**
+     * Return a copy of the tree's files and directories (not its write
+     * statistics or transaction) in constant time. The copy shares all of its
+     * nodes with this tree, and whichever one next modifies a shared node
+     * first replaces it with a private copy of its own. Copying a directory
+     * this way takes time proportional to its number of shards, not its
+     * number of children (see ChildTable). This is used to write
+     * a snapshot of the tree and to serve read-only queries from other
+     * threads while this one continues to change: the trees may be used from
+     * different threads without further synchronization, and the const
+     * methods of the copy may be called from many threads at once. Reads
+     * from the copy are counted in this tree's statistics.
+     */
+    Tree lazyCopy() const;
+
+    /**
+     * Write only the parts of the tree that have changed since the last call
+     * to markClean() or loadSnapshot() to the given stream. Loading the result
+     * with loadSnapshotDelta() on top of the tree as it was then reproduces
+     * the current tree.
+     */
+    void dumpSnapshotDelta(Core::ProtoBuf::OutputStream& stream) const;
+
     /**
      * Load the tree from the given stream.
+     * \param stream
+     *      Where to read the snapshot from.
+     * \param numThreads
+     *      How many threads may decode the top-level directories of the
+     *      snapshot in parallel (see Directory::loadSnapshot()).
      * \warning
      *      This will blow away any existing files and directories.
      */
-    void loadSnapshot(Core::ProtoBuf::InputStream& stream);
+    void loadSnapshot(Core::ProtoBuf::InputStream& stream,
+                      uint64_t numThreads = 1);
+
+    /**
+     * Apply a snapshot written by dumpSnapshotDelta() on top of the current
+     * tree, which must be the one the delta was taken against.
+     * \param stream
+     *      Where to read the snapshot from.
+     * \param numThreads
+     *      See loadSnapshot().
+     */
+    void loadSnapshotDelta(Core::ProtoBuf::InputStream& stream,
+                           uint64_t numThreads = 1);
+
+    /**
+     * Forget which parts of the tree have changed, once a snapshot has
+     * captured them. The next dumpSnapshotDelta() will only write what
+     * changes after this call. This just starts a new #epoch, so it takes
+     * constant time and doesn't modify any nodes that a lazy copy shares.
+     */
+    void markClean();
+
+    /**
+     * Start recording enough information to revert the changes made by
+     * subsequent operations. This is used to apply a batch of operations
+     * atomically. Transactions may not be nested.
+     */
+    void beginTransaction();
+
+    /**
+     * Keep the changes made since beginTransaction() and stop recording.
+     */
+    void commitTransaction();
+
+    /**
+     * Revert the changes made since beginTransaction() and stop recording.
+     */
+    void rollbackTransaction();
+
+    /**
+     * Set whether operations assign versions to the files and directories
+     * they modify (see read() and listDirectory()). This is on by default.
+     * The state machine turns it on only once every server in the cluster
+     * assigns versions, so that they all assign the same ones; until then,
+     * every version is 0.
+     */
+    void setVersioning(bool enabled);
 
     /**
      * Verify that the file at path has the given contents.
@@ -320,6 +841,25 @@ class Tree {
     checkCondition(const std::string& path,
                    const std::string& contents) const;
 
+    /**
+     * Verify that the file or directory at path has the given version. This
+     * is a cheaper way than comparing contents to make sure that nothing
+     * changed since a read.
+     * \param path
+     *      The path to the file or directory that must have the version
+     *      specified in 'version'.
+     * \param version
+     *      The version that the file or directory specified by 'path' should
+     *      have for an OK response, as returned by read() or listDirectory().
+     *      An OK response is also returned if 'version' is 0 and nothing
+     *      exists at 'path'.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - CONDITION_NOT_MET upon any error.
+     */
+    Result
+    checkCondition(const std::string& path, uint64_t version) const;
+
     /**
      * Make sure a directory exists at the given path.
      * Create parent directories listed in path as necessary.
@@ -356,6 +896,70 @@ class Tree {
     listDirectory(const std::string& path,
                   std::vector<std::string>& children) const;
 
+    /**
+     * List the contents of a directory and return its version.
+     * \copydetails listDirectory(const std::string&, std::vector<std::string>&) const
+     * \param[out] version
+     *      Set to the Tree version in which a child was last added to or
+     *      removed from the directory, or in which it was created. Versions
+     *      only increase, so if this is unchanged, so is the listing.
+     */
+    Result
+    listDirectory(const std::string& path,
+                  std::vector<std::string>& children,
+                  uint64_t& version) const;
+
+    /**
+     * Read the files below a directory, a bounded batch at a time. The scan
+     * visits the children of each directory in lexicographic order of their
+     * names, and in recursive scans it visits the contents of a child
+     * directory in its place. So files come out sorted by their paths when
+     * those are compared one component at a time.
+     *
+     * Directories keep their children sorted within each of their shards (see
+     * ChildTable), so a batch doesn't sort any names. Resuming after a path
+     * takes O(s log n) time in each directory along it, where s is the
+     * directory's number of shards (about n/256) and n its number of
+     * children. Each file or directory that the batch visits then takes
+     * O(log s) time. A scan of a large directory in many batches therefore
+     * costs O(n/256 log n) per batch on top of the files it returns.
+     * \param path
+     *      The directory to scan.
+     * \param recursive
+     *      If true, return the files in all the descendants of path;
+     *      otherwise, return only the files that it immediately contains.
+     * \param after
+     *      If nonempty, skip the files up to and including this absolute path
+     *      in the scan order, which must be below path. This is the path of
+     *      the last entry of a previous scan that stopped early. It needn't
+     *      exist any longer.
+     * \param maxBytes
+     *      Stop the scan early rather than return paths and contents that
+     *      total more than this many bytes. It always returns at least one
+     *      file if any remain, however large. Zero means no limit.
+     * \param[out] entries
+     *      This will be replaced by the (path, contents) pairs of the files
+     *      found, in scan order. The paths are absolute.
+     * \param[out] more
+     *      Set to true if the scan stopped early because of maxBytes, false
+     *      if it reached the end.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path or after is malformed.
+     *       - INVALID_ARGUMENT if after is not below path.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - LOOKUP_ERROR if path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a file.
+     */
+    Result
+    scanTree(const std::string& path,
+             bool recursive,
+             const std::string& after,
+             uint64_t maxBytes,
+             std::vector<std::pair<std::string, std::string>>& entries,
+             bool& more) const;
+
     /**
      * Make sure a directory does not exist.
      * Also removes all direct and indirect children of the directory.
@@ -409,6 +1013,20 @@ class Tree {
     Result
     read(const std::string& path, std::string& contents) const;
 
+    /**
+     * Get the value of a file and its version.
+     * \copydetails read(const std::string&, std::string&) const
+     * \param[out] version
+     *      Set to the Tree version in which the file was created or last
+     *      written. Versions only increase, so if this is unchanged, so are
+     *      the contents; checkCondition() can test that without comparing
+     *      them.
+     */
+    Result
+    read(const std::string& path,
+         std::string& contents,
+         uint64_t& version) const;
+
     /**
      * Make sure a file does not exist.
      * \param path
@@ -431,7 +1049,9 @@ class Tree {
   private:
     /**
      * Resolve the final next-to-last component of the given path (the target's
-     * parent).
+     * parent). Since the caller may modify the parent, the directories along
+     * the way are touched with the current #epoch and recorded in
+     * #lookupPath.
      * \param[in] path
      *      The path whose parent directory to find.
      * \param[out] parent
@@ -455,7 +1075,11 @@ class Tree {
                  const Internal::Directory** parent) const;
 
     /**
-     * Like normalLookup but creates parent directories as necessary.
+     * Like normalLookup but creates parent directories as necessary, giving
+     * them and the directories they're created in the given version. This
+     * also touches the directories along the way with the current #epoch and
+     * records them in #lookupPath, so the caller must call
+     * updateSubtreeBytes() afterwards even if this fails.
      * \param[in] path
      *      The path whose parent directory to find.
      * \param[out] parent
@@ -465,7 +1089,69 @@ class Tree {
      *       - TYPE_ERROR if a parent of path is a file.
      */
     Result
-    mkdirLookup(const Internal::Path& path, Internal::Directory** parent);
+    mkdirLookup(const Internal::Path& path,
+                uint64_t version,
+                Internal::Directory** parent);
+
+    /**
+     * Return the version to assign to the files and directories that the
+     * calling operation creates or changes. This is one more than the last
+     * operation's, or 0 if #versioning is off. The latest version is kept in
+     * #superRoot, so that it's saved in snapshots with the rest of the tree.
+     */
+    uint64_t nextVersion();
+
+    /**
+     * If a transaction is active, save the part of the tree that an operation
+     * on the given path may modify, so that rollbackTransaction() can restore
+     * it. This is the entry for the path's shallowest missing parent or, if
+     * all the parents exist, the target itself.
+     * \param path
+     *      The path that the operation is about to modify.
+     * \param removeDirectory
+     *      True if the operation is removeDirectory. A directory at the target
+     *      is only copied for removeDirectory, since no other operation
+     *      modifies an existing directory's contents.
+     */
+    void saveForRollback(const Internal::Path& path, bool removeDirectory);
+
+    /**
+     * Add the changes in size below each directory in #lookupPath to its
+     * parent, from the bottom up, so that every directory's subtree bytes
+     * (see Internal::Directory::getSubtreeBytes()) are correct again. Then
+     * clear #lookupPath. Operations call this after modifying the directory
+     * at the end of the path.
+     */
+    void updateSubtreeBytes();
+
+    /**
+     * The state of one entry in the tree before an operation in a transaction,
+     * as saved by saveForRollback().
+     */
+    struct RollbackEntry {
+        RollbackEntry();
+        /**
+         * The directories to traverse from #superRoot to get to the entry's
+         * parent. These all existed when the entry was saved.
+         */
+        std::vector<std::string> parents;
+        /**
+         * The name of the entry within its parent directory.
+         */
+        std::string name;
+        /**
+         * What the entry was.
+         */
+        enum class Type { ABSENT, FILE, DIRECTORY } type;
+        /**
+         * If type is FILE, a copy of it.
+         */
+        Internal::File file;
+        /**
+         * If type is DIRECTORY, a copy of it.
+         */
+        Internal::Directory directory;
+    };
 
     /**
      * This directory contains the root directory. The super root has a single
@@ -479,15 +1165,45 @@ class Tree {
      */
     Internal::Directory superRoot;
 
+    /**
+     * Incremented by markClean(). Every modified file and directory is
+     * stamped with the epoch in which it was modified, so that delta
+     * snapshots can tell which ones changed since the last markClean().
+     * Starts at 1, so that nodes loaded from a snapshot (epoch 0) are never
+     * considered changed.
+     */
+    uint64_t epoch;
+
+    /**
+     * See setVersioning().
+     */
+    bool versioning;
+
+    /**
+     * Server stats that the const methods update. A lazy copy of the tree
+     * (see lazyCopy()) shares these with the original, so that reads served
+     * from the copy, possibly by many threads at once, are counted in the
+     * original's stats.
+     */
+    struct ReadStats {
+        ReadStats();
+        std::atomic<uint64_t> numConditionsChecked;
+        std::atomic<uint64_t> numConditionsFailed;
+        std::atomic<uint64_t> numListDirectoryAttempted;
+        std::atomic<uint64_t> numListDirectorySuccess;
+        std::atomic<uint64_t> numReadAttempted;
+        std::atomic<uint64_t> numReadSuccess;
+        std::atomic<uint64_t> numScanTreeAttempted;
+        std::atomic<uint64_t> numScanTreeSuccess;
+        std::atomic<uint64_t> numScanTreeFilesReturned;
+    };
+
     // Server stats collected in updateServerStats.
     // Note that when a condition fails, the operation is not invoked,
     // so operations whose conditions fail are not counted as 'Attempted'.
-    mutable uint64_t numConditionsChecked;
-    mutable uint64_t numConditionsFailed;
+    std::shared_ptr<ReadStats> readStats;
     uint64_t numMakeDirectoryAttempted;
     uint64_t numMakeDirectorySuccess;
-    mutable uint64_t numListDirectoryAttempted;
-    mutable uint64_t numListDirectorySuccess;
     uint64_t numRemoveDirectoryAttempted;
     uint64_t numRemoveDirectoryParentNotFound;
     uint64_t numRemoveDirectoryTargetNotFound;
@@ -495,13 +1211,31 @@ class Tree {
     uint64_t numRemoveDirectorySuccess;
     uint64_t numWriteAttempted;
     uint64_t numWriteSuccess;
-    mutable uint64_t numReadAttempted;
-    mutable uint64_t numReadSuccess;
     uint64_t numRemoveFileAttempted;
     uint64_t numRemoveFileParentNotFound;
     uint64_t numRemoveFileTargetNotFound;
     uint64_t numRemoveFileDone;
     uint64_t numRemoveFileSuccess;
+
+    /**
+     * True between beginTransaction() and commitTransaction() or
+     * rollbackTransaction().
+     */
+    bool inTransaction;
+
+    /**
+     * The entries saved by saveForRollback() during the current transaction,
+     * in the order they were saved.
+     */
+    std::vector<RollbackEntry> rollbackLog;
+
+    /**
+     * The directories from #superRoot down to the target's parent that the
+     * last mutable lookup went through, each paired with its subtree bytes
+     * at the time its own parent last accounted for it. See
+     * updateSubtreeBytes().
+     */
+    std::vector<std::pair<Internal::Directory*, uint64_t>> lookupPath;
 };
 
 
@@ -16,9 +16,12 @@
 
 #include <fcntl.h>
 #include <gtest/gtest.h>
+#include <set>
 #include <stdexcept>
 #include <sys/stat.h>
 
+#include "build/Protocol/ServerStats.pb.h"
+#include "build/Tree/Snapshot.pb.h"
 #include "Core/StringUtil.h"
 #include "Tree/Tree.h"
 #include "Storage/FilesystemUtil.h"
@@ -29,6 +32,7 @@ namespace LogCabin {
 namespace Tree {
 namespace {
 
+using Core::StringUtil::format;
 using namespace Internal; // NOLINT
 
 #define EXPECT_OK(c) do { \
@@ -89,6 +93,157 @@ TEST(TreeFileTest, dumpSnapshot)
     }
 }
 
+TEST(TreeFileTest, snapshotBytes)
+{
+    Storage::Layout layout;
+    layout.initTemporary();
+    Storage::SnapshotFile::Writer writer(layout);
+    File f;
+    f.dumpSnapshot(writer);
+    EXPECT_EQ(writer.getBytesWritten(), f.snapshotBytes());
+    f.contents = std::string(200, 'x');
+    uint64_t before = writer.getBytesWritten();
+    f.dumpSnapshot(writer);
+    EXPECT_EQ(writer.getBytesWritten() - before, f.snapshotBytes());
+    f.version = 300;
+    before = writer.getBytesWritten();
+    f.dumpSnapshot(writer);
+    EXPECT_EQ(writer.getBytesWritten() - before, f.snapshotBytes());
+    writer.discard();
+}
+
+TEST(TreeChildTableTest, basics)
+{
+    ChildTable<File> table;
+    EXPECT_TRUE(table.empty());
+    EXPECT_EQ(0U, table.memoryBytes());
+    EXPECT_TRUE(table.find("a") == NULL);
+    EXPECT_FALSE(table.erase("a"));
+    std::shared_ptr<File> a = std::make_shared<File>();
+    EXPECT_EQ(a, table.insert("a", a));
+    EXPECT_EQ(1U, table.size());
+    EXPECT_LT(1U, table.memoryBytes());
+    EXPECT_EQ(a, *table.find(std::string("a")));
+    EXPECT_TRUE(table.find("ab") == NULL);
+    std::shared_ptr<File> a2 = std::make_shared<File>();
+    table.insert("a", a2);
+    EXPECT_EQ(1U, table.size());
+    EXPECT_EQ(a2, *table.find("a"));
+    EXPECT_TRUE(table.erase("a"));
+    EXPECT_TRUE(table.empty());
+    EXPECT_TRUE(table.find("a") == NULL);
+}
+
+TEST(TreeChildTableTest, manyChildren)
+{
+    ChildTable<File> table;
+    for (uint64_t i = 0; i < 1000; ++i)
+        table.insert(format("%lu", i), std::make_shared<File>());
+    EXPECT_EQ(1000U, table.size());
+    EXPECT_EQ(4U, table.shards.size());
+    size_t indexSlots = 0;
+    for (auto it = table.shards.begin(); it != table.shards.end(); ++it) {
+        EXPECT_GE((*it)->index.size() * 3, (*it)->entries.size() * 4);
+        indexSlots += (*it)->index.size();
+    }
+    EXPECT_EQ(indexSlots, table.indexSlots);
+    // Erasing has to keep the rest of each probe sequence reachable.
+    for (uint64_t i = 0; i < 1000; i += 3)
+        EXPECT_TRUE(table.erase(format("%lu", i)));
+    for (uint64_t i = 0; i < 1000; ++i)
+        EXPECT_EQ(i % 3 != 0, table.find(format("%lu", i)) != NULL) << i;
+    EXPECT_EQ(666U, table.size());
+
+    ChildTable<File> other;
+    other.insert("x", std::make_shared<File>());
+    other.swap(table);
+    EXPECT_EQ(1U, table.size());
+    EXPECT_EQ(666U, other.size());
+    other.clear();
+    EXPECT_TRUE(other.empty());
+    EXPECT_TRUE(other.find("1") == NULL);
+}
+
+TEST(TreeChildTableTest, copiesShareShards)
+{
+    ChildTable<File> table;
+    for (uint64_t i = 0; i < 1000; ++i)
+        table.insert(format("%lu", i), std::make_shared<File>());
+    ChildTable<File> copy(table);
+    std::shared_ptr<File> replacement = std::make_shared<File>();
+    copy.insert("7", replacement);
+    EXPECT_TRUE(copy.erase("8"));
+    EXPECT_FALSE(copy.erase("nope"));
+    EXPECT_TRUE(copy.find("9") != NULL);
+
+    // The original didn't change.
+    EXPECT_EQ(1000U, table.size());
+    EXPECT_NE(replacement, *table.find("7"));
+    EXPECT_TRUE(table.find("8") != NULL);
+    EXPECT_EQ(999U, copy.size());
+    EXPECT_EQ(replacement, *copy.find("7"));
+    EXPECT_TRUE(copy.find("8") == NULL);
+
+    // Only the shards that the copy changed were copied.
+    size_t shared = 0;
+    for (size_t i = 0; i < table.shards.size(); ++i) {
+        if (table.shards.at(i) == copy.shards.at(i))
+            ++shared;
+    }
+    EXPECT_LE(table.shards.size() - 3, shared);
+}
+
+TEST(TreeChildTableTest, sortedNames)
+{
+    ChildTable<File> table;
+    EXPECT_EQ((std::vector<StringRef> {}), table.sortedNames());
+    const char* names[] = {"b", "ab", "a", "ba", "c", "aa"};
+    for (size_t i = 0; i < 6; ++i)
+        table.insert(names[i], std::make_shared<File>());
+    EXPECT_EQ((std::vector<StringRef> {"a", "aa", "ab", "b", "ba", "c"}),
+              table.sortedNames());
+}
+
+TEST(TreeChildTableTest, sortedCursor)
+{
+    ChildTable<File> table;
+    EXPECT_TRUE(ChildTable<File>::SortedCursor(table, NULL, false).done());
+    // Enough children for several shards, inserted and erased out of order.
+    std::set<std::string> expected;
+    for (uint64_t i = 0; i < 2000; ++i) {
+        std::string name = format("%lu", i * 7919 % 2000);
+        table.insert(name, std::make_shared<File>());
+        expected.insert(name);
+    }
+    for (uint64_t i = 0; i < 2000; i += 7) {
+        table.erase(format("%lu", i));
+        expected.erase(format("%lu", i));
+    }
+    EXPECT_LT(1U, table.shards.size());
+    for (auto it = table.shards.begin(); it != table.shards.end(); ++it)
+        EXPECT_EQ((*it)->entries.size(), (*it)->order.size());
+    std::vector<std::string> names;
+    std::vector<StringRef> sorted = table.sortedNames();
+    for (auto it = sorted.begin(); it != sorted.end(); ++it)
+        names.push_back(it->str());
+    EXPECT_EQ(std::vector<std::string>(expected.begin(), expected.end()),
+              names);
+
+    StringRef from("1000");
+    ChildTable<File>::SortedCursor after(table, &from, false);
+    EXPECT_EQ("1002", after.name()); // 1001 was erased
+    EXPECT_EQ(*table.find("1002"), after.node());
+    after.advance();
+    EXPECT_EQ("1003", after.name());
+    ChildTable<File>::SortedCursor at(table, &from, true);
+    EXPECT_EQ("1000", at.name());
+    StringRef missing("1000a");
+    ChildTable<File>::SortedCursor past(table, &missing, true);
+    EXPECT_EQ("1002", past.name());
+    StringRef last("999");
+    EXPECT_TRUE(ChildTable<File>::SortedCursor(table, &last, false).done());
+}
+
 TEST(TreeDirectoryTest, getChildren)
 {
     Directory d;
@@ -229,6 +384,27 @@ TEST(TreeDirectoryTest, dumpSnapshot)
     }
 }
 
+TEST(TreeDirectoryTest, snapshotBytes)
+{
+    Tree tree;
+    tree.makeDirectory("/a/b/c");
+    tree.write("/a/x", std::string(300, 'x'));
+    tree.markClean();
+    tree.write("/a/b/y", "foo");
+    tree.makeDirectory("/d");
+
+    Storage::Layout layout;
+    layout.initTemporary();
+    Storage::SnapshotFile::Writer writer(layout);
+    tree.superRoot.dumpSnapshot(writer);
+    EXPECT_EQ(writer.getBytesWritten(), tree.superRoot.snapshotBytes());
+    uint64_t before = writer.getBytesWritten();
+    tree.superRoot.dumpSnapshot(writer, tree.epoch);
+    EXPECT_EQ(writer.getBytesWritten() - before,
+              tree.superRoot.snapshotBytes(tree.epoch));
+    writer.discard();
+}
+
 TEST(TreePathTest, constructor)
 {
     Path p1("");
@@ -237,14 +413,14 @@ TEST(TreePathTest, constructor)
     Path p2("/");
     EXPECT_OK(p2.result);
     EXPECT_EQ("/", p2.symbolic);
-    EXPECT_EQ((std::vector<std::string> {
+    EXPECT_EQ((std::vector<StringRef> {
                }), p2.parents);
     EXPECT_EQ("root", p2.target);
 
     Path p3("/foo");
     EXPECT_OK(p3.result);
     EXPECT_EQ("/foo", p3.symbolic);
-    EXPECT_EQ((std::vector<std::string> {
+    EXPECT_EQ((std::vector<StringRef> {
                    "root",
                }), p3.parents);
     EXPECT_EQ("foo", p3.target);
@@ -252,7 +428,7 @@ TEST(TreePathTest, constructor)
     Path p4("/foo/bar/");
     EXPECT_OK(p4.result);
     EXPECT_EQ("/foo/bar/", p4.symbolic);
-    EXPECT_EQ((std::vector<std::string> {
+    EXPECT_EQ((std::vector<StringRef> {
                    "root", "foo",
                }), p4.parents);
     EXPECT_EQ("bar", p4.target);
@@ -271,6 +447,29 @@ TEST(TreePathTest, parentsThrough)
     EXPECT_EQ("/a/b/c", path.parentsThrough(it));
 }
 
+/**
+ * Add up the memory used by the directory and everything below it from
+ * scratch, and check that each directory's cached subtree bytes match.
+ */
+uint64_t
+checkSubtreeBytes(const Directory& directory)
+{
+    uint64_t bytes = (sizeof(void*) + 2 * sizeof(uint32_t) +
+                      sizeof(Directory) +
+                      directory.directories.memoryBytes() +
+                      directory.files.memoryBytes());
+    directory.directories.forEach(
+        [&bytes] (const std::shared_ptr<Directory>& child) {
+            bytes += checkSubtreeBytes(*child);
+        });
+    directory.files.forEach(
+        [&bytes] (const std::shared_ptr<File>& child) {
+            bytes += child->memoryBytes();
+        });
+    EXPECT_EQ(bytes, directory.getSubtreeBytes());
+    return bytes;
+}
+
 class TreeTreeTest : public ::testing::Test {
     TreeTreeTest()
         : tree()
@@ -302,6 +501,290 @@ TEST_F(TreeTreeTest, dumpSnapshot)
     EXPECT_EQ((std::vector<std::string>{ "c" }), children);
 }
 
+TEST_F(TreeTreeTest, dumpSnapshot_versions)
+{
+    Storage::Layout layout;
+    layout.initTemporary();
+    tree.makeDirectory("/a");
+    tree.write("/a/x", "1");
+    tree.write("/b", "2");
+    tree.removeFile("/b");
+    tree.removeFile("/b");
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.dumpSnapshot(writer);
+        writer.save();
+    }
+    Tree copy;
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        copy.loadSnapshot(reader);
+    }
+    std::vector<std::string> children;
+    std::string contents;
+    uint64_t version = 0;
+    EXPECT_OK(copy.listDirectory("/a", children, version));
+    EXPECT_EQ(2U, version);
+    EXPECT_OK(copy.read("/a/x", contents, version));
+    EXPECT_EQ(2U, version);
+    EXPECT_OK(copy.listDirectory("/", children, version));
+    EXPECT_EQ(4U, version);
+    // The latest version survives too, even though no node has it.
+    EXPECT_EQ(5U, copy.superRoot.getVersion());
+    EXPECT_OK(copy.makeDirectory("/a"));
+    EXPECT_OK(copy.write("/a/y", "3"));
+    EXPECT_OK(copy.listDirectory("/a", children, version));
+    EXPECT_EQ(7U, version);
+}
+
+TEST_F(TreeTreeTest, dumpSnapshotDelta)
+{
+    tree.makeDirectory("/a/b");
+    tree.write("/a/b/x", "1");
+    tree.write("/a/y", "2");
+    tree.makeDirectory("/c/d");
+    tree.write("/c/z", "3");
+    tree.makeDirectory("/e");
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.dumpSnapshot(writer);
+        writer.save();
+    }
+    tree.markClean();
+    tree.write("/a/b/x", "4");
+    tree.removeFile("/a/y");
+    tree.removeDirectory("/e");
+    tree.makeDirectory("/f");
+    Storage::Layout layout2;
+    layout2.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout2);
+        tree.dumpSnapshotDelta(writer);
+        writer.save();
+    }
+
+    Tree t2;
+    t2.makeDirectory("/g");
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        t2.loadSnapshot(reader);
+    }
+    {
+        Storage::SnapshotFile::Reader reader(layout2);
+        t2.loadSnapshotDelta(reader);
+    }
+    EXPECT_EQ("/ /a/ /a/b/ /a/b/x /c/ /c/d/ /c/z /f/", dumpTree(t2));
+    EXPECT_EQ(dumpTree(tree), dumpTree(t2));
+    std::string contents;
+    EXPECT_OK(t2.read("/a/b/x", contents));
+    EXPECT_EQ("4", contents);
+    EXPECT_OK(t2.read("/c/z", contents));
+    EXPECT_EQ("3", contents);
+    EXPECT_EQ(0U, t2.superRoot.getEpoch());
+}
+
+// Not really a unit test: this reports how fast reads are in a directory with
+// many children, so that changes to the directory index can be compared.
+TEST_F(TreeTreeTest, read_largeDirectory)
+{
+    // Tree/LookupBenchmark times this with many more children.
+    const uint64_t numChildren = 2000;
+    EXPECT_OK(tree.makeDirectory("/dir"));
+    for (uint64_t i = 0; i < numChildren; ++i) {
+        uint64_t id = i * 7919 % numChildren;
+        EXPECT_OK(tree.write(format("/dir/child-%lu", id),
+                             format("%lu", id)));
+    }
+    std::string contents;
+    for (uint64_t i = 0; i < numChildren; ++i) {
+        EXPECT_OK(tree.read(format("/dir/child-%lu", i), contents));
+        EXPECT_EQ(format("%lu", i), contents);
+    }
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.read(format("/dir/child-%lu", numChildren),
+                        contents).status);
+    EXPECT_EQ(numChildren, tree.readStats->numReadSuccess);
+    std::vector<std::string> children;
+    EXPECT_OK(tree.listDirectory("/dir", children));
+    EXPECT_EQ(numChildren, children.size());
+}
+
+TEST_F(TreeTreeTest, loadSnapshot_parallel)
+{
+    for (uint64_t i = 0; i < 10; ++i) {
+        tree.makeDirectory(format("/%lu/a", i));
+        tree.write(format("/%lu/x", i), format("%lu", i));
+    }
+    tree.write("/y", "top");
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.dumpSnapshot(writer);
+        writer.save();
+    }
+    tree.markClean();
+    tree.write("/3/x", "changed");
+    tree.removeDirectory("/5");
+    tree.makeDirectory("/7/b");
+    tree.makeDirectory("/new");
+    Storage::Layout layout2;
+    layout2.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout2);
+        tree.dumpSnapshotDelta(writer);
+        writer.save();
+    }
+
+    // the root directory is indexed
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        Snapshot::Directory superRoot;
+        Snapshot::Directory root;
+        EXPECT_EQ("", reader.readMessage(superRoot));
+        EXPECT_EQ(0, superRoot.subtree_bytes_size());
+        EXPECT_EQ("", reader.readMessage(root));
+        EXPECT_EQ(10, root.subtree_bytes_size());
+    }
+
+    // loading in parallel and sequentially give the same tree
+    for (uint64_t numThreads = 1; numThreads <= 4; numThreads += 3) {
+        Tree t2;
+        {
+            Storage::SnapshotFile::Reader reader(layout);
+            t2.loadSnapshot(reader, numThreads);
+            EXPECT_EQ(reader.getSizeBytes(), reader.getBytesRead());
+        }
+        {
+            Storage::SnapshotFile::Reader reader(layout2);
+            t2.loadSnapshotDelta(reader, numThreads);
+            EXPECT_EQ(reader.getSizeBytes(), reader.getBytesRead());
+        }
+        EXPECT_EQ(dumpTree(tree), dumpTree(t2)) << numThreads;
+        std::string contents;
+        EXPECT_OK(t2.read("/3/x", contents));
+        EXPECT_EQ("changed", contents);
+        EXPECT_OK(t2.read("/9/x", contents));
+        EXPECT_EQ("9", contents);
+        EXPECT_EQ(0U, t2.superRoot.getEpoch());
+    }
+}
+
+TEST_F(TreeTreeTest, loadSnapshot_badIndex)
+{
+    tree.makeDirectory("/a");
+    tree.makeDirectory("/b");
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        Snapshot::Directory superRoot;
+        superRoot.add_directories("root");
+        writer.writeMessage(superRoot);
+        Snapshot::Directory root;
+        root.add_directories("a");
+        root.add_directories("b");
+        root.add_subtree_bytes(tree.superRoot.snapshotBytes());
+        writer.writeMessage(root);
+        writer.save();
+    }
+    Tree t2;
+    Storage::SnapshotFile::Reader reader(layout);
+    EXPECT_DEATH(t2.loadSnapshot(reader, 2),
+                 "index lists 1 subtrees but there are 2");
+}
+
+TEST_F(TreeTreeTest, loadSnapshotDelta_missingBase)
+{
+    tree.makeDirectory("/a");
+    tree.markClean();
+    tree.write("/b", "foo");
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.dumpSnapshotDelta(writer);
+        writer.save();
+    }
+    Tree t2;
+    Storage::SnapshotFile::Reader reader(layout);
+    EXPECT_DEATH(t2.loadSnapshotDelta(reader),
+                 "unchanged directory a is missing");
+}
+
+TEST_F(TreeTreeTest, markClean)
+{
+    tree.makeDirectory("/a/b");
+    tree.makeDirectory("/c");
+    tree.write("/a/x", "foo");
+    EXPECT_EQ(1U, tree.superRoot.getEpoch());
+    tree.markClean();
+    EXPECT_EQ(2U, tree.epoch);
+    const Directory* root = tree.superRoot.lookupDirectory("root");
+    const Directory* a = root->lookupDirectory("a");
+    const Directory* c = root->lookupDirectory("c");
+    EXPECT_EQ(1U, root->getEpoch());
+    EXPECT_EQ(1U, a->getEpoch());
+    EXPECT_EQ(1U, a->lookupDirectory("b")->getEpoch());
+    EXPECT_EQ(1U, a->lookupFile("x")->epoch);
+    EXPECT_EQ(1U, c->getEpoch());
+
+    // reads don't touch anything
+    std::string contents;
+    EXPECT_OK(tree.read("/a/x", contents));
+    EXPECT_EQ(1U, root->getEpoch());
+
+    // writes touch the file and each directory above it
+    tree.write("/a/x", "bar");
+    EXPECT_EQ(2U, tree.superRoot.getEpoch());
+    EXPECT_EQ(2U, root->getEpoch());
+    EXPECT_EQ(2U, a->getEpoch());
+    EXPECT_EQ(1U, a->lookupDirectory("b")->getEpoch());
+    EXPECT_EQ(2U, a->lookupFile("x")->epoch);
+    EXPECT_EQ(1U, c->getEpoch());
+}
+
+TEST_F(TreeTreeTest, lazyCopy)
+{
+    tree.makeDirectory("/a/b");
+    tree.write("/a/x", "foo");
+    tree.write("/c", "bar");
+    tree.markClean();
+    Tree copy = tree.lazyCopy();
+    EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+    EXPECT_EQ(tree.epoch, copy.epoch);
+    // (the non-const lookups would copy shared nodes)
+    const Directory& superRoot1 = tree.superRoot;
+    const Directory& superRoot2 = copy.superRoot;
+    EXPECT_EQ(superRoot1.lookupDirectory("root"),
+              superRoot2.lookupDirectory("root"));
+
+    // modifying one copies the path to the change, and shares the rest
+    tree.write("/a/x", "baz");
+    tree.removeFile("/c");
+    tree.makeDirectory("/d");
+    std::string contents;
+    EXPECT_OK(copy.read("/a/x", contents));
+    EXPECT_EQ("foo", contents);
+    EXPECT_OK(tree.read("/a/x", contents));
+    EXPECT_EQ("baz", contents);
+    EXPECT_EQ("/ /a/ /a/b/ /a/x /c", dumpTree(copy));
+    EXPECT_EQ("/ /a/ /a/b/ /a/x /d/", dumpTree(tree));
+    const Directory* a1 = superRoot1.lookupDirectory("root")->
+        lookupDirectory("a");
+    const Directory* a2 = superRoot2.lookupDirectory("root")->
+        lookupDirectory("a");
+    EXPECT_NE(a1, a2);
+    EXPECT_EQ(a1->lookupDirectory("b"), a2->lookupDirectory("b"));
+
+    // the copy can be modified too
+    copy.write("/a/b/y", "qux");
+    EXPECT_OK(copy.read("/a/b/y", contents));
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.read("/a/b/y", contents).status);
+    EXPECT_EQ("/ /a/ /a/b/ /a/x /d/", dumpTree(tree));
+}
 
 TEST_F(TreeTreeTest, normalLookup)
 {
@@ -365,6 +848,102 @@ TEST_F(TreeTreeTest, checkCondition)
               result.error);
 }
 
+TEST_F(TreeTreeTest, checkCondition_version)
+{
+    uint64_t version = 0;
+    std::string contents;
+    tree.write("/a", "b");
+    EXPECT_OK(tree.read("/a", contents, version));
+    EXPECT_OK(tree.checkCondition("/a", version));
+    Result result;
+    result = tree.checkCondition("/a", version + 1);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/a' has version 1, not 2 as required",
+              result.error);
+    tree.write("/a", "b");
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.checkCondition("/a", version).status);
+
+    EXPECT_OK(tree.checkCondition("/c", 0));
+    EXPECT_OK(tree.checkCondition("/c/d", 0));
+    result = tree.checkCondition("/c", 3);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/c' has version 0, not 3 as required",
+              result.error);
+    EXPECT_OK(tree.makeDirectory("/c"));
+    EXPECT_OK(tree.checkCondition("/c", 3));
+    EXPECT_OK(tree.checkCondition("/", 3));
+
+    result = tree.checkCondition("/a/b", 0);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Could not look up path '/a/b': Parent /a of /a/b is a file",
+              result.error);
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.checkCondition("a", 0).status);
+}
+
+TEST_F(TreeTreeTest, versions)
+{
+    std::vector<std::string> children;
+    std::string contents;
+    uint64_t version = 0;
+    EXPECT_OK(tree.listDirectory("/", children, version));
+    EXPECT_EQ(0U, version);
+
+    // Creating a directory changes it and the directory it's created in,
+    // along with any parents it creates.
+    EXPECT_OK(tree.makeDirectory("/a/b"));
+    EXPECT_OK(tree.listDirectory("/", children, version));
+    EXPECT_EQ(1U, version);
+    EXPECT_OK(tree.listDirectory("/a", children, version));
+    EXPECT_EQ(1U, version);
+    EXPECT_OK(tree.listDirectory("/a/b", children, version));
+    EXPECT_EQ(1U, version);
+    EXPECT_OK(tree.makeDirectory("/a/b"));
+    EXPECT_OK(tree.listDirectory("/a/b", children, version));
+    EXPECT_EQ(1U, version);
+
+    // Writing a file changes it, and its directory only if it's new.
+    EXPECT_OK(tree.write("/a/x", "1"));
+    EXPECT_OK(tree.read("/a/x", contents, version));
+    EXPECT_EQ(3U, version);
+    EXPECT_OK(tree.listDirectory("/a", children, version));
+    EXPECT_EQ(3U, version);
+    EXPECT_OK(tree.write("/a/x", "1"));
+    EXPECT_OK(tree.read("/a/x", contents, version));
+    EXPECT_EQ(4U, version);
+    EXPECT_OK(tree.listDirectory("/a", children, version));
+    EXPECT_EQ(3U, version);
+    EXPECT_OK(tree.listDirectory("/", children, version));
+    EXPECT_EQ(1U, version);
+
+    // Removing changes the directory removed from.
+    EXPECT_OK(tree.removeFile("/a/x"));
+    EXPECT_OK(tree.listDirectory("/a", children, version));
+    EXPECT_EQ(5U, version);
+    EXPECT_OK(tree.removeFile("/a/x"));
+    EXPECT_OK(tree.listDirectory("/a", children, version));
+    EXPECT_EQ(5U, version);
+    EXPECT_OK(tree.removeDirectory("/a/b"));
+    EXPECT_OK(tree.listDirectory("/a", children, version));
+    EXPECT_EQ(7U, version);
+    EXPECT_OK(tree.removeDirectory("/"));
+    EXPECT_OK(tree.listDirectory("/", children, version));
+    EXPECT_EQ(8U, version);
+
+    // Failed reads return version 0.
+    version = 4;
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.read("/a/x", contents, version).status);
+    EXPECT_EQ(0U, version);
+
+    tree.setVersioning(false);
+    EXPECT_OK(tree.write("/y", "2"));
+    EXPECT_OK(tree.read("/y", contents, version));
+    EXPECT_EQ(0U, version);
+    EXPECT_EQ(8U, tree.superRoot.getVersion());
+}
+
 TEST_F(TreeTreeTest, makeDirectory)
 {
     EXPECT_OK(tree.makeDirectory("/"));
@@ -411,6 +990,87 @@ TEST_F(TreeTreeTest, listDirectory)
     EXPECT_EQ("/d is a file", result.error);
 }
 
+TEST_F(TreeTreeTest, scanTree)
+{
+    typedef std::vector<std::pair<std::string, std::string>> Entries;
+    Entries entries;
+    bool more = true;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.scanTree("", true, "", 0, entries, more).status);
+    EXPECT_OK(tree.scanTree("/", true, "", 0, entries, more));
+    EXPECT_EQ(Entries{}, entries);
+    EXPECT_FALSE(more);
+
+    EXPECT_OK(tree.write("/b", "2"));
+    EXPECT_OK(tree.makeDirectory("/a/empty"));
+    EXPECT_OK(tree.write("/a/y", "4"));
+    EXPECT_OK(tree.write("/a/x", "3"));
+    EXPECT_OK(tree.write("/a-", "1"));
+    EXPECT_OK(tree.makeDirectory("/c/d"));
+    EXPECT_OK(tree.write("/c/d/e", "5"));
+    EXPECT_OK(tree.write("/c/f", "6"));
+    Entries all = {
+        {"/a/x", "3"},
+        {"/a/y", "4"},
+        {"/a-", "1"},
+        {"/b", "2"},
+        {"/c/d/e", "5"},
+        {"/c/f", "6"},
+    };
+    EXPECT_OK(tree.scanTree("/", true, "", 0, entries, more));
+    EXPECT_EQ(all, entries);
+    EXPECT_FALSE(more);
+    EXPECT_OK(tree.scanTree("//c/", true, "", 0, entries, more));
+    EXPECT_EQ((Entries{{"/c/d/e", "5"}, {"/c/f", "6"}}), entries);
+    EXPECT_OK(tree.scanTree("/", false, "", 0, entries, more));
+    EXPECT_EQ((Entries{{"/a-", "1"}, {"/b", "2"}}), entries);
+
+    // Each entry here is 5 or 7 bytes; batches always hold at least one.
+    for (uint64_t maxBytes = 1; maxBytes < 40; ++maxBytes) {
+        Entries scanned;
+        std::string after;
+        do {
+            EXPECT_OK(tree.scanTree("/", true, after, maxBytes,
+                                    entries, more));
+            ASSERT_FALSE(entries.empty());
+            uint64_t bytes = 0;
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+                bytes += it->first.size() + it->second.size();
+            if (entries.size() > 1) {
+                EXPECT_GE(maxBytes, bytes);
+            }
+            scanned.insert(scanned.end(), entries.begin(), entries.end());
+            after = entries.back().first;
+        } while (more);
+        EXPECT_EQ(all, scanned) << maxBytes;
+    }
+
+    // The continuation needn't exist any longer.
+    EXPECT_OK(tree.scanTree("/", true, "/a/xx", 0, entries, more));
+    EXPECT_EQ(Entries(all.begin() + 1, all.end()), entries);
+    EXPECT_OK(tree.scanTree("/", true, "/a/z/q", 0, entries, more));
+    EXPECT_EQ(Entries(all.begin() + 2, all.end()), entries);
+    EXPECT_OK(tree.scanTree("/", true, "/c", 0, entries, more));
+    EXPECT_EQ(Entries(all.begin() + 4, all.end()), entries);
+    EXPECT_OK(tree.scanTree("/", true, "/d", 0, entries, more));
+    EXPECT_EQ(Entries{}, entries);
+    EXPECT_OK(tree.scanTree("/c", true, "/c/d/e", 0, entries, more));
+    EXPECT_EQ((Entries{{"/c/f", "6"}}), entries);
+
+    Result result;
+    result = tree.scanTree("/c", true, "/a/x", 0, entries, more);
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ("/a/x is not below /c", result.error);
+    result = tree.scanTree("/c", true, "/c", 0, entries, more);
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    result = tree.scanTree("/e", true, "", 0, entries, more);
+    EXPECT_EQ(Status::LOOKUP_ERROR, result.status);
+    EXPECT_EQ("/e does not exist", result.error);
+    result = tree.scanTree("/b", true, "", 0, entries, more);
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/b is a file", result.error);
+}
+
 TEST_F(TreeTreeTest, removeDirectory)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT, tree.removeDirectory("").status);
@@ -494,6 +1154,148 @@ TEST_F(TreeTreeTest, removeFile)
     EXPECT_EQ("/e is a directory", result.error);
 }
 
+TEST_F(TreeTreeTest, rollbackTransaction)
+{
+    EXPECT_OK(tree.makeDirectory("/a/b"));
+    EXPECT_OK(tree.write("/a/f", "foo"));
+    EXPECT_OK(tree.write("/g", "bar"));
+    std::string before = dumpTree(tree);
+    std::string contents;
+
+    tree.beginTransaction();
+    EXPECT_OK(tree.makeDirectory("/x/y/z"));
+    EXPECT_OK(tree.makeDirectory("/a/b"));
+    EXPECT_OK(tree.write("/a/f", "changed"));
+    EXPECT_OK(tree.write("/a/b/new", "new"));
+    EXPECT_OK(tree.removeFile("/g"));
+    EXPECT_OK(tree.removeDirectory("/a"));
+    EXPECT_OK(tree.write("/a", "now a file"));
+    EXPECT_EQ(Status::TYPE_ERROR, tree.makeDirectory("/a/c").status);
+    EXPECT_EQ("/ /x/ /x/y/ /x/y/z/ /a", dumpTree(tree));
+    tree.rollbackTransaction();
+    EXPECT_EQ(before, dumpTree(tree));
+    EXPECT_OK(tree.read("/a/f", contents));
+    EXPECT_EQ("foo", contents);
+    EXPECT_OK(tree.read("/g", contents));
+    EXPECT_EQ("bar", contents);
+    EXPECT_EQ(0U, tree.rollbackLog.size());
+
+    // removing the root directory
+    tree.beginTransaction();
+    EXPECT_OK(tree.removeDirectory("/"));
+    EXPECT_EQ("/", dumpTree(tree));
+    tree.rollbackTransaction();
+    EXPECT_EQ(before, dumpTree(tree));
+
+    // commit keeps the changes
+    tree.beginTransaction();
+    EXPECT_OK(tree.write("/g", "baz"));
+    tree.commitTransaction();
+    EXPECT_EQ(0U, tree.rollbackLog.size());
+    EXPECT_OK(tree.read("/g", contents));
+    EXPECT_EQ("baz", contents);
+
+    // nothing is saved outside of transactions
+    EXPECT_OK(tree.write("/h", "x"));
+    EXPECT_EQ(0U, tree.rollbackLog.size());
+
+    // rolled back nodes get their versions back, but the tree's versions
+    // keep increasing
+    uint64_t version = 0;
+    uint64_t latest = tree.superRoot.getVersion();
+    tree.beginTransaction();
+    EXPECT_OK(tree.write("/h", "y"));
+    tree.rollbackTransaction();
+    EXPECT_OK(tree.read("/h", contents, version));
+    EXPECT_EQ(latest, version);
+    EXPECT_OK(tree.write("/h", "z"));
+    EXPECT_OK(tree.read("/h", contents, version));
+    EXPECT_EQ(latest + 2, version);
+}
+
+TEST_F(TreeTreeTest, subtreeBytes)
+{
+    uint64_t empty = tree.superRoot.getSubtreeBytes();
+    checkSubtreeBytes(tree.superRoot);
+    EXPECT_OK(tree.makeDirectory("/a/b/c"));
+    EXPECT_OK(tree.write("/a/b/short", "x"));
+    EXPECT_OK(tree.write("/a/b/long", std::string(1000, 'x')));
+    uint64_t withLong = tree.superRoot.getSubtreeBytes();
+    EXPECT_LT(empty + 1000, withLong);
+    checkSubtreeBytes(tree.superRoot);
+    EXPECT_OK(tree.write("/a/b/long", "now short"));
+    EXPECT_GT(withLong - 1000, tree.superRoot.getSubtreeBytes());
+    checkSubtreeBytes(tree.superRoot);
+    EXPECT_EQ(Status::TYPE_ERROR,
+              tree.makeDirectory("/a/b/short/x").status);
+    EXPECT_OK(tree.removeFile("/a/b/short"));
+    checkSubtreeBytes(tree.superRoot);
+    EXPECT_OK(tree.removeDirectory("/a/b"));
+    checkSubtreeBytes(tree.superRoot);
+
+    // lazy copies share nodes but account for them separately
+    Tree copy = tree.lazyCopy();
+    EXPECT_OK(copy.write("/a/f", std::string(100, 'y')));
+    checkSubtreeBytes(tree.superRoot);
+    checkSubtreeBytes(copy.superRoot);
+    EXPECT_LT(tree.superRoot.getSubtreeBytes(),
+              copy.superRoot.getSubtreeBytes());
+
+    // transactions
+    EXPECT_OK(tree.write("/a/f", std::string(100, 'z')));
+    uint64_t before = tree.superRoot.getSubtreeBytes();
+    tree.beginTransaction();
+    EXPECT_OK(tree.makeDirectory("/x/y/z"));
+    EXPECT_OK(tree.write("/a/f", "changed"));
+    EXPECT_OK(tree.write("/a/g", std::string(100, 'z')));
+    EXPECT_OK(tree.removeDirectory("/a"));
+    checkSubtreeBytes(tree.superRoot);
+    tree.rollbackTransaction();
+    checkSubtreeBytes(tree.superRoot);
+    EXPECT_EQ(before, tree.superRoot.getSubtreeBytes());
+
+    // snapshots
+    for (uint64_t i = 0; i < 10; ++i)
+        EXPECT_OK(tree.write(format("/%lu", i), std::string(i * 10, 'a')));
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.dumpSnapshot(writer);
+        writer.save();
+    }
+    Tree t2;
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        t2.loadSnapshot(reader, 4);
+    }
+    // (The tables may be smaller than the original's, which have grown and
+    // shrunk.)
+    checkSubtreeBytes(t2.superRoot);
+    EXPECT_LT(1000U, t2.superRoot.getSubtreeBytes());
+}
+
+TEST_F(TreeTreeTest, updateServerStats_memory)
+{
+    EXPECT_OK(tree.makeDirectory("/small"));
+    EXPECT_OK(tree.makeDirectory("/big"));
+    EXPECT_OK(tree.write("/big/f", std::string(10000, 'x')));
+    EXPECT_OK(tree.write("/file", std::string(100000, 'x')));
+    for (uint64_t i = 0; i < 20; ++i)
+        EXPECT_OK(tree.makeDirectory(format("/d%02lu", i)));
+    Protocol::ServerStats::Tree stats;
+    tree.updateServerStats(stats);
+    EXPECT_EQ(tree.superRoot.getSubtreeBytes(), stats.memory_bytes());
+    EXPECT_LT(110000U, stats.memory_bytes());
+    ASSERT_EQ(10, stats.largest_subtrees_size());
+    EXPECT_EQ("/big", stats.largest_subtrees(0).path());
+    EXPECT_LT(10000U, stats.largest_subtrees(0).memory_bytes());
+    EXPECT_EQ("/d00", stats.largest_subtrees(1).path());
+    EXPECT_EQ("/d08", stats.largest_subtrees(9).path());
+    EXPECT_LT(0U, stats.node_slab_bytes_in_use());
+    EXPECT_LE(stats.node_slab_bytes_in_use(), stats.node_slab_bytes());
+}
+
 } // namespace LogCabin::Tree::<anonymous>
 } // namespace LogCabin::Tree
 } // namespace LogCabin
@@ -50,7 +50,9 @@ class StateMachineCommand_Response;
 
 namespace Client {
 
+class BatchDetails; // forward declaration
 class ClientImpl; // forward declaration
+class ScanDetails; // forward declaration
 class TreeDetails; // forward declaration
 
 // To control how the debug log operates, clients should
@@ -217,6 +219,38 @@ enum class Status {
 std::ostream&
 operator<<(std::ostream& os, Status status);
 
+/**
+ * How up-to-date the results of read-only Tree operations must be. See
+ * Tree::setReadConsistency().
+ */
+enum class ReadConsistency {
+
+    /**
+     * Reads reflect every operation that completed before they started. They
+     * must be served by the cluster leader. This is the default.
+     */
+    LINEARIZABLE = 0,
+
+    /**
+     * Reads may be served by any server whose state is within the bounds given
+     * to Tree::setReadConsistency(). Servers that fall outside those bounds
+     * redirect the client to the leader.
+     */
+    BOUNDED_STALENESS = 1,
+
+    /**
+     * Reads may be served by any server from whatever state it has, which may
+     * be arbitrarily out of date.
+     */
+    ANY_REPLICA = 2,
+};
+
+/**
+ * Print a read consistency level to a stream.
+ */
+std::ostream&
+operator<<(std::ostream& os, ReadConsistency consistency);
+
 /**
  * Returned by Tree operations; contain a status code and an error message.
  */
@@ -303,6 +337,205 @@ class ConfigurationExceptionChanged : public Exception {
     explicit ConfigurationExceptionChanged(const std::string& error);
 };
 
+/**
+ * A list of read-write operations on the hierarchical key-value store that
+ * are applied together, atomically, in a single round trip and a single
+ * replicated log entry. If any operation in the batch fails, none of them
+ * take effect.
+ *
+ * You can get an instance of Batch through Tree::batch(). The batch uses the
+ * working directory, condition, and timeout that its Tree had at that time.
+ * Operations are only buffered locally until commit() is called, so paths are
+ * not checked until then.
+ *
+ * Unlike Tree, this class is not thread-safe.
+ */
+class Batch {
+  private:
+    /// Constructor.
+    explicit Batch(std::shared_ptr<const TreeDetails> treeDetails);
+  public:
+    /// Copy constructor.
+    Batch(const Batch& other);
+    /// Destructor.
+    ~Batch();
+    /// Assignment operator.
+    Batch& operator=(const Batch& other);
+
+    /**
+     * Set a predicate for the operations added to this batch after this call
+     * (until it's changed again). These are in addition to any condition on
+     * the Tree. If an operation's predicate is false, the entire batch fails
+     * with CONDITION_NOT_MET. The predicate is evaluated after the preceding
+     * operations in the batch have been applied.
+     * \param path
+     *      The path to a file that must have the contents specified in
+     *      'value'. If this is empty, operations added later will not have a
+     *      condition of their own.
+     * \param value
+     *      The contents that the file specified by 'path' should have for an
+     *      operation to take effect. If the file should not exist, pass the
+     *      empty string.
+     * \return
+     *      This batch, to chain calls.
+     */
+    Batch& setCondition(const std::string& path, const std::string& value);
+
+    /**
+     * Like setCondition, but the predicate is that the file or directory at
+     * 'path' has the given version (see Tree::setVersionCondition()).
+     * \return
+     *      This batch, to chain calls.
+     */
+    Batch& setVersionCondition(const std::string& path, uint64_t version);
+
+    /**
+     * Add an operation that makes sure a directory exists at the given path,
+     * like Tree::makeDirectory().
+     * \return
+     *      This batch, to chain calls.
+     */
+    Batch& makeDirectory(const std::string& path);
+
+    /**
+     * Add an operation that makes sure a directory does not exist, like
+     * Tree::removeDirectory().
+     * \return
+     *      This batch, to chain calls.
+     */
+    Batch& removeDirectory(const std::string& path);
+
+    /**
+     * Add an operation that sets the value of a file, like Tree::write().
+     * \return
+     *      This batch, to chain calls.
+     */
+    Batch& write(const std::string& path, const std::string& contents);
+
+    /**
+     * Add an operation that makes sure a file does not exist, like
+     * Tree::removeFile().
+     * \return
+     *      This batch, to chain calls.
+     */
+    Batch& removeFile(const std::string& path);
+
+    /**
+     * Return the number of operations added to this batch.
+     */
+    uint64_t size() const;
+
+    /**
+     * Apply all of the operations in this batch, in order, atomically.
+     * The batch may be committed again later, which applies its operations
+     * again.
+     * \return
+     *      Status and error message. If an operation fails, this is the error
+     *      for that operation (see the corresponding Tree method), with its
+     *      position in the batch (counting from 0) prepended to the error
+     *      message. Possible errors include:
+     *       - INVALID_ARGUMENT if a path is malformed.
+     *       - LOOKUP_ERROR or TYPE_ERROR, as for the Tree methods.
+     *       - CONDITION_NOT_MET if the Tree's predicate or an operation's
+     *         predicate was false.
+     *       - TIMEOUT if timeout elapsed before the operation completed.
+     *      If this returns an error, none of the operations took effect
+     *      (except for TIMEOUT, in which case it is not known).
+     */
+    Result commit();
+
+    /**
+     * Like commit but throws exceptions upon errors.
+     */
+    void commitEx();
+
+  private:
+    /**
+     * Implementation-specific members of this class.
+     */
+    std::unique_ptr<BatchDetails> batchDetails;
+    friend class Tree;
+};
+
+/**
+ * Reads the files below a directory in the hierarchical key-value store,
+ * fetching them from the cluster in batches of limited size rather than with
+ * one read per file.
+ *
+ * You can get an instance of Scan through Tree::scan(). The scan uses the
+ * working directory, condition, read consistency, and timeout that its Tree
+ * had at that time. Each batch is a separate read-only operation, so a scan
+ * that spans several batches is not an atomic snapshot: files changed during
+ * the scan may be returned with their old or new contents, or not at all.
+ * Still, no path is returned twice, and paths come out in order: the files
+ * in each directory in lexicographic order of their names, with the contents
+ * of each child directory (in recursive scans) in place of its name.
+ *
+ * For example:
+ * \code
+ *   Scan scan = tree.scan("/services");
+ *   std::string path, contents;
+ *   while (scan.nextEx(path, contents))
+ *       handle(path, contents);
+ * \endcode
+ *
+ * Unlike Tree, this class is not thread-safe.
+ */
+class Scan {
+  private:
+    /// Constructor.
+    Scan(std::shared_ptr<const TreeDetails> treeDetails,
+         const std::string& path,
+         bool recursive,
+         uint64_t maxBytesPerBatch);
+  public:
+    /// Copy constructor.
+    Scan(const Scan& other);
+    /// Destructor.
+    ~Scan();
+    /// Assignment operator.
+    Scan& operator=(const Scan& other);
+
+    /**
+     * Return the next file of the scan, fetching another batch from the
+     * cluster if none are left from the last one.
+     * \param[out] path
+     *      The absolute path of the file.
+     * \param[out] contents
+     *      The value associated with the file.
+     * \param[out] done
+     *      Set to true if the scan has no more files, in which case 'path'
+     *      and 'contents' are cleared.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if the scan's path is malformed.
+     *       - LOOKUP_ERROR if a parent of the path does not exist.
+     *       - LOOKUP_ERROR if the path does not exist.
+     *       - TYPE_ERROR if a parent of the path is a file.
+     *       - TYPE_ERROR if the path exists but is a file.
+     *       - CONDITION_NOT_MET if predicate from Tree::setCondition() was
+     *         false.
+     *       - TIMEOUT if timeout elapsed before the batch was fetched.
+     *      After an error, calling this again retries the failed batch.
+     */
+    Result next(std::string& path, std::string& contents, bool& done);
+
+    /**
+     * Like next but throws exceptions upon errors.
+     * \return
+     *      True if 'path' and 'contents' were set to the next file, false if
+     *      the scan has no more files.
+     */
+    bool nextEx(std::string& path, std::string& contents);
+
+  private:
+    /**
+     * Implementation-specific members of this class.
+     */
+    std::unique_ptr<ScanDetails> scanDetails;
+    friend class Tree;
+};
+
 /**
  * Provides access to the hierarchical key-value store.
  * You can get an instance of Tree through Cluster::getTree() or by copying
@@ -366,7 +599,8 @@ class Tree {
      *      First component: the absolute path corresponding to the 'path'
      *      argument of setCondition().
      *      Second component: the file contents given as the 'value' argument
-     *      of setCondition().
+     *      of setCondition(), or empty if the condition was set by
+     *      setVersionCondition().
      */
     std::pair<std::string, std::string> getCondition() const;
 
@@ -396,6 +630,37 @@ class Tree {
      */
     void setConditionEx(const std::string& path, const std::string& value);
 
+    /**
+     * Set a predicate on all future operations, like setCondition(), except
+     * that the file or directory at 'path' must have the given version
+     * rather than given contents. Versions are assigned from a counter that
+     * only increases, so this is true only if the file or directory hasn't
+     * changed since the read that returned 'version'. Unlike comparing
+     * contents, this costs the same however large the file is.
+     * \param path
+     *      The relative or absolute path to the file or directory that must
+     *      have the given version, or an empty string to clear the condition.
+     * \param version
+     *      The version returned by read() or listDirectory(). If this is 0
+     *      and nothing exists at 'path', the condition will also be
+     *      satisfied.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *      If this returns an error, future operations on this tree will fail
+     *      until a new condition is set or the condition is cleared.
+     * \warning
+     *      Versions are all 0 until every server in the cluster supports
+     *      them (state machine version 4), and operations with this condition
+     *      have no effect until then.
+     */
+    Result setVersionCondition(const std::string& path, uint64_t version);
+
+    /**
+     * Like setVersionCondition but throws exceptions upon errors.
+     */
+    void setVersionConditionEx(const std::string& path, uint64_t version);
+
     /**
      * Return the timeout set by a previous call to setTimeout().
      * \return
@@ -416,6 +681,32 @@ class Tree {
      */
     void setTimeout(uint64_t nanoseconds);
 
+    /**
+     * Return the consistency level set by a previous call to
+     * setReadConsistency().
+     */
+    ReadConsistency getReadConsistency() const;
+
+    /**
+     * Relax the consistency of future read-only operations (listDirectory,
+     * read, scans, and watches) on this Tree, so that they may be served by servers
+     * other than the leader. Read-write operations are unaffected.
+     * \param consistency
+     *      See ReadConsistency.
+     * \param maxStalenessNanos
+     *      For BOUNDED_STALENESS: if nonzero, reads must reflect the log as
+     *      the leader had committed it no more than this many nanoseconds ago.
+     *      This is approximate: it does not account for network delays, and
+     *      during a leader change it may be exceeded by up to an election
+     *      timeout.
+     * \param maxLagEntries
+     *      For BOUNDED_STALENESS: reads may be missing up to this many of the
+     *      latest committed log entries.
+     */
+    void setReadConsistency(ReadConsistency consistency,
+                            uint64_t maxStalenessNanos = 0,
+                            uint64_t maxLagEntries = 0);
+
     /**
      * Make sure a directory exists at the given path.
      * Create parent directories listed in path as necessary.
@@ -466,6 +757,94 @@ class Tree {
      */
     std::vector<std::string> listDirectoryEx(const std::string& path) const;
 
+    /**
+     * List the contents of a directory and get its version.
+     * \param path
+     *      The directory whose direct children to list.
+     * \param[out] children
+     *      See listDirectory(const std::string&, std::vector<std::string>&).
+     * \param[out] version
+     *      The version in which the directory was created or a child was last
+     *      added to or removed from it. Pass this to setVersionCondition() to
+     *      make later operations depend on the listing being unchanged.
+     * \return
+     *      See listDirectory(const std::string&, std::vector<std::string>&).
+     */
+    Result
+    listDirectory(const std::string& path,
+                  std::vector<std::string>& children,
+                  uint64_t& version) const;
+
+    /**
+     * Like listDirectory but throws exceptions upon errors.
+     */
+    std::vector<std::string> listDirectoryEx(const std::string& path,
+                                             uint64_t& version) const;
+
+    /**
+     * Start reading the files below a directory, a batch at a time. See Scan.
+     * This only saves its arguments; errors, such as the path not existing,
+     * are reported by Scan::next().
+     * \param path
+     *      The directory whose files to read.
+     * \param recursive
+     *      If true, read the files in all the descendants of path; otherwise,
+     *      read only the files that it immediately contains.
+     * \param maxBytesPerBatch
+     *      A limit on the total size of the paths and contents fetched in
+     *      one round trip, including their encoding. Each batch holds at
+     *      least one file, even if that alone is larger. The servers cap
+     *      batches at about 1 MB regardless, so that each fits in one
+     *      message; 0 asks for that cap.
+     */
+    Scan
+    scan(const std::string& path,
+         bool recursive = true,
+         uint64_t maxBytesPerBatch = 1024 * 1024) const;
+
+    /**
+     * Wait for a file or directory to change, instead of polling it.
+     * For example:
+     * \code
+     *   uint64_t index = 0;
+     *   tree.watchEx("/config", true, index); // returns right away
+     *   while (true) {
+     *       reload(tree.scan("/config"));
+     *       index = tree.watchEx("/config", true, index);
+     *   }
+     * \endcode
+     * The watch ignores the predicate from setCondition(). Use the same
+     * read consistency for the watch and the reads that follow it, or the
+     * reads may not reflect the change yet.
+     * \param path
+     *      The file or directory to watch. It need not exist.
+     * \param recursive
+     *      If true, changes anywhere below path count. Otherwise, only
+     *      changes to path itself and to its immediate children count.
+     * \param[in,out] index
+     *      A position in the replicated log. Pass 0 to learn the current
+     *      position without waiting, then read whatever path covers. After
+     *      that, pass the position back in to wait for changes since. On
+     *      return, this is set to the position to pass in next time.
+     * \return
+     *      Status and error message. OK means something may have changed:
+     *      the servers sometimes wake watches up when nothing relevant
+     *      changed, so callers should read again and compare. Possible errors
+     *      are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - TIMEOUT if timeout elapsed before anything changed.
+     */
+    Result
+    watch(const std::string& path, bool recursive, uint64_t& index) const;
+
+    /**
+     * Like watch but throws exceptions upon errors.
+     * \return
+     *      The new index (see watch()).
+     */
+    uint64_t
+    watchEx(const std::string& path, bool recursive, uint64_t index) const;
+
     /**
      * Make sure a directory does not exist.
      * Also removes all direct and indirect children of the directory.
@@ -543,6 +922,30 @@ class Tree {
     std::string
     readEx(const std::string& path) const;
 
+    /**
+     * Get the value of a file and its version.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param contents
+     *      The current value associated with the file.
+     * \param[out] version
+     *      The version in which the file was created or last written. Pass
+     *      this to setVersionCondition() to make later operations depend on
+     *      the file being unchanged, without sending its contents back.
+     * \return
+     *      See read(const std::string&, std::string&).
+     */
+    Result
+    read(const std::string& path,
+         std::string& contents,
+         uint64_t& version) const;
+
+    /**
+     * Like read but throws exceptions upon errors.
+     */
+    std::string
+    readEx(const std::string& path, uint64_t& version) const;
+
     /**
      * Make sure a file does not exist.
      * \param path
@@ -564,6 +967,13 @@ class Tree {
     void
     removeFileEx(const std::string& path);
 
+    /**
+     * Start a batch of operations on this Tree that will be applied
+     * atomically. See Batch.
+     */
+    Batch
+    batch() const;
+
   private:
     /**
      * Get a reference to the implementation-specific members of this class.
@@ -668,6 +1078,12 @@ class Cluster {
      *      the client will wait until giving up on the close session RPC. It
      *      defaults to tcpConnectTimeoutMilliseconds, since they should be on
      *      the same order of magnitude.
+     * - readHosts:
+     *      A string describing the hosts to send read-only Tree operations to
+     *      when they don't need to be linearizable (see
+     *      Tree::setReadConsistency()), in the same form as the hosts given to
+     *      the constructor. This is typically a nearby replica. Defaults to
+     *      the hosts given to the constructor.
      */
     typedef std::map<std::string, std::string> Options;
 